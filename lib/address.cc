@@ -20,10 +20,10 @@
 // <nullmailer-subscribe@lists.untroubled.org>.
 
 #include "config.h"
-#include <ctype.h>
+#include <string.h>
+#include "arena.h"
 #include "canonicalize.h"
 #include "mystring/mystring.h"
-#include "list.h"
 
 #define LSQBRACKET '['
 #define RSQBRACKET ']'
@@ -52,58 +52,87 @@ enum node_type {
   EOT = '$',
 };
 
+// A token is a span of the input line.  The whole line is tokenized
+// into one array, ending with an EOT token, before it is parsed.
 struct token
 {
-  const node_type type;
-  const bool has_ws;
-  const mystring str;
-
-  token(node_type);
-  token(node_type, bool, mystring);
+  node_type type;
+  bool has_ws;
+  const char* start;
+  unsigned length;
 };
 
-token::token(node_type t)
-  : type(t), has_ws(false)
-{
-}
-
-token::token(node_type t, bool w, mystring s)
-  : type(t), has_ws(w), str(s)
-{
-}
+// Everything built while parsing a line is allocated from this arena,
+// which is reset when parse_addresses returns.
+static arena parse_arena;
+
+// A string built while parsing.  It either refers to text it does not
+// own (the input line, a literal, or a string it was copied from) or
+// owns a buffer in the parse arena that it appends to in place.  A copy
+// only refers to the original's text, so each buffer has one owner,
+// and since appending never changes the bytes already there, copies
+// stay valid as the original grows.
+class astring
+{
+public:
+  astring() : ptr(""), len(0), cap(0) { }
+  astring(const char* s) : ptr(s), len(strlen(s)), cap(0) { }
+  astring(const char* s, unsigned l) : ptr(s), len(l), cap(0) { }
+  explicit astring(const token* t) : ptr(t->start), len(t->length), cap(0) { }
+  astring(const astring& that) : ptr(that.ptr), len(that.len), cap(0) { }
+  astring& operator=(const astring& that)
+    {
+      ptr = that.ptr;
+      len = that.len;
+      cap = 0;
+      return *this;
+    }
 
-struct anode : public token
-{
-  anode* next;
-  anode(node_type, const char*, const char*, const char*);
-  anode(node_type, bool, mystring);
+  const char* data() const { return ptr; }
+  unsigned length() const { return len; }
+  char operator[](unsigned i) const { return ptr[i]; }
+  bool operator!() const { return len == 0; }
+
+  void append(const char* s, unsigned l);
+  astring& operator+=(const astring& s) { append(s.ptr, s.len); return *this; }
+  astring& operator+=(const char* s) { append(s, strlen(s)); return *this; }
+  astring& operator+=(char c) { append(&c, 1); return *this; }
+
+private:
+  const char* ptr;
+  unsigned len;
+  // The size of the owned buffer, or 0 if the text is not owned.
+  unsigned cap;
 };
 
-anode::anode(node_type t,
-	     const char* wstart,
-	     const char* start,
-	     const char* end)
-  : token(t, start > wstart, mystring(start, end-start)), next(0)
-{
-}
-
-anode::anode(node_type t, bool w, mystring s)
-  : token(t, w, s), next(0)
-{
+void astring::append(const char* s, unsigned l)
+{
+  if (l == 0)
+    return;
+  if (len + l > cap) {
+    unsigned newcap = cap ? cap : 32;
+    while (newcap < len + l)
+      newcap *= 2;
+    char* newptr = (char*)parse_arena.alloc(newcap);
+    memcpy(newptr, ptr, len);
+    ptr = newptr;
+    cap = newcap;
+  }
+  memcpy(const_cast<char*>(ptr) + len, s, l);
+  len += l;
 }
 
 struct result
 {
-  anode* next;
+  const token* next;
   bool good;
-  mystring str;
-  mystring comment;
-  mystring addr;
+  astring str;
+  astring comment;
+  astring addr;
 
   result();
-  result(const result&);
-  result(anode*);
-  result(anode*, const mystring&, const mystring&, const mystring&);
+  result(const token*);
+  result(const token*, const astring&, const astring&, const astring&);
   bool operator!() const
     {
       return !good;
@@ -119,22 +148,17 @@ result::result()
 {
 }
 
-result::result(anode* n)
+result::result(const token* n)
   : next(n), good(1)
 {
 }
 
-result::result(anode* n, const mystring& s,
-	       const mystring& c, const mystring& l)
+result::result(const token* n, const astring& s,
+	       const astring& c, const astring& l)
   : next(n), good(1), str(s), comment(c), addr(l)
 {
 }
 
-result::result(const result& r)
-  : next(r.next), good(r.good), str(r.str), comment(r.comment), addr(r.addr)
-{
-}
-
 #ifndef TRACE
 #define ENTER(R)
 #define FAIL(MSG) return result()
@@ -142,48 +166,80 @@ result::result(const result& r)
 #define RETURN(N,S,C,L) return result(N,S,C,L)
 #else
 #include "fdbuf/fdbuf.h"
+static fdobuf& operator<<(fdobuf& out, const astring& str)
+{
+  out.write(str.data(), str.length());
+  return out;
+}
 static const char indentstr[] = "                       ";
 static const char* indent = indentstr + sizeof indentstr - 1;
-#define ENTER(R) do{ fout << indent-- << __FUNCTION__ << ": \"" << node->str << "\": " << R << endl; }while(0)
+#define ENTER(R) do{ fout << indent-- << __FUNCTION__ << ": \"" << astring(node) << "\": " << R << endl; }while(0)
 #define FAIL(MSG) do{ fout << ++indent << __FUNCTION__ << ": failed: " << MSG << endl; return result(); }while(0)
 #define RETURNR(R) do{ fout << ++indent << __FUNCTION__ << ": succeded str=" << R.str << " comment=" << R.comment << " addr=" << R.addr << endl; return (R); }while(0)
 #define RETURN(N,S,C,L) do{ result _result(N,S,C,L); RETURNR(_result); }while(0)
 #endif
 
-#define RULE(X) static result match_##X(anode* node)
-#define MATCHTOKEN(X) do{ if(node->type != X) FAIL("node is not type " #X); else node = node->next; }while(0)
+#define RULE(X) static result match_##X(const token* node)
+#define MATCHTOKEN(X) do{ if(node->type != X) FAIL("node is not type " #X); else ++node; }while(0)
 #define MATCHRULE(V,R) result V = match_##R(node); if(!V) FAIL("did not match " #R);
 #define OR_RULE(ALT1,ALT2) { result r=match_##ALT1(node); if(r) RETURNR(r); }{ result r=match_##ALT2(node); if(r) RETURNR(r); } FAIL("did not match " #ALT1 " OR " #ALT2);
 
-static bool issymbol(char c)
+// The character classes, one bit each, in a table built at compile
+// time so that classifying a character is a single load.
+#define C_SPACE 1
+#define C_SYMBOL 2
+#define C_CTL 4
+#define C_ATOM 8
+#define C_QTEXT 16
+#define C_DTEXT 32
+
+#define IS_SPACE(c) ((c) == ' ' || ((c) >= '\t' && (c) <= '\r'))
+#define IS_SYMBOL(c) ((c) == LPAREN || (c) == RPAREN || \
+		      (c) == LABRACKET || (c) == RABRACKET || \
+		      (c) == LSQBRACKET || (c) == RSQBRACKET || \
+		      (c) == AT || (c) == COMMA || \
+		      (c) == SEMICOLON || (c) == COLON || \
+		      (c) == ESCAPE || (c) == QUOTE || (c) == PERIOD)
+#define IS_CTL(c) ((c) <= 31 || (c) == 127)
+#define CLASSES(c) ((IS_SPACE(c) ? C_SPACE : 0) | \
+		    (IS_SYMBOL(c) ? C_SYMBOL : 0) | \
+		    (IS_CTL(c) ? C_CTL : 0) | \
+		    (IS_SPACE(c) || IS_SYMBOL(c) || IS_CTL(c) ? 0 : C_ATOM) | \
+		    ((c) && (c) != QUOTE && (c) != ESCAPE ? C_QTEXT : 0) | \
+		    ((c) && (c) != LSQBRACKET && (c) != RSQBRACKET && \
+		     (c) != ESCAPE && (c) != CR ? C_DTEXT : 0))
+#define CLASSES4(c) CLASSES(c), CLASSES(c+1), CLASSES(c+2), CLASSES(c+3)
+#define CLASSES16(c) CLASSES4(c), CLASSES4(c+4), CLASSES4(c+8), CLASSES4(c+12)
+#define CLASSES64(c) CLASSES16(c), CLASSES16(c+16), CLASSES16(c+32), CLASSES16(c+48)
+
+// Characters from 128 up are not controls, space or symbols.
+static const unsigned char char_classes[256] = {
+  CLASSES64(0), CLASSES64(64), CLASSES64(128), CLASSES64(192)
+};
+
+static inline bool is_class(char c, unsigned char mask)
 {
-  switch(c) {
-  case LPAREN: case RPAREN:
-  case LABRACKET: case RABRACKET:
-  case LSQBRACKET: case RSQBRACKET:
-  case AT: case COMMA:
-  case SEMICOLON: case COLON:
-  case ESCAPE: case QUOTE: case PERIOD:
-    return true;
-  default:
-    return false;
-  }
+  return char_classes[(unsigned char)c] & mask;
 }
 
-static bool isctl(char c)
+static inline bool iswsp(char c)
 {
-  return (c >= 0 && c <= 31) || (c == 127);
+  return is_class(c, C_SPACE);
 }
-  
-static bool isqtext(char c)
+
+static inline bool issymbol(char c)
+{
+  return is_class(c, C_SYMBOL);
+}
+
+static inline bool isqtext(char c)
 {
-  return c && c != QUOTE && c != ESCAPE;
+  return is_class(c, C_QTEXT);
 }
 
-static bool isdtext(char c)
+static inline bool isdtext(char c)
 {
-  return c && c != LSQBRACKET && c != RSQBRACKET &&
-    c != ESCAPE && c != CR;
+  return is_class(c, C_DTEXT);
 }
 
 // quoted-pair = ESCAPE CHAR
@@ -193,24 +249,34 @@ static bool isqpair(const char* ptr)
     *(ptr+1);
 }
 
-static bool isatom(char ch)
+static inline bool isatom(char ch)
 {
-  return !(isspace(ch) || issymbol(ch) || isctl(ch));
+  return is_class(ch, C_ATOM);
 }
 
-static anode* tokenize_atom(const char* wstart, const char* &ptr)
+static bool make_token(token& tok, node_type type, const char* wstart,
+		       const char* start, const char* end)
 {
-  if(!isatom(*ptr)) return 0;
+  tok.type = type;
+  tok.has_ws = start > wstart;
+  tok.start = start;
+  tok.length = end - start;
+  return true;
+}
+
+static bool tokenize_atom(token& tok, const char* wstart, const char* &ptr)
+{
+  if(!isatom(*ptr)) return false;
   const char* start = ptr;
   do {
     ++ptr;
   } while(isatom(*ptr));
-  return new anode(ATOM, wstart, start, ptr);
+  return make_token(tok, ATOM, wstart, start, ptr);
 }
 
-static anode* tokenize_comment(const char* wstart, const char* &ptr)
+static bool tokenize_comment(token& tok, const char* wstart, const char* &ptr)
 {
-  if(*ptr != LPAREN) return 0;
+  if(*ptr != LPAREN) return false;
   unsigned count = 0;
   const char* start = ptr;
   char ch = *ptr;
@@ -222,61 +288,60 @@ static anode* tokenize_comment(const char* wstart, const char* &ptr)
     else if(ch == RPAREN) {
       --count;
       if(!count)
-	return new anode(COMMENT, wstart, start, ++ptr);
+	return make_token(tok, COMMENT, wstart, start, ++ptr);
     }
     else if(ch == CR)
-      return 0;			// ERROR
+      return false;		// ERROR
     ++ptr;
     ch = *ptr;
   }
-  return 0;			// ERROR
+  return false;			// ERROR
 }
 
-static anode* tokenize_domain_literal(const char* wstart, const char* &ptr)
+static bool tokenize_domain_literal(token& tok, const char* wstart,
+				    const char* &ptr)
 {
-  if(*ptr != LSQBRACKET) return 0;
+  if(*ptr != LSQBRACKET) return false;
   const char* start = ptr;
   ++ptr;
-  while(isspace(*ptr)) ++ptr;
-  for(; *ptr; ++ptr) {
-    if(isdtext(*ptr))
-      continue;
-    else if(isqpair(ptr))
-      ++ptr;
-    else
+  while(iswsp(*ptr)) ++ptr;
+  for(;;) {
+    while(isdtext(*ptr)) ++ptr;
+    if(!isqpair(ptr))
       break;
+    ptr += 2;
   }
-  while(isspace(*ptr)) ++ptr;
+  while(iswsp(*ptr)) ++ptr;
   if(*ptr != RSQBRACKET)
-    return 0;			// ERROR
-  return new anode(DOMAIN_LITERAL, wstart, start, ptr);
+    return false;		// ERROR
+  return make_token(tok, DOMAIN_LITERAL, wstart, start, ptr);
 }
 
-static anode* tokenize_quoted_string(const char* wstart, const char* &ptr)
+static bool tokenize_quoted_string(token& tok, const char* wstart,
+				   const char* &ptr)
 {
-  if(*ptr != QUOTE) return 0;
+  if(*ptr != QUOTE) return false;
   const char* start = ptr;
-  for(++ptr; *ptr; ++ptr) {
-    if(isqtext(*ptr))
-      continue;
-    else if(isqpair(ptr))
-      ++ptr;
-    else
+  ++ptr;
+  for(;;) {
+    while(isqtext(*ptr)) ++ptr;
+    if(!isqpair(ptr))
       break;
+    ptr += 2;
   }
-  if(*ptr != QUOTE) return 0;
+  if(*ptr != QUOTE) return false;
   ++ptr;
-  return new anode(QUOTED_STRING, wstart, start, ptr);
+  return make_token(tok, QUOTED_STRING, wstart, start, ptr);
 }
 
-static anode* tokenize(const char* &ptr)
+static bool tokenize(token& tok, const char* &ptr)
 {
   const char* wstart = ptr;
-  while(isspace(*ptr)) ++ptr;
+  while(iswsp(*ptr)) ++ptr;
   char ch = *ptr;
   switch(ch) {
   case 0:
-    return new anode(EOT, wstart, ptr, ptr);
+    return make_token(tok, EOT, wstart, ptr, ptr);
   case LABRACKET:
   case RABRACKET:
   case AT:
@@ -286,42 +351,44 @@ static anode* tokenize(const char* &ptr)
   case ESCAPE:
   case PERIOD:
     ++ptr;
-    return new anode((node_type)ch, wstart, ptr-1, ptr);
+    return make_token(tok, (node_type)ch, wstart, ptr-1, ptr);
   case LPAREN:
-    return tokenize_comment(wstart, ptr);
+    return tokenize_comment(tok, wstart, ptr);
   case LSQBRACKET:
-    return tokenize_domain_literal(wstart, ptr);
+    return tokenize_domain_literal(tok, wstart, ptr);
   case QUOTE:
-    return tokenize_quoted_string(wstart, ptr);
+    return tokenize_quoted_string(tok, wstart, ptr);
   default:
-    return tokenize_atom(wstart, ptr);
+    return tokenize_atom(tok, wstart, ptr);
   }
 }
 
-anode* tokenize(const mystring str)
+static const token* tokenize(const mystring& str)
 {
   const char* ptr = str.c_str();
-  anode* head = new anode(EMPTY, ptr, ptr, ptr);
-  anode* tail = head;
-  anode* tmp;
-  while((tmp = tokenize(ptr)) != 0) {
-    tail = tail->next = tmp;
-    if(tmp->type == EOT) {
-      tail = head->next;
-      delete head;
-      return tail;
+  unsigned alloc = 16;
+  token* tokens = (token*)parse_arena.alloc(alloc * sizeof(token));
+  for(unsigned count = 0; ; ++count) {
+    if(count == alloc) {
+      token* more = (token*)parse_arena.alloc(alloc * 2 * sizeof(token));
+      memcpy(more, tokens, alloc * sizeof(token));
+      tokens = more;
+      alloc *= 2;
     }
+    if(!tokenize(tokens[count], ptr))
+      return 0;
+    if(tokens[count].type == EOT)
+      return tokens;
   }
-  return 0;
 }
 
-static mystring quote(const mystring& in)
+static astring quote(const astring& in)
 {
   unsigned length = in.length();
   // The result will never be more than double the length of the input plus 2
-  char out[length*2 + 2 + 1];
-  char* ptrout = out;
-  const char* ptrin = in.c_str();
+  char* out = (char*)parse_arena.alloc(length*2 + 2);
+  char* ptrout = out + 1;
+  const char* ptrin = in.data();
   bool quoted = false;
   for(; length; ++ptrin, ++ptrout, --length) {
     if(*ptrin == QUOTE || *ptrin == ESCAPE)
@@ -330,20 +397,20 @@ static mystring quote(const mystring& in)
       quoted = true;
     *ptrout = *ptrin;
   }
-  *ptrout = 0;
-  if(quoted)
-    return mystringjoin("\"") + out + "\"";
-  else
+  if(!quoted)
     return in;
+  *out = QUOTE;
+  *ptrout++ = QUOTE;
+  return astring(out, ptrout - out);
 }
 
-static mystring unquote(const mystring& in)
+static astring unquote(const astring& in)
 {
   unsigned length = in.length();
   // The result will never be more than the length of the input
-  char out[length+1];
+  char* out = (char*)parse_arena.alloc(length);
   bool modified = false;
-  const char* ptrin = in.c_str();
+  const char* ptrin = in.data();
   char* ptrout = out;
   if(in[0] == QUOTE && in[length-1] == QUOTE) {
     length -= 2;
@@ -351,7 +418,7 @@ static mystring unquote(const mystring& in)
     modified = true;
   }
   // Skip leading whitespace before copying to out
-  for(; length > 0 && isspace(*ptrin); ++ptrin, --length, modified = true)
+  for(; length > 0 && iswsp(*ptrin); ++ptrin, --length, modified = true)
     ;
   for(; length; ++ptrin, ++ptrout, --length) {
     if(isqpair(ptrin)) {
@@ -362,20 +429,20 @@ static mystring unquote(const mystring& in)
     *ptrout = *ptrin;
   }
   // Skip trailing whitespace copied into out
-  for(; ptrout > out && isspace(ptrout[-1]); --ptrout, modified = true)
+  for(; ptrout > out && iswsp(ptrout[-1]); --ptrout, modified = true)
     ;
-  *ptrout = 0;
   if(modified)
-    return out;
+    return astring(out, ptrout - out);
   else
     return in;
 }
 
-anode* skipcomment(anode* node, mystring& comment)
+static const token* skipcomment(const token* node, astring& comment)
 {
   while(node->type == COMMENT) {
-    comment = comment + " " + node->str;
-    node = node->next;
+    comment += ' ';
+    comment += astring(node);
+    ++node;
   }
   return node;
 }
@@ -384,10 +451,10 @@ RULE(sub_domain)
 {
   // Note atom <= domain-ref
   ENTER("atom / domain-literal");
-  mystring comment;
+  astring comment;
   node = skipcomment(node, comment);
   if(node->type == ATOM || node->type == DOMAIN_LITERAL)
-    RETURN(node->next, node->str, comment, node->str);
+    RETURN(node + 1, astring(node), comment, astring(node));
   FAIL("did not match ATOM or DOMAIN-LITERAL");
 }
 
@@ -396,14 +463,14 @@ RULE(domain)
   ENTER("sub-domain *(PERIOD sub-domain) [PERIOD]");
   MATCHRULE(r, sub_domain);
   if(!r) FAIL("did not match sub-domain");
-  mystring comment;
+  astring comment;
   for(;;) {
     node = r.next = skipcomment(r.next, comment);
     if(node->type != PERIOD)
       break;
     r.str += PERIOD;
     r.addr += PERIOD;
-    node = node->next;
+    ++node;
     result r1 = match_sub_domain(node);
     if(r1) {
       r.next = r1.next;
@@ -424,11 +491,11 @@ RULE(route)
 {
   ENTER("1#(AT domain) COLON");
   unsigned count=0;
-  mystring str;
-  mystring comment;
+  astring str;
+  astring comment;
   for(;;) {
     if(node->type != AT) break;
-    node = node->next;
+    ++node;
     MATCHRULE(r, domain);
     str += AT;
     str += r.str;
@@ -446,13 +513,13 @@ RULE(route)
 RULE(word)
 {
   ENTER("atom / quoted-string");
-  mystring comment;
+  astring comment;
   node = skipcomment(node, comment);
   if(node->type == ATOM)
-    RETURN(node->next, node->str, comment, node->str);
+    RETURN(node + 1, astring(node), comment, astring(node));
   else if(node->type == QUOTED_STRING) {
-    mystring addr = unquote(node->str);
-    RETURN(node->next, quote(addr), comment, addr);
+    astring addr = unquote(astring(node));
+    RETURN(node + 1, quote(addr), comment, addr);
   }
   FAIL("did not match ATOM or QUOTED-STRING");
 }
@@ -465,7 +532,7 @@ RULE(local_part)
     node = r.next = skipcomment(r.next, r.comment);
     if(node->type != PERIOD)
       break;
-    node = node->next;
+    ++node;
     result r1 = match_word(node);
     if(!r1)
       break;
@@ -483,12 +550,12 @@ RULE(addr_spec)
 {
   ENTER("local-part *( AT domain )");
   MATCHRULE(r, local_part);
-  mystring domain;
+  astring domain;
   for(;;) {
     node = r.next = skipcomment(r.next, r.comment);
     if(node->type != AT)
       break;
-    node = node->next;
+    ++node;
     result r2 = match_domain(node);
     if(!r2) break;
     if(!!domain) {
@@ -501,15 +568,22 @@ RULE(addr_spec)
     r.comment += r2.comment;
     r.next = r2.next;
   }
-  canonicalize(domain);
-  RETURN(r.next, r.str + "@" + domain, r.comment,
-	 r.addr + "@" + domain + "\n");
+  mystring canonical(domain.data(), domain.length());
+  canonicalize(canonical);
+  astring str = r.str;
+  str += '@';
+  str.append(canonical.c_str(), canonical.length());
+  astring addr = r.addr;
+  addr += '@';
+  addr.append(canonical.c_str(), canonical.length());
+  addr += '\n';
+  RETURN(r.next, str, r.comment, addr);
 }
 
 RULE(route_addr) 
 {
   ENTER("LABRACKET [route] addr-spec RABRACKET");
-  mystring comment;
+  astring comment;
   node = skipcomment(node, comment);
   MATCHTOKEN(LABRACKET);
   result r1 = match_route(node);
@@ -520,7 +594,11 @@ RULE(route_addr)
   comment += r2.comment;
   node = skipcomment(node, comment);
   MATCHTOKEN(RABRACKET);
-  RETURN(node, "<" + r2.str + ">" + comment, "", r2.addr);
+  astring str = "<";
+  str += r2.str;
+  str += '>';
+  str += comment;
+  RETURN(node, str, "", r2.addr);
 }
 
 RULE(phrase)
@@ -532,7 +610,7 @@ RULE(phrase)
       if (r1.next->has_ws)
 	r1.str += ' ';
       r1.str += PERIOD;
-      r1.next = r1.next->next;
+      ++r1.next;
     }
     else {
       result r2 = match_word(r1.next);
@@ -557,7 +635,12 @@ RULE(route_spec)
   MATCHRULE(r2, route_addr);
   if(!r1)
     RETURNR(r2);
-  r2.str = r1.str + r1.comment + " " + r2.str + r2.comment;
+  astring str = r1.str;
+  str += r1.comment;
+  str += ' ';
+  str += r2.str;
+  str += r2.comment;
+  r2.str = str;
   RETURNR(r2);
 }
 
@@ -572,12 +655,12 @@ RULE(mailboxes)
   ENTER("mailbox *(*(COMMA) mailbox)");
   MATCHRULE(r1, mailbox);
   r1.str += r1.comment;
-  r1.comment = "";
+  r1.comment = astring();
   for(;;) {
     node = r1.next;
     for(;;) {
       node = skipcomment(node, r1.str);
-      if(node->type == COMMA) node = node->next;
+      if(node->type == COMMA) ++node;
       else break;
     }
     if(node->type == EOT)
@@ -585,7 +668,9 @@ RULE(mailboxes)
     result r2 = match_mailbox(node);
     if(!r2) break;
     r1.next = r2.next;
-    r1.str = r1.str + ", " + r2.str + r2.comment;
+    r1.str += ", ";
+    r1.str += r2.str;
+    r1.str += r2.comment;
     r1.addr += r2.addr;
   }
   node = skipcomment(node, r1.str);
@@ -601,11 +686,16 @@ RULE(group)
   MATCHTOKEN(COLON);
   result r2 = match_mailboxes(node);
   if(r2) node = r2.next;
-  mystring comment;
+  astring comment;
   node = skipcomment(node, comment);
   MATCHTOKEN(SEMICOLON);
-  RETURN(node, r1.str + ": " + r2.str + r2.comment + comment + ";",
-	 "", r2.addr);
+  astring str = r1.str;
+  str += ": ";
+  str += r2.str;
+  str += r2.comment;
+  str += comment;
+  str += ';';
+  RETURN(node, str, "", r2.addr);
 }
 
 RULE(address)
@@ -620,17 +710,17 @@ RULE(addresses)
 
   // Special-case handling for empty address lists
   if(node->type == EOT) RETURN(0, "", "", "");
-  if(node->type == COMMENT && node->next->type == EOT)
-    RETURN(0, node->str, "", "");
+  if(node->type == COMMENT && node[1].type == EOT)
+    RETURN(0, astring(node), "", "");
 
   MATCHRULE(r1, address);
   r1.str += r1.comment;
-  r1.comment = "";
+  r1.comment = astring();
   for(;;) {
     node = r1.next;
     for(;;) {
       node = skipcomment(node, r1.str);
-      if(node->type == COMMA) node = node->next;
+      if(node->type == COMMA) ++node;
       else break;
     }
     if(node->type == EOT)
@@ -638,35 +728,26 @@ RULE(addresses)
     result r2 = match_address(node);
     if(!r2) break;
     r1.next = r2.next;
-    r1.str = r1.str + ", " + r2.str + r2.comment;
+    r1.str += ", ";
+    r1.str += r2.str;
+    r1.str += r2.comment;
     r1.addr += r2.addr;
   }
   node = skipcomment(node, r1.str);
-  if(node->next) FAIL("Rule ended before EOF");
+  if(node->type != EOT) FAIL("Rule ended before EOF");
   RETURNR(r1);
 }
 
-static void del_tokens(anode* node)
-{
-  while(node) {
-    anode* tmp = node->next;
-    delete node;
-    node = tmp;
-  }
-}
-
 bool parse_addresses(mystring& line, mystring& list)
 {
-  anode* tokenlist = tokenize(line.c_str());
-  if(!tokenlist)
-    return false;
-  result r = match_addresses(tokenlist);
-  del_tokens(tokenlist);
+  const token* tokens = tokenize(line);
+  result r;
+  if(tokens)
+    r = match_addresses(tokens);
   if(r) {
-    line = r.str;
-    list = r.addr;
-    return true;
+    list = mystring(r.addr.data(), r.addr.length());
+    line = mystring(r.str.data(), r.str.length());
   }
-  else
-    return false;
+  parse_arena.reset();
+  return r;
 }
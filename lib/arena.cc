@@ -0,0 +1,108 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#include "config.h"
+#include <string.h>
+#include "arena.h"
+
+#define ARENA_FIRST 4096
+// Allocations are aligned for any of the types put into an arena.
+#define ARENA_ALIGN (sizeof(void*) > sizeof(double) ? sizeof(void*) : sizeof(double))
+
+arena::arena()
+  : head(0), nblocks(0)
+{
+}
+
+arena::~arena()
+{
+  clear();
+}
+
+void arena::clear()
+{
+  while (head) {
+    block* next = head->next;
+    delete[] (char*)head;
+    head = next;
+  }
+  nblocks = 0;
+}
+
+void arena::reset()
+{
+  if (!head)
+    return;
+  block* keep = head;
+  head = head->next;
+  clear();
+  keep->next = 0;
+  keep->used = 0;
+  head = keep;
+  nblocks = 1;
+}
+
+static unsigned align(unsigned size)
+{
+  return (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+void* arena::alloc(unsigned size)
+{
+  size = align(size);
+  const unsigned header = align(sizeof(block));
+  if (!head || head->size - head->used < size) {
+    unsigned newsize = head ? head->size * 2 : ARENA_FIRST;
+    while (newsize < size)
+      newsize *= 2;
+    block* b = (block*)new char[header + newsize];
+    b->next = head;
+    b->size = newsize;
+    b->used = 0;
+    head = b;
+    ++nblocks;
+  }
+  void* ptr = (char*)head + header + head->used;
+  head->used += size;
+  return ptr;
+}
+
+char* arena::copy(const char* str, unsigned length)
+{
+  char* ptr = (char*)alloc(length + 1);
+  memcpy(ptr, str, length);
+  ptr[length] = 0;
+  return ptr;
+}
+
+void arena_strlist::append(const char* str, unsigned length)
+{
+  node* n = (node*)mem.alloc(sizeof(node));
+  n->str = mem.copy(str, length);
+  n->length = length;
+  n->next = 0;
+  if (tail)
+    tail->next = n;
+  else
+    head = n;
+  tail = n;
+  ++cnt;
+}
@@ -0,0 +1,89 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#ifndef NULLMAILER__ARENA__H__
+#define NULLMAILER__ARENA__H__
+
+#include "mystring/mystring.h"
+
+// A region allocator: memory is handed out from a chain of blocks,
+// each twice the size of the last, and is only freed all at once.  It
+// suits data that lives exactly as long as one message.
+class arena
+{
+public:
+  arena();
+  ~arena();
+  void* alloc(unsigned size);
+  // Copy a string into the arena, adding a terminating NUL.
+  char* copy(const char* str, unsigned length);
+  void clear();
+  // Forget everything allocated, but keep the largest block to hand
+  // out again.
+  void reset();
+  unsigned blocks() const { return nblocks; }
+
+private:
+  struct block
+  {
+    block* next;
+    unsigned size;
+    unsigned used;
+  };
+  block* head;
+  unsigned nblocks;
+
+  arena(const arena&);
+  void operator=(const arena&);
+};
+
+// A list of strings whose nodes and text are allocated from an arena,
+// so that appending costs no more than copying the string.
+class arena_strlist
+{
+public:
+  struct node
+  {
+    const char* str;
+    unsigned length;
+    node* next;
+  };
+
+  arena_strlist(arena& a) : mem(a), head(0), tail(0), cnt(0) { }
+  void append(const char* str, unsigned length);
+  void append(const mystring& str) { append(str.c_str(), str.length()); }
+  // Forget the strings; their memory goes when the arena is cleared.
+  void empty() { head = tail = 0; cnt = 0; }
+  unsigned count() const { return cnt; }
+  const node* first() const { return head; }
+  const node* last() const { return tail; }
+
+private:
+  arena& mem;
+  node* head;
+  node* tail;
+  unsigned cnt;
+
+  arena_strlist(const arena_strlist&);
+  void operator=(const arena_strlist&);
+};
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef NULLMAILER_AUTOCLOSE__H__
 #define NULLMAILER_AUTOCLOSE__H__
 
+#include <sys/socket.h>
 #include <unistd.h>
 
 // Simple inline wrapper to automatically close an open file descriptor
@@ -47,6 +48,12 @@ class autoclose_pipe
   {
     return pipe(fds) == 0;
   }
+  // A connected pair of Unix stream sockets, used like a pipe from the
+  // second to the first, over which descriptors can also be passed.
+  inline bool open_socket()
+  {
+    return socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0;
+  }
   inline void close()
   {
     if (fds[0] >= 0) {
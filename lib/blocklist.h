@@ -0,0 +1,284 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#ifndef NULLMAILER__BLOCKLIST__H__
+#define NULLMAILER__BLOCKLIST__H__
+
+#include <new>
+#if __cplusplus >= 201103L
+#include <utility>
+#endif
+
+template<class T, unsigned B> class blocklist_iterator;
+template<class T, unsigned B> class const_blocklist_iterator;
+
+// A sequence kept in fixed-size blocks of elements rather than in one
+// node per element.  Appending never moves an element, so pointers to
+// elements stay valid until they are removed or the list is compacted.
+// Removal leaves a hole that iteration skips; compact() closes the
+// holes, keeping the order of the remaining elements.
+template<class T, unsigned B = 256> class blocklist
+{
+  struct block
+  {
+    union
+    {
+      char bytes[B * sizeof(T)];
+      long double align_d;
+      void* align_p;
+    } u;
+    bool live[B];
+    T* slot(unsigned i) { return reinterpret_cast<T*>(u.bytes) + i; }
+  };
+public:
+  typedef blocklist_iterator<T, B> iter;
+  typedef const_blocklist_iterator<T, B> const_iter;
+  friend class blocklist_iterator<T, B>;
+  friend class const_blocklist_iterator<T, B>;
+
+  blocklist()
+    : blocks(0), nblocks(0), ablocks(0), used(0), cnt(0)
+    {
+    }
+  ~blocklist()
+    {
+      empty();
+      for (unsigned i = 0; i < nblocks; i++)
+	delete blocks[i];
+      delete[] blocks;
+    }
+
+  unsigned count() const
+    {
+      return cnt;
+    }
+  // The number of removed elements whose slots have not been reused.
+  unsigned holes() const
+    {
+      return used - cnt;
+    }
+
+  void empty()
+    {
+      for (unsigned i = 0; i < used; i++)
+	if (is_live(i))
+	  kill(i);
+      used = cnt = 0;
+    }
+
+  bool append(const T& data)
+    {
+      new(next_slot()) T(data);
+      return link();
+    }
+#if __cplusplus >= 201103L
+  bool append(T&& data)
+    {
+      new(next_slot()) T(std::move(data));
+      return link();
+    }
+  template<class... Args> T& emplace(Args&&... args)
+    {
+      T* p = new(next_slot()) T(std::forward<Args>(args)...);
+      link();
+      return *p;
+    }
+#endif
+  // The last element appended that has not been removed.
+  T& last()
+    {
+      return *at(used - 1);
+    }
+  bool remove(iter&);
+  // Move the elements down over the holes left by removals and free the
+  // blocks left empty.  This invalidates all pointers to elements.
+  void compact();
+
+private:
+  // Not copyable: elements are referred to by address.
+  blocklist(const blocklist&);
+  blocklist& operator=(const blocklist&);
+
+  T* at(unsigned i) const
+    {
+      return blocks[i / B]->slot(i % B);
+    }
+  bool is_live(unsigned i) const
+    {
+      return blocks[i / B]->live[i % B];
+    }
+  void kill(unsigned i)
+    {
+      at(i)->~T();
+      blocks[i / B]->live[i % B] = false;
+    }
+  // The first live element at or after i, or used if there is none.
+  unsigned skip(unsigned i) const
+    {
+      while (i < used && !is_live(i))
+	++i;
+      return i;
+    }
+  T* next_slot()
+    {
+      if (used == nblocks * B) {
+	if (nblocks == ablocks) {
+	  ablocks = ablocks ? ablocks * 2 : 4;
+	  block** nb = new block*[ablocks];
+	  for (unsigned i = 0; i < nblocks; i++)
+	    nb[i] = blocks[i];
+	  delete[] blocks;
+	  blocks = nb;
+	}
+	blocks[nblocks++] = new block;
+      }
+      return at(used);
+    }
+  bool link()
+    {
+      blocks[used / B]->live[used % B] = true;
+      ++used;
+      ++cnt;
+      return true;
+    }
+
+  block** blocks;
+  unsigned nblocks;
+  unsigned ablocks;
+  // The number of slots handed out, including holes.
+  unsigned used;
+  unsigned cnt;
+};
+
+template<class T, unsigned B> class const_blocklist_iterator
+{
+  friend class blocklist<T, B>;
+public:
+  const_blocklist_iterator(const blocklist<T, B>& l)
+    : lst(l), curr(l.skip(0))
+    {
+    }
+  void operator++()
+    {
+      curr = lst.skip(curr + 1);
+    }
+  void operator++(int)
+    {
+      curr = lst.skip(curr + 1);
+    }
+  const T& operator*() const
+    {
+      return *lst.at(curr);
+    }
+  bool operator!() const
+    {
+      return curr >= lst.used;
+    }
+  operator bool() const
+    {
+      return !operator!();
+    }
+private:
+  const blocklist<T, B>& lst;
+  unsigned curr;
+};
+
+template<class T, unsigned B> class blocklist_iterator
+{
+  friend class blocklist<T, B>;
+public:
+  blocklist_iterator(blocklist<T, B>& l)
+    : lst(l), curr(l.skip(0))
+    {
+    }
+  void operator++()
+    {
+      curr = lst.skip(curr + 1);
+    }
+  void operator++(int)
+    {
+      curr = lst.skip(curr + 1);
+    }
+  const T& operator*() const
+    {
+      return *lst.at(curr);
+    }
+  T& operator*()
+    {
+      return *lst.at(curr);
+    }
+  bool operator!() const
+    {
+      return curr >= lst.used;
+    }
+  operator bool() const
+    {
+      return !operator!();
+    }
+private:
+  blocklist<T, B>& lst;
+  unsigned curr;
+};
+
+// Remove the element at the iterator and advance it to the next one.
+template<class T, unsigned B>
+bool blocklist<T, B>::remove(iter& it)
+{
+  if (this != &it.lst || it.curr >= used)
+    return false;
+  kill(it.curr);
+  --cnt;
+  it.curr = skip(it.curr + 1);
+  // Holes at the end are given back, so that a list used as a queue
+  // does not grow without bound.
+  while (used > 0 && !is_live(used - 1))
+    --used;
+  if (it.curr > used)
+    it.curr = used;
+  return true;
+}
+
+template<class T, unsigned B>
+void blocklist<T, B>::compact()
+{
+  unsigned to = 0;
+  for (unsigned from = 0; from < used; from++) {
+    if (!is_live(from))
+      continue;
+    if (from != to) {
+#if __cplusplus >= 201103L
+      new(at(to)) T(std::move(*at(from)));
+#else
+      new(at(to)) T(*at(from));
+#endif
+      kill(from);
+      blocks[to / B]->live[to % B] = true;
+    }
+    ++to;
+  }
+  used = to;
+  // Keep one spare block past the last one in use.
+  unsigned keep = (used + B - 1) / B + 1;
+  while (nblocks > keep)
+    delete blocks[--nblocks];
+}
+
+#endif // NULLMAILER__BLOCKLIST__H__
@@ -0,0 +1,156 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#include "config.h"
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cgroup.h"
+#include "fdbuf/fdbuf.h"
+
+static bool read_line(const mystring& path, mystring& line)
+{
+  fdibuf in(path.c_str());
+  return in && in.getline(line);
+}
+
+static void take_cpus(cgroup_limits& limits, long long quota,
+		      long long period)
+{
+  if(quota <= 0 || period <= 0)
+    return;
+  unsigned long millicpus = quota * 1000 / period;
+  if(millicpus == 0)
+    millicpus = 1;
+  if(limits.millicpus == 0 || millicpus < limits.millicpus)
+    limits.millicpus = millicpus;
+}
+
+// Version 1 has no word for no limit, and reports the largest number
+// it can instead, rounded down to the page size.
+static void take_memory(cgroup_limits& limits, unsigned long long bytes)
+{
+  if(bytes == 0 || bytes >= 1ULL << 60)
+    return;
+  if(limits.memory == 0 || bytes < limits.memory)
+    limits.memory = bytes;
+}
+
+// In version 2, cpu.max holds the quota and the period, or "max" for
+// the quota when there is none, and memory.max the limit or "max".
+static void read_v2(cgroup_limits& limits, const mystring& dir)
+{
+  mystring line;
+  if(read_line(dir + "/cpu.max", line)) {
+    const int space = line.find_first(' ');
+    if(space > 0 && line.left(space) != "max")
+      take_cpus(limits, strtoll(line.c_str(), 0, 10),
+		strtoll(line.c_str() + space + 1, 0, 10));
+  }
+  if(read_line(dir + "/memory.max", line) && line != "max")
+    take_memory(limits, strtoull(line.c_str(), 0, 10));
+}
+
+static void read_v1_cpu(cgroup_limits& limits, const mystring& dir)
+{
+  mystring quota;
+  mystring period;
+  if(read_line(dir + "/cpu.cfs_quota_us", quota)
+     && read_line(dir + "/cpu.cfs_period_us", period))
+    take_cpus(limits, strtoll(quota.c_str(), 0, 10),
+	      strtoll(period.c_str(), 0, 10));
+}
+
+static void read_v1_memory(cgroup_limits& limits, const mystring& dir)
+{
+  mystring line;
+  if(read_line(dir + "/memory.limit_in_bytes", line))
+    take_memory(limits, strtoull(line.c_str(), 0, 10));
+}
+
+// Read the limits of the group at path in the hierarchy mounted at
+// mount, and of each group above it.  Inside a container the hierarchy
+// may be mounted from the group itself down, so that the path is not
+// found under it, and then only the root of the mount is read.
+static void read_groups(cgroup_limits& limits, const mystring& mount,
+			mystring path,
+			void (*reader)(cgroup_limits&, const mystring&))
+{
+  for(;;) {
+    reader(limits, mount + path);
+    const int slash = path.find_last('/');
+    if(slash < 0 || path == "/")
+      break;
+    path = slash == 0 ? mystring("/") : path.left(slash);
+  }
+}
+
+// The controllers of a version 1 hierarchy are listed with commas
+// between them, as in "cpu,cpuacct".
+static bool has_controller(const mystring& list, const char* name)
+{
+  const mystring padded = "," + list + ",";
+  return strstr(padded.c_str(), mystring(mystring(",") + name + ",").c_str())
+    != 0;
+}
+
+// Each line of /proc/self/cgroup is "ID:CONTROLLERS:PATH", with no
+// controllers for the version 2 hierarchy, which is mounted at
+// /sys/fs/cgroup or, beside version 1, at /sys/fs/cgroup/unified.
+bool cgroup_read_limits(cgroup_limits& limits, const mystring& root)
+{
+  limits.millicpus = 0;
+  limits.memory = 0;
+  const mystring base = root + "/sys/fs/cgroup";
+  fdibuf in(mystring(root + "/proc/self/cgroup").c_str());
+  mystring line;
+  while(in.getline(line)) {
+    const int colon = line.find_first(':');
+    const int colon2 = colon < 0 ? -1 : line.find_first(':', colon + 1);
+    if(colon2 < 0)
+      continue;
+    const mystring controllers = line.sub(colon + 1, colon2 - colon - 1);
+    const mystring path = line.right(colon2 + 1);
+    if(!controllers) {
+      read_groups(limits, base, path, read_v2);
+      read_groups(limits, base + "/unified", path, read_v2);
+      continue;
+    }
+    const mystring mount = base + "/" + controllers;
+    if(has_controller(controllers, "cpu"))
+      read_groups(limits, mount, path, read_v1_cpu);
+    if(has_controller(controllers, "memory"))
+      read_groups(limits, mount, path, read_v1_memory);
+  }
+  return limits.millicpus > 0 || limits.memory > 0;
+}
+
+unsigned cgroup_online_cpus()
+{
+#ifdef CPU_COUNT
+  cpu_set_t set;
+  if(sched_getaffinity(0, sizeof set, &set) == 0 && CPU_COUNT(&set) > 0)
+    return CPU_COUNT(&set);
+#endif
+  const long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? n : 1;
+}
@@ -0,0 +1,46 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#ifndef NULLMAILER__CGROUP__H__
+#define NULLMAILER__CGROUP__H__
+
+#include "mystring/mystring.h"
+
+// The CPU and memory limits set on a process by its control groups,
+// version 1 or 2: the CPU quota in thousandths of a CPU, and the memory
+// limit in bytes, each 0 where there is no limit.
+struct cgroup_limits
+{
+  unsigned long millicpus;
+  unsigned long long memory;
+};
+
+// Read the limits of this process, taking the tightest of those set on
+// its group and the groups above it.  The files are looked for under
+// root, which only the tests set.  Returns false if neither resource is
+// limited.
+bool cgroup_read_limits(cgroup_limits& limits,
+			const mystring& root = mystring());
+
+// The number of CPUs this process may run on.
+unsigned cgroup_online_cpus();
+
+#endif
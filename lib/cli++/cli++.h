@@ -1,6 +1,33 @@
 #ifndef VMAILMGR__CLIPP__CLIPP__H__
 #define VMAILMGR__CLIPP__CLIPP__H__
 
+/* A program built into a multi-call binary is compiled with CLI_PREFIX
+   set to its name, which keeps its symbols, and those of the copy of
+   this library built with it, apart from the other programs'. */
+#ifdef CLI_PREFIX
+#define CLI_PASTE2(P,N) P##_##N
+#define CLI_PASTE(P,N) CLI_PASTE2(P,N)
+#define cli_option CLI_PASTE(CLI_PREFIX,cli_option)
+#define cli_program CLI_PASTE(CLI_PREFIX,cli_program)
+#define cli_help_prefix CLI_PASTE(CLI_PREFIX,cli_help_prefix)
+#define cli_help_suffix CLI_PASTE(CLI_PREFIX,cli_help_suffix)
+#define cli_args_usage CLI_PASTE(CLI_PREFIX,cli_args_usage)
+#define cli_args_min CLI_PASTE(CLI_PREFIX,cli_args_min)
+#define cli_args_max CLI_PASTE(CLI_PREFIX,cli_args_max)
+#define cli_options CLI_PASTE(CLI_PREFIX,cli_options)
+#define cli_only_long CLI_PASTE(CLI_PREFIX,cli_only_long)
+#define cli_main CLI_PASTE(CLI_PREFIX,cli_main)
+#define argv0 CLI_PASTE(CLI_PREFIX,argv0)
+#define argv0base CLI_PASTE(CLI_PREFIX,argv0base)
+#define argv0dir CLI_PASTE(CLI_PREFIX,argv0dir)
+#define usage CLI_PASTE(CLI_PREFIX,usage)
+#define cli_parse_args CLI_PASTE(CLI_PREFIX,cli_parse_args)
+#define cli_error CLI_PASTE(CLI_PREFIX,cli_error)
+#define cli_syserror CLI_PASTE(CLI_PREFIX,cli_syserror)
+#define cli_warning CLI_PASTE(CLI_PREFIX,cli_warning)
+#define main CLI_PASTE(CLI_PREFIX,main)
+#endif
+
 typedef bool (*cli_funcptr)(void*);
 
 struct cli_stringlist
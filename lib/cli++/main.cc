@@ -159,7 +159,8 @@ void usage(int exit_value, const char* errorstr)
   exit(exit_value);
 }
 
-cli_stringlist* stringlist_append(cli_stringlist* node, const char* newstr)
+static cli_stringlist* stringlist_append(cli_stringlist* node,
+					 const char* newstr)
 {
   cli_stringlist* newnode = new cli_stringlist(newstr);
   if(node) {
@@ -21,7 +21,11 @@
 
 #include "config.h"
 #include "defines.h"
+#include <ctype.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "configio.h"
 #include "fdbuf/fdbuf.h"
 
@@ -34,7 +38,28 @@ mystring config_SBIN_DIR;
 static mystring test_prefix;
 static bool initialized = false;
 
-mystring config_path(const char* dflt, const char* testdir, const char* subdir, const char* filename)
+bool config_tenant_valid(const char* name)
+{
+  if (*name == 0 || *name == '.')
+    return false;
+  for (; *name; ++name)
+    if (!isalnum((unsigned char)*name) && !strchr("._-", *name))
+      return false;
+  return true;
+}
+
+const char* config_tenant()
+{
+  const char* name = getenv("NULLMAILER_TENANT");
+  return name != 0 && config_tenant_valid(name) ? name : 0;
+}
+
+// The queue and config directories of a tenant are under the shared
+// ones, except that the TLS session cache stays shared, so that a
+// session made for one tenant is resumed for the others.
+static mystring make_path(const char* dflt, const char* testdir,
+			  const char* subdir, const char* filename,
+			  const char* tenant)
 {
   if (!initialized) {
     // Check if the program is running setuid, to avoid privilege escallation.
@@ -48,6 +73,12 @@ mystring config_path(const char* dflt, const char* testdir, const char* subdir,
     result += '/';
     result += testdir;
   }
+  if (tenant != 0
+      && (dflt == CONFIG_DIR
+	  || (dflt == QUEUE_DIR && !(subdir && strcmp(subdir, "tls") == 0)))) {
+    result += "/tenant/";
+    result += tenant;
+  }
   result += '/';
   if (subdir) {
     result += subdir;
@@ -56,3 +87,19 @@ mystring config_path(const char* dflt, const char* testdir, const char* subdir,
   result += filename;
   return result;
 }
+
+mystring config_path(const char* dflt, const char* testdir, const char* subdir, const char* filename)
+{
+  return make_path(dflt, testdir, subdir, filename, config_tenant());
+}
+
+mystring config_source(const char* filename)
+{
+  const mystring path = CONFIG_PATH(CONFIG, NULL, filename);
+  if (config_tenant() == 0 || access(path.c_str(), F_OK) == 0
+      || errno != ENOENT)
+    return path;
+  // The tenant's own file is watched for appearing.
+  config_stamp(path);
+  return make_path(CONFIG_DIR, CONFIG_TEST_DIR, NULL, filename, 0);
+}
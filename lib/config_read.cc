@@ -20,13 +20,22 @@
 // <nullmailer-subscribe@lists.untroubled.org>.
 
 #include "config.h"
+#include <string.h>
 #include "defines.h"
 #include "configio.h"
 #include "fdbuf/fdbuf.h"
 
 bool config_read(const char* filename, mystring& result)
 {
-  const mystring fullname = CONFIG_PATH(CONFIG, NULL, filename);
+  const char* data;
+  unsigned length;
+  if (configdb_lookup(filename, data, length)) {
+    const char* end = (const char*)memchr(data, '\n', length);
+    result = mystring(data, end ? end - data : length).strip();
+    return result.length() > 0;
+  }
+  const mystring fullname = config_source(filename);
+  config_stamp(fullname);
   fdibuf in(fullname.c_str());
   if (!in)
     return config_syserr(fullname.c_str());
@@ -20,24 +20,45 @@
 // <nullmailer-subscribe@lists.untroubled.org>.
 
 #include "config.h"
+#include <string.h>
 #include "defines.h"
 #include "configio.h"
 #include "fdbuf/fdbuf.h"
 
+static bool add_line(list<mystring>& result, mystring line)
+{
+  line = line.strip();
+  if(line[0] == '#' || line.length() == 0)
+    return false;
+  result.append(line);
+  return true;
+}
+
 bool config_readlist(const char* filename, list<mystring>& result)
 {
-  const mystring fullname = CONFIG_PATH(CONFIG, NULL, filename);
+  const char* data;
+  unsigned length;
+  bool nonempty = false;
+  if (configdb_lookup(filename, data, length)) {
+    const char* const end = data + length;
+    while (data < end) {
+      const char* nl = (const char*)memchr(data, '\n', end - data);
+      if (!nl)
+	nl = end;
+      if (add_line(result, mystring(data, nl - data)))
+	nonempty = true;
+      data = nl + 1;
+    }
+    return nonempty;
+  }
+  const mystring fullname = config_source(filename);
+  config_stamp(fullname);
   fdibuf in(fullname.c_str());
   if(!in)
     return config_syserr(fullname.c_str());
   mystring tmp;
-  bool nonempty = false;
-  while(in.getline(tmp)) {
-    tmp = tmp.strip();
-    if(tmp[0] != '#' && tmp.length() > 0) {
-      result.append(tmp);
+  while(in.getline(tmp))
+    if(add_line(result, tmp))
       nonempty = true;
-    }
-  }
   return nonempty;
 }
@@ -0,0 +1,90 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#include "config.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "configio.h"
+#include "list.h"
+
+// What stat said about a config file when it was read.  The file is
+// stamped before it is read, so a change made while it was being read
+// is seen as a change the next time.
+struct config_file
+{
+  mystring path;
+  bool exists;
+  struct stat st;
+};
+
+static list<config_file> files;
+static bool tracking = false;
+
+static bool stamp(const char* path, struct stat& st)
+{
+  return stat(path, &st) == 0;
+}
+
+void config_track()
+{
+  files.empty();
+  tracking = true;
+  // Map the database afresh, in case it was recompiled.
+  configdb_close();
+}
+
+void config_stamp(const mystring& fullname)
+{
+  if (!tracking)
+    return;
+  for (list<config_file>::const_iter i(files); i; i++)
+    if ((*i).path == fullname)
+      return;
+  config_file f;
+  f.path = fullname;
+  f.exists = stamp(fullname.c_str(), f.st);
+  files.append(f);
+}
+
+static bool same(const struct stat& a, const struct stat& b)
+{
+  return a.st_dev == b.st_dev
+    && a.st_ino == b.st_ino
+    && a.st_size == b.st_size
+    && a.st_mtime == b.st_mtime
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+    && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec
+#endif
+    && a.st_ctime == b.st_ctime;
+}
+
+bool config_changed()
+{
+  if (!tracking)
+    return true;
+  for (list<config_file>::const_iter i(files); i; i++) {
+    struct stat st;
+    bool exists = stamp((*i).path.c_str(), st);
+    if (exists != (*i).exists || (exists && !same(st, (*i).st)))
+      return true;
+  }
+  return false;
+}
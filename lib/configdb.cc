@@ -0,0 +1,107 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2018  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#include "config.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "configdb.h"
+#include "configio.h"
+#include "defines.h"
+
+// The database is mapped once and kept for the life of the program,
+// or until config_track() starts a new round of reads.
+static const unsigned char* db_map = 0;
+static unsigned db_size = 0;
+static bool db_opened = false;
+
+static void db_open(const mystring& path)
+{
+  db_opened = true;
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+      && st.st_size >= CONFIGDB_HEADER && (unsigned long)st.st_size <= 0xffffffffUL) {
+    void* map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED) {
+      db_map = (const unsigned char*)map;
+      db_size = st.st_size;
+    }
+  }
+  close(fd);
+}
+
+void configdb_close()
+{
+  if (db_map != 0)
+    munmap((void*)db_map, db_size);
+  db_map = 0;
+  db_size = 0;
+  db_opened = false;
+}
+
+// Every offset read from the file is checked against its size, so a
+// truncated or corrupt database reads as missing keys, not a crash.
+static bool db_find(const char* key, unsigned klen,
+		    const char*& data, unsigned& dlen)
+{
+  const uint32_t h = configdb_hash(key, klen);
+  const unsigned char* table = db_map + (h & 255) * 8;
+  const uint32_t tpos = configdb_get(table);
+  const uint32_t slots = configdb_get(table + 4);
+  if (slots == 0 || tpos > db_size || slots > (db_size - tpos) / 8)
+    return false;
+  uint32_t slot = (h >> 8) % slots;
+  for (uint32_t n = 0; n < slots; ++n) {
+    const unsigned char* s = db_map + tpos + slot * 8;
+    const uint32_t rpos = configdb_get(s + 4);
+    if (rpos == 0)
+      return false;
+    if (configdb_get(s) == h && rpos <= db_size - 8) {
+      const unsigned char* rec = db_map + rpos;
+      const uint32_t rk = configdb_get(rec);
+      const uint32_t rd = configdb_get(rec + 4);
+      const uint32_t room = db_size - rpos - 8;
+      if (rk <= room && rd <= room - rk
+	  && rk == klen && memcmp(rec + 8, key, klen) == 0) {
+	data = (const char*)rec + 8 + rk;
+	dlen = rd;
+	return true;
+      }
+    }
+    if (++slot == slots)
+      slot = 0;
+  }
+  return false;
+}
+
+bool configdb_lookup(const char* filename, const char*& data, unsigned& length)
+{
+  const mystring path = CONFIG_PATH(CONFIG, NULL, CONFIGDB_NAME);
+  config_stamp(path);
+  if (!db_opened)
+    db_open(path);
+  return db_map != 0 && db_find(filename, strlen(filename), data, length);
+}
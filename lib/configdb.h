@@ -0,0 +1,57 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2018  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#ifndef NULLMAILER__CONFIGDB__H__
+#define NULLMAILER__CONFIGDB__H__
+
+#include <stdint.h>
+
+// The compiled config database is a constant database in the cdb
+// layout: a header of 256 (position, slot count) pairs locating one
+// hash table each, the records (key length, data length, key, data),
+// and then the hash tables of (hash, record position) slots.  All
+// numbers are 32-bit little-endian.  Keys are control file names and
+// data is the contents of the file.
+#define CONFIGDB_NAME "config.cdb"
+#define CONFIGDB_HEADER (256 * 8)
+
+inline uint32_t configdb_hash(const char* key, unsigned length)
+{
+  uint32_t h = 5381;
+  while (length-- > 0)
+    h = ((h << 5) + h) ^ (unsigned char)*key++;
+  return h;
+}
+
+inline uint32_t configdb_get(const unsigned char* p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+inline void configdb_put(unsigned char* p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+#endif // NULLMAILER__CONFIGDB__H__
@@ -7,9 +7,33 @@
 mystring config_path(const char* dflt, const char* testdir, const char* subdir, const char* filename);
 #define CONFIG_PATH(NAME, SUBDIR, FILENAME) config_path(NAME##_DIR, NAME##_TEST_DIR, SUBDIR, FILENAME)
 
+// The tenant named by $NULLMAILER_TENANT, whose queue and config
+// directories are used in place of the shared ones, or 0 if there is
+// none.  A tenant name is letters, digits, '.', '-' and '_', and does
+// not start with '.'.
+const char* config_tenant();
+bool config_tenant_valid(const char* name);
+// The path of a control file to read: a tenant's own, or the shared
+// one if the tenant has none.
+mystring config_source(const char* filename);
+
 bool config_read(const char* filename, mystring& result);
 bool config_readlist(const char* filename, list<mystring>& result);
 bool config_readint(const char* filename, int& result);
 bool config_syserr(const char* filename);
 
+// Record the state of every config file read from now on, replacing
+// any earlier record.
+void config_track();
+// Check whether any config file read since config_track was called has
+// changed, appeared or disappeared since.  True if nothing is tracked.
+bool config_changed();
+void config_stamp(const mystring& fullname);
+
+// Look up a control file in the compiled config database, giving its
+// contents.  Returns false if the database or the file is not in it,
+// in which case the file itself is to be read.
+bool configdb_lookup(const char* filename, const char*& data, unsigned& length);
+void configdb_close();
+
 #endif // NULLMAILER__CONFIGIO__H__
@@ -1,6 +1,15 @@
 #ifndef NULLMAILER_CONNECT__H__
 #define NULLMAILER_CONNECT__H__
 
-extern int tcpconnect(const char* hostname, int port, const char* source);
+// Connect to the host, giving up after timeout seconds unless it is 0.
+// If resolved is given, it is called with data once the names have been
+// looked up, before the connection attempts start.
+extern int tcpconnect(const char* hostname, int port, const char* source,
+		      int timeout = 0, void (*resolved)(void*) = 0,
+		      void* data = 0);
+
+// Connect to the stream socket at path, giving up after timeout seconds
+// unless it is 0.
+extern int unixconnect(const char* path, int timeout = 0);
 
 #endif // NULLMAILER_CONNECT__H__
@@ -0,0 +1,128 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2018  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+
+#include "config.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include "autoclose.h"
+#include "configio.h"
+#include "dedup.h"
+#include "defines.h"
+
+struct dedup_slot
+{
+  uint64_t digest;
+  int64_t when;
+};
+
+// FNV-1a, over the fields with a NUL after each.
+static uint64_t fnv(uint64_t h, const mystring& s)
+{
+  const unsigned char* p = (const unsigned char*)s.c_str();
+  for (unsigned i = 0; i <= s.length(); i++) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+uint64_t dedup_digest(const envelope_index& index)
+{
+  // The index holds the whole header line; only its value is compared.
+  const int colon = index.message_id.find_first(':');
+  if (colon < 0)
+    return 0;
+  const mystring id = index.message_id.right(colon + 1).strip();
+  if (!id)
+    return 0;
+  uint64_t h = fnv(14695981039346656037ULL, id);
+  h = fnv(h, index.sender);
+  for (list<mystring>::const_iter i(index.recipients); i; i++)
+    h = fnv(h, *i);
+  return h ? h : 1;
+}
+
+// The run of slots a digest may be found in, which never wraps around
+// the end of the table.
+static off_t probe_offset(uint64_t digest)
+{
+  return (off_t)(digest % (DEDUP_SLOTS - DEDUP_PROBE + 1))
+    * sizeof (dedup_slot);
+}
+
+static int open_index(int lock)
+{
+  const mystring path = CONFIG_PATH(QUEUE, NULL, DEDUP_NAME);
+  int fd = open(path.c_str(), O_RDWR|O_CREAT, 0600);
+  if (fd >= 0 && flock(fd, lock) == -1) {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+// Read the run of slots for a digest.  A run not yet written reads
+// as empty slots.
+static bool read_probe(int fd, uint64_t digest, dedup_slot* slots)
+{
+  memset(slots, 0, DEDUP_PROBE * sizeof *slots);
+  return pread(fd, slots, DEDUP_PROBE * sizeof *slots,
+	       probe_offset(digest)) >= 0;
+}
+
+bool dedup_seen(uint64_t digest, time_t now, int window)
+{
+  autoclose fd = open_index(LOCK_SH);
+  dedup_slot slots[DEDUP_PROBE];
+  if (fd < 0 || !read_probe(fd, digest, slots))
+    return false;
+  for (unsigned i = 0; i < DEDUP_PROBE; i++)
+    if (slots[i].digest == digest && slots[i].when <= now
+	&& now - slots[i].when < window)
+      return true;
+  return false;
+}
+
+void dedup_record(uint64_t digest, time_t when)
+{
+  autoclose fd = open_index(LOCK_EX);
+  dedup_slot slots[DEDUP_PROBE];
+  if (fd < 0 || !read_probe(fd, digest, slots))
+    return;
+  // Reuse the slot of an earlier copy, or else the oldest.
+  unsigned use = 0;
+  for (unsigned i = 0; i < DEDUP_PROBE; i++) {
+    if (slots[i].digest == digest) {
+      use = i;
+      break;
+    }
+    if (slots[i].when < slots[use].when)
+      use = i;
+  }
+  slots[use].digest = digest;
+  slots[use].when = when;
+  ssize_t ignored = pwrite(fd, &slots[use], sizeof slots[use],
+			   probe_offset(digest) + use * sizeof (dedup_slot));
+  (void)ignored;
+}
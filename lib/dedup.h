@@ -0,0 +1,51 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2018  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+
+#ifndef NULLMAILER__DEDUP__H__
+#define NULLMAILER__DEDUP__H__
+
+#include <stdint.h>
+#include <time.h>
+#include "envindex.h"
+
+// The duplicate index is a small hash table in the spool directory
+// recording the messages queued recently that had a Message-Id, so that
+// a client that injects the same message again, because it gave up
+// waiting on the first attempt, does not have it delivered twice.  Each
+// slot holds a 64-bit digest of the Message-Id and the envelope and the
+// time the message was queued, both in host byte order.  A digest is
+// looked for in a short run of slots from the one it hashes to, and an
+// old entry in the run is overwritten when a new one is added, so the
+// index never grows.
+#define DEDUP_NAME "dedup"
+#define DEDUP_SLOTS 8192
+#define DEDUP_PROBE 16
+
+// The digest of a message, or 0 if it has no Message-Id.
+uint64_t dedup_digest(const envelope_index& index);
+// Whether a message with the digest was queued less than window
+// seconds before now.
+bool dedup_seen(uint64_t digest, time_t now, int window);
+// Note that a message with the digest was queued at the given time.
+void dedup_record(uint64_t digest, time_t when);
+
+#endif // NULLMAILER__DEDUP__H__
@@ -0,0 +1,142 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#include <string.h>
+#include "dotstuff.h"
+
+dotstuffer::dotstuffer(bool s)
+  : stuff(s), last('\n')
+{
+}
+
+unsigned dotstuffer::encode(const char* in, unsigned len, char* out)
+{
+  char* ptr = out;
+  const char* end = in + len;
+  while (in < end) {
+    if (last == '\n' && stuff && *in == '.')
+      *ptr++ = '.';
+    const char* nl = (const char*)memchr(in, '\n', end - in);
+    const char* stop = nl ? nl : end;
+    unsigned seglen = stop - in;
+    memcpy(ptr, in, seglen);
+    ptr += seglen;
+    if (seglen > 0)
+      last = stop[-1];
+    if (!nl)
+      break;
+    if (last != '\r')
+      *ptr++ = '\r';
+    *ptr++ = last = '\n';
+    in = nl + 1;
+  }
+  return ptr - out;
+}
+
+unsigned dotstuffer::finish(char* out)
+{
+  char* ptr = out;
+  if (last != '\n') {
+    if (last != '\r')
+      *ptr++ = '\r';
+    *ptr++ = last = '\n';
+  }
+  return ptr - out;
+}
+
+dotunstuffer::dotunstuffer()
+  : state(st_bol)
+{
+}
+
+unsigned dotunstuffer::decode(const char* in, unsigned len, char* out, unsigned& outlen)
+{
+  const char* start = in;
+  const char* end = in + len;
+  char* ptr = out;
+  while (in < end && state != st_done) {
+    char ch = *in++;
+    switch (state) {
+    case st_bol:
+      if (ch == '.') {
+	state = st_dot;
+	continue;
+      }
+      break;
+    case st_dot:
+      if (ch == '\n') {
+	state = st_done;
+	continue;
+      }
+      if (ch == '\r') {
+	state = st_dotcr;
+	continue;
+      }
+      break;
+    case st_dotcr:
+      if (ch == '\n') {
+	state = st_done;
+	continue;
+      }
+      *ptr++ = '\r';
+      break;
+    case st_cr:
+      if (ch != '\n')
+	*ptr++ = '\r';
+      break;
+    default:
+      break;
+    }
+    // Plain line content: copy everything up to the next CR or LF.
+    if (ch == '\n') {
+      *ptr++ = ch;
+      state = st_bol;
+    }
+    else if (ch == '\r')
+      state = st_cr;
+    else {
+      *ptr++ = ch;
+      state = st_line;
+      const char* run = in;
+      while (run < end && *run != '\n' && *run != '\r')
+	++run;
+      memcpy(ptr, in, run - in);
+      ptr += run - in;
+      in = run;
+    }
+  }
+  outlen = ptr - out;
+  return in - start;
+}
+
+unsigned dotunstuffer::finish(char* out)
+{
+  switch (state) {
+  case st_line:
+  case st_cr:
+    state = st_done;
+    out[0] = '\n';
+    return 1;
+  default:
+    state = st_done;
+    return 0;
+  }
+}
@@ -0,0 +1,61 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#ifndef NULLMAILER_DOTSTUFF__H__
+#define NULLMAILER_DOTSTUFF__H__
+
+// Converts a message with LF line endings into the SMTP wire format a
+// block at a time: LF becomes CRLF and, when stuffing is enabled, a
+// dot is doubled at the start of a line.  The output buffer must hold
+// at least twice as many bytes as the input, plus 2 for finish().
+class dotstuffer
+{
+ public:
+  dotstuffer(bool stuff = true);
+  unsigned encode(const char* in, unsigned len, char* out);
+  // Terminate an incomplete last line.
+  unsigned finish(char* out);
+
+ private:
+  const bool stuff;
+  char last;
+};
+
+// The reverse of dotstuffer for a DATA transfer: strips the CR before
+// LF and one leading dot from each line, and stops after the line
+// holding only a dot.  The output buffer must hold at least one byte
+// more than the input.
+class dotunstuffer
+{
+ public:
+  dotunstuffer();
+  // Returns the number of input bytes used, which is less than len
+  // only when the terminating line was found.
+  unsigned decode(const char* in, unsigned len, char* out, unsigned& outlen);
+  // Terminate an incomplete last line when the input ends early.
+  unsigned finish(char* out);
+  bool done() const { return state == st_done; }
+
+ private:
+  enum { st_bol, st_dot, st_dotcr, st_line, st_cr, st_done } state;
+};
+
+#endif // NULLMAILER_DOTSTUFF__H__
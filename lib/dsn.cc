@@ -0,0 +1,262 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2018  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#include "config.h"
+#include "canonicalize.h"
+#include "configio.h"
+#include "dsn.h"
+#include "fdbuf/mmapibuf.h"
+#include "hostname.h"
+#include "itoa.h"
+#include "makefield.h"
+#include "queuefile.h"
+
+typedef list<dsn_message> mlist;
+typedef list<mystring> slist;
+
+void dsn_read_config(dsn_config& config)
+{
+  if (!config_readint("bouncelines", config.lines))
+    config.lines = -1;
+  if (!config_readint("bouncemaxbytes", config.maxbytes)
+      || config.maxbytes < 0)
+    config.maxbytes = 0;
+  if (!config_read("doublebounceto", config.doublebounceto)
+      || !config.doublebounceto)
+    config_read("adminaddr", config.doublebounceto);
+  read_hostnames();
+  if (!config_read("idhost", config.idhost))
+    config.idhost = me;
+  else
+    canonicalize(config.idhost);
+  if (!config_read("bounceto", config.bounceto))
+    config.bounceto = "";
+}
+
+bool dsn_read_envelope(fdibuf& in, dsn_message& msg)
+{
+  queuefile_read(in, msg.layout);
+  if (!in.getline(msg.sender))
+    return false;
+  mystring line;
+  while (in.getline(line)) {
+    if (!line)
+      break;
+    msg.recipients.append(line);
+  }
+  return msg.recipients.count() > 0;
+}
+
+bool dsn_envelope(const dsn_config& config, const mystring& sender,
+		  mystring& from, mystring& to)
+{
+  if (!!sender) {
+    // Bounces either go to the sender or bounceto, if configured
+    from = "";
+    to = !!config.bounceto ? config.bounceto : sender;
+    return true;
+  }
+  from = "#@[]";
+  to = config.doublebounceto;
+  return !!to;
+}
+
+static void write_text(fdobuf& out, const mlist& msgs, bool ddn)
+{
+  const mystring verb = ddn ? "has not been" : "could not be";
+  if (msgs.count() == 1) {
+    out << "This is the nullmailer delivery system.  The message attached below\n"
+	<< verb << " delivered to one or more of the intended recipients:\n"
+      "\n";
+    for (slist::const_iter r((*mlist::const_iter(msgs)).recipients); r; r++)
+      out << "\t<" << (*r) << ">\n";
+  }
+  else {
+    out << "This is the nullmailer delivery system.  The " << itoa(msgs.count())
+	<< " messages listed below\n"
+	<< verb << " delivered to one or more of the intended recipients:\n";
+    for (mlist::const_iter m(msgs); m; m++) {
+      out << "\nThe message queued at " << make_date((*m).timestamp) << ":\n";
+      for (slist::const_iter r((*m).recipients); r; r++)
+	out << "\t<" << (*r) << ">\n";
+    }
+  }
+  if (ddn) {
+    const time_t retry_until = (*mlist::const_iter(msgs)).retry_until;
+    if (msgs.count() == 1 && retry_until > 0)
+      out << "\nDelivery will continue to be attempted until "
+	  << make_date(retry_until) << '\n';
+    out << "\n"
+      "A final delivery status notification will be generated if delivery\n"
+      "proves to be impossible within the configured time limit.\n";
+  }
+}
+
+static void write_status(fdobuf& out, const dsn_message& m, bool ddn)
+{
+  for (slist::const_iter r(m.recipients); r; r++) {
+    out << "\n"
+      "Final-Recipient: rfc822; " << (*r) << "\n"
+      "Action: " << (ddn ? "delayed": "failed") << "\n"
+      "Status: " << m.status << "\n"
+      "Last-Attempt-Date: " << make_date(m.last_attempt) << '\n';
+    if (!!m.remote)
+      out << "Remote-MTA: dns; " << m.remote << '\n';
+    if (!!m.diagnostic_code)
+      out << "Diagnostic-Code: " << m.diagnostic_code << '\n';
+    if (ddn && m.retry_until > 0)
+      out << "Will-Retry-Until: " << make_date(m.retry_until) << '\n';
+  }
+}
+
+// Copy the header, and optionally the body, of a message, a buffer at
+// a time straight from the input.  The body ends after the given
+// number of lines, unless that is negative, and at the last line that
+// fits within maxbytes of the copy, if that is set.  The header is
+// always copied whole.
+static void write_copy(fdobuf& out, fdibuf& in, int lines,
+		       unsigned long maxbytes)
+{
+  const char* data;
+  unsigned len;
+  unsigned long copied = 0;
+  bool linestart = true;
+  bool blank = false;
+  while (!blank && in.peek(data, len)) {
+    unsigned i = 0;
+    while (i < len) {
+      if (linestart && data[i] == '\n') {
+	blank = true;
+	break;
+      }
+      const char* nl = (const char*)memchr(data + i, '\n', len - i);
+      linestart = nl != 0;
+      i = nl ? nl - data + 1 : len;
+    }
+    out.write(data, i);
+    copied += i;
+    in.skip(blank ? i + 1 : i);
+  }
+  if (!linestart)
+    out << '\n';
+  if (!lines)
+    return;
+  out << '\n';
+  if (!blank)
+    return;
+
+  unsigned long room = maxbytes == 0 ? (unsigned long)-1
+    : maxbytes > copied ? maxbytes - copied : 0;
+  linestart = true;
+  while (lines != 0 && room > 0 && in.peek(data, len)) {
+    unsigned n = len < room ? len : room;
+    unsigned i = n;
+    if (lines > 0)
+      for (i = 0; lines > 0 && i < n; --lines) {
+	const char* nl = (const char*)memchr(data + i, '\n', n - i);
+	if (!nl) {
+	  i = n;
+	  break;
+	}
+	i = nl - data + 1;
+      }
+    // Out of room part way through a line: end at the one before it.
+    if (i == n && n == room && n < len)
+      while (i > 0 && data[i-1] != '\n')
+	--i;
+    out.write(data, i);
+    in.skip(i);
+    room -= i;
+    if (i > 0)
+      linestart = data[i-1] == '\n';
+    if (i < len)
+      break;
+  }
+  if (!linestart)
+    out << '\n';
+}
+
+bool dsn_write(fdobuf& out, const dsn_config& config, mlist& msgs,
+	       const mystring& messageid)
+{
+  if (msgs.count() == 0)
+    return false;
+  const dsn_message& first = *mlist::const_iter(msgs);
+  const bool ddn = first.status[0] == '4';
+  const bool single = msgs.count() == 1;
+  const mystring boundary = make_boundary();
+
+  out << "From: Message Delivery Subsystem <MAILER-DAEMON@" << me << ">\n"
+    "To: <" << first.sender << ">\n"
+    "Subject: " << (ddn ? "Delayed mail: Message not yet delivered"
+		    : "Returned mail: Could not send message") << "\n"
+    "Date: " << make_date() << "\n"
+    "Message-Id: " << messageid << "\n"
+    "MIME-Version: 1.0\n"
+    "Content-Type: multipart/report; report-type=delivery-status;\n"
+    "\tboundary=\"" << boundary << "\"\n";
+
+  /* Human readable text portion */
+  out << "\n"
+    "--" << boundary << "\n"
+    "Content-Type: text/plain; charset=us-ascii\n"
+    "\n";
+  write_text(out, msgs, ddn);
+
+  /* delivery-status portion */
+  out << "\n"
+    "--" << boundary << "\n"
+    "Content-Type: message/delivery-status\n"
+    "\n"
+    "Reporting-MTA: x-local-hostname; " << me << "\n";
+  if (single) {
+    out << "Arrival-Date: " << make_date(first.timestamp) << "\n";
+    if (!!first.envelope_id)
+      out << "Original-Envelope-Id: " << first.envelope_id << '\n';
+  }
+  for (mlist::const_iter m(msgs); m; m++)
+    write_status(out, *m, ddn);
+
+  // Copy the message, or the headers of each of several.
+  for (mlist::iter m(msgs); m; m++) {
+    out << "\n"
+      "--" << boundary << "\n"
+      "Content-Type: " << (single ? "message/rfc822" : "text/rfc822-headers")
+	<< "\n"
+      "\n";
+    if ((*m).in != 0) {
+      queuefile_data data(*(*m).in, (*m).layout);
+      write_copy(out, data.in(), single ? config.lines : 0, config.maxbytes);
+    }
+    else {
+      mmapibuf in((*m).path.c_str());
+      dsn_message skipped;
+      if (dsn_read_envelope(in, skipped)) {
+	queuefile_data data(in, skipped.layout);
+	write_copy(out, data.in(), single ? config.lines : 0, config.maxbytes);
+      }
+    }
+  }
+
+  out << "\n"
+    "--" << boundary << "--\n";
+  return out;
+}
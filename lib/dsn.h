@@ -0,0 +1,78 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2018  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#ifndef NULLMAILER__DSN__H__
+#define NULLMAILER__DSN__H__
+
+#include <time.h>
+#include "fdbuf/fdbuf.h"
+#include "list.h"
+#include "mystring/mystring.h"
+#include "queuefile.h"
+
+// The control files that shape delivery status notifications, read
+// once by a program that generates many of them.
+struct dsn_config
+{
+  int lines;			// Lines of the body to copy, or -1 for all
+  int maxbytes;			// Bytes of the message to copy, or 0 for all
+  mystring bounceto;
+  mystring doublebounceto;
+  mystring idhost;
+};
+
+void dsn_read_config(dsn_config& config);
+
+// One message being reported on.  Its envelope is read from in, which
+// is left at the start of the message; if in is not set, the file
+// named by path is opened when the message is copied.  The layout is
+// the header line of the queue file, if it has one.
+struct dsn_message
+{
+  mystring path;
+  fdibuf* in;
+  queuefile_header layout;
+  mystring sender;
+  list<mystring> recipients;
+  time_t timestamp;		// When the message was queued
+  time_t last_attempt;
+  time_t retry_until;		// For a delay, when attempts end, or 0
+  mystring envelope_id;
+  mystring status;		// The status code, 4.#.# or 5.#.#
+  mystring remote;
+  mystring diagnostic_code;
+
+  dsn_message() : in(0), timestamp(0), last_attempt(0), retry_until(0) { }
+};
+
+bool dsn_read_envelope(fdibuf& in, dsn_message& msg);
+// Choose the envelope of the notification about a message from sender.
+// Returns false if there is nowhere to send it.
+bool dsn_envelope(const dsn_config& config, const mystring& sender,
+		  mystring& from, mystring& to);
+// Write the header and body of one notification reporting on all of
+// the messages, which share the same sender.  A single message is
+// copied whole, up to the configured lines of its body; with more than
+// one, only their headers are.
+bool dsn_write(fdobuf& out, const dsn_config& config,
+	       list<dsn_message>& msgs, const mystring& messageid);
+
+#endif // NULLMAILER__DSN__H__
@@ -0,0 +1,151 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#include "config.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "configio.h"
+#include "defines.h"
+#include "envindex.h"
+#include "fdbuf/fdbuf.h"
+#include "itoa.h"
+#include "priority.h"
+
+// The index file for a message, which is named after the last
+// component of the message file name.
+mystring envindex_path(const mystring& filename)
+{
+  int i = filename.find_last('/');
+  return CONFIG_PATH(QUEUE, "index", filename.right(i+1).c_str());
+}
+
+// The index holds the size, the offset and the Message-Id header
+// line, followed by the envelope in the same form as the message file,
+// the priority class and then the trace.  An index written before the
+// class was added ends with the envelope, and its message has normal
+// priority; one written before the trace was added has none.
+bool envindex_write(const mystring& path, const envelope_index& index)
+{
+  fdobuf out(path.c_str(), O_CREAT|O_WRONLY|O_TRUNC, 0600);
+  if (!out)
+    return false;
+  out << itoa(index.size) << '\n'
+      << itoa(index.offset) << '\n'
+      << index.message_id << '\n'
+      << index.sender << '\n';
+  for (list<mystring>::const_iter i(index.recipients); i; i++)
+    out << *i << '\n';
+  out << '\n'
+      << itoa(index.priority) << '\n'
+      << index.trace << '\n'
+      << itoa(index.injected) << '\n'
+      << itoa(index.queued) << '\n';
+  return out.sync() && out.close();
+}
+
+static bool read_number(fdibuf& in, unsigned long& n)
+{
+  mystring line;
+  if (!in.getline(line) || !line)
+    return false;
+  char* end;
+  n = strtoul(line.c_str(), &end, 10);
+  return *end == 0;
+}
+
+bool envindex_read(const mystring& path, unsigned long size,
+		   envelope_index& index)
+{
+  fdibuf in(path.c_str());
+  if (!in)
+    return false;
+  if (!read_number(in, index.size) || index.size != size
+      || !read_number(in, index.offset) || index.offset > size
+      || !in.getline(index.message_id)
+      || !in.getline(index.sender))
+    return false;
+  index.recipients.empty();
+  mystring line;
+  for (;;) {
+    if (!in.getline(line))
+      return false;
+    if (!line)
+      break;
+    index.recipients.append(line);
+  }
+  if (index.recipients.count() == 0)
+    return false;
+  unsigned long priority;
+  index.priority = read_number(in, priority) && priority < PRIORITY_CLASSES
+    ? (int)priority : PRIORITY_NORMAL;
+  unsigned long injected;
+  unsigned long queued;
+  if (in.getline(index.trace) && read_number(in, injected)
+      && read_number(in, queued)) {
+    index.injected = injected;
+    index.queued = queued;
+  }
+  else {
+    index.trace = "";
+    index.injected = index.queued = 0;
+  }
+  return true;
+}
+
+long long trace_clock(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+mystring trace_new(long long now)
+{
+  char usec[8];
+  usec[0] = '.';
+  long u = now % 1000000;
+  for (int i = 6; i > 0; i--, u /= 10)
+    usec[i] = '0' + u % 10;
+  usec[7] = 0;
+  mystring id = itoa(now / 1000000);
+  id += usec;
+  id += '.';
+  id += itoa(getpid());
+  return id;
+}
+
+// Take the time injection started back out of a trace ID.
+bool trace_time(const mystring& id, long long& started)
+{
+  const char* p = id.c_str();
+  char* end;
+  const unsigned long secs = strtoul(p, &end, 10);
+  if (end == p || *end != '.')
+    return false;
+  p = end + 1;
+  const unsigned long usecs = strtoul(p, &end, 10);
+  if (end - p != 6 || *end != '.')
+    return false;
+  started = secs * 1000000LL + usecs;
+  return true;
+}
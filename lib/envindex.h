@@ -0,0 +1,65 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#ifndef NULLMAILER__ENVINDEX__H__
+#define NULLMAILER__ENVINDEX__H__
+
+#include "list.h"
+#include "mystring/mystring.h"
+
+// A summary of a queued message, written by nullmailer-queue into the
+// index directory under the same name as the message, so that the
+// envelope and headers need not be parsed again for each delivery.
+// An index only applies to a message file of exactly the given size.
+struct envelope_index
+{
+  unsigned long size;		// Size of the whole message file
+  unsigned long offset;		// Start of the message after the envelope
+  mystring message_id;		// The Message-Id header line, if any
+  mystring sender;
+  list<mystring> recipients;
+  int priority;			// The class from priority.h
+  // The trace ID of the message, and when its injection started and
+  // when it was committed to the queue, in microseconds since the
+  // epoch (0 if not known).
+  mystring trace;
+  long long injected;
+  long long queued;
+};
+
+// A trace ID follows a message from the start of its injection to its
+// final outcome.  It is the time injection started, as seconds and
+// microseconds, and the process ID that started it:
+//   1791983563.186131.26241
+// nullmailer-inject passes it on in $NULLMAILER_TRACE, and it is given
+// in the Received line of the message so that it can be matched up
+// with the logs of the remotes.
+#define TRACE_ENV "NULLMAILER_TRACE"
+long long trace_clock(void);
+mystring trace_new(long long now);
+bool trace_time(const mystring& id, long long& started);
+
+mystring envindex_path(const mystring& filename);
+bool envindex_write(const mystring& path, const envelope_index& index);
+bool envindex_read(const mystring& path, unsigned long size,
+		   envelope_index& index);
+
+#endif
@@ -20,6 +20,7 @@
 #define ERR_UNKNOWN 17		// Arbitrary error code
 #define ERR_CONFIG 18		// Error reading a config file
 #define ERR_BIND_FAILED 19      // Failed to bind source address
+#define ERR_TIMEOUT 20		// the remote did not respond in time
 
 // Permanent errors
 #define ERR_GHBN_FATAL 33	// gethostbyname failed with NO_RECOVERY
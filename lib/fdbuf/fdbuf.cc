@@ -17,34 +17,42 @@
 #include "fdbuf.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <string.h>
 #include <unistd.h>
 
 ///////////////////////////////////////////////////////////////////////////////
 // Class fdbuf
 ///////////////////////////////////////////////////////////////////////////////
-fdbuf::fdbuf(int fdesc, bool dc, unsigned bufsz)
-  : buf(new char[bufsz]),
+fdbuf::fdbuf(int fdesc, bool dc, unsigned bufsz, bool shared)
+  : buf(0),
     buflength(0),
     bufstart(0),
     offset(0),
     errnum(0),
     flags(0),
-    bufsize(bufsz),
+    bufsize(bufsz == FDBUF_NOBUF ? 0 : bufsz ? bufsz : fdbuf_size_for(fdesc)),
     fd(fdesc),
-    do_close(dc)
+    do_close(dc),
+    timeout(-1)
 {
-  if(!buf) {
-    flags = flag_error;
-    errnum = errno;
+  if(bufsize) {
+    buf = fdbuf_pool_get(bufsize);
+    if(!buf) {
+      flags = flag_error;
+      errnum = errno;
+    }
   }
   if(fdesc < 0)
     flags |= flag_closed;
 #ifdef _REENTRANT
-  pthread_mutex_t tmp = PTHREAD_MUTEX_INITIALIZER;
-  mutex = tmp;
-  pthread_mutex_init(&mutex, 0);
+  mutex = 0;
+  if(shared) {
+    mutex = new pthread_mutex_t;
+    pthread_mutex_init(mutex, 0);
+  }
 #else
+  (void)shared;
 #ifdef FDBUF_MUTEX_DEBUG
   mutex_count = 0;
 #endif
@@ -55,9 +63,12 @@ fdbuf::~fdbuf()
 {
   close();
 #ifdef _REENTRANT
-  pthread_mutex_destroy(&mutex);
+  if(mutex) {
+    pthread_mutex_destroy(mutex);
+    delete mutex;
+  }
 #endif
-  delete buf;
+  fdbuf_pool_put(buf, bufsize);
 }
 
 bool fdbuf::error() const
@@ -70,6 +81,24 @@ bool fdbuf::closed() const
   return flags & flag_closed;
 }
 
+// Wait up to the timeout for the descriptor to become ready, failing
+// with ETIMEDOUT if it does not.
+bool fdbuf::wait_ready(int fdesc, short events)
+{
+  if(timeout < 0)
+    return true;
+  struct pollfd pfd;
+  pfd.fd = fdesc;
+  pfd.events = events;
+  int r;
+  do
+    r = poll(&pfd, 1, timeout);
+  while(r < 0 && errno == EINTR);
+  if(r == 0)
+    errno = ETIMEDOUT;
+  return r > 0;
+}
+
 bool fdbuf::close()
 {
   if(do_close && fd >= 0 && !(flags & flag_closed)) {
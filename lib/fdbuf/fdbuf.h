@@ -29,6 +29,22 @@
 #ifndef FDBUF_SIZE
 #define FDBUF_SIZE 4096
 #endif
+#ifndef FDBUF_POOL_MAX
+#define FDBUF_POOL_MAX (256*1024)
+#endif
+#ifndef FDBUF_POOL_BUDGET
+#define FDBUF_POOL_BUDGET (1024*1024)
+#endif
+// A buffer size that leaves the buffer to the derived class.
+#define FDBUF_NOBUF (~0U)
+
+// Marks the stream classes that nothing derives from, for compilers
+// that know about final.
+#if __cplusplus >= 201103L
+#define FDBUF_FINAL final
+#else
+#define FDBUF_FINAL
+#endif
 
 class mystring;
 
@@ -37,14 +53,18 @@ class fdbuf
 public:
   enum flagbits { flag_eof=1, flag_error=2, flag_closed=4 };
 
-  fdbuf(int fdesc, bool dc, unsigned bufsz = FDBUF_SIZE);
+  // A size of 0 picks one to suit the descriptor, from fdbuf_size_for,
+  // and one of FDBUF_NOBUF takes no buffer at all.
+  fdbuf(int fdesc, bool dc, unsigned bufsz = FDBUF_SIZE, bool shared = false);
   ~fdbuf();
   bool error() const;
   bool closed() const;
   bool close();
 #ifdef _REENTRANT
-  void lock() { pthread_mutex_lock(&mutex); }
-  void unlock() { pthread_mutex_unlock(&mutex); }
+  // A buffer belongs to the one thread using it and is not locked.
+  // Only those created as shared, such as the standard streams, are.
+  void lock() { if(mutex) pthread_mutex_lock(mutex); }
+  void unlock() { if(mutex) pthread_mutex_unlock(mutex); }
 #else
 #ifdef FDBUF_MUTEX_DEBUG
   void lock();
@@ -55,19 +75,22 @@ public:
 #endif
 #endif
 protected:
-  char* const buf;
+  char* buf;
   unsigned buflength;		// Length of the data in the buffer
   unsigned bufstart;		// Start of the data in the buffer
   unsigned offset;		// Current file read/write offset
   int errnum;			// Saved error flag
   unsigned flags;		// Status flags
 
-  const unsigned bufsize;	// Total buffer size
+  unsigned bufsize;		// Total buffer size
   const int fd;
   const bool do_close;		// True to close on destructor
+  int timeout;			// Milliseconds to wait for I/O, or -1
+
+  bool wait_ready(int fdesc, short events);
 
 #ifdef _REENTRANT
-  pthread_mutex_t mutex;
+  pthread_mutex_t* mutex;
 #else
 #ifdef FDBUF_MUTEX_DEBUG
   unsigned mutex;
@@ -77,6 +100,25 @@ protected:
 
 bool fdbuf_copy(class fdibuf&, class fdobuf&, bool noflush = false);
 
+// Buffers are borrowed from a pool and given back to it, so that the
+// streams opened for every message do not each allocate their own.
+// Buffers above FDBUF_SIZE come out of a budget, FDBUF_POOL_BUDGET
+// unless set; once it is spent size is cut back to FDBUF_SIZE.  As
+// much again is kept for reuse when buffers are given back.
+char* fdbuf_pool_get(unsigned& size);
+void fdbuf_pool_put(char* buf, unsigned size);
+void fdbuf_pool_budget(unsigned long bytes);
+unsigned fdbuf_size_for(int fd);
+
+// Hints to the kernel about the page cache of a file that is written
+// once and read once, as queue files are, so that large messages do
+// not push everything else out of it.  They do nothing where the calls
+// are not available.
+void fdbuf_advise_sequential(int fd);
+void fdbuf_advise_willneed(int fd);
+void fdbuf_drop_cache(int fd);
+void fdbuf_start_writeback(int fd, unsigned long offset, unsigned long length);
+
 #include "fdbuf/fdibuf.h"
 #include "fdbuf/fdobuf.h"
 
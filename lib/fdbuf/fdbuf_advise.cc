@@ -0,0 +1,62 @@
+// Copyright (C) 2016 Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+#include "fdbuf.h"
+
+// Read ahead further than usual, and drop pages behind the reader.
+void fdbuf_advise_sequential(int fd)
+{
+#ifdef HAVE_POSIX_FADVISE
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#else
+  (void)fd;
+#endif
+}
+
+// Start reading the whole file into the page cache without waiting
+// for it, as it is about to be read.
+void fdbuf_advise_willneed(int fd)
+{
+#ifdef HAVE_POSIX_FADVISE
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#else
+  (void)fd;
+#endif
+}
+
+// Drop the clean pages of the file, which is not going to be read
+// again soon.  Pages that are still dirty or mapped stay.
+void fdbuf_drop_cache(int fd)
+{
+#ifdef HAVE_POSIX_FADVISE
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#else
+  (void)fd;
+#endif
+}
+
+// Start writing out part of the file without waiting for it, so that
+// a large file is not all dirty when it is synced.
+void fdbuf_start_writeback(int fd, unsigned long offset, unsigned long length)
+{
+#ifdef HAVE_SYNC_FILE_RANGE
+  sync_file_range(fd, offset, length, SYNC_FILE_RANGE_WRITE);
+#else
+  (void)fd;
+  (void)offset;
+  (void)length;
+#endif
+}
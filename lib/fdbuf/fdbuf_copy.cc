@@ -15,23 +15,125 @@
 // Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 
 #include "fdbuf.h"
+#include <errno.h>
+#include <poll.h>
+
+#ifndef SPLICE_SIZE
+#define SPLICE_SIZE 65536
+#endif
 
 ///////////////////////////////////////////////////////////////////////////////
 // Other routines
 ///////////////////////////////////////////////////////////////////////////////
+// Wait for one end of a splice that would have blocked, however long
+// its buffer waits for I/O: forever for a non-blocking descriptor with
+// no timeout.
+static bool splice_wait(int fd, short events, int timeout)
+{
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = events;
+  int r;
+  do
+    r = poll(&pfd, 1, timeout);
+  while(r < 0 && errno == EINTR);
+  if(r == 0)
+    errno = ETIMEDOUT;
+  return r > 0;
+}
+
 bool fdbuf_copy(fdibuf& in, fdobuf& out, bool noflush)
 {
   if(in.eof())
     return true;
   if(!in || !out)
     return false;
-  do {
-    char buf[FDBUF_SIZE];
-    if(!in.read(buf, FDBUF_SIZE) && in.last_count() == 0)
-      break;
-    if(!out.write(buf, in.last_count()) && out.last_count() < in.last_count())
+  // Send the rest of a regular file with sendfile, after writing out
+  // what is already in the input buffer.
+  unsigned long left;
+  const bool regular = in.size_left(left);
+  if(regular && left > in.buflength - in.bufstart) {
+    unsigned buffered = in.buflength - in.bufstart;
+    if(!out.write(in.buf + in.bufstart, buffered) || !out.flush())
+      return false;
+    in.bufstart = in.buflength;
+    left -= buffered;
+    off_t off = in.offset;
+    ssize_t sent = out._sendfile(in.fd, &off, left);
+    if(sent > 0) {
+      while((unsigned long)sent < left) {
+	ssize_t more = out._sendfile(in.fd, &off, left - sent);
+	if(more <= 0) {
+	  if(more < 0) {
+	    out.errnum = errno;
+	    out.flags |= fdbuf::flag_error;
+	    return false;
+	  }
+	  break;
+	}
+	sent += more;
+      }
+      // Leave the input positioned at the end, as if it had been read.
+      lseek(in.fd, off, SEEK_SET);
+      in.offset += sent;
+      out.offset += sent;
+      in.flags |= fdbuf::flag_eof;
+      return noflush || out.flush();
+    }
+    // Nothing was sent; fall back to copying through the buffers.
+  }
+  // Otherwise, when one end is a pipe, splice the rest across until
+  // the input reaches EOF.  TLS buffers have no descriptor of their own.
+  else if(!regular && in.fd >= 0) {
+    if(!out.write(in.buf + in.bufstart, in.buflength - in.bufstart)
+       || !out.flush())
+      return false;
+    in.bufstart = in.buflength;
+    unsigned long total = 0;
+    bool spliced = true;
+    for(;;) {
+      ssize_t moved;
+      if(!in.wait_ready(in.fd, POLLIN))
+	moved = -1;
+      else
+	moved = out._splice(in.fd, SPLICE_SIZE);
+      if(moved == 0)
+	break;
+      if(moved < 0) {
+	if(errno == EINTR)
+	  continue;
+	// A non-blocking end was not ready: the output was full or the
+	// input was empty.
+	if(errno == EAGAIN) {
+	  if(splice_wait(out.fd, POLLOUT, out.timeout)
+	     && splice_wait(in.fd, POLLIN, in.timeout))
+	    continue;
+	}
+	else if(total == 0 && (errno == EINVAL || errno == ENOSYS)) {
+	  spliced = false;
+	  break;
+	}
+	out.errnum = errno;
+	out.flags |= fdbuf::flag_error;
+	return false;
+      }
+      total += moved;
+    }
+    if(spliced) {
+      in.offset += total;
+      out.offset += total;
+      in.flags |= fdbuf::flag_eof;
+      return true;
+    }
+    // Neither end could be spliced; copy through the buffers.
+  }
+  // Copy straight out of the input buffer, which for a mapped file
+  // already holds all of it.
+  while(in.bufstart < in.buflength || in.refill()) {
+    if(!out.write(in.buf + in.bufstart, in.buflength - in.bufstart))
       return false;
-  } while(!in.eof());
+    in.bufstart = in.buflength;
+  }
   if(!noflush && !out.flush())
     return false;
   return in.eof();
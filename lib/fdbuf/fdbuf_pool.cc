@@ -0,0 +1,109 @@
+// Copyright (C) 2016 Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+#include "fdbuf.h"
+#include "stats.h"
+#include <sys/stat.h>
+
+// Buffers are kept on a free list per size, each a power of two from
+// FDBUF_SIZE up to FDBUF_POOL_MAX, linked through their first bytes.
+// Other sizes are allocated and freed as they are asked for.
+#define POOL_CLASSES 16
+
+static char* pool[POOL_CLASSES];
+static unsigned long pool_budget = FDBUF_POOL_BUDGET;
+static unsigned long pool_cached;	// Bytes on the free lists
+static unsigned long pool_large;	// Bytes in use above FDBUF_SIZE
+
+#ifdef _REENTRANT
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define POOL_LOCK() pthread_mutex_lock(&pool_mutex)
+#define POOL_UNLOCK() pthread_mutex_unlock(&pool_mutex)
+#else
+#define POOL_LOCK() do { } while(0)
+#define POOL_UNLOCK() do { } while(0)
+#endif
+
+static int pool_class(unsigned size)
+{
+  int c = 0;
+  for(unsigned s = FDBUF_SIZE; s <= FDBUF_POOL_MAX; s *= 2, c++)
+    if(s == size)
+      return c;
+  return -1;
+}
+
+void fdbuf_pool_budget(unsigned long bytes)
+{
+  POOL_LOCK();
+  pool_budget = bytes;
+  POOL_UNLOCK();
+}
+
+char* fdbuf_pool_get(unsigned& size)
+{
+  POOL_LOCK();
+  if(size > FDBUF_SIZE) {
+    if(pool_large + size > pool_budget)
+      size = FDBUF_SIZE;
+    else
+      pool_large += size;
+  }
+  char* buf = 0;
+  int c = pool_class(size);
+  if(c >= 0 && pool[c]) {
+    buf = pool[c];
+    memcpy(&pool[c], buf, sizeof buf);
+    pool_cached -= size;
+  }
+  POOL_UNLOCK();
+  if(!buf) {
+    buf = new char[size];
+    ++run_stats.buffers;
+    run_stats.buffer_bytes += size;
+  }
+  return buf;
+}
+
+void fdbuf_pool_put(char* buf, unsigned size)
+{
+  if(!buf)
+    return;
+  int c = pool_class(size);
+  POOL_LOCK();
+  if(size > FDBUF_SIZE)
+    pool_large -= size;
+  if(c >= 0 && pool_cached + size <= pool_budget) {
+    memcpy(buf, &pool[c], sizeof buf);
+    pool[c] = buf;
+    pool_cached += size;
+    buf = 0;
+  }
+  POOL_UNLOCK();
+  delete[] buf;
+}
+
+// A file is read through a buffer that holds all of it, up to
+// FDBUF_POOL_MAX; anything else through one of the usual size.
+unsigned fdbuf_size_for(int fd)
+{
+  struct stat st;
+  unsigned size = FDBUF_SIZE;
+  if(fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    while(size < FDBUF_POOL_MAX && (off_t)size < st.st_size)
+      size *= 2;
+  return size;
+}
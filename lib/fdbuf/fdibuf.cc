@@ -15,16 +15,19 @@
 // Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 
 #include "fdbuf.h"
+#include "stats.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
 #include <string.h>
 #include <unistd.h>
 
 ///////////////////////////////////////////////////////////////////////////////
 // Class fdibuf
 ///////////////////////////////////////////////////////////////////////////////
-fdibuf::fdibuf(int fdesc, bool dc, unsigned bufsz)
-  : fdbuf(fdesc, dc, bufsz)
+fdibuf::fdibuf(int fdesc, bool dc, unsigned bufsz, bool shared)
+  : fdbuf(fdesc, dc, bufsz, shared)
 {
 }
 
@@ -52,6 +55,8 @@ bool fdibuf::operator!() const
 }
 
 // refill is protected -- no locking
+// Only the unread tail, at most the start of a partial line, is moved
+// to the front before reading more.
 bool fdibuf::refill()
 {
   if(flags)
@@ -59,7 +64,7 @@ bool fdibuf::refill()
   if(bufstart != 0) {
     if(bufstart < buflength) {
       buflength -= bufstart;
-      memcpy(buf, buf+bufstart, buflength);
+      memmove(buf, buf+bufstart, buflength);
     } else
       buflength = 0;
     bufstart = 0;
@@ -81,21 +86,77 @@ bool fdibuf::refill()
   return buflength > oldbuflength;
 }
 
-bool fdibuf::get(char& ch)
+// Double the buffer, up to FDIBUF_MAX, to fit a line that fills it.
+// It cannot grow while the pool's budget is spent.
+bool fdibuf::grow()
+{
+  if(bufsize >= FDIBUF_MAX)
+    return false;
+  unsigned newsize = bufsize * 2;
+  char* newbuf = fdbuf_pool_get(newsize);
+  if(newsize <= bufsize) {
+    fdbuf_pool_put(newbuf, newsize);
+    return false;
+  }
+  buflength -= bufstart;
+  memcpy(newbuf, buf+bufstart, buflength);
+  bufstart = 0;
+  fdbuf_pool_put(buf, bufsize);
+  buf = newbuf;
+  bufsize = newsize;
+  return true;
+}
+
+// Find the end of the next line in the buffer, reading more as needed.
+// A line that cannot fit is returned without its terminator and with
+// complete cleared.  scanline is protected -- no locking.
+bool fdibuf::scanline(const char*& data, unsigned& len, char terminator,
+		      bool& complete)
 {
-  lock();
   count = 0;
   if(bufstart >= buflength)
     refill();
-  bool r = true;
   if(eof() || error())
-    r = false;
-  else {
-    ch = buf[bufstart++];
-    count = 1;
+    return false;
+  unsigned scanned = 0;
+  for(;;) {
+    const char* start = buf + bufstart;
+    unsigned left = buflength - bufstart;
+    const char* end = (const char*)memchr(start + scanned, terminator,
+					  left - scanned);
+    if(end) {
+      data = start;
+      len = end - start;
+      bufstart += len + 1;
+      count = len + 1;
+      complete = true;
+      return true;
+    }
+    scanned = left;
+    if(bufstart == 0 && buflength == bufsize && !grow())
+      break;
+    if(!refill())
+      break;
   }
-  unlock();
-  return r;
+  data = buf + bufstart;
+  len = buflength - bufstart;
+  bufstart = buflength;
+  count = len;
+  complete = false;
+  return true;
+}
+
+// The rest of get, once the buffer has run out.  get_refill is
+// protected -- no locking.
+bool fdibuf::get_refill(char& ch)
+{
+  count = 0;
+  refill();
+  if(eof() || error())
+    return false;
+  ch = buf[bufstart++];
+  count = 1;
+  return true;
 }
 
 bool fdibuf::read_large(char* data, unsigned datalen)
@@ -158,6 +219,29 @@ bool fdibuf::read(char* data, unsigned datalen)
   return !datalen;
 }
 
+bool fdibuf::peek(const char*& data, unsigned& len)
+{
+  lock();
+  count = 0;
+  if(bufstart >= buflength)
+    refill();
+  bool r = !eof() && !error();
+  data = buf+bufstart;
+  len = r ? buflength-bufstart : 0;
+  unlock();
+  return r;
+}
+
+void fdibuf::skip(unsigned len)
+{
+  lock();
+  if(len > buflength-bufstart)
+    len = buflength-bufstart;
+  bufstart += len;
+  count = len;
+  unlock();
+}
+
 bool fdibuf::seek(unsigned o)
 {
   lock();
@@ -186,12 +270,28 @@ bool fdibuf::seekfwd(unsigned o)
   return seek(tell() + o);
 }
 
+bool fdibuf::size_left(unsigned long& len) const
+{
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+     || st.st_size < (off_t)tell())
+    return false;
+  len = st.st_size - tell();
+  return true;
+}
+
 ssize_t fdibuf::_read(char* buf, ssize_t len)
 {
-  return ::read(fd, buf, len);
+  if(!wait_ready(fd, POLLIN))
+    return -1;
+  ssize_t r = ::read(fd, buf, len);
+  ++run_stats.reads;
+  if(r > 0)
+    run_stats.read_bytes += r;
+  return r;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 // Globals
 ///////////////////////////////////////////////////////////////////////////////
-fdibuf fin(0);
+fdibuf fin(0, false, FDBUF_SIZE, true);
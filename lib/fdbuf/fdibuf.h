@@ -19,21 +19,69 @@
 
 #include "fdbuf.h"
 
+#ifndef FDIBUF_MAX
+#define FDIBUF_MAX 65536
+#endif
+
+class fdobuf;
+
 class fdibuf : protected fdbuf
 {
 public:
-  fdibuf(const char* filename, unsigned bufsz = FDBUF_SIZE);
-  fdibuf(int fdesc, bool dc = false, unsigned bufsz = FDBUF_SIZE);
+  fdibuf(const char* filename, unsigned bufsz = 0);
+  fdibuf(int fdesc, bool dc = false, unsigned bufsz = FDBUF_SIZE,
+	 bool shared = false);
   virtual ~fdibuf();
   bool close() { lock(); bool r = fdbuf::close(); unlock(); return r; }
   bool eof() const;
   bool operator!() const ;
   operator bool() const { return !operator!(); }
-  virtual bool get(char& ch);
-  virtual bool getline(mystring& out, char terminator = '\n');
-  virtual bool getnetstring(mystring& out);
-  virtual bool read(char*, unsigned);
-  virtual bool read_large(char*, unsigned);
+  // The reads are not virtual, so that the byte and line readers the
+  // protocols loop over are bound at compile time; only refilling the
+  // buffer goes through the transport's _read.  A byte or a whole line
+  // already in the buffer is taken inline.
+  bool get(char& ch)
+    {
+      lock();
+      if(bufstart < buflength) {
+	ch = buf[bufstart++];
+	count = 1;
+	unlock();
+	return true;
+      }
+      bool r = get_refill(ch);
+      unlock();
+      return r;
+    }
+  bool getline(mystring& out, char terminator = '\n');
+  // Point at the next line in place, valid until the next read.  Lines
+  // longer than the buffer can grow to come back in pieces.
+  bool getline(const char*& data, unsigned& len, char terminator = '\n')
+    {
+      lock();
+      const char* start = buf + bufstart;
+      const char* end = bufstart < buflength
+	? (const char*)memchr(start, terminator, buflength - bufstart) : 0;
+      bool r = true;
+      if(end) {
+	data = start;
+	len = end - start;
+	bufstart += len + 1;
+	count = len + 1;
+      }
+      else {
+	bool complete;
+	r = scanline(data, len, terminator, complete);
+      }
+      unlock();
+      return r;
+    }
+  bool getnetstring(mystring& out);
+  bool read(char*, unsigned);
+  bool read_large(char*, unsigned);
+  // Access the buffered data in place, refilling first if it is empty.
+  bool peek(const char*& data, unsigned& len);
+  void skip(unsigned len);
   bool read(unsigned char* b, unsigned l) { return read((char*)b, l); }
   bool read(signed char* b, unsigned l) { return read((char*)b, l); }
   unsigned last_count() { return count; }
@@ -41,10 +89,22 @@ public:
   bool seekfwd(unsigned o);
   bool rewind() { return seek(0); }
   unsigned tell() const { return offset-buflength+bufstart; }
+  // The number of bytes read in but not yet consumed.
+  unsigned buffered() const { return buflength-bufstart; }
   int error_number() const { return errnum; }
+  // Fail reads or writes that have to wait longer than this, or forever
+  // if negative.
+  void set_timeout(int ms) { timeout = ms; }
+  // For a regular file, the number of bytes left after the read position.
+  bool size_left(unsigned long& len) const;
+  friend bool fdbuf_copy(fdibuf&, fdobuf&, bool);
 protected:
   unsigned count;		// Number of bytes read by last operation
   bool refill();
+  bool get_refill(char& ch);
+  bool scanline(const char*& data, unsigned& len, char terminator,
+		bool& complete);
+  virtual bool grow();
   virtual ssize_t _read(char*, ssize_t);
 };
 
@@ -21,32 +21,20 @@
 bool fdibuf::getline(mystring& out, char terminator)
 {
   lock();
-  count = 0;
-  if(bufstart >= buflength)
-    refill();
-  if(eof() || error()) {
+  const char* data;
+  unsigned len;
+  bool complete;
+  if(!scanline(data, len, terminator, complete)) {
     unlock();
     return false;
   }
-  out = "";
-  while(!eof() && !error()) {
-    char* ptr = buf+bufstart;
-    unsigned bufleft = buflength - bufstart;
-    const char* end = (const char*)memchr(ptr, terminator, bufleft);
-    if(!end) {
-      out += mystring(ptr, bufleft);
-      bufstart = buflength;
-      count += bufleft;
-      refill();
-    }
-    else {
-      unsigned copylen = end - ptr;
-      out += mystring(ptr, copylen);
-      bufstart += copylen+1;
-      count += copylen+1;
-      break;
-    }
+  out = mystring(data, len);
+  unsigned total = count;
+  while(!complete && scanline(data, len, terminator, complete)) {
+    out.append(data, len);
+    total += count;
   }
+  count = total;
   unlock();
   return true;
 }
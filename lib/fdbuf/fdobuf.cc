@@ -15,22 +15,27 @@
 // Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 
 #include "fdbuf.h"
+#include "stats.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <string.h>
 #include <unistd.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 
 ///////////////////////////////////////////////////////////////////////////////
 // Globals
 ///////////////////////////////////////////////////////////////////////////////
-fdobuf fout(1);
-fdobuf ferr(2);
+fdobuf fout(1, false, FDBUF_SIZE, true);
+fdobuf ferr(2, false, FDBUF_SIZE, true);
 
 ///////////////////////////////////////////////////////////////////////////////
 // Class fdobuf
 ///////////////////////////////////////////////////////////////////////////////
-fdobuf::fdobuf(int fdesc, bool dc, unsigned bufsz)
-  : fdbuf(fdesc, dc, bufsz),
+fdobuf::fdobuf(int fdesc, bool dc, unsigned bufsz, bool shared)
+  : fdbuf(fdesc, dc, bufsz, shared),
     bufpos(0)
 {
 }
@@ -131,34 +136,121 @@ bool fdobuf::write(char ch)
   return true;
 }
 
-bool fdobuf::write_large(const char* data, unsigned datalen)
+// Write out the buffer followed by the given pieces, all in one go.
+// Called with the lock held and the buffer position at its end.
+bool fdobuf::nwritev(const struct iovec* iov, int iovcnt, unsigned total)
+{
+  struct iovec vec[FDOBUF_IOV_MAX + 1];
+  int n = 0;
+  unsigned buffered = buflength - bufstart;
+  if(buffered > 0) {
+    vec[n].iov_base = buf + bufstart;
+    vec[n].iov_len = buffered;
+    ++n;
+  }
+  for(int i = 0; i < iovcnt; i++)
+    if(iov[i].iov_len > 0)
+      vec[n++] = iov[i];
+  struct iovec* v = vec;
+  unsigned long written = 0;
+  while(n > 0) {
+    ssize_t w = _writev(v, n);
+    if(w < 0) {
+      flags |= flag_error;
+      errnum = errno;
+      if(written > buffered)
+	count = written - buffered;
+      return false;
+    }
+    written += w;
+    offset += w;
+    while(n > 0 && (size_t)w >= v->iov_len) {
+      w -= v->iov_len;
+      ++v;
+      --n;
+    }
+    if(n > 0) {
+      v->iov_base = (char*)v->iov_base + w;
+      v->iov_len -= w;
+    }
+  }
+  buflength = 0;
+  bufstart = 0;
+  bufpos = 0;
+  count = total;
+  return true;
+}
+
+bool fdobuf::writev(const struct iovec* iov, int iovcnt)
 {
   if(flags)
     return false;
 
   lock();
   count = 0;
-
-  if(!nflush(false)) {
+  unsigned total = 0;
+  for(int i = 0; i < iovcnt; i++)
+    total += iov[i].iov_len;
+  bool r = true;
+  if(bufpos + total < bufsize) {
+    for(int i = 0; i < iovcnt; i++) {
+      memcpy(buf+bufpos, iov[i].iov_base, iov[i].iov_len);
+      bufpos += iov[i].iov_len;
+    }
+    if(bufpos > buflength) buflength = bufpos;
+    count = total;
+  }
+  else if(bufpos == buflength && iovcnt <= FDOBUF_IOV_MAX)
+    r = nwritev(iov, iovcnt, total);
+  else {
+    // The buffer was seeked into, or there are too many pieces;
+    // write them one at a time.
     unlock();
-    return false;
+    unsigned done = 0;
+    for(int i = 0; r && i < iovcnt; i++) {
+      r = write((const char*)iov[i].iov_base, iov[i].iov_len);
+      done += last_count();
+    }
+    count = done;
+    return r;
   }
+  unlock();
+  return r;
+}
 
-  while(datalen > 0) {
-    ssize_t written = _write(data, datalen);
-    if(written < 0) {
-      flags |= flag_error;
-      errnum = errno;
-      unlock();
-      return false;
+bool fdobuf::write_large(const char* data, unsigned datalen)
+{
+  if(flags)
+    return false;
+
+  lock();
+  count = 0;
+  bool r;
+  if(bufpos == buflength) {
+    // Send what is buffered along with the data in a single write.
+    struct iovec iov;
+    iov.iov_base = (void*)data;
+    iov.iov_len = datalen;
+    r = nwritev(&iov, 1, datalen);
+  }
+  else {
+    r = nflush(false);
+    while(r && datalen > 0) {
+      ssize_t written = _write(data, datalen);
+      if(written < 0) {
+	flags |= flag_error;
+	errnum = errno;
+	r = false;
+	break;
+      }
+      datalen -= written;
+      data += written;
+      offset += written;
+      count += written;
     }
-    datalen -= written;
-    data += written;
-    offset += written;
-    count += written;
   }
   unlock();
-  return true;
+  return r;
 }
 
 bool fdobuf::write(const char* data, unsigned datalen)
@@ -198,9 +290,75 @@ bool fdobuf::write(const char* data, unsigned datalen)
   return true;
 }
 
+// Charge a system call and what it moved to the run counters.
+static ssize_t counted(ssize_t r, unsigned long& calls, unsigned long& bytes)
+{
+  ++calls;
+  if(r > 0)
+    bytes += r;
+  return r;
+}
+
 ssize_t fdobuf::_write(const char* buf, ssize_t len)
 {
-  return ::write(fd, buf, len);
+  if(!wait_ready(fd, POLLOUT))
+    return -1;
+  ssize_t r = counted(::write(fd, buf, len),
+		      run_stats.writes, run_stats.write_bytes);
+  // A socket send timeout expired.
+  if(r < 0 && errno == EAGAIN && timeout >= 0)
+    errno = ETIMEDOUT;
+  return r;
+}
+
+ssize_t fdobuf::_writev(const struct iovec* iov, int iovcnt)
+{
+  if(!wait_ready(fd, POLLOUT))
+    return -1;
+  ssize_t r = counted(::writev(fd, iov, iovcnt),
+		      run_stats.writes, run_stats.write_bytes);
+  if(r < 0 && errno == EAGAIN && timeout >= 0)
+    errno = ETIMEDOUT;
+  return r;
+}
+
+ssize_t fdobuf::_sendfile(int infd, off_t* inoff, size_t len)
+{
+  if(!wait_ready(fd, POLLOUT))
+    return -1;
+#ifdef HAVE_COPY_FILE_RANGE
+  // Between regular files, let the filesystem share or copy the blocks.
+  ssize_t r = counted(::copy_file_range(infd, inoff, fd, 0, len, 0),
+		      run_stats.transfers, run_stats.transfer_bytes);
+  if(r >= 0 || (errno != EINVAL && errno != EXDEV && errno != ENOSYS
+		&& errno != EBADF && errno != EOPNOTSUPP))
+    return r;
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+  return counted(::sendfile(fd, infd, inoff, len),
+		 run_stats.transfers, run_stats.transfer_bytes);
+#else
+  (void)infd;
+  (void)inoff;
+  (void)len;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+ssize_t fdobuf::_splice(int infd, size_t len)
+{
+#ifdef HAVE_SPLICE
+  if(!wait_ready(fd, POLLOUT))
+    return -1;
+  return counted(::splice(infd, 0, fd, 0, len, SPLICE_F_MOVE | SPLICE_F_MORE),
+		 run_stats.transfers, run_stats.transfer_bytes);
+#else
+  (void)infd;
+  (void)len;
+  errno = ENOSYS;
+  return -1;
+#endif
 }
 
 ///////////////////////////////////////////////////////////////////////////////
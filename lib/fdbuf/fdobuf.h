@@ -18,6 +18,11 @@
 #define FDBUF__FDOBUF__H__
 
 #include "fdbuf.h"
+#include <sys/uio.h>
+
+#ifndef FDOBUF_IOV_MAX
+#define FDOBUF_IOV_MAX 16
+#endif
 
 class fdobuf : protected fdbuf
 {
@@ -29,7 +34,8 @@ public:
 
   fdobuf(const char* filename, int, int mode = 0666,
 	 unsigned bufsz = FDBUF_SIZE);
-  fdobuf(int fdesc, bool dc=false, unsigned bufsz = FDBUF_SIZE);
+  fdobuf(int fdesc, bool dc=false, unsigned bufsz = FDBUF_SIZE,
+	 bool shared = false);
   virtual ~fdobuf();
   bool close();
   bool operator!() const;
@@ -46,6 +52,10 @@ public:
   bool write(const unsigned char* b, unsigned l) { return write((char*)b, l); }
   bool write(const signed char* b, unsigned l) { return write((char*)b, l); }
   virtual bool write_large(const char*, unsigned);
+  // Write several pieces at once.  Pieces that fit are gathered into
+  // the buffer; otherwise the buffer and the pieces go out together in
+  // one writev, without copying the pieces.
+  bool writev(const struct iovec*, int);
   unsigned last_count() { return count; }
   bool seek(unsigned o);
   bool rewind() { return seek(0); }
@@ -76,9 +86,17 @@ public:
   fdobuf& operator<<(signed short i) { return operator<<((signed long)i); }
 
   int error_number() const { return errnum; }
+  // Fail reads or writes that have to wait longer than this, or forever
+  // if negative.
+  void set_timeout(int ms) { timeout = ms; }
+  friend bool fdbuf_copy(fdibuf&, fdobuf&, bool);
 protected:
   virtual bool nflush(bool withsync);
+  bool nwritev(const struct iovec*, int, unsigned total);
   virtual ssize_t _write(const char* buf, ssize_t len);
+  virtual ssize_t _writev(const struct iovec* iov, int iovcnt);
+  virtual ssize_t _sendfile(int infd, off_t* inoff, size_t len);
+  virtual ssize_t _splice(int infd, size_t len);
 
   unsigned bufpos;		// Current write position in the buffer
   unsigned count;		// Number of bytes written by last operation
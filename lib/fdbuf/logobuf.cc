@@ -0,0 +1,322 @@
+// Copyright (C) 2016 Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+#include "logobuf.h"
+#include "stats.h"
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static long long clock_ms()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Class logobuf
+///////////////////////////////////////////////////////////////////////////////
+logobuf::logobuf(int fdesc, unsigned bufsz)
+  : fdobuf(fdesc, false, bufsz, true),
+    kind(other), fmt(text), program(0), line(0), linelen(0),
+    midline(false), draining(false), last_write(0),
+    dropped_lines(0), unreported(0)
+{
+  struct stat st;
+  if (fstat(fdesc, &st) == 0) {
+    if (S_ISSOCK(st.st_mode))
+      kind = socket;
+    else if (S_ISFIFO(st.st_mode))
+      kind = pipe;
+  }
+}
+
+logobuf::~logobuf()
+{
+  if (linelen > 0)
+    put_record(line, linelen);
+  // Give a slow reader a moment to take the rest before exiting, but
+  // no more: whatever is left then is lost rather than waited for.
+  for (int i = 0; i < 10 && pending() > 0 && drain() && pending() > 0; i++) {
+    struct pollfd p;
+    p.fd = fd;
+    p.events = POLLOUT;
+    poll(&p, 1, 100);
+  }
+  discard();
+  delete[] line;
+}
+
+void logobuf::set_format(format f, const char* prog)
+{
+  fmt = f;
+  program = prog;
+  if (fmt != text && line == 0)
+    line = new char[LOGOBUF_LINE_MAX];
+  linelen = 0;
+}
+
+bool logobuf::drain()
+{
+  lock();
+  draining = true;
+  bool r = nflush(false);
+  draining = false;
+  unlock();
+  return r;
+}
+
+void logobuf::discard()
+{
+  lock();
+  buflength = bufstart = bufpos = 0;
+  linelen = 0;
+  midline = false;
+  unlock();
+}
+
+bool logobuf::write(char ch)
+{
+  return write(&ch, 1);
+}
+
+bool logobuf::write(const char* data, unsigned len)
+{
+  bool ok = true;
+  while (len > 0) {
+    if (unreported > 0 && !midline && linelen == 0)
+      report_dropped();
+    const char* nl = (const char*)memchr(data, '\n', len);
+    unsigned n = nl ? nl - data : len;
+    unsigned used = nl ? n + 1 : n;
+    if (fmt == text) {
+      ok = fdobuf::write(data, used) && ok;
+      midline = nl == 0;
+    }
+    else {
+      unsigned room = LOGOBUF_LINE_MAX - linelen;
+      memcpy(line + linelen, data, n < room ? n : room);
+      linelen += n < room ? n : room;
+      if (nl) {
+	put_record(line, linelen);
+	linelen = 0;
+      }
+    }
+    data += used;
+    len -= used;
+  }
+  return ok && !flags;
+}
+
+void logobuf::report_dropped()
+{
+  char note[64];
+  unsigned long n = unreported;
+  unreported = 0;
+  snprintf(note, sizeof note, "Dropped %lu log line%s.", n, n == 1 ? "" : "s");
+  put_line(note, strlen(note));
+}
+
+void logobuf::put_line(const char* msg, unsigned len)
+{
+  if (fmt == text) {
+    fdobuf::write(msg, len);
+    fdobuf::write('\n');
+  }
+  else
+    put_record(msg, len);
+}
+
+void logobuf::put_escaped(const char* msg, unsigned len)
+{
+  const char* run = msg;
+  for (const char* p = msg; p < msg + len; p++) {
+    unsigned char ch = *p;
+    if (ch >= 0x20 && ch != '"' && ch != '\\')
+      continue;
+    fdobuf::write(run, p - run);
+    run = p + 1;
+    if (ch == '"' || ch == '\\') {
+      fdobuf::write('\\');
+      fdobuf::write((char)ch);
+    }
+    else {
+      char esc[8];
+      snprintf(esc, sizeof esc, "\\u%04x", ch);
+      fdobuf::write(esc, 6);
+    }
+  }
+  fdobuf::write(run, msg + len - run);
+}
+
+// One line as a record of when and by whom it was logged.
+void logobuf::put_record(const char* msg, unsigned len)
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  struct tm tm;
+  time_t t = tv.tv_sec;
+  gmtime_r(&t, &tm);
+  char stamp[40];
+  unsigned n = strftime(stamp, sizeof stamp - 8, "%Y-%m-%dT%H:%M:%S", &tm);
+  n += snprintf(stamp + n, sizeof stamp - n, ".%03ldZ", (long)tv.tv_usec / 1000);
+  char pid[24];
+  snprintf(pid, sizeof pid, "%ld", (long)getpid());
+
+  if (fmt == json) {
+    fdobuf::write("{\"time\":\"", 9);
+    fdobuf::write(stamp, n);
+    fdobuf::write("\",\"program\":\"", 13);
+    fdobuf::write(program, strlen(program));
+    fdobuf::write("\",\"pid\":", 8);
+    fdobuf::write(pid, strlen(pid));
+    fdobuf::write(",\"msg\":\"", 8);
+    put_escaped(msg, len);
+    fdobuf::write("\"}\n", 3);
+  }
+  else {
+    fdobuf::write("time=", 5);
+    fdobuf::write(stamp, n);
+    fdobuf::write(" program=", 9);
+    fdobuf::write(program, strlen(program));
+    fdobuf::write(" pid=", 5);
+    fdobuf::write(pid, strlen(pid));
+    fdobuf::write(" msg=\"", 6);
+    put_escaped(msg, len);
+    fdobuf::write("\"\n", 2);
+  }
+}
+
+// Write out the buffer only once it is worth a system call, and only
+// as much of it as the reader will take without waiting.
+bool logobuf::nflush(bool withsync)
+{
+  if (flags)
+    return false;
+  const long long now = clock_ms();
+  if (!draining && !withsync && buflength < bufsize
+      && buflength - bufstart < bufsize / 2
+      && now - last_write < LOGOBUF_FLUSH_MS)
+    return true;
+  if (bufstart < buflength)
+    last_write = now;
+  while (bufstart < buflength) {
+    ssize_t written = try_write(buf + bufstart, buflength - bufstart);
+    if (written < 0) {
+      flags |= flag_error;
+      errnum = errno;
+      return false;
+    }
+    if (written == 0)
+      break;
+    bufstart += written;
+    offset += written;
+  }
+  if (bufstart > 0) {
+    memmove(buf, buf + bufstart, buflength - bufstart);
+    buflength -= bufstart;
+    bufstart = 0;
+  }
+  if (buflength >= bufsize)
+    make_room();
+  bufpos = buflength;
+  return true;
+}
+
+// The reader has fallen a whole buffer behind: keep the newer half,
+// starting at a line.
+void logobuf::make_room()
+{
+  unsigned cut = buflength / 2;
+  const char* nl = (const char*)memchr(buf + cut, '\n', buflength - cut);
+  cut = nl ? nl - buf + 1 : buflength;
+  drop(buf, cut);
+  memmove(buf, buf + cut, buflength - cut);
+  buflength -= cut;
+}
+
+void logobuf::drop(const char* data, size_t len)
+{
+  for (const char* p = data; (p = (const char*)memchr(p, '\n', data + len - p)) != 0; p++) {
+    ++dropped_lines;
+    ++unreported;
+  }
+}
+
+ssize_t logobuf::try_write(const char* data, size_t len)
+{
+  struct pollfd p;
+  p.fd = fd;
+  p.events = POLLOUT;
+  p.revents = 0;
+  int r;
+  while ((r = poll(&p, 1, 0)) < 0 && errno == EINTR)
+    ;
+  if (r <= 0)
+    return r;
+  // A pipe that polls writable has room for PIPE_BUF bytes, so a write
+  // of up to that much does not wait.  End it at a line where possible.
+  if (kind == pipe && len > PIPE_BUF) {
+    size_t n = PIPE_BUF;
+    while (n > 0 && data[n-1] != '\n')
+      --n;
+    len = n > 0 ? n : PIPE_BUF;
+  }
+  ssize_t w = kind == socket
+    ? ::send(fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL)
+    : ::write(fd, data, len);
+  ++run_stats.writes;
+  if (w > 0)
+    run_stats.write_bytes += w;
+  if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return 0;
+  return w;
+}
+
+// Writes of more than the buffer holds go the same way, dropping what
+// the reader has no room for.
+ssize_t logobuf::_write(const char* data, ssize_t len)
+{
+  ssize_t w = try_write(data, len);
+  if (w != 0)
+    return w;
+  drop(data, len);
+  return len;
+}
+
+ssize_t logobuf::_writev(const struct iovec* iov, int iovcnt)
+{
+  ssize_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    ssize_t w = _write((const char*)iov[i].iov_base, iov[i].iov_len);
+    if (w < 0)
+      return total > 0 ? total : w;
+    total += w;
+    if ((size_t)w < iov[i].iov_len)
+      break;
+  }
+  return total;
+}
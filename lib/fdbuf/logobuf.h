@@ -0,0 +1,78 @@
+// Copyright (C) 2016 Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+#ifndef FDBUF__LOGOBUF__H__
+#define FDBUF__LOGOBUF__H__
+
+#include "fdobuf.h"
+
+#define LOGOBUF_SIZE 65536
+#define LOGOBUF_LINE_MAX 4096
+#define LOGOBUF_FLUSH_MS 250
+
+// A log that never holds up the program writing it.  Lines are
+// gathered in the buffer and written out once it is half full, when
+// the last write was long enough ago, or on drain(), and only as much
+// as the reader has room for.  When a slow reader lets the buffer fill
+// up, the oldest whole lines are dropped and counted, and a line saying
+// how many is logged once there is room again.  Each line can also be
+// written as a record with the time and program that logged it.
+class logobuf FDBUF_FINAL : public fdobuf
+{
+public:
+  enum format { text, keyvalue, json };
+
+  logobuf(int fdesc, unsigned bufsz = LOGOBUF_SIZE);
+  ~logobuf();
+
+  void set_format(format f, const char* program);
+  // Write out what the reader has room for now.
+  bool drain();
+  // Forget what is buffered, as a child that shares the descriptor
+  // must, so that the parent's lines are not written twice.
+  void discard();
+  unsigned long dropped() const { return dropped_lines; }
+  unsigned pending() const { return buflength - bufstart; }
+
+  using fdobuf::write;
+  virtual bool write(char);
+  virtual bool write(const char*, unsigned);
+protected:
+  virtual bool nflush(bool withsync);
+  virtual ssize_t _write(const char* buf, ssize_t len);
+  virtual ssize_t _writev(const struct iovec* iov, int iovcnt);
+private:
+  enum { other, socket, pipe } kind;
+  format fmt;
+  const char* program;
+  char* line;
+  unsigned linelen;
+  bool midline;
+  bool draining;
+  long long last_write;
+  unsigned long dropped_lines;
+  unsigned long unreported;
+
+  ssize_t try_write(const char* data, size_t len);
+  void drop(const char* data, size_t len);
+  void make_room(void);
+  void report_dropped(void);
+  void put_line(const char* msg, unsigned len);
+  void put_record(const char* msg, unsigned len);
+  void put_escaped(const char* msg, unsigned len);
+};
+
+#endif // FDBUF__LOGOBUF__H__
@@ -0,0 +1,107 @@
+// Copyright (C) 2016 Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+#include "mmapibuf.h"
+#include "stats.h"
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Class mmapibuf
+///////////////////////////////////////////////////////////////////////////////
+mmapibuf::mmapibuf(const char* filename, unsigned bufsz)
+  : fdibuf(filename, FDBUF_NOBUF), map(0), maplen(0)
+{
+  if(!map_file())
+    take_buffer(bufsz);
+}
+
+mmapibuf::mmapibuf(int fdesc, bool dc, unsigned bufsz)
+  : fdibuf(fdesc, dc, FDBUF_NOBUF), map(0), maplen(0)
+{
+  if(!map_file())
+    take_buffer(bufsz);
+}
+
+mmapibuf::~mmapibuf()
+{
+  if(map) {
+    munmap(map, maplen);
+    buf = 0;
+  }
+}
+
+// The mapping becomes the buffer, already filled with the whole file.
+// It is private and writable so that refilling it after a seek past
+// the end, which reads the file back into the buffer, still works.
+bool mmapibuf::map_file()
+{
+  struct stat st;
+  if(flags || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    return false;
+  // Files read this way, such as queue files, are read through once.
+  fdbuf_advise_sequential(fd);
+  if(st.st_size <= 0 || st.st_size > (off_t)(UINT_MAX / 2)
+     || lseek(fd, 0, SEEK_CUR) != 0)
+    return false;
+  void* m = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(m == MAP_FAILED)
+    return false;
+#ifdef MADV_SEQUENTIAL
+  madvise(m, st.st_size, MADV_SEQUENTIAL);
+#endif
+  map = buf = (char*)m;
+  maplen = bufsize = buflength = offset = st.st_size;
+  run_stats.read_bytes += maplen;
+  bufstart = 0;
+  return true;
+}
+
+// Only what is not mapped borrows a buffer from the pool, so mapping a
+// file takes nothing out of the pool's budget.
+void mmapibuf::take_buffer(unsigned bufsz)
+{
+  bufsize = bufsz ? bufsz : fdbuf_size_for(fd);
+  buf = fdbuf_pool_get(bufsize);
+  if(!buf) {
+    flags |= flag_error;
+    errnum = errno;
+  }
+}
+
+// The mapping already holds the whole file, so a line that fills it
+// is the last one.
+bool mmapibuf::grow()
+{
+  return !map && fdibuf::grow();
+}
+
+// Reads past the mapping go to the file at the buffer's offset, which
+// leaves the descriptor's own position untouched.
+ssize_t mmapibuf::_read(char* data, ssize_t len)
+{
+  if(!map)
+    return fdibuf::_read(data, len);
+  ssize_t r = pread(fd, data, len, offset);
+  ++run_stats.reads;
+  if(r > 0)
+    run_stats.read_bytes += r;
+  return r;
+}
@@ -0,0 +1,42 @@
+// Copyright (C) 2016 Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+#ifndef FDBUF__MMAPIBUF__H__
+#define FDBUF__MMAPIBUF__H__
+
+#include "fdibuf.h"
+
+// An input buffer that maps a whole regular file instead of reading it
+// a block at a time.  Anything that cannot be mapped, such as a pipe or
+// an empty file, is read through an ordinary buffer.
+class mmapibuf FDBUF_FINAL : public fdibuf
+{
+public:
+  mmapibuf(const char* filename, unsigned bufsz = FDBUF_SIZE);
+  mmapibuf(int fdesc, bool dc = false, unsigned bufsz = FDBUF_SIZE);
+  virtual ~mmapibuf();
+  bool mapped() const { return map != 0; }
+protected:
+  char* map;
+  unsigned maplen;
+  bool map_file();
+  void take_buffer(unsigned bufsz);
+  virtual bool grow();
+  virtual ssize_t _read(char*, ssize_t);
+};
+
+#endif // FDBUF__MMAPIBUF__H__
@@ -15,17 +15,38 @@
 // Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 
 #include "tlsibuf.h"
+#include "tlsobuf.h"
+#include <errno.h>
+#include <poll.h>
 
 ///////////////////////////////////////////////////////////////////////////////
 // Class tlsibuf
 ///////////////////////////////////////////////////////////////////////////////
 tlsibuf::tlsibuf(gnutls_session_t s, unsigned bufsz)
-  : fdibuf(-1, false, bufsz), session(s)
+  : fdibuf(-1, false, tls_record_size(s, bufsz)), session(s)
 {
   flags &= ~flag_closed;
 }
 
 ssize_t tlsibuf::_read(char* buf, ssize_t len)
 {
-  return gnutls_record_recv(session, buf, len);
+  ssize_t r;
+#ifdef HAVE_GNUTLS_RECORD_SET_TIMEOUT
+  gnutls_record_set_timeout(session, timeout < 0 ? 0 : timeout);
+#endif
+  // Non-fatal results, such as after a TLS 1.3 session ticket has been
+  // processed, carry no data and the read has to be repeated.
+  do {
+#ifndef HAVE_GNUTLS_RECORD_SET_TIMEOUT
+    if (gnutls_record_check_pending(session) == 0
+	&& !wait_ready((long)gnutls_transport_get_ptr(session), POLLIN))
+      return -1;
+#endif
+    r = gnutls_record_recv(session, buf, len);
+  } while (r == GNUTLS_E_AGAIN || r == GNUTLS_E_INTERRUPTED);
+  if (r == GNUTLS_E_TIMEDOUT) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  return r;
 }
@@ -20,10 +20,11 @@
 #include "fdibuf.h"
 #include <gnutls/gnutls.h>
 
-class tlsibuf : public fdibuf
+// Unless given a size, the buffer holds one whole record.
+class tlsibuf FDBUF_FINAL : public fdibuf
 {
 public:
-  tlsibuf(gnutls_session_t, unsigned bufsz = FDBUF_SIZE);
+  tlsibuf(gnutls_session_t, unsigned bufsz = 0);
 protected:
   gnutls_session_t session;
   virtual ssize_t _read(char* buf, ssize_t len);
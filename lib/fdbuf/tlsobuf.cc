@@ -15,17 +15,88 @@
 // Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 
 #include "tlsobuf.h"
+#include <errno.h>
+#include <poll.h>
 
 ///////////////////////////////////////////////////////////////////////////////
 // Class tlsobuf
 ///////////////////////////////////////////////////////////////////////////////
+unsigned tls_record_size(gnutls_session_t s, unsigned bufsz)
+{
+  if (bufsz == 0)
+    bufsz = gnutls_record_get_max_size(s);
+  return bufsz > 0 ? bufsz : FDBUF_SIZE;
+}
+
 tlsobuf::tlsobuf(gnutls_session_t s, unsigned bufsz)
-  : fdobuf(-1, false, bufsz), session(s)
+  : fdobuf(-1, false, tls_record_size(s, bufsz)), session(s)
 {
   flags &= ~flag_closed;
 }
 
 ssize_t tlsobuf::_write(const char* buf, ssize_t len)
 {
-  return gnutls_record_send(session, buf, len);
+  if (!wait_ready((long)gnutls_transport_get_ptr(session), POLLOUT))
+    return -1;
+  ssize_t r = gnutls_record_send(session, buf, len);
+  // A socket send timeout expired.
+  if (r == GNUTLS_E_AGAIN && timeout >= 0)
+    errno = ETIMEDOUT;
+  return r;
+}
+
+#ifdef HAVE_GNUTLS_RECORD_CORK
+// The pieces, such as a command and the chunk of the message after it,
+// are corked together into full records instead of each ending in a
+// short one of its own.
+ssize_t tlsobuf::_writev(const struct iovec* iov, int iovcnt)
+{
+  if (!wait_ready((long)gnutls_transport_get_ptr(session), POLLOUT))
+    return -1;
+  gnutls_record_cork(session);
+  ssize_t total = 0;
+  for(int i = 0; i < iovcnt; i++) {
+    if(iov[i].iov_len == 0)
+      continue;
+    ssize_t r = gnutls_record_send(session, iov[i].iov_base, iov[i].iov_len);
+    if(r < 0)
+      return r;
+    total += r;
+  }
+  // Not GNUTLS_RECORD_WAIT, which would retry past a send timeout.
+  ssize_t r;
+  do
+    r = gnutls_record_uncork(session, 0);
+  while(r == GNUTLS_E_INTERRUPTED
+	|| (r >= 0 && gnutls_record_check_corked(session) > 0));
+  if(r < 0) {
+    if(r == GNUTLS_E_AGAIN && timeout >= 0)
+      errno = ETIMEDOUT;
+    return r;
+  }
+  return total;
+}
+#else
+ssize_t tlsobuf::_writev(const struct iovec* iov, int iovcnt)
+{
+  // Each piece becomes its own TLS records; the caller carries on
+  // with the rest after a short count.
+  for(int i = 0; i < iovcnt; i++)
+    if(iov[i].iov_len > 0)
+      return _write((const char*)iov[i].iov_base, iov[i].iov_len);
+  return 0;
+}
+#endif
+
+ssize_t tlsobuf::_sendfile(int, off_t*, size_t)
+{
+  // The data has to pass through the TLS session.
+  errno = EINVAL;
+  return -1;
+}
+
+ssize_t tlsobuf::_splice(int, size_t)
+{
+  errno = EINVAL;
+  return -1;
 }
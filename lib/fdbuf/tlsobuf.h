@@ -20,13 +20,22 @@
 #include "fdobuf.h"
 #include <gnutls/gnutls.h>
 
-class tlsobuf : public fdobuf
+// Unless given a size, the buffer holds one record of the largest size
+// the session allows, so that each flush makes one full record.
+class tlsobuf FDBUF_FINAL : public fdobuf
 {
 public:
-  tlsobuf(gnutls_session_t, unsigned bufsz = FDBUF_SIZE);
+  tlsobuf(gnutls_session_t, unsigned bufsz = 0);
 protected:
   gnutls_session_t session;
   virtual ssize_t _write(const char* buf, ssize_t len);
+  virtual ssize_t _writev(const struct iovec* iov, int iovcnt);
+  virtual ssize_t _sendfile(int infd, off_t* inoff, size_t len);
+  virtual ssize_t _splice(int infd, size_t len);
 };
 
+// The size of the largest record the session allows, unless bufsz is
+// given.
+unsigned tls_record_size(gnutls_session_t, unsigned bufsz);
+
 #endif // FDBUF__TLSOBUF__H__
@@ -0,0 +1,144 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#include "config.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "fdpass.h"
+
+// The longest line taken, which is far longer than any queue file name.
+#define FDPASS_LINE_MAX 4096
+// Room for more descriptors than are sent, so that any extra ones are
+// received and closed rather than truncated.
+#define FDPASS_FDS_MAX 4
+
+bool fdpass_send(int sock, const mystring& line, int fd)
+{
+  const mystring data = line + "\n";
+  struct iovec iov = { (void*)data.c_str(), data.length() };
+  struct msghdr mh;
+  memset(&mh, 0, sizeof mh);
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  if (fd >= 0) {
+    memset(&control, 0, sizeof control);
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof control.buf;
+    struct cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+  }
+  ssize_t wr;
+  while ((wr = sendmsg(sock, &mh, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+    ;
+  if (wr < 0)
+    return false;
+  // The descriptor went with the first byte, so the rest of a short
+  // write is sent as plain data.
+  const char* rest = data.c_str() + wr;
+  size_t left = data.length() - wr;
+  while (left > 0) {
+    if ((wr = send(sock, rest, left, MSG_NOSIGNAL)) < 0) {
+      if (errno == EINTR)
+	continue;
+      return false;
+    }
+    rest += wr;
+    left -= wr;
+  }
+  return true;
+}
+
+// Take the descriptors out of the control data, keeping the first and
+// closing the rest.
+static void take_fds(struct msghdr& mh, int& fd)
+{
+  for (struct cmsghdr* cm = CMSG_FIRSTHDR(&mh); cm != 0;
+       cm = CMSG_NXTHDR(&mh, cm)) {
+    if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+      continue;
+    const unsigned n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (unsigned i = 0; i < n; i++) {
+      int got;
+      memcpy(&got, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+      if (fd < 0)
+	fd = got;
+      else
+	close(got);
+    }
+  }
+}
+
+int fdpass_recv(int sock, mystring& line, int& fd)
+{
+  fd = -1;
+  line = "";
+  char buf[FDPASS_LINE_MAX];
+  size_t have = 0;
+  while (have < sizeof buf) {
+    struct iovec iov = { buf + have, sizeof buf - have };
+    struct msghdr mh;
+    memset(&mh, 0, sizeof mh);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    union {
+      struct cmsghdr align;
+      char buf[CMSG_SPACE(sizeof(int) * FDPASS_FDS_MAX)];
+    } control;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof control.buf;
+    ssize_t rd = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+    if (rd < 0) {
+      if (errno == EINTR)
+	continue;
+      break;
+    }
+    take_fds(mh, fd);
+    if (rd == 0) {
+      if (have == 0 && fd < 0)
+	return 0;
+      break;
+    }
+    const char* nl = (const char*)memchr(buf + have, '\n', rd);
+    have += rd;
+    if (nl != 0) {
+      // Nothing follows a job until it has been answered.
+      if (nl != buf + have - 1)
+	break;
+      line = mystring(buf, nl - buf);
+      return 1;
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+  return -1;
+}
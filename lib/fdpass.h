@@ -0,0 +1,42 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#ifndef NULLMAILER__FDPASS__H__
+#define NULLMAILER__FDPASS__H__
+
+#include "mystring/mystring.h"
+
+// A job passed to a protocol session over a Unix stream socket: a line
+// of text, such as the name of a queued message, with the open file it
+// names attached to its first byte, so that the receiver need not open
+// it again.  A job is read with one call, so each is sent only once the
+// one before it has been read.
+
+// Send the line, with a newline added, and fd, unless it is negative.
+bool fdpass_send(int sock, const mystring& line, int fd);
+
+// Receive a line sent with fdpass_send, without its newline.  The
+// received descriptor is close-on-exec, and fd is set to -1 if none was
+// attached.  Returns 1 if a line was read, 0 at end of file, or -1 on
+// an error.
+int fdpass_recv(int sock, mystring& line, int& fd);
+
+#endif // NULLMAILER__FDPASS__H__
@@ -21,8 +21,11 @@
 
 #include "config.h"
 #include <errno.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include "cli++/cli++.h"
@@ -32,6 +35,10 @@
 #include "errcodes.h"
 #include "forkexec.h"
 
+#ifndef HAVE_VFORK
+#define vfork fork
+#endif
+
 #define ERR(MSG) do{ ferr << cli_program << ": " << MSG << ": " << strerror(errno) << endl; } while(0)
 #define FAIL(MSG) do{ ERR(MSG); return false; }while(0)
 
@@ -52,46 +59,117 @@ bool fork_exec::operator!() const
   return pid < 0;
 }
 
-bool fork_exec::start(const char* args[], int redirn, int redirs[])
+// Set up the redirections in a new child process.  Only system calls
+// are made, so that this is safe in a child that shares the parent's
+// memory.
+static void redirect(int redirn, const int redirs[],
+		     const autoclose_pipe pipes[])
+{
+  for (int i = 0; i < redirn; i++) {
+    int r = redirs[i];
+    if (r == REDIRECT_NULL)
+      dup2(fdnull, i);
+    else if (r == REDIRECT_PIPE_FROM) {
+      dup2(pipes[i][1], i);
+      close(pipes[i][0]);
+      close(pipes[i][1]);
+    }
+    else if (r == REDIRECT_PIPE_TO || r == REDIRECT_SOCKET_TO) {
+      dup2(pipes[i][0], i);
+      close(pipes[i][0]);
+      close(pipes[i][1]);
+    }
+    else if (r > 0) {
+      dup2(r, i);
+      if (r >= redirn)
+        close(r);
+    }
+  }
+}
+
+// Execute the program in a child created by vfork.  The child shares
+// the parent's memory until it calls exec, so it must not touch any of
+// it: the redirected descriptors are closed without marking the pipes
+// closed, and a failure is reported with a bare write.  Signals stay
+// blocked until the handlers the child inherited are reset, since they
+// would otherwise run in the child against the parent's state.
+static pid_t vfork_exec(const char* args[], const char* name,
+			int redirn, const int redirs[],
+			const autoclose_pipe pipes[])
+{
+  const mystring errmsg = mystring(cli_program) + ": Could not exec " + name + ": ";
+  sigset_t all;
+  sigset_t old;
+  sigfillset(&all);
+  sigprocmask(SIG_SETMASK, &all, &old);
+  pid_t pid = vfork();
+  if (pid == 0) {
+    for (int sig = 1; sig < NSIG; sig++) {
+      struct sigaction sa;
+      if (sigaction(sig, 0, &sa) == 0
+          && sa.sa_handler != SIG_IGN && sa.sa_handler != SIG_DFL) {
+        sa.sa_handler = SIG_DFL;
+        sigaction(sig, &sa, 0);
+      }
+    }
+    sigprocmask(SIG_SETMASK, &old, 0);
+    redirect(redirn, redirs, pipes);
+    execv(args[0], (char**)args);
+    const char* err = strerror(errno);
+    struct iovec iov[3] = {
+      { (void*)errmsg.c_str(), errmsg.length() },
+      { (void*)err, strlen(err) },
+      { (void*)"\n", 1 },
+    };
+    ssize_t ignored = writev(2, iov, 3);
+    (void)ignored;
+    _exit(ERR_EXEC_FAILED);
+  }
+  const int err = errno;
+  sigprocmask(SIG_SETMASK, &old, 0);
+  errno = err;
+  return pid;
+}
+
+// Start a child process with the given redirections, which either
+// executes the program in args or exits with the result of calling the
+// function.  Programs are started with vfork where it is available, so
+// that the cost does not grow with the size of the parent; a child
+// calling a function runs in a full copy of the parent, made by fork.
+bool fork_exec::spawn(const char* args[], int (*function)(void*), void* arg,
+		      int redirn, int redirs[])
 {
   autoclose_pipe pipes[redirn];
   for (int i = 0; i < redirn; i++) {
     if (redirs[i] == REDIRECT_PIPE_TO || redirs[i] == REDIRECT_PIPE_FROM)
       if (!pipes[i].open())
         FAIL("Could not create pipe");
+    if (redirs[i] == REDIRECT_SOCKET_TO)
+      if (!pipes[i].open_socket())
+        FAIL("Could not create socket pair");
     if (redirs[i] == REDIRECT_NULL)
       if (fdnull < 0)
         if ((fdnull = open("/dev/null", O_RDWR)) < 0)
           FAIL("Could not open \"/dev/null\"");
   }
-  if ((pid = fork()) < 0)
-    FAIL("Could not fork");
-  if (pid == 0) {
-    // Child process, exec program
-    for (int i = 0; i < redirn; i++) {
-      int r = redirs[i];
-      if (r == REDIRECT_NULL)
-        dup2(fdnull, i);
-      else if (r == REDIRECT_PIPE_FROM) {
-        dup2(pipes[i][1], i);
-        pipes[i].close();
-      }
-      else if (r == REDIRECT_PIPE_TO) {
-        dup2(pipes[i][0], i);
-        pipes[i].close();
-      }
-      else if (r > 0) {
-        dup2(r, i);
-        if (r >= redirn)
-          close(r);
-      }
+  // Output still buffered here would otherwise be written again by a
+  // child that does not exec, or out of order with what the child writes.
+  fout.flush();
+  ferr.flush();
+  if (function == 0) {
+    if ((pid = vfork_exec(args, name, redirn, redirs, pipes)) < 0)
+      FAIL("Could not fork");
+  }
+  else {
+    if ((pid = fork()) < 0)
+      FAIL("Could not fork");
+    if (pid == 0) {
+      redirect(redirn, redirs, pipes);
+      exit(function(arg));
     }
-    execv(args[0], (char**)args);
-    ERR("Could not exec " << name);
-    _exit(ERR_EXEC_FAILED);
   }
   for (int i = 0; i < redirn; i++) {
-    if (redirs[i] == REDIRECT_PIPE_TO)
+    if (redirs[i] == REDIRECT_PIPE_TO || redirs[i] == REDIRECT_SOCKET_TO)
       redirs[i] = pipes[i].extract(1);
     else if (redirs[i] == REDIRECT_PIPE_FROM)
       redirs[i] = pipes[i].extract(0);
@@ -99,12 +177,23 @@ bool fork_exec::start(const char* args[], int redirn, int redirs[])
   return true;
 }
 
+bool fork_exec::start(const char* args[], int redirn, int redirs[])
+{
+  return spawn(args, 0, 0, redirn, redirs);
+}
+
 bool fork_exec::start(const char* program, int redirn, int redirs[])
 {
   const char* args[2] = { program, NULL };
   return start(args, redirn, redirs);
 }
 
+bool fork_exec::start(int (*function)(void*), void* arg,
+		      int redirn, int redirs[])
+{
+  return spawn(0, function, arg, redirn, redirs);
+}
+
 int fork_exec::wait_status()
 {
   if (pid > 0) {
@@ -117,6 +206,23 @@ int fork_exec::wait_status()
   return -1;
 }
 
+// Check if the child has exited without blocking.  Returns true and
+// sets the status (negative on error) if it has.
+bool fork_exec::poll_status(int& status)
+{
+  if (pid <= 0) {
+    status = -1;
+    return true;
+  }
+  pid_t r = waitpid(pid, &status, WNOHANG);
+  if (r == 0)
+    return false;
+  if (r != pid)
+    status = -1;
+  pid = -1;
+  return true;
+}
+
 bool fork_exec::wait()
 {
   if (pid > 0) {
@@ -159,10 +265,11 @@ queue_pipe::queue_pipe()
 {
 }
 
-int queue_pipe::start()
+int queue_pipe::start(bool direct)
 {
   int redirs[] = { REDIRECT_PIPE_TO, REDIRECT_NULL, REDIRECT_NULL };
-  if (!fork_exec::start(nqpath(), 3, redirs))
+  const char* args[] = { nqpath(), direct ? "--direct" : 0, 0 };
+  if (!fork_exec::start(args, 3, redirs))
     return -1;
   return redirs[0];
 }
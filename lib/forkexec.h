@@ -14,12 +14,16 @@ mystring program_path(const char* program);
 #define REDIRECT_NULL -2
 #define REDIRECT_PIPE_FROM -3
 #define REDIRECT_PIPE_TO -4
+// As REDIRECT_PIPE_TO, but through a Unix socket pair, for fdpass.h.
+#define REDIRECT_SOCKET_TO -5
 
 class fork_exec
 {
  private:
   pid_t pid;
   const char* name;
+  bool spawn(const char* args[], int (*function)(void*), void* arg,
+	     int redirn, int redirs[]);
 
  public:
   fork_exec(const char*);
@@ -28,8 +32,10 @@ class fork_exec
 
   bool start(const char* args[], int redirn, int redirs[]);
   bool start(const char* program, int redirn, int redirs[]);
+  bool start(int (*function)(void*), void* arg, int redirn, int redirs[]);
   bool wait();
   int wait_status();
+  bool poll_status(int& status);
   inline void kill(int sig) { ::kill(pid, sig); }
 };
 
@@ -37,7 +43,9 @@ class queue_pipe : public fork_exec
 {
   public:
   queue_pipe();
-  int start();
+  // A direct message is delivered immediately, and only queued if
+  // delivery is deferred.
+  int start(bool direct = false);
 };
 
 #endif
@@ -0,0 +1,337 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2018  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#endif
+#include "iobatch.h"
+
+enum { OP_FSYNC, OP_STAT, OP_OPEN, OP_LINK, OP_UNLINK, OP_COUNT };
+
+#ifdef HAVE_IO_URING
+
+struct statx_buf
+{
+  struct statx st;
+};
+
+// The ring shared by all the batches in the process, set up when it is
+// first used.  If the kernel has no io_uring, or it is not allowed, the
+// calls are made without it.
+static struct
+{
+  bool tried;
+  int fd;
+  unsigned entries;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned sq_mask;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+  bool supported[OP_COUNT];
+} uring = { false, -1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, { false } };
+
+static const int opcodes[OP_COUNT] = {
+  IORING_OP_FSYNC, IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_LINKAT,
+  IORING_OP_UNLINKAT,
+};
+
+// Find out which of the calls the kernel can make through the ring.
+// Kernels too old to be probed have none of them but fsync.
+static void ring_probe()
+{
+  const unsigned nops = 256;
+  const size_t size = sizeof(struct io_uring_probe)
+    + nops * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, size);
+  if (probe != 0
+      && syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_PROBE,
+		 probe, nops) == 0) {
+    for (int i = 0; i < OP_COUNT; i++)
+      uring.supported[i] = opcodes[i] <= probe->last_op
+	&& (probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED) != 0;
+  }
+  else
+    uring.supported[OP_FSYNC] = true;
+  free(probe);
+}
+
+static bool ring_setup()
+{
+  if (uring.tried)
+    return uring.fd >= 0;
+  uring.tried = true;
+  struct io_uring_params p;
+  memset(&p, 0, sizeof p);
+  int fd = syscall(__NR_io_uring_setup, IOBATCH_MAX, &p);
+  if (fd < 0)
+    return false;
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if ((p.features & IORING_FEAT_SINGLE_MMAP) && cq_len > sq_len)
+    sq_len = cq_len;
+  char* sq = (char*)mmap(0, sq_len, PROT_READ|PROT_WRITE,
+			 MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+  char* cq = sq;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    cq = (char*)mmap(0, cq_len, PROT_READ|PROT_WRITE,
+		     MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED) {
+      munmap(sq, sq_len);
+      close(fd);
+      return false;
+    }
+  }
+  void* sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe),
+		    PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		    fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    if (cq != sq)
+      munmap(cq, cq_len);
+    munmap(sq, sq_len);
+    close(fd);
+    return false;
+  }
+  uring.fd = fd;
+  uring.entries = p.sq_entries;
+  uring.sq_head = (unsigned*)(sq + p.sq_off.head);
+  uring.sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  uring.sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+  uring.sq_array = (unsigned*)(sq + p.sq_off.array);
+  uring.sqes = (struct io_uring_sqe*)sqes;
+  uring.cq_head = (unsigned*)(cq + p.cq_off.head);
+  uring.cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  uring.cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+  uring.cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  ring_probe();
+  return true;
+}
+
+static void fill_stat(struct stat* st, const struct statx& sx)
+{
+  memset(st, 0, sizeof *st);
+  st->st_mode = sx.stx_mode;
+  st->st_nlink = sx.stx_nlink;
+  st->st_uid = sx.stx_uid;
+  st->st_gid = sx.stx_gid;
+  st->st_size = sx.stx_size;
+  st->st_ino = sx.stx_ino;
+  st->st_dev = makedev(sx.stx_dev_major, sx.stx_dev_minor);
+  st->st_atime = sx.stx_atime.tv_sec;
+  st->st_mtime = sx.stx_mtime.tv_sec;
+  st->st_ctime = sx.stx_ctime.tv_sec;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+  st->st_atim.tv_nsec = sx.stx_atime.tv_nsec;
+  st->st_mtim.tv_nsec = sx.stx_mtime.tv_nsec;
+  st->st_ctim.tv_nsec = sx.stx_ctime.tv_nsec;
+#endif
+}
+
+#define STATX_WANTED (STATX_TYPE|STATX_MODE|STATX_NLINK|STATX_UID|STATX_GID \
+		      |STATX_ATIME|STATX_MTIME|STATX_CTIME|STATX_INO|STATX_SIZE)
+
+#endif // HAVE_IO_URING
+
+io_batch::io_batch(bool use_ring)
+  : cnt(0), done(0), ring(use_ring), stx(0)
+{
+}
+
+io_batch::~io_batch()
+{
+#ifdef HAVE_IO_URING
+  delete[] stx;
+#endif
+}
+
+bool io_batch::have_ring()
+{
+#ifdef HAVE_IO_URING
+  return ring_setup();
+#else
+  return false;
+#endif
+}
+
+int io_batch::add(int code, int fd, const char* path, const char* path2,
+		  int flags, struct stat* st)
+{
+  if (full())
+    return -1;
+  op& o = ops[cnt];
+  o.code = code;
+  o.fd = fd;
+  o.path = path;
+  o.path2 = path2;
+  o.flags = flags;
+  o.st = st;
+  o.result = -EINPROGRESS;
+  return cnt++;
+}
+
+int io_batch::fsync(int fd)
+{
+  return add(OP_FSYNC, fd, 0, 0, 0, 0);
+}
+
+int io_batch::stat(const char* path, struct stat* st)
+{
+  return add(OP_STAT, -1, path, 0, 0, st);
+}
+
+int io_batch::open(const char* path, int flags)
+{
+  return add(OP_OPEN, -1, path, 0, flags | O_CLOEXEC, 0);
+}
+
+int io_batch::link(const char* from, const char* to, int flags)
+{
+  return add(OP_LINK, -1, from, to, flags, 0);
+}
+
+int io_batch::unlink(const char* path)
+{
+  return add(OP_UNLINK, -1, path, 0, 0, 0);
+}
+
+// Make one call without the ring.
+void io_batch::call(op& o)
+{
+  int r = -1;
+  switch (o.code) {
+  case OP_FSYNC: r = ::fsync(o.fd); break;
+  case OP_STAT: r = ::stat(o.path, o.st); break;
+  case OP_OPEN: r = ::open(o.path, o.flags); break;
+  case OP_LINK:
+    r = ::linkat(AT_FDCWD, o.path, AT_FDCWD, o.path2, o.flags);
+    break;
+  case OP_UNLINK: r = ::unlink(o.path); break;
+  }
+  o.result = r < 0 ? -errno : r;
+}
+
+bool io_batch::submit()
+{
+  bool ok = true;
+#ifdef HAVE_IO_URING
+  if (ring && done < cnt && ring_setup()) {
+    if (stx == 0)
+      for (unsigned i = done; i < cnt && stx == 0; i++)
+	if (ops[i].code == OP_STAT)
+	  stx = new statx_buf[IOBATCH_MAX];
+    unsigned tail = *uring.sq_tail;
+    unsigned queued = 0;
+    for (unsigned i = done; i < cnt && queued < uring.entries; i++) {
+      op& o = ops[i];
+      if (!uring.supported[o.code])
+	continue;
+      const unsigned slot = tail & uring.sq_mask;
+      struct io_uring_sqe* sqe = &uring.sqes[slot];
+      memset(sqe, 0, sizeof *sqe);
+      sqe->opcode = opcodes[o.code];
+      sqe->user_data = i;
+      switch (o.code) {
+      case OP_FSYNC:
+	sqe->fd = o.fd;
+	break;
+      case OP_STAT:
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (unsigned long)o.path;
+	sqe->len = STATX_WANTED;
+	sqe->off = (unsigned long)&stx[i].st;
+	break;
+      case OP_OPEN:
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (unsigned long)o.path;
+	sqe->open_flags = o.flags;
+	break;
+      case OP_LINK:
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (unsigned long)o.path;
+	sqe->len = AT_FDCWD;
+	sqe->addr2 = (unsigned long)o.path2;
+	sqe->hardlink_flags = o.flags;
+	break;
+      case OP_UNLINK:
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (unsigned long)o.path;
+	break;
+      }
+      uring.sq_array[slot] = slot;
+      ++tail;
+      ++queued;
+    }
+    __atomic_store_n(uring.sq_tail, tail, __ATOMIC_RELEASE);
+    unsigned submitted = 0;
+    unsigned reaped = 0;
+    while (reaped < queued) {
+      int n = syscall(__NR_io_uring_enter, uring.fd, queued - submitted,
+		      queued - reaped, IORING_ENTER_GETEVENTS, (void*)0, 0);
+      if (n >= 0)
+	submitted += n;
+      else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+	ok = false;
+	break;
+      }
+      unsigned head = *uring.cq_head;
+      const unsigned ctail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+      for (; head != ctail; ++head, ++reaped) {
+	const struct io_uring_cqe* cqe = &uring.cqes[head & uring.cq_mask];
+	op& o = ops[cqe->user_data];
+	o.result = cqe->res;
+	if (o.code == OP_STAT && o.result == 0)
+	  fill_stat(o.st, stx[cqe->user_data].st);
+      }
+      __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    if (!ok) {
+      // The calls still outstanding are made without the ring, which
+      // is given up on for the rest of the process.
+      close(uring.fd);
+      uring.fd = -1;
+    }
+  }
+#endif
+  for (unsigned i = done; i < cnt; i++)
+    if (ops[i].result == -EINPROGRESS)
+      call(ops[i]);
+  done = cnt;
+  return ok;
+}
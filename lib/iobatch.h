@@ -0,0 +1,91 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2018  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+
+#ifndef NULLMAILER__IOBATCH__H__
+#define NULLMAILER__IOBATCH__H__
+
+#include <sys/stat.h>
+
+// A batch of file system calls made together: submitted to the kernel
+// at once through io_uring where it is available, or made one after
+// the other otherwise, or for the calls the kernel's io_uring lacks.
+// The calls are queued with the functions below, which return their
+// index in the batch (or -1 once it holds IOBATCH_MAX calls), and are
+// made by submit().  Their results are
+// then read with result(): what the system call returns, or -errno if
+// it fails.  The paths passed in must stay valid until then.
+#define IOBATCH_MAX 256
+
+class io_batch
+{
+ public:
+  explicit io_batch(bool use_ring = true);
+  ~io_batch();
+
+  unsigned count() const { return cnt; }
+  bool full() const { return cnt >= IOBATCH_MAX; }
+
+  int fsync(int fd);
+  // Only the type, size, mode, owner, inode, device and times of the
+  // file are filled in.
+  int stat(const char* path, struct stat* st);
+  int open(const char* path, int flags);
+  // flags are those of linkat(2).
+  int link(const char* from, const char* to, int flags = 0);
+  int unlink(const char* path);
+
+  // Make the calls queued since the last submit, waiting for them all
+  // to finish.  Returns false if the ring failed, in which case the
+  // rest of the calls were made without it.
+  bool submit();
+  int result(unsigned i) const { return ops[i].result; }
+  // Forget the calls made, so the batch can be used again.
+  void clear() { cnt = done = 0; }
+
+  // Whether the calls are submitted through io_uring.
+  static bool have_ring();
+
+ private:
+  struct op
+  {
+    int code;
+    int fd;
+    int flags;
+    const char* path;
+    const char* path2;
+    struct stat* st;
+    int result;
+  };
+  op ops[IOBATCH_MAX];
+  unsigned cnt;
+  unsigned done;
+  bool ring;
+  struct statx_buf* stx;
+
+  int add(int code, int fd, const char* path, const char* path2,
+	  int flags, struct stat* st);
+  void call(op& o);
+  io_batch(const io_batch&);
+  io_batch& operator=(const io_batch&);
+};
+
+#endif // NULLMAILER__IOBATCH__H__
@@ -1,8 +1,7 @@
 #include "itoa.h"
 
-const char *itoa(long v, int digits)
+const char *itoa(long v, char* buf, int digits)
 {
-  static char buf[INTLENGTH];
   bool neg = false;
   if(v < 0) {
     v = -v;
@@ -21,3 +20,13 @@ const char *itoa(long v, int digits)
     *--ptr = '-';
   return ptr;
 }
+
+const char *itoa(long v, int digits)
+{
+#ifdef _REENTRANT
+  static thread_local char buf[INTLENGTH];
+#else
+  static char buf[INTLENGTH];
+#endif
+  return itoa(v, buf, digits);
+}
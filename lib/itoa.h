@@ -6,6 +6,10 @@
 /* 40 digits is long enough to handle unsigned 128-bit numbers */
 #endif
 
+// Format into the caller's buffer of INTLENGTH bytes, returning a
+// pointer into it.  The plain form uses a buffer of its own, which is
+// overwritten by the next call from the same thread.
+const char *itoa(long, char*, int = 0);
 const char *itoa(long, int = 0);
 
 #endif
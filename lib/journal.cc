@@ -0,0 +1,409 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "autoclose.h"
+#include "configio.h"
+#include "defines.h"
+#include "fdbuf/fdbuf.h"
+#include "itoa.h"
+#include "journal.h"
+#include "netstring.h"
+
+journal_entry::journal_entry(const mystring& p)
+  : path(p), queued(0), size(0), attempts(0), next_attempt(0),
+    warned(false), live(true), mark(false), next(0), chain(0)
+{
+}
+
+queue_journal::queue_journal()
+  : head(0), tail(0), buckets(0), size(0), nodes(0), entries(0), nrecords(0)
+{
+}
+
+queue_journal::~queue_journal()
+{
+  while (head) {
+    journal_entry* next = head->next;
+    delete head;
+    head = next;
+  }
+  delete[] buckets;
+}
+
+static unsigned hash(const mystring& key)
+{
+  // FNV-1a
+  unsigned h = 2166136261U;
+  for (const char* ptr = key.c_str(); *ptr; ++ptr) {
+    h ^= (unsigned char)*ptr;
+    h *= 16777619U;
+  }
+  return h;
+}
+
+// Double the number of buckets, keeping them at least twice the number
+// of entries so that the chains stay short.
+void queue_journal::grow()
+{
+  unsigned newsize = size ? size * 2 : 64;
+  delete[] buckets;
+  buckets = new journal_entry*[newsize];
+  size = newsize;
+  for (unsigned i = 0; i < size; i++)
+    buckets[i] = 0;
+  for (journal_entry* e = head; e; e = e->next) {
+    unsigned b = hash(e->path) & (size - 1);
+    e->chain = buckets[b];
+    buckets[b] = e;
+  }
+}
+
+journal_entry* queue_journal::find(const mystring& path) const
+{
+  if (size == 0)
+    return 0;
+  for (journal_entry* e = buckets[hash(path) & (size - 1)]; e; e = e->chain)
+    if (e->path == path)
+      return e->live ? e : 0;
+  return 0;
+}
+
+// Add an entry for a message, or start the existing one over.
+journal_entry* queue_journal::add(const mystring& path)
+{
+  journal_entry* e = 0;
+  if (size > 0)
+    for (e = buckets[hash(path) & (size - 1)]; e; e = e->chain)
+      if (e->path == path)
+	break;
+  if (e) {
+    if (!e->live)
+      ++entries;
+    e->live = true;
+    e->recipients.empty();
+    e->attempts = 0;
+    e->next_attempt = 0;
+    return e;
+  }
+  if (nodes * 2 >= size)
+    grow();
+  e = new journal_entry(path);
+  if (tail)
+    tail->next = e;
+  else
+    head = e;
+  tail = e;
+  unsigned b = hash(path) & (size - 1);
+  e->chain = buckets[b];
+  buckets[b] = e;
+  ++nodes;
+  ++entries;
+  return e;
+}
+
+void queue_journal::remove(const mystring& path)
+{
+  journal_entry* e = find(path);
+  if (e) {
+    e->live = false;
+    --entries;
+  }
+}
+
+// Take the next netstring from a buffer.  Returns 1 on success, 0 if
+// the buffer ends first, and -1 if the netstring is malformed.
+static int take_net(const char* buf, unsigned long length,
+		    unsigned long& pos, mystring& out)
+{
+  unsigned long len = 0;
+  unsigned long i;
+  for (i = pos; i < length && buf[i] != ':'; i++) {
+    if (buf[i] < '0' || buf[i] > '9' || i - pos >= 9)
+      return -1;
+    len = len * 10 + buf[i] - '0';
+  }
+  if (i >= length)
+    return 0;
+  if (i == pos)
+    return -1;
+  if (length - i - 1 < len + 1)
+    return 0;
+  if (buf[i + 1 + len] != ',')
+    return -1;
+  out = mystring(buf + i + 1, len);
+  pos = i + 1 + len + 1;
+  return 1;
+}
+
+bool queue_journal::apply(const mystring& record)
+{
+  if (!record)
+    return false;
+  const char type = record[0];
+  const char* buf = record.c_str() + 1;
+  const unsigned long length = record.length() - 1;
+  unsigned long pos = 0;
+  mystring path;
+  if (take_net(buf, length, pos, path) <= 0)
+    return false;
+  mystring field;
+  journal_entry* e;
+  switch (type) {
+  case 'Q':
+    e = add(path);
+    if (take_net(buf, length, pos, field) <= 0)
+      return false;
+    e->queued = strtoul(field.c_str(), 0, 10);
+    if (take_net(buf, length, pos, field) <= 0)
+      return false;
+    e->size = strtoul(field.c_str(), 0, 10);
+    if (take_net(buf, length, pos, e->sender) <= 0)
+      return false;
+    while (take_net(buf, length, pos, field) > 0)
+      e->recipients.append(field);
+    return true;
+  case 'A':
+    if ((e = find(path)) == 0)
+      return true;
+    if (take_net(buf, length, pos, field) <= 0)
+      return false;
+    e->attempts = strtoul(field.c_str(), 0, 10);
+    if (take_net(buf, length, pos, field) <= 0)
+      return false;
+    e->next_attempt = strtoul(field.c_str(), 0, 10);
+    return true;
+  case 'R':
+    if ((e = find(path)) == 0)
+      return true;
+    e->recipients.empty();
+    while (take_net(buf, length, pos, field) > 0)
+      e->recipients.append(field);
+    return true;
+  case 'D':
+  case 'B':
+    remove(path);
+    return true;
+  case 'W':
+    if ((e = find(path)) != 0)
+      e->warned = true;
+    return true;
+  }
+  return false;
+}
+
+// Apply the records in a buffer.  A record cut short at the end, as
+// left by a crash while appending, is ignored.
+bool queue_journal::replay(const char* buf, unsigned long length)
+{
+  unsigned long pos = 0;
+  while (pos < length) {
+    if (buf[pos] == '\n') {
+      ++pos;
+      continue;
+    }
+    mystring record;
+    int r = take_net(buf, length, pos, record);
+    if (r == 0)
+      break;
+    if (r < 0 || !apply(record))
+      return false;
+    ++nrecords;
+  }
+  return true;
+}
+
+static bool read_all(int fd, char*& buf, unsigned long& length)
+{
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    return false;
+  buf = new char[st.st_size + 1];
+  length = 0;
+  ssize_t rd;
+  while (length < (unsigned long)st.st_size
+	 && (rd = read(fd, buf + length, st.st_size - length)) > 0)
+    length += rd;
+  return true;
+}
+
+// Read the journal without locking it, as a record that is being
+// appended is ignored anyway.  Returns false if it does not exist or
+// cannot be read.
+bool queue_journal::load(const mystring& path)
+{
+  autoclose fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  char* buf;
+  unsigned long length;
+  if (!read_all(fd, buf, length))
+    return false;
+  bool ok = replay(buf, length);
+  delete[] buf;
+  return ok;
+}
+
+// Write the live entries out as a fresh journal.
+bool queue_journal::write(int fd) const
+{
+  fdobuf out(fd);
+  for (journal_entry* e = head; e; e = e->next) {
+    if (!e->live)
+      continue;
+    out << journal_queued(e->path, e->queued, e->size, e->sender,
+			  e->recipients);
+    if (e->attempts > 0)
+      out << journal_attempt(e->path, e->attempts, e->next_attempt);
+    if (e->warned)
+      out << journal_warned(e->path);
+  }
+  return out.flush();
+}
+
+mystring journal_path()
+{
+  return CONFIG_PATH(QUEUE, NULL, "journal");
+}
+
+static mystring make_record(const mystring& body)
+{
+  return str2net(body) + "\n";
+}
+
+mystring journal_queued(const mystring& path, time_t queued,
+			unsigned long size, const mystring& sender,
+			const list<mystring>& recipients)
+{
+  mystring body = "Q";
+  body += str2net(path);
+  body += str2net(itoa(queued));
+  body += str2net(itoa(size));
+  body += str2net(sender);
+  for (list<mystring>::const_iter i(recipients); i; i++)
+    body += str2net(*i);
+  return make_record(body);
+}
+
+mystring journal_attempt(const mystring& path, unsigned attempts,
+			 time_t next_attempt)
+{
+  mystring body = "A";
+  body += str2net(path);
+  body += str2net(itoa(attempts));
+  body += str2net(itoa(next_attempt));
+  return make_record(body);
+}
+
+mystring journal_recipients(const mystring& path,
+			    const list<mystring>& recipients)
+{
+  mystring body = "R";
+  body += str2net(path);
+  for (list<mystring>::const_iter i(recipients); i; i++)
+    body += str2net(*i);
+  return make_record(body);
+}
+
+mystring journal_delivered(const mystring& path)
+{
+  return make_record("D" + str2net(path));
+}
+
+mystring journal_bounced(const mystring& path)
+{
+  return make_record("B" + str2net(path));
+}
+
+mystring journal_warned(const mystring& path)
+{
+  return make_record("W" + str2net(path));
+}
+
+// Open the journal with a lock, making sure that it was not replaced
+// while waiting for the lock.
+static int open_locked(const mystring& path, int flags, int lock)
+{
+  for (int tries = 0; tries < 10; tries++) {
+    int fd = open(path.c_str(), flags);
+    if (fd < 0)
+      return -1;
+    struct stat fst;
+    struct stat pst;
+    if (flock(fd, lock) == 0
+	&& fstat(fd, &fst) == 0
+	&& stat(path.c_str(), &pst) == 0
+	&& fst.st_dev == pst.st_dev && fst.st_ino == pst.st_ino)
+      return fd;
+    close(fd);
+  }
+  return -1;
+}
+
+// Append a record to the journal, which is written with one write so
+// that appends from several programs do not mix.  Nothing is written
+// if there is no journal, since it would then be missing the messages
+// queued before.
+bool journal_append(const mystring& record)
+{
+  autoclose fd = open_locked(journal_path(), O_WRONLY|O_APPEND, LOCK_SH);
+  if (fd < 0)
+    return false;
+  return write(fd, record.c_str(), record.length())
+    == (ssize_t)record.length();
+}
+
+bool journal_compact(journal_update update, void* arg)
+{
+  const mystring path = journal_path();
+  const mystring tmp = CONFIG_PATH(QUEUE, "tmp", "journal");
+  queue_journal journal;
+  autoclose fd = open_locked(path, O_RDONLY, LOCK_EX);
+  bool existed = fd >= 0;
+  if (existed) {
+    char* buf;
+    unsigned long length;
+    existed = read_all(fd, buf, length);
+    if (existed) {
+      existed = journal.replay(buf, length);
+      delete[] buf;
+    }
+  }
+  if (!update(journal, existed, arg))
+    return false;
+  autoclose out = open(tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  if (out < 0)
+    return false;
+  if (!journal.write(out) || fsync(out) == -1
+      || rename(tmp.c_str(), path.c_str()) == -1) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
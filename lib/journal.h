@@ -0,0 +1,116 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#ifndef NULLMAILER__JOURNAL__H__
+#define NULLMAILER__JOURNAL__H__
+
+#include <time.h>
+#include "list.h"
+#include "mystring/mystring.h"
+
+// The queue journal is an append-only file in the spool directory
+// holding a record of each message put into the queue and of what
+// happens to it, so that nullmailer-send can start and mailq can list
+// the queue without reading the queue directory and every message.
+// Each record is a netstring holding the record type and a netstring
+// for each field, followed by a newline:
+//   Q path queued size sender recipient...  the message was queued
+//   A path attempts next-attempt            a delivery attempt failed
+//   R path recipient...                     the recipients were changed
+//   D path                                  the message was delivered
+//   B path                                  the message was bounced
+//   W path                                  a delay notice was sent
+// Paths are relative to the queue directory.  Only nullmailer-send
+// creates the journal, from a scan of the queue, and it is compacted by
+// writing out the live messages and renaming the result into place.
+// Appending takes a shared lock and compacting an exclusive one, so no
+// record is lost to the rename.
+struct journal_entry
+{
+  mystring path;
+  time_t queued;
+  unsigned long size;
+  mystring sender;
+  list<mystring> recipients;
+  unsigned attempts;
+  time_t next_attempt;
+  bool warned;
+  bool live;
+  bool mark;			// Free for use by the caller
+  journal_entry* next;		// The next entry in the journal
+  journal_entry* chain;		// The next entry in the same hash bucket
+  journal_entry(const mystring& p);
+};
+
+class queue_journal
+{
+public:
+  queue_journal();
+  ~queue_journal();
+
+  bool load(const mystring& path);
+  bool replay(const char* buf, unsigned long length);
+  journal_entry* first() const { return head; }
+  journal_entry* find(const mystring& path) const;
+  journal_entry* add(const mystring& path);
+  void remove(const mystring& path);
+  unsigned live() const { return entries; }
+  unsigned records() const { return nrecords; }
+  bool write(int fd) const;
+
+private:
+  journal_entry* head;
+  journal_entry* tail;
+  journal_entry** buckets;
+  unsigned size;
+  unsigned nodes;
+  unsigned entries;
+  unsigned nrecords;
+
+  queue_journal(const queue_journal&);
+  void operator=(const queue_journal&);
+
+  void grow();
+  bool apply(const mystring& record);
+};
+
+mystring journal_path();
+mystring journal_queued(const mystring& path, time_t queued,
+			unsigned long size, const mystring& sender,
+			const list<mystring>& recipients);
+mystring journal_attempt(const mystring& path, unsigned attempts,
+			 time_t next_attempt);
+mystring journal_recipients(const mystring& path,
+			    const list<mystring>& recipients);
+mystring journal_delivered(const mystring& path);
+mystring journal_bounced(const mystring& path);
+mystring journal_warned(const mystring& path);
+bool journal_append(const mystring& record);
+
+// Replay the journal under an exclusive lock, let the update function
+// bring it up to date, and write it out in compacted form.  The update
+// function is told whether the journal existed, and returns false to
+// leave the journal alone.
+typedef bool (*journal_update)(queue_journal& journal, bool existed,
+			       void* arg);
+bool journal_compact(journal_update update, void* arg);
+
+#endif
@@ -1,11 +1,23 @@
 #ifndef LIST__H__
 #define LIST__H__
 
+#if __cplusplus >= 201103L
+#include <utility>
+
+// Selects the list_node constructor that builds its data in place.
+struct list_emplace { };
+#endif
+
 template<class T> struct list_node
 {
   list_node* next;
   T data;
-  list_node(T d, list_node* n = 0) : next(n), data(d) { }
+  list_node(const T& d, list_node* n = 0) : next(n), data(d) { }
+#if __cplusplus >= 201103L
+  list_node(T&& d, list_node* n = 0) : next(n), data(std::move(d)) { }
+  template<class... Args> list_node(list_emplace, Args&&... args)
+    : next(0), data(std::forward<Args>(args)...) { }
+#endif
   ~list_node() { }
 };
 
@@ -26,6 +38,26 @@ public:
     {
     }
   list(const list&);
+#if __cplusplus >= 201103L
+  list(list&& that)
+    : head(that.head), tail(that.tail), cnt(that.cnt)
+    {
+      that.head = that.tail = 0;
+      that.cnt = 0;
+    }
+  list& operator=(list&& that)
+    {
+      if(this != &that) {
+	empty();
+	head = that.head;
+	tail = that.tail;
+	cnt = that.cnt;
+	that.head = that.tail = 0;
+	that.cnt = 0;
+      }
+      return *this;
+    }
+#endif
   
   ~list()
     {
@@ -48,18 +80,11 @@ public:
       cnt = 0;
     }
   
-  bool append(T data) 
+  bool append(const T& data)
     {
-      node* n = new node(data);
-      if(tail)
-	tail->next = n;
-      else
-	head = n;
-      tail = n;
-      ++cnt;
-      return true;
+      return link(new node(data));
     }
-  bool prepend(T data)
+  bool prepend(const T& data)
     {
       head = new node(data, head);
       if(!tail)
@@ -67,8 +92,44 @@ public:
       ++cnt;
       return true;
     }
+#if __cplusplus >= 201103L
+  bool append(T&& data)
+    {
+      return link(new node(std::move(data)));
+    }
+  // Append an element constructed in place from the arguments.
+  template<class... Args> T& emplace(Args&&... args)
+    {
+      node* n = new node(list_emplace(), std::forward<Args>(args)...);
+      link(n);
+      return n->data;
+    }
+#else
+  // Without variadic templates, only a default constructed element.
+  T& emplace()
+    {
+      node* n = new node(T());
+      link(n);
+      return n->data;
+    }
+#endif
+  T& last()
+    {
+      return tail->data;
+    }
   bool remove(iter&);
 private:
+  bool link(node* n)
+    {
+      if(tail)
+	tail->next = n;
+      else
+	head = n;
+      tail = n;
+      ++cnt;
+      return true;
+    }
+
   node* head;
   node* tail;
   unsigned cnt;
@@ -97,7 +158,7 @@ public:
     {
       go_next();
     }
-  T operator*() const
+  const T& operator*() const
     {
       return curr->data;
     }
@@ -147,7 +208,7 @@ public:
     {
       go_next();
     }
-  T operator*() const
+  const T& operator*() const
     {
       return curr->data;
     }
@@ -0,0 +1,150 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2018  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#include "config.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "itoa.h"
+#include "metrics.h"
+
+const double metrics_histogram::bounds[METRICS_BUCKETS] = {
+  0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 300
+};
+
+metrics_histogram::metrics_histogram()
+  : count(0), sum(0)
+{
+  for (unsigned i = 0; i < METRICS_BUCKETS; i++)
+    counts[i] = 0;
+}
+
+void metrics_histogram::observe(double seconds)
+{
+  for (unsigned i = 0; i < METRICS_BUCKETS; i++)
+    if (seconds <= bounds[i]) {
+      ++counts[i];
+      break;
+    }
+  ++count;
+  sum += seconds;
+}
+
+static mystring format(double value)
+{
+  char buf[32];
+  snprintf(buf, sizeof buf, "%.6g", value);
+  return buf;
+}
+
+mystring metrics_label(const char* name, const mystring& value)
+{
+  mystring label = name;
+  label += "=\"";
+  for (unsigned i = 0; i < value.length(); i++) {
+    const char ch = value[i];
+    if (ch == '\\' || ch == '"')
+      label += '\\';
+    if (ch == '\n')
+      label += "\\n";
+    else
+      label += ch;
+  }
+  label += '"';
+  return label;
+}
+
+metrics_file::metrics_file(const mystring& p)
+  : path(p), tmppath(p + ".tmp"), out(0)
+{
+}
+
+metrics_file::~metrics_file()
+{
+  if (out) {
+    delete out;
+    unlink(tmppath.c_str());
+  }
+}
+
+bool metrics_file::open()
+{
+  out = new fdobuf(tmppath.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (*out)
+    return true;
+  delete out;
+  out = 0;
+  return false;
+}
+
+void metrics_file::family(const char* name, const char* type,
+			  const char* help)
+{
+  *out << "# HELP " << name << ' ' << help << "\n"
+    "# TYPE " << name << ' ' << type << '\n';
+}
+
+static void sample(fdobuf& out, const char* name, const char* suffix,
+		   const mystring& labels, const mystring& value)
+{
+  out << name << suffix;
+  if (!!labels)
+    out << '{' << labels << '}';
+  out << ' ' << value << '\n';
+}
+
+void metrics_file::value(const char* name, const mystring& labels,
+			 unsigned long value)
+{
+  sample(*out, name, "", labels, itoa(value));
+}
+
+void metrics_file::value(const char* name, const mystring& labels,
+			 double value)
+{
+  sample(*out, name, "", labels, format(value));
+}
+
+void metrics_file::histogram(const char* name, const mystring& labels,
+			     const metrics_histogram& h)
+{
+  const mystring sep = !labels ? "" : ",";
+  unsigned long total = 0;
+  for (unsigned i = 0; i < METRICS_BUCKETS; i++) {
+    total += h.counts[i];
+    sample(*out, name, "_bucket",
+	   labels + sep + "le=\"" + format(metrics_histogram::bounds[i]) + "\"",
+	   itoa(total));
+  }
+  sample(*out, name, "_bucket", labels + sep + "le=\"+Inf\"", itoa(h.count));
+  sample(*out, name, "_sum", labels, format(h.sum));
+  sample(*out, name, "_count", labels, itoa(h.count));
+}
+
+bool metrics_file::commit()
+{
+  bool ok = out->close() && rename(tmppath.c_str(), path.c_str()) == 0;
+  delete out;
+  out = 0;
+  if (!ok)
+    unlink(tmppath.c_str());
+  return ok;
+}
@@ -0,0 +1,69 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2018  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#ifndef NULLMAILER__METRICS__H__
+#define NULLMAILER__METRICS__H__
+
+#include "fdbuf/fdbuf.h"
+#include "mystring/mystring.h"
+
+// A histogram of durations in seconds, with fixed bucket bounds.
+#define METRICS_BUCKETS 10
+struct metrics_histogram
+{
+  static const double bounds[METRICS_BUCKETS];
+  unsigned long counts[METRICS_BUCKETS];
+  unsigned long count;
+  double sum;
+  metrics_histogram();
+  void observe(double seconds);
+};
+
+// Writes a set of metrics in the Prometheus text format.  The file is
+// written in full under a temporary name and renamed into place, so
+// that a reader never sees part of one.  Labels are given ready made as
+// name="value" pairs separated by commas, as made by metrics_label.
+class metrics_file
+{
+public:
+  metrics_file(const mystring& path);
+  ~metrics_file();
+
+  bool open();
+  void family(const char* name, const char* type, const char* help);
+  void value(const char* name, const mystring& labels, unsigned long value);
+  void value(const char* name, const mystring& labels, double value);
+  void histogram(const char* name, const mystring& labels,
+		 const metrics_histogram& h);
+  bool commit();
+
+private:
+  mystring path;
+  mystring tmppath;
+  fdobuf* out;
+
+  metrics_file(const metrics_file&);
+  metrics_file& operator=(const metrics_file&);
+};
+
+mystring metrics_label(const char* name, const mystring& value);
+
+#endif // NULLMAILER__METRICS__H__
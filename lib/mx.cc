@@ -0,0 +1,135 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2018  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#include "config.h"
+#include <stdlib.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#ifdef HAVE_RES_QUERY
+#include <arpa/nameser.h>
+#include <netdb.h>
+#include <resolv.h>
+#endif
+#include "mx.h"
+
+// How long an answer without a time to live of its own is kept.
+#define MX_DEFAULT_TTL 300
+
+#ifdef HAVE_RES_QUERY
+
+#define MX_MAX 32
+
+struct mx_record
+{
+  unsigned preference;
+  long order;
+  mystring host;
+};
+
+static int by_preference(const void* a, const void* b)
+{
+  const mx_record* ra = *(const mx_record* const*)a;
+  const mx_record* rb = *(const mx_record* const*)b;
+  if (ra->preference != rb->preference)
+    return ra->preference < rb->preference ? -1 : 1;
+  return ra->order < rb->order ? -1 : ra->order > rb->order;
+}
+
+int mx_lookup(const mystring& domain, list<mystring>& hosts,
+	      unsigned long& ttl)
+{
+  hosts.empty();
+  ttl = MX_DEFAULT_TTL;
+  if (domain[0] == '[') {
+    hosts.append(domain.sub(1, domain.length() - 2));
+    return MX_FOUND;
+  }
+  unsigned char answer[4096];
+  int len = res_query(domain.c_str(), C_IN, T_MX, answer, sizeof answer);
+  if (len < 0) {
+    switch (h_errno) {
+    case HOST_NOT_FOUND:
+      return MX_NONE;
+    case NO_DATA:
+      hosts.append(domain);
+      return MX_FOUND;
+    default:
+      return MX_TEMPFAIL;
+    }
+  }
+  if (len > (int)sizeof answer)
+    len = sizeof answer;
+  ns_msg msg;
+  if (ns_initparse(answer, len, &msg) < 0)
+    return MX_TEMPFAIL;
+  mx_record records[MX_MAX];
+  mx_record* sorted[MX_MAX];
+  int count = 0;
+  const int answers = ns_msg_count(msg, ns_s_an);
+  for (int i = 0; i < answers && count < MX_MAX; i++) {
+    ns_rr rr;
+    if (ns_parserr(&msg, ns_s_an, i, &rr) < 0)
+      return MX_TEMPFAIL;
+    if (ns_rr_type(rr) != ns_t_mx || ns_rr_rdlen(rr) < 3)
+      continue;
+    char name[NS_MAXDNAME];
+    if (dn_expand(ns_msg_base(msg), ns_msg_end(msg), ns_rr_rdata(rr) + 2,
+		  name, sizeof name) < 0)
+      return MX_TEMPFAIL;
+    if (count == 0 || ns_rr_ttl(rr) < ttl)
+      ttl = ns_rr_ttl(rr);
+    mx_record& r = records[count];
+    r.preference = ns_get16(ns_rr_rdata(rr));
+    r.order = random();
+    r.host = name;
+    sorted[count] = &r;
+    ++count;
+  }
+  if (count == 0) {
+    hosts.append(domain);
+    return MX_FOUND;
+  }
+  // A single MX record naming the root is the null MX of RFC 7505.
+  if (count == 1 && !sorted[0]->host)
+    return MX_NONE;
+  qsort(sorted, count, sizeof *sorted, by_preference);
+  for (int i = 0; i < count; i++)
+    if (!!sorted[i]->host)
+      hosts.append(sorted[i]->host);
+  return MX_FOUND;
+}
+
+#else
+
+// Without a resolver library, every domain is its own mail exchanger.
+int mx_lookup(const mystring& domain, list<mystring>& hosts,
+	      unsigned long& ttl)
+{
+  hosts.empty();
+  ttl = MX_DEFAULT_TTL;
+  if (domain[0] == '[')
+    hosts.append(domain.sub(1, domain.length() - 2));
+  else
+    hosts.append(domain);
+  return MX_FOUND;
+}
+
+#endif
@@ -0,0 +1,41 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2018  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#ifndef NULLMAILER__MX__H__
+#define NULLMAILER__MX__H__
+
+#include "list.h"
+#include "mystring/mystring.h"
+
+// The results of looking up the mail exchangers of a domain.
+#define MX_FOUND 0		// The hosts are listed
+#define MX_NONE 1		// The domain does not exist or takes no mail
+#define MX_TEMPFAIL 2		// The lookup failed and may be tried again
+
+// Find the mail exchangers of a domain, most preferred first, with
+// those of the same preference in random order.  A domain with no MX
+// records is its own mail exchanger, and an address literal ([1.2.3.4])
+// names its host directly.  ttl is set to the time the answer may be
+// cached for, in seconds.
+int mx_lookup(const mystring& domain, list<mystring>& hosts,
+	      unsigned long& ttl);
+
+#endif // NULLMAILER__MX__H__
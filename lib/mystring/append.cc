@@ -8,6 +8,11 @@ void mystring::append(const char* str, size_t len)
     return;
   if(!*this)
     assign(str, len);
+  else if(is_local() && local.length + len <= MYSTRING_LOCAL) {
+    memcpy(local.buf + local.length, str, len);
+    local.length += len;
+    local.buf[local.length] = 0;
+  }
   else
     rep = rep->append(str, len);
 }
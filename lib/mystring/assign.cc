@@ -34,7 +34,7 @@ void mystring::assign(const char* in, size_t len)
 void mystring::dup(const char* in, size_t len)
 {
   trace("in='" << in << "'");
-  rep = mystringrep::dup(in, len);
+  rep = mystringrep::dup(in, len, &local);
   rep->attach();
 }
 
@@ -46,10 +46,30 @@ void mystring::dup(const char* in)
     dupnil();
 }
 
+// Take over the contents of another string, leaving it empty.  A short
+// string is copied out of its local storage; a long one keeps its rep.
+void mystring::take(mystring& s)
+{
+  if(s.is_local()) {
+    local = s.local;
+    rep = (mystringrep*)&local;
+  }
+  else {
+    rep = s.rep;
+    s.rep = &nil;
+    nil.attach();
+  }
+}
+
 void mystring::operator=(const mystringjoin& in)
 {
+  // The join may include this string, so it is built somewhere else
+  // before replacing it.
+  mystringlocal built;
   mystringrep* tmp = rep;
-  rep = in.traverse();
+  rep = in.traverse(&built);
+  if(rep == (mystringrep*)&built)
+    rep = mystringrep::dup(built.buf, built.length, &local);
   rep->attach();
   tmp->detach();
 }
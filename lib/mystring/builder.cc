@@ -0,0 +1,79 @@
+// Copyright (C) 2016 Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+#include "mystring.h"
+#include "builder.h"
+#include <limits.h>
+
+mystringbuilder::mystringbuilder(unsigned size)
+  : rep(&nil)
+{
+  nil.attach();
+  reserve(size);
+}
+
+// The new storage is a rep of its own, which the string taking it over
+// is the only one to refer to.
+void mystringbuilder::grow(unsigned size)
+{
+  mystringrep* tmp = mystringrep::alloc(size);
+  memcpy(tmp->buf, rep->buf, rep->length + 1);
+  tmp->length = rep->length;
+  tmp->attach();
+  rep->detach();
+  rep = tmp;
+}
+
+void mystringbuilder::clear()
+{
+  if(rep->length > 0) {
+    rep->length = 0;
+    rep->buf[0] = 0;
+  }
+}
+
+mystringbuilder& mystringbuilder::operator<<(unsigned long i)
+{
+  char buf[sizeof(unsigned long) * CHAR_BIT / 3 + 2];
+  char* ptr = buf + sizeof buf;
+  do {
+    *--ptr = i % 10 + '0';
+    i /= 10;
+  } while(i);
+  append(ptr, buf + sizeof buf - ptr);
+  return *this;
+}
+
+mystringbuilder& mystringbuilder::operator<<(signed long i)
+{
+  if(i < 0) {
+    operator<<('-');
+    return operator<<(0UL - (unsigned long)i);
+  }
+  return operator<<((unsigned long)i);
+}
+
+mystring mystringbuilder::str()
+{
+  mystring s;
+  if(rep != &nil) {
+    s.rep->detach();
+    s.rep = rep;
+    rep = &nil;
+    nil.attach();
+  }
+  return s;
+}
@@ -0,0 +1,90 @@
+// Copyright (C) 2016 Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+#ifndef MYSTRING__BUILDER__H__
+#define MYSTRING__BUILDER__H__
+
+#include "mystring/mystring.h"
+
+// Assembles a string from many pieces in one allocation, when room for
+// the whole of it is reserved first, and grows geometrically when it
+// is not.  The result is moved into a mystring without being copied,
+// and clearing the builder keeps its storage for the next string.
+class mystringbuilder
+{
+private:
+  mystringrep* rep;
+
+  void grow(unsigned);
+  mystringbuilder(const mystringbuilder&);
+  mystringbuilder& operator=(const mystringbuilder&);
+public:
+  mystringbuilder(unsigned size = 0);
+  ~mystringbuilder() { rep->detach(); }
+
+  // Make room for at least size characters in all.
+  void reserve(unsigned size)
+    {
+      if(size >= rep->size)
+	grow(size);
+    }
+  void clear();
+
+  const char* c_str() const { return rep->buf; }
+  unsigned length() const { return rep->length; }
+  bool empty() const { return rep->length == 0; }
+  bool operator!() const { return empty(); }
+  mystringview view() const { return mystringview(rep->buf, rep->length); }
+
+  void append(const char* str, unsigned len)
+    {
+      if(rep->length + len >= rep->size)
+	grow(rep->length + len + (rep->length + len) / 2);
+      memcpy(rep->buf + rep->length, str, len);
+      rep->length += len;
+      rep->buf[rep->length] = 0;
+    }
+
+  mystringbuilder& operator<<(const mystringview& s)
+    {
+      append(s.data(), s.length());
+      return *this;
+    }
+  mystringbuilder& operator<<(const mystring& s)
+    {
+      append(s.c_str(), s.length());
+      return *this;
+    }
+  mystringbuilder& operator<<(const char* s)
+    {
+      append(s, strlen(s));
+      return *this;
+    }
+  mystringbuilder& operator<<(char ch)
+    {
+      append(&ch, 1);
+      return *this;
+    }
+  mystringbuilder& operator<<(unsigned long);
+  mystringbuilder& operator<<(signed long);
+  mystringbuilder& operator<<(unsigned i) { return operator<<((unsigned long)i); }
+  mystringbuilder& operator<<(signed i) { return operator<<((signed long)i); }
+
+  // Move what was built into a string, leaving the builder empty.
+  mystring str();
+};
+
+#endif
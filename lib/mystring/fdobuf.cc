@@ -7,3 +7,9 @@ fdobuf& operator<<(fdobuf& out, const mystring& str)
   return out;
 }
 
+fdobuf& operator<<(fdobuf& out, const mystringview& str)
+{
+  out.write(str.data(), str.length());
+  return out;
+}
+
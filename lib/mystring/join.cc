@@ -14,7 +14,7 @@ struct tmpitem
   unsigned len;
 };
 
-mystringrep* mystringjoin::traverse() const
+mystringrep* mystringjoin::traverse(mystringlocal* local) const
 {
   // At first glance, a recursive implementation would be the most logical
   // way of doing this, but it turned out to be a significant loss.  This
@@ -46,7 +46,7 @@ mystringrep* mystringjoin::traverse() const
 
   // Since the chain is constructed such that the last item is the
   // first node, the string gets constructed in reverse order.
-  mystringrep* rep = mystringrep::alloc(length);
+  mystringrep* rep = mystringrep::alloc(length, local);
   char* buf = rep->buf + length;
   item = items;
   do {
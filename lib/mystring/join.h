@@ -32,6 +32,13 @@ public:
     {
       rep->attach();
     }
+#if __cplusplus >= 201103L
+  mystringjoin(mystringjoin&& j)
+    : prev(j.prev), rep(j.rep), str(j.str)
+    {
+      j.rep = 0;
+    }
+#endif
   mystringjoin(const mystring& s)
     : prev(0), rep(s.rep), str(s.rep->buf)
     {
@@ -54,11 +61,11 @@ public:
     {
       if(rep) rep->detach();
     }
-  mystringrep* traverse() const;
+  mystringrep* traverse(mystringlocal* local = 0) const;
 };
 
 inline mystring::mystring(const mystringjoin& j)
-  : rep(j.traverse())
+  : rep(j.traverse(&local))
 {
   rep->attach();
 }
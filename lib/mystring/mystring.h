@@ -22,12 +22,16 @@
 #include "mystring/rep.h"
 
 class mystringjoin;
+class mystringview;
 class mystring
 {
   friend class mystringtmp;
   friend class mystringjoin;
+  friend class mystringbuilder;
 private:
   mystringrep* rep;
+  mystringlocal local;
+  bool is_local() const { return rep == (const mystringrep*)&local; }
 
 protected:
   void dupnil();
@@ -35,6 +39,7 @@ protected:
   void dup(const char*);
   void assign(const char*);
   void assign(const char*, size_t);
+  void take(mystring&);
 public:
   static const mystring NUL;
   
@@ -43,6 +48,9 @@ public:
   mystring(const mystring& s) { dup(s.rep->buf, s.rep->length); }
   mystring(const char* str, size_t len) { dup(str, len); }
   mystring(const mystringjoin&);
+#if __cplusplus >= 201103L
+  mystring(mystring&& s) { take(s); }
+#endif
   ~mystring();
 
   const char* c_str() const { return rep->buf; }
@@ -69,6 +77,16 @@ public:
   void operator=(const char* in) { assign(in); }
   void operator=(const mystring& in) { assign(in.rep->buf, in.rep->length); }
   void operator=(const mystringjoin& in);
+#if __cplusplus >= 201103L
+  void operator=(mystring&& in)
+    {
+      if(&in != this) {
+	mystringrep* tmp = rep;
+	take(in);
+	tmp->detach();
+      }
+    }
+#endif
 
   mystring subst(char from, char to) const;
   
@@ -100,6 +118,7 @@ public:
 
   void operator+=(const mystring& str) {append(str.rep->buf, str.rep->length);}
   void operator+=(const char* str) { append(str); }
+  void operator+=(const mystringview& str);
   void operator+=(char ch)
     {
       char str[2] = { ch, 0 };
@@ -116,6 +135,7 @@ inline mystring::~mystring()
 
 #include "mystring/iter.h"
 #include "mystring/join.h"
+#include "mystring/view.h"
 
 class fdobuf;
 fdobuf& operator<<(fdobuf& out, const mystring& str);
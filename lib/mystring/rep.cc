@@ -2,6 +2,7 @@
 #include "trace.h"
 #include <ctype.h>
 #include <string.h>
+#include "stats.h"
 
 mystringrep nil = { 0, 1, 1, "" };
 
@@ -10,14 +11,16 @@ static const unsigned replength = sizeof(unsigned)*3;
 static const unsigned sizestep = sizeof(unsigned);
 static const unsigned slackdiv = 4;
 static const unsigned slackmax = 16;
+static const unsigned localrefs = 1U << 30;
 
 #ifdef MYSTRINGREP_STATS
 
-#include "fdbuf.h"
+#include "fdbuf/fdbuf.h"
 
 struct _rep_stats
 {
   unsigned allocs;
+  unsigned locals;
   unsigned alloc_size;
   unsigned alloc_len;
   
@@ -25,7 +28,7 @@ struct _rep_stats
   unsigned appends_dup;
 
   _rep_stats()
-    : allocs(0)
+    : allocs(0), locals(0)
     {
     }
   
@@ -48,6 +51,7 @@ struct _rep_stats
       stat(" slack divisor", slackdiv);
       stat(" slack maximum", slackmax);
       stat("        allocs", allocs);
+      stat("        locals", locals);
       stat("  alloc length", alloc_len);
       stat("    alloc size", alloc_size);
       pcnt("   alloc slack", alloc_size-alloc_len, alloc_len);
@@ -77,12 +81,14 @@ mystringrep* mystringrep::alloc(unsigned length)
     return &nil;
 
   ACCOUNT(alloc_len, length);
+  ++run_stats.allocs;
   unsigned slack = length / slackdiv;
   if(slack > slackmax)
     slack = slackmax;
   unsigned size = length+1 + sizestep-1 + slack;
   size = size - size % sizestep;
   ACCOUNT(alloc_size, size);
+  run_stats.alloc_bytes += size;
 
   mystringrep* ptr = (mystringrep*)new char[size+replength];
   ptr->length = length;
@@ -91,6 +97,31 @@ mystringrep* mystringrep::alloc(unsigned length)
   return ptr;
 }
 
+// Use the local storage for a short string, if there is any.
+mystringrep* mystringrep::alloc(unsigned length, mystringlocal* local)
+{
+  if(!local || length == 0 || length > MYSTRING_LOCAL)
+    return alloc(length);
+  ACCOUNT(locals, 1);
+  local->length = length;
+  local->references = localrefs;
+  local->size = MYSTRING_LOCAL+1;
+  return (mystringrep*)local;
+}
+
+// The source may lie within the local storage being assigned.
+mystringrep* mystringrep::dup(const char* str, unsigned length,
+			      mystringlocal* local)
+{
+  trace_static("str=" << (void*)str << " length=" << length);
+  if(length == 0)
+    return &nil;
+  mystringrep* ptr = alloc(length, local);
+  memmove(ptr->buf, str, length);
+  ptr->buf[length] = 0;
+  return ptr;
+}
+
 mystringrep* mystringrep::dup(const char* str, unsigned length)
 {
   trace_static("str=" << (void*)str << " length=" << length);
@@ -123,7 +154,13 @@ mystringrep* mystringrep::append(const char* str, unsigned len)
   // Also, if this does not have enough space to add the new string, dup it
   if(references > 1 || newlen >= size) {
     ACCOUNT(appends_dup, 1);
-    mystringrep* tmp = dup(buf, length, str, len);
+    // A string that is being appended to is likely to grow again, so
+    // grow it geometrically to keep building a long string linear.
+    mystringrep* tmp = alloc(references > 1 ? newlen : newlen + newlen / 2);
+    memcpy(tmp->buf, buf, length);
+    memcpy(tmp->buf+length, str, len);
+    tmp->buf[newlen] = 0;
+    tmp->length = newlen;
     tmp->attach();
     detach();
     return tmp;
@@ -141,7 +178,11 @@ mystringrep* mystringrep::append(const char* str, unsigned len)
 void mystringrep::attach()
 {
   trace("references=" << references);
+#ifdef _REENTRANT
+  __atomic_add_fetch(&references, 1, __ATOMIC_RELAXED);
+#else
   ++references;
+#endif
 }
 #endif
 
@@ -149,8 +190,11 @@ void mystringrep::detach()
 {
   trace("references=" << references);
   
-  --references;
-  if(!references) {
+#ifdef _REENTRANT
+  if(!__atomic_sub_fetch(&references, 1, __ATOMIC_ACQ_REL)) {
+#else
+  if(!--references) {
+#endif
     trace("deleting this");
     delete this;
   }
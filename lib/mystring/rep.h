@@ -18,6 +18,22 @@
 #ifndef MYSTRING__REP__H__
 #define MYSTRING__REP__H__
 
+// Strings up to this length are kept inside the mystring itself.
+#ifndef MYSTRING_LOCAL
+#define MYSTRING_LOCAL 23
+#endif
+
+// Storage for a short string, laid out like a mystringrep.  Its
+// reference count is kept far from zero, so the attach and detach
+// calls made on any rep never try to free it.
+struct mystringlocal
+{
+  unsigned length;
+  unsigned references;
+  unsigned size;
+  char buf[MYSTRING_LOCAL+1];
+};
+
 struct mystringrep
 {
   unsigned length;
@@ -30,15 +46,23 @@ struct mystringrep
   mystringrep* append(const char*, unsigned);
   
   static mystringrep* alloc(unsigned);
+  static mystringrep* alloc(unsigned, mystringlocal*);
   static mystringrep* dup(const char*, unsigned);
+  static mystringrep* dup(const char*, unsigned, mystringlocal*);
   static mystringrep* dup(const char*, unsigned,
 			  const char*, unsigned);
 };
 
 #ifndef MYSTRING_TRACE
+// Strings may be shared between threads, so the count is changed
+// atomically when they are in use.
 inline void mystringrep::attach()
 {
+#ifdef _REENTRANT
+  __atomic_add_fetch(&references, 1, __ATOMIC_RELAXED);
+#else
   references++;
+#endif
 }
 #endif
 
@@ -0,0 +1,68 @@
+#include "mystring.h"
+#include <ctype.h>
+#include <strings.h>
+
+int mystringview::find_first(char ch, size_t offset) const
+{
+  if(offset >= len)
+    return -1;
+  const char* p = (const char*)memchr(ptr + offset, ch, len - offset);
+  return p ? p - ptr : -1;
+}
+
+int mystringview::find_first_of(const char* set, size_t offset) const
+{
+  for(; offset < len; offset++)
+    if(ptr[offset] && strchr(set, ptr[offset]))
+      return offset;
+  return -1;
+}
+
+int mystringview::find_last(char ch) const
+{
+  for(size_t i = len; i > 0; i--)
+    if(ptr[i-1] == ch)
+      return i-1;
+  return -1;
+}
+
+mystringview mystringview::lstrip() const
+{
+  size_t i = 0;
+  while(i < len && isspace((unsigned char)ptr[i]))
+    ++i;
+  return mystringview(ptr + i, len - i);
+}
+
+mystringview mystringview::rstrip() const
+{
+  size_t n = len;
+  while(n > 0 && isspace((unsigned char)ptr[n-1]))
+    --n;
+  return mystringview(ptr, n);
+}
+
+mystringview mystringview::strip() const
+{
+  return lstrip().rstrip();
+}
+
+bool mystringview::operator==(const mystringview& in) const
+{
+  return len == in.len && memcmp(ptr, in.ptr, len) == 0;
+}
+
+bool mystringview::equal_nocase(const mystringview& in) const
+{
+  return len == in.len && strncasecmp(ptr, in.ptr, len) == 0;
+}
+
+bool mystringview::starts_with(const mystringview& prefix) const
+{
+  return len >= prefix.len && memcmp(ptr, prefix.ptr, prefix.len) == 0;
+}
+
+bool mystringview::starts_with_nocase(const mystringview& prefix) const
+{
+  return len >= prefix.len && strncasecmp(ptr, prefix.ptr, prefix.len) == 0;
+}
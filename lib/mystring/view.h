@@ -0,0 +1,81 @@
+// Copyright (C) 2016 Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+#ifndef MYSTRING__VIEW__H__
+#define MYSTRING__VIEW__H__
+
+#include <string.h>
+
+// A span of characters owned by something else, such as a mystring or
+// an input buffer.  Slicing and comparing a view never allocates; it is
+// only valid while the characters it points at are.
+class mystringview
+{
+private:
+  const char* ptr;
+  size_t len;
+
+public:
+  mystringview() : ptr(""), len(0) { }
+  mystringview(const char* s) : ptr(s), len(strlen(s)) { }
+  mystringview(const char* s, size_t l) : ptr(s), len(l) { }
+  mystringview(const mystring& s) : ptr(s.c_str()), len(s.length()) { }
+
+  const char* data() const { return ptr; }
+  size_t length() const { return len; }
+  bool empty() const { return len == 0; }
+  bool operator!() const { return empty(); }
+  char operator[](size_t i) const { return ptr[i]; }
+  mystring str() const { return mystring(ptr, len); }
+
+  mystringview left(size_t n) const
+    {
+      return mystringview(ptr, n < len ? n : len);
+    }
+  mystringview right(size_t offset) const
+    {
+      return offset >= len ? mystringview()
+	: mystringview(ptr + offset, len - offset);
+    }
+  mystringview sub(size_t offset, size_t n) const
+    {
+      return right(offset).left(n);
+    }
+
+  int find_first(char, size_t = 0) const;
+  int find_first_of(const char*, size_t = 0) const;
+  int find_last(char) const;
+
+  mystringview lstrip() const;
+  mystringview rstrip() const;
+  mystringview strip() const;
+
+  bool operator==(const mystringview&) const;
+  bool operator!=(const mystringview& in) const { return !operator==(in); }
+  bool equal_nocase(const mystringview&) const;
+  bool starts_with(const mystringview&) const;
+  bool starts_with_nocase(const mystringview&) const;
+};
+
+inline void mystring::operator+=(const mystringview& str)
+{
+  append(str.data(), str.length());
+}
+
+class fdobuf;
+fdobuf& operator<<(fdobuf& out, const mystringview& str);
+
+#endif
@@ -1,13 +1,109 @@
 #include "config.h"
 #include "netstring.h"
-#include "itoa.h"
+#include "fdbuf/fdbuf.h"
+
+static unsigned digits(unsigned long n)
+{
+  unsigned d = 1;
+  for (; n >= 10; n /= 10)
+    ++d;
+  return d;
+}
+
+unsigned long netstring_size(unsigned long len)
+{
+  return digits(len) + 1 + len + 1;
+}
+
+unsigned long netstring_number_size(long n)
+{
+  return netstring_size(n < 0 ? digits(0UL - n) + 1 : digits(n));
+}
+
+void netstring_append(mystringbuilder& b, const char* s, unsigned long len)
+{
+  b << len << ':';
+  b.append(s, len);
+  b << ',';
+}
+
+void netstring_append(mystringbuilder& b, const mystring& s)
+{
+  netstring_append(b, s.c_str(), s.length());
+}
+
+void netstring_append(mystringbuilder& b, long n)
+{
+  unsigned long len = n < 0 ? digits(0UL - n) + 1 : digits(n);
+  b << len << ':' << n << ',';
+}
+
+bool netstring_begin(fdobuf& out, unsigned long len)
+{
+  out << len;
+  return out.write(':');
+}
+
+bool netstring_write(fdobuf& out, const char* s, unsigned long len)
+{
+  char head[24];
+  char* p = head + sizeof head;
+  *--p = ':';
+  unsigned long n = len;
+  do {
+    *--p = n % 10 + '0';
+    n /= 10;
+  } while (n);
+  struct iovec iov[3];
+  iov[0].iov_base = p;
+  iov[0].iov_len = head + sizeof head - p;
+  iov[1].iov_base = (void*)s;
+  iov[1].iov_len = len;
+  iov[2].iov_base = (void*)",";
+  iov[2].iov_len = 1;
+  return out.writev(iov, 3);
+}
+
+bool netstring_write(fdobuf& out, const mystring& s)
+{
+  return netstring_write(out, s.c_str(), s.length());
+}
 
 mystring str2net(const mystring& s)
 {
-  return mystringjoin(itoa(s.length())) + ":" + s + ",";
+  mystringbuilder b(netstring_size(s.length()));
+  netstring_append(b, s);
+  return b.str();
 }
 
 mystring strnl2net(const mystring& s)
 {
-  return mystringjoin(itoa(s.length()+1)) + ":" + s + "\012,";
+  mystringbuilder b(netstring_size(s.length() + 1));
+  b << (unsigned long)(s.length() + 1) << ':' << s << "\012,";
+  return b.str();
+}
+
+// Remove the netstring at the start of in and store its contents in
+// out.  Returns 1 if a netstring was decoded, 0 if in does not yet hold
+// all of it, or -1 if it is malformed.
+int net2str(mystring& in, mystring& out)
+{
+  unsigned long len = 0;
+  unsigned i;
+  for (i = 0; i < in.length() && in[i] != ':'; i++) {
+    if (in[i] < '0' || in[i] > '9' || i >= 9)
+      return -1;
+    len = len * 10 + in[i] - '0';
+  }
+  if (i >= in.length())
+    return 0;
+  if (i == 0)
+    return -1;
+  if (in.length() < i + 1 + len + 1)
+    return 0;
+  if (in[i + 1 + len] != ',')
+    return -1;
+  out = in.sub(i + 1, len);
+  in = in.right(i + 1 + len + 1);
+  return 1;
 }
@@ -2,7 +2,27 @@
 #define NULLMAILER__NETSTRING__H__
 
 #include "mystring/mystring.h"
+#include "mystring/builder.h"
+
+class fdobuf;
+
 mystring str2net(const mystring&);
 mystring strnl2net(const mystring&);
+int net2str(mystring& in, mystring& out);
+
+// The encoders below write netstrings straight into a builder or an
+// output buffer.  The sizes let a netstring holding others, or the
+// builder it goes into, be sized before any of them is written.
+unsigned long netstring_size(unsigned long len);
+unsigned long netstring_number_size(long n);
+void netstring_append(mystringbuilder& b, const char* s, unsigned long len);
+void netstring_append(mystringbuilder& b, const mystring& s);
+void netstring_append(mystringbuilder& b, long n);
+// Write the "length:" that starts a netstring, for its contents and
+// the closing comma to follow.
+bool netstring_begin(fdobuf& out, unsigned long len);
+// Write a whole netstring in one go, without copying s.
+bool netstring_write(fdobuf& out, const char* s, unsigned long len);
+bool netstring_write(fdobuf& out, const mystring& s);
 
 #endif // NULLMAILER__NETSTRING__H__
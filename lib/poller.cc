@@ -0,0 +1,135 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+#include "poller.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+
+poller::poller()
+  : epfd(epoll_create(16)), events(new struct epoll_event[POLLER_EVENTS])
+{
+  if (epfd >= 0)
+    fcntl(epfd, F_SETFD, FD_CLOEXEC);
+}
+
+poller::~poller()
+{
+  if (epfd >= 0)
+    close(epfd);
+  delete[] events;
+}
+
+poller::operator bool() const
+{
+  return epfd >= 0;
+}
+
+bool poller::add(int fd)
+{
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+  return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+void poller::remove(int fd)
+{
+  struct epoll_event event;
+  epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &event);
+}
+
+int poller::wait(int timeout, int ready[], int max)
+{
+  if (max > POLLER_EVENTS)
+    max = POLLER_EVENTS;
+  int n = epoll_wait(epfd, events, max, timeout);
+  if (n < 0)
+    return errno == EINTR ? 0 : -1;
+  for (int i = 0; i < n; i++)
+    ready[i] = events[i].data.fd;
+  return n;
+}
+
+#else
+
+poller::poller()
+  : fds(0), count(0), alloc(0)
+{
+}
+
+poller::~poller()
+{
+  delete[] fds;
+}
+
+poller::operator bool() const
+{
+  return true;
+}
+
+bool poller::add(int fd)
+{
+  if (count == alloc) {
+    alloc = alloc ? alloc * 2 : 16;
+    struct pollfd* newfds = new struct pollfd[alloc];
+    for (unsigned i = 0; i < count; i++)
+      newfds[i] = fds[i];
+    delete[] fds;
+    fds = newfds;
+  }
+  fds[count].fd = fd;
+  fds[count].events = POLLIN;
+  fds[count].revents = 0;
+  ++count;
+  return true;
+}
+
+void poller::remove(int fd)
+{
+  for (unsigned i = 0; i < count; i++)
+    if (fds[i].fd == fd) {
+      fds[i] = fds[--count];
+      return;
+    }
+}
+
+int poller::wait(int timeout, int ready[], int max)
+{
+  int n = poll(fds, count, timeout);
+  if (n < 0)
+    return errno == EINTR ? 0 : -1;
+  n = 0;
+  for (unsigned i = 0; i < count && n < max; i++)
+    if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+      ready[n++] = fds[i].fd;
+  return n;
+}
+
+#endif
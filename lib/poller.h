@@ -0,0 +1,58 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#ifndef NULLMAILER_POLLER__H__
+#define NULLMAILER_POLLER__H__
+
+// The most ready descriptors one wait returns with epoll.  Any others
+// are returned by the next wait.
+#define POLLER_EVENTS 64
+
+// A set of file descriptors to wait on for input, using epoll where it
+// is available and poll otherwise.
+class poller
+{
+ public:
+  poller();
+  ~poller();
+
+  operator bool() const;
+
+  bool add(int fd);
+  void remove(int fd);
+  // Wait up to timeout milliseconds (forever if negative) for any of
+  // the descriptors to become readable or hang up.  Returns the number
+  // of ready descriptors stored in ready, 0 on timeout or when
+  // interrupted by a signal, or -1 on error.
+  int wait(int timeout, int ready[], int max);
+
+ private:
+#ifdef HAVE_SYS_EPOLL_H
+  int epfd;
+  struct epoll_event* events;
+#else
+  struct pollfd* fds;
+  unsigned count;
+  unsigned alloc;
+#endif
+};
+
+#endif // NULLMAILER_POLLER__H__
@@ -0,0 +1,80 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2018  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#include "config.h"
+#include "priority.h"
+
+const char* const priority_names[PRIORITY_CLASSES] = {
+  "urgent", "normal", "bulk"
+};
+
+int priority_parse(const mystring& name)
+{
+  for (int i = 0; i < PRIORITY_CLASSES; i++)
+    if (mystringview(name).equal_nocase(priority_names[i]))
+      return i;
+  return -1;
+}
+
+// The value of the header line if it has the given field name.
+static bool field_value(const mystring& line, const char* name,
+			mystringview& value)
+{
+  const mystringview field(name);
+  if (!mystringview(line).starts_with_nocase(field))
+    return false;
+  value = mystringview(line).right(field.length()).strip();
+  return true;
+}
+
+// Priority: is from RFC 2156, X-Priority: runs from 1 (highest) to 5
+// (lowest), and Precedence: marks mailing list and bulk mail.
+int priority_header(const mystring& line)
+{
+  mystringview value;
+  if (field_value(line, "priority:", value)) {
+    if (value.equal_nocase("urgent"))
+      return PRIORITY_URGENT;
+    if (value.equal_nocase("normal"))
+      return PRIORITY_NORMAL;
+    if (value.equal_nocase("non-urgent"))
+      return PRIORITY_BULK;
+    return priority_parse(value.str());
+  }
+  if (field_value(line, "x-priority:", value)) {
+    if (!value)
+      return -1;
+    switch (value[0]) {
+    case '1': case '2':
+      return PRIORITY_URGENT;
+    case '3':
+      return PRIORITY_NORMAL;
+    case '4': case '5':
+      return PRIORITY_BULK;
+    }
+    return -1;
+  }
+  if (field_value(line, "precedence:", value)
+      && (value.equal_nocase("bulk") || value.equal_nocase("list")
+	  || value.equal_nocase("junk")))
+    return PRIORITY_BULK;
+  return -1;
+}
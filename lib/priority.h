@@ -0,0 +1,43 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2018  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#ifndef NULLMAILER__PRIORITY__H__
+#define NULLMAILER__PRIORITY__H__
+
+#include "mystring/mystring.h"
+
+// The classes of priority a queued message may have, most urgent
+// first.  nullmailer-send serves the classes in proportion to their
+// weights, so that urgent mail goes first without starving bulk mail.
+#define PRIORITY_URGENT 0
+#define PRIORITY_NORMAL 1
+#define PRIORITY_BULK 2
+#define PRIORITY_CLASSES 3
+
+extern const char* const priority_names[PRIORITY_CLASSES];
+
+// The class with the given name, or -1 if there is none.
+int priority_parse(const mystring& name);
+// The class set by a Priority:, X-Priority: or Precedence: header
+// line, or -1 if the line is not one of those or names no class.
+int priority_header(const mystring& line);
+
+#endif // NULLMAILER__PRIORITY__H__
@@ -0,0 +1,73 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#include "config.h"
+#include <ctype.h>
+#include "configio.h"
+#include "queuedirs.h"
+
+int queuedirs_read()
+{
+  int dirs;
+  if (!config_readint("queuedirs", dirs) || dirs < 0)
+    return 0;
+  return dirs > QUEUEDIRS_MAX ? QUEUEDIRS_MAX : dirs;
+}
+
+static const char hex[] = "0123456789abcdef";
+
+// The subdirectory for a message, or the empty string if the queue is
+// not divided.
+mystring queuedir_of(const mystring& name, int dirs)
+{
+  if (dirs <= 0)
+    return mystring();
+  // FNV-1a
+  unsigned h = 2166136261U;
+  for (const char* ptr = name.c_str(); *ptr; ++ptr) {
+    h ^= (unsigned char)*ptr;
+    h *= 16777619U;
+  }
+  h %= dirs;
+  char sub[3] = { hex[h >> 4], hex[h & 15], 0 };
+  return sub;
+}
+
+// The path of a message relative to the queue directory.
+mystring queuedir_path(const mystring& name, int dirs)
+{
+  if (dirs <= 0)
+    return name;
+  return queuedir_of(name, dirs) + "/" + name;
+}
+
+mystring queuedir_name(const mystring& path)
+{
+  int i = path.find_last('/');
+  return i < 0 ? path : path.right(i+1);
+}
+
+bool queuedir_is_subdir(const char* name)
+{
+  return name[0] && name[1] && !name[2]
+    && (isdigit(name[0]) || (name[0] >= 'a' && name[0] <= 'f'))
+    && (isdigit(name[1]) || (name[1] >= 'a' && name[1] <= 'f'));
+}
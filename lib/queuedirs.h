@@ -0,0 +1,42 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#ifndef NULLMAILER__QUEUEDIRS__H__
+#define NULLMAILER__QUEUEDIRS__H__
+
+#include "mystring/mystring.h"
+
+// The queue may be spread over subdirectories, named with two hex
+// digits, to keep each directory small.  The "queuedirs" control file
+// sets how many are used (0 for none), and a message is put into the
+// one given by a hash of its file name.  Messages are found in any of
+// the subdirectories as well as the queue itself, so changing the
+// setting does not lose any; nullmailer-rehash moves them to where
+// they now belong.
+#define QUEUEDIRS_MAX 256
+
+int queuedirs_read();
+mystring queuedir_of(const mystring& name, int dirs);
+mystring queuedir_path(const mystring& name, int dirs);
+mystring queuedir_name(const mystring& path);
+bool queuedir_is_subdir(const char* name);
+
+#endif
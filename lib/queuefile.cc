@@ -0,0 +1,189 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2018  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+
+#include "config.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#include "queuefile.h"
+
+mystring queuefile_format(const queuefile_header& h)
+{
+  char buf[QUEUEFILE_HEADER_LENGTH + 1];
+  snprintf(buf, sizeof buf, "%s%010lu %010lu %010lu %06u\n",
+	   h.compressed ? QUEUEFILE_MAGIC_COMPRESSED : QUEUEFILE_MAGIC,
+	   h.offset, h.header_length, h.body_size, h.recipients);
+  return mystring(buf, QUEUEFILE_HEADER_LENGTH);
+}
+
+// Read one zero-padded field of the given width, followed by the
+// separator.
+static bool parse_field(const char*& p, unsigned width, char sep,
+			unsigned long& value)
+{
+  value = 0;
+  for (unsigned i = 0; i < width; i++, p++) {
+    if (*p < '0' || *p > '9')
+      return false;
+    value = value * 10 + (*p - '0');
+  }
+  return *p++ == sep;
+}
+
+bool queuefile_parse(const char* data, unsigned len, queuefile_header& h)
+{
+  if (len < QUEUEFILE_HEADER_LENGTH)
+    return false;
+  if (memcmp(data, QUEUEFILE_MAGIC, sizeof QUEUEFILE_MAGIC - 1) == 0)
+    h.compressed = false;
+  else if (memcmp(data, QUEUEFILE_MAGIC_COMPRESSED,
+		  sizeof QUEUEFILE_MAGIC_COMPRESSED - 1) == 0)
+    h.compressed = true;
+  else
+    return false;
+  const char* p = data + sizeof QUEUEFILE_MAGIC - 1;
+  unsigned long recipients;
+  if (!parse_field(p, 10, ' ', h.offset)
+      || !parse_field(p, 10, ' ', h.header_length)
+      || !parse_field(p, 10, ' ', h.body_size)
+      || !parse_field(p, 6, '\n', recipients))
+    return false;
+  h.recipients = recipients;
+  return h.offset >= QUEUEFILE_HEADER_LENGTH;
+}
+
+bool queuefile_read(fdibuf& in, queuefile_header& h)
+{
+  const char* data;
+  unsigned len;
+  if (!in.peek(data, len) || !queuefile_parse(data, len, h))
+    return false;
+  in.skip(QUEUEFILE_HEADER_LENGTH);
+  return true;
+}
+
+bool queuefile_skip(fdibuf& in)
+{
+  queuefile_header h;
+  return queuefile_read(in, h);
+}
+
+// Reads a message whose body is compressed: the header block straight
+// from the queue file, and then the body inflated from it.  Without
+// zlib, the body cannot be read.
+class queuefile_inflater FDBUF_FINAL : public fdibuf
+{
+public:
+  queuefile_inflater(fdibuf& in, unsigned long header_length);
+  ~queuefile_inflater();
+protected:
+  virtual ssize_t _read(char* buf, ssize_t len);
+private:
+  fdibuf& source;
+  unsigned long raw_left;
+#ifdef HAVE_LIBZ
+  z_stream zs;
+  bool started;
+  bool ended;
+#endif
+};
+
+queuefile_inflater::queuefile_inflater(fdibuf& in, unsigned long header_length)
+  : fdibuf(-1), source(in), raw_left(header_length)
+{
+  flags &= ~flag_closed;
+#ifdef HAVE_LIBZ
+  memset(&zs, 0, sizeof zs);
+  started = inflateInit(&zs) == Z_OK;
+  ended = false;
+#endif
+}
+
+queuefile_inflater::~queuefile_inflater()
+{
+#ifdef HAVE_LIBZ
+  if (started)
+    inflateEnd(&zs);
+#endif
+}
+
+ssize_t queuefile_inflater::_read(char* buf, ssize_t len)
+{
+  const char* data;
+  unsigned avail;
+  if (raw_left > 0) {
+    if (!source.peek(data, avail))
+      return source.eof() ? 0 : -1;
+    if (avail > raw_left)
+      avail = raw_left;
+    if ((ssize_t)avail > len)
+      avail = len;
+    memcpy(buf, data, avail);
+    source.skip(avail);
+    raw_left -= avail;
+    return avail;
+  }
+#ifdef HAVE_LIBZ
+  if (!started) {
+    errno = ENOMEM;
+    return -1;
+  }
+  zs.next_out = (Bytef*)buf;
+  zs.avail_out = len;
+  while (!ended && zs.avail_out == (uInt)len) {
+    // A stream that ends before it is finished is an error.
+    if (!source.peek(data, avail)) {
+      errno = source.eof() ? EINVAL : source.error_number();
+      return -1;
+    }
+    zs.next_in = (Bytef*)data;
+    zs.avail_in = avail;
+    const int r = inflate(&zs, Z_NO_FLUSH);
+    source.skip(avail - zs.avail_in);
+    if (r == Z_STREAM_END)
+      ended = true;
+    else if (r != Z_OK) {
+      errno = EINVAL;
+      return -1;
+    }
+  }
+  return len - zs.avail_out;
+#else
+  errno = ENOTSUP;
+  return -1;
+#endif
+}
+
+queuefile_data::queuefile_data(fdibuf& in, const queuefile_header& h)
+  : source(in), inflater(h.compressed
+			 ? new queuefile_inflater(in, h.header_length) : 0)
+{
+}
+
+queuefile_data::~queuefile_data()
+{
+  delete inflater;
+}
@@ -0,0 +1,81 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2018  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+
+#ifndef NULLMAILER__QUEUEFILE__H__
+#define NULLMAILER__QUEUEFILE__H__
+
+#include "fdbuf/fdbuf.h"
+#include "mystring/mystring.h"
+
+// A queue file holds the envelope lines, a blank line, and the
+// message.  In the versioned format, set by "2" in the queueformat
+// control file, it starts instead with a header line of fixed length,
+// so that readers can go straight to the parts of the message and
+// know their sizes up front:
+//   #NQ2 0000000058 0000000412 0000001734 000002
+// giving as zero-padded decimal numbers the offset of the message
+// after the envelope, the length of its header block including the
+// blank line ending it, the length of its body, and the number of
+// recipients.  The envelope follows as usual.  Files in either format
+// are read everywhere.  A file whose body is compressed, as set by the
+// queuecompress control file, starts with "#NQZ " instead; the header
+// block is left as it is and the body follows it as a zlib stream, its
+// length in the header line being the length once it is inflated.
+#define QUEUEFILE_MAGIC "#NQ2 "
+#define QUEUEFILE_MAGIC_COMPRESSED "#NQZ "
+#define QUEUEFILE_HEADER_LENGTH 45
+
+struct queuefile_header
+{
+  unsigned long offset;
+  unsigned long header_length;
+  unsigned long body_size;
+  unsigned recipients;
+  bool compressed;
+  queuefile_header() : offset(0), header_length(0), body_size(0),
+		       recipients(0), compressed(false) { }
+};
+
+mystring queuefile_format(const queuefile_header& h);
+bool queuefile_parse(const char* data, unsigned len, queuefile_header& h);
+// Take the header off the start of a queue file, if it has one.
+bool queuefile_read(fdibuf& in, queuefile_header& h);
+bool queuefile_skip(fdibuf& in);
+
+// The message in a queue file, read from just after the envelope: from
+// the file itself, or with the body inflated if it was compressed.
+class queuefile_data
+{
+ public:
+  queuefile_data(fdibuf& in, const queuefile_header& h);
+  ~queuefile_data();
+  fdibuf& in() { return inflater ? *inflater : source; }
+
+ private:
+  fdibuf& source;
+  fdibuf* inflater;
+
+  queuefile_data(const queuefile_data&);
+  queuefile_data& operator=(const queuefile_data&);
+};
+
+#endif // NULLMAILER__QUEUEFILE__H__
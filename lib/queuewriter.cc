@@ -0,0 +1,1057 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2018  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#include "config.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#include "ac/time.h"
+#include "cli++/cli++.h"
+#include "configio.h"
+#include "dedup.h"
+#include "defines.h"
+#include "hostname.h"
+#include "itoa.h"
+#include "journal.h"
+#include "priority.h"
+#include "queuedirs.h"
+#include "queuefile.h"
+#include "queuewriter.h"
+#include "routetable.h"
+#include "stats.h"
+
+// Large messages are written back as they are written, a megabyte at
+// a time, and dropped from the page cache once they are synced.
+#define QUEUE_WRITEBACK_SIZE (1024 * 1024)
+
+// The longest nullmailer-queue waits on nullmailer-queued to commit a
+// message before committing it itself.
+#define QUEUED_TIMEOUT 60
+
+// The output buffer for a queue file, which starts writing the file out
+// while the rest of it is still arriving, so that syncing it at the end
+// does not have to write all of it at once.  When compression is turned
+// on, the body of the message is deflated as it goes by, once the blank
+// line ending its header block has been written.
+class queue_fdobuf FDBUF_FINAL : public fdobuf
+{
+ public:
+  queue_fdobuf(int fdesc)
+    : fdobuf(fdesc), written(0), mark(0), level(0), consumed(0),
+      message(0), linelen(0), last(0), in_body(false), body_start(0),
+      body_length(0)
+  {
+  }
+  ~queue_fdobuf()
+  {
+#ifdef HAVE_LIBZ
+    if(level > 0)
+      deflateEnd(&zs);
+#endif
+  }
+  // Deflate the body of the message that starts at the given offset.
+  bool compress(int lvl, unsigned long start)
+  {
+#ifdef HAVE_LIBZ
+    memset(&zs, 0, sizeof zs);
+    if(deflateInit(&zs, lvl) != Z_OK)
+      return false;
+    level = lvl;
+    message = start;
+    return true;
+#else
+    (void)lvl;
+    (void)start;
+    return false;
+#endif
+  }
+  // Finish the compressed body, after the buffer has been flushed.
+  bool finish()
+  {
+#ifdef HAVE_LIBZ
+    if(level > 0 && in_body)
+      return deflate_out(Z_FINISH);
+#endif
+    return true;
+  }
+  // Whether the body was compressed, and where it starts and how long
+  // it is before compression.
+  bool compressed() const { return in_body; }
+  unsigned long body() const { return body_start; }
+  unsigned long body_size() const { return body_length; }
+ protected:
+  virtual ssize_t _write(const char* data, ssize_t len)
+  {
+    if(level > 0)
+      return pass(data, len) ? len : -1;
+    return consumed_plain(wrote(fdobuf::_write(data, len)));
+  }
+  virtual ssize_t _writev(const struct iovec* iov, int iovcnt)
+  {
+    if(level > 0) {
+      ssize_t total = 0;
+      for(int i = 0; i < iovcnt; i++) {
+	if(!pass((const char*)iov[i].iov_base, iov[i].iov_len))
+	  return -1;
+	total += iov[i].iov_len;
+      }
+      return total;
+    }
+    return consumed_plain(wrote(fdobuf::_writev(iov, iovcnt)));
+  }
+  // The data has to go through the deflater, so it cannot be copied
+  // straight into the file.
+  virtual ssize_t _sendfile(int infd, off_t* inoff, size_t len)
+  {
+    if(level > 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    return consumed_plain(wrote(fdobuf::_sendfile(infd, inoff, len)));
+  }
+  virtual ssize_t _splice(int infd, size_t len)
+  {
+    if(level > 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    return consumed_plain(wrote(fdobuf::_splice(infd, len)));
+  }
+ private:
+  unsigned long written;
+  unsigned long mark;
+  int level;
+  // The bytes taken in so far, the offset of the message and the state
+  // of the search for the end of its header block.
+  unsigned long consumed;
+  unsigned long message;
+  unsigned linelen;
+  char last;
+  bool in_body;
+  unsigned long body_start;
+  unsigned long body_length;
+#ifdef HAVE_LIBZ
+  z_stream zs;
+  char zbuf[16384];
+#endif
+
+  ssize_t wrote(ssize_t r)
+  {
+    if(r > 0) {
+      written += r;
+      if(written - mark >= QUEUE_WRITEBACK_SIZE) {
+	fdbuf_start_writeback(fd, mark, written - mark);
+	mark = written;
+      }
+    }
+    return r;
+  }
+  ssize_t consumed_plain(ssize_t r)
+  {
+    if(r > 0)
+      consumed += r;
+    return r;
+  }
+  bool write_all(const char* data, size_t len)
+  {
+    while(len > 0) {
+      ssize_t r = wrote(fdobuf::_write(data, len));
+      if(r <= 0)
+	return false;
+      data += r;
+      len -= r;
+    }
+    return true;
+  }
+  // Write through what comes before the body as it is, finding the end
+  // of the header block the same way write_layout does, and deflate
+  // the rest.
+  bool pass(const char* data, size_t len)
+  {
+    size_t plain = 0;
+    for(; !in_body && plain < len; plain++, consumed++) {
+      if(consumed < message)
+	continue;
+      const char c = data[plain];
+      if(c != '\n') {
+	++linelen;
+	last = c;
+	continue;
+      }
+      if(linelen == 0 || (linelen == 1 && last == '\r')) {
+	in_body = true;
+	body_start = consumed + 1;
+      }
+      linelen = 0;
+    }
+    if(plain > 0 && !write_all(data, plain))
+      return false;
+#ifdef HAVE_LIBZ
+    if(plain < len) {
+      zs.next_in = (Bytef*)(data + plain);
+      zs.avail_in = len - plain;
+      body_length += len - plain;
+      return deflate_out(Z_NO_FLUSH);
+    }
+#endif
+    return true;
+  }
+#ifdef HAVE_LIBZ
+  bool deflate_out(int flush)
+  {
+    for(;;) {
+      zs.next_out = (Bytef*)zbuf;
+      zs.avail_out = sizeof zbuf;
+      const int r = deflate(&zs, flush);
+      if(r == Z_STREAM_ERROR)
+	return false;
+      const size_t len = sizeof zbuf - zs.avail_out;
+      if(len > 0 && !write_all(zbuf, len))
+	return false;
+      if(flush == Z_FINISH ? r == Z_STREAM_END
+	 : zs.avail_in == 0 && zs.avail_out > 0)
+	return true;
+    }
+  }
+#endif
+};
+
+// The process writing messages, read again for each one so that the
+// processes forked from it, such as the workers of nullmailer-smtpd
+// --listen, name theirs apart.
+static pid_t pid = 0;
+static const uid_t uid = getuid();
+static unsigned sequence = 0;
+
+static bool loaded = false;
+static mystring adminaddr;
+static mystring allmailfrom;
+static mystring trigger_path;
+static mystring notify_path;
+static mystring commit_path;
+static mystring msg_dir;
+static mystring tmp_dir;
+static mystring hold_dir;
+static mystring fast_dir;
+static int queueformat;
+static int queuecompress;
+static int dedupwindow;
+static mystring usage_path;
+static int maxqueuefiles;
+static int maxqueuesize;
+static int minfreespace;
+static route_table durability_rules;
+static int uid_durability;
+static int durabilityinterval;
+static mystring batchsync_path;
+
+const char* const durability_names[DURABILITY_CLASSES] = {
+  "strict", "batched", "relaxed"
+};
+
+int durability_parse(const mystring& name)
+{
+  for(int i = 0; i < DURABILITY_CLASSES; i++)
+    if(name == durability_names[i])
+      return i;
+  return -1;
+}
+
+// Each rule is a sender pattern, or uid=N for the messages submitted
+// by that user, and the class they get.  Only the rules for the user
+// running this program matter to it.
+static void load_durability()
+{
+  uid_durability = -1;
+  list<mystring> rules;
+  config_readlist("durability", rules);
+  for(list<mystring>::const_iter r(rules); r; r++) {
+    if((*r)[0] == '#')
+      continue;
+    const int space = (*r).find_first(' ');
+    if(space <= 0)
+      continue;
+    const mystring pattern = (*r).left(space);
+    const mystring name = (*r).right(space + 1).strip();
+    const int cls = durability_parse(name);
+    if(cls < 0)
+      continue;
+    if(mystringview(pattern).starts_with("uid=")) {
+      if(uid_durability < 0 && (uid_t)atoi(pattern.c_str() + 4) == uid
+	 && isdigit(pattern[4]))
+	uid_durability = cls;
+    }
+    else
+      durability_rules.add(pattern, name);
+  }
+  if(!config_readint("durabilityinterval", durabilityinterval)
+     || durabilityinterval < 0)
+    durabilityinterval = 5;
+  batchsync_path = CONFIG_PATH(QUEUE, NULL, "batchsync");
+}
+
+static void load()
+{
+  if (loaded)
+    return;
+  loaded = true;
+  trigger_path = CONFIG_PATH(QUEUE, NULL, "trigger");
+  msg_dir = CONFIG_PATH(QUEUE, "queue", "");
+  tmp_dir = CONFIG_PATH(QUEUE, "tmp", "");
+  notify_path = CONFIG_PATH(QUEUE, "queue", ".notify");
+  commit_path = CONFIG_PATH(QUEUE, "queue", ".commit");
+  hold_dir = CONFIG_PATH(QUEUE, "holding", "");
+  fast_dir = CONFIG_PATH(QUEUE, "fastlane", "");
+  if(config_read("adminaddr", adminaddr) && !!adminaddr) {
+    adminaddr = adminaddr.subst(',', '\n');
+    read_hostnames();
+  }
+  config_read("allmailfrom", allmailfrom);
+  if(!config_readint("queueformat", queueformat))
+    queueformat = 1;
+  if(!config_readint("queuecompress", queuecompress) || queuecompress < 0)
+    queuecompress = 0;
+  else if(queuecompress > 9)
+    queuecompress = 9;
+  if(!config_readint("dedupwindow", dedupwindow) || dedupwindow < 0)
+    dedupwindow = 0;
+  usage_path = CONFIG_PATH(QUEUE, NULL, "usage");
+  if(!config_readint("maxqueuefiles", maxqueuefiles))
+    maxqueuefiles = 0;
+  if(!config_readint("maxqueuesize", maxqueuesize))
+    maxqueuesize = 0;
+  if(!config_readint("minfreespace", minfreespace))
+    minfreespace = 0;
+  load_durability();
+}
+
+mystring queue_msg_dir()
+{
+  load();
+  return msg_dir;
+}
+
+mystring queue_hold_dir()
+{
+  load();
+  return hold_dir;
+}
+
+mystring queue_fastlane_dir()
+{
+  load();
+  return fast_dir;
+}
+
+// The copy is made in the temporary directory, under the name of the
+// message, and linked into place once it is synced, so that the queue
+// never holds part of a message.
+bool queue_spill(const mystring& name)
+{
+  load();
+  const mystring from = fast_dir + name;
+  const mystring tmp = tmp_dir + name;
+  fdibuf in(from.c_str());
+  if(!in)
+    return false;
+  fdobuf out(tmp.c_str(), O_CREAT|O_WRONLY|O_TRUNC, 0600);
+  if(!out || !fdbuf_copy(in, out) || !out.sync() || !out.close()) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  const int dirs = queuedirs_read();
+  const mystring newdir = msg_dir + queuedir_of(name, dirs);
+  const mystring newfile = msg_dir + queuedir_path(name, dirs);
+  if(dirs > 0 && !queue_is_dir(newdir.c_str()))
+    mkdir(newdir.c_str(), 0700);
+  const bool linked = link(tmp.c_str(), newfile.c_str()) == 0
+    || errno == EEXIST;
+  unlink(tmp.c_str());
+  if(!linked || queue_fsyncdir(newdir.c_str()))
+    return false;
+  unlink(from.c_str());
+  return true;
+}
+
+bool queue_is_dir(const char* path)
+{
+  struct stat buf;
+  return !stat(path, &buf) && S_ISDIR(buf.st_mode);
+}
+
+bool queue_is_exist(const char* path)
+{
+  struct stat buf;
+  return !stat(path, &buf);
+}
+
+int queue_fsyncdir(const char* path)
+{
+  autoclose fd = open(path, O_RDONLY);
+  if(fd == -1)
+    return 0;
+  int result = fsync(fd);
+  if(result == -1 && errno != EIO)
+    result = 0;
+  return result;
+}
+
+// The number of messages in the queue and their total size, as last
+// written by nullmailer-send, which keeps count of them anyway.  This
+// saves scanning the queue for every message that arrives.
+static bool read_usage(unsigned long& files, unsigned long& bytes)
+{
+  autoclose fd = open(usage_path.c_str(), O_RDONLY);
+  if(fd == -1)
+    return false;
+  char buf[64];
+  const ssize_t len = read(fd, buf, sizeof buf - 1);
+  if(len <= 0)
+    return false;
+  buf[len] = 0;
+  char* end;
+  files = strtoul(buf, &end, 10);
+  if(end == buf || *end != ' ')
+    return false;
+  const char* start = end + 1;
+  bytes = strtoul(start, &end, 10);
+  return end != start;
+}
+
+bool queue_admit(unsigned long size, mystring& reason)
+{
+  load();
+  if(minfreespace > 0) {
+    struct statvfs vfs;
+    if(statvfs(msg_dir.c_str(), &vfs) == 0
+       && (unsigned long long)vfs.f_bavail * vfs.f_frsize / 1024
+       < (unsigned long long)minfreespace + size / 1024) {
+      reason = "There is not enough free space for the queue.";
+      return false;
+    }
+  }
+  if(maxqueuefiles <= 0 && maxqueuesize <= 0)
+    return true;
+  unsigned long files;
+  unsigned long bytes;
+  if(!read_usage(files, bytes))
+    return true;
+  if(maxqueuefiles > 0 && files >= (unsigned long)maxqueuefiles) {
+    reason = "The queue holds too many messages.";
+    return false;
+  }
+  const unsigned long long maxbytes = (unsigned long long)maxqueuesize * 1024;
+  if(maxqueuesize > 0
+     && (bytes >= maxbytes || (unsigned long long)bytes + size > maxbytes)) {
+    reason = "The queue is too large.";
+    return false;
+  }
+  return true;
+}
+
+// The queue is owned by the user nullmailer-queue runs as, and the
+// messages are only readable by that user, so a program may only write
+// them itself if it runs as that same user.  The messages are left to
+// nullmailer-queue while the fast lane is set up, as it sees to their
+// delivery.
+bool queue_writer::usable()
+{
+  if(getenv("NULLMAILER_QUEUE") != NULL)
+    return false;
+  load();
+  struct stat st;
+  return !queue_is_dir(fast_dir.c_str())
+    && stat(msg_dir.c_str(), &st) == 0 && st.st_uid == geteuid()
+    && access(tmp_dir.c_str(), W_OK) == 0;
+}
+
+queue_writer::queue_writer(fdobuf& errors)
+  : errout(errors), file(0), hold(false), fast(false), is_full(false),
+    is_duplicate(false), unnamed(false), versioned(false),
+    recipients(0), in_headers(true), timesecs(0), dirs(0)
+{
+  index.size = 0;
+  index.offset = 0;
+  index.priority = PRIORITY_NORMAL;
+  sender_durability = header_durability = -1;
+  index.injected = 0;
+  index.queued = 0;
+}
+
+queue_writer::~queue_writer()
+{
+  abandon();
+}
+
+queue_fdobuf* queue_writer::qfile()
+{
+  return static_cast<queue_fdobuf*>(file);
+}
+
+bool queue_writer::fail(const char* msg)
+{
+  errout << cli_program << ": " << msg << endl;
+  return false;
+}
+
+// Remove what was written of a message that was not committed.
+void queue_writer::abandon()
+{
+  delete file;
+  file = 0;
+  if(fd >= 0) {
+    fd.close();
+    if(!unnamed)
+      unlink(tmpfile.c_str());
+  }
+}
+
+// Send the name of the new message to nullmailer-send, falling back to
+// pulling the trigger if it is not listening for it.  The send never
+// waits: a nullmailer-send that is stopped or busy lets the queue on
+// its socket fill up, and then the trigger is pulled instead.
+static bool notify(const mystring& name)
+{
+  struct sockaddr_un sa;
+  memset(&sa, 0, sizeof sa);
+  sa.sun_family = AF_UNIX;
+  if (notify_path.length() >= sizeof sa.sun_path)
+    return false;
+  strcpy(sa.sun_path, notify_path.c_str());
+  autoclose fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if (fd == -1)
+    return false;
+  return sendto(fd, name.c_str(), name.length(), MSG_DONTWAIT,
+		(struct sockaddr*)&sa, sizeof sa) == (ssize_t)name.length();
+}
+
+void queue_writer::trigger()
+{
+  if (notify(msgname))
+    return;
+  autoclose fd = ::open(trigger_path.c_str(), O_WRONLY|O_NONBLOCK, 0666);
+  if(fd == -1)
+    return;
+  char x = 0;
+  ssize_t ignored = ::write(fd, &x, 1);
+  (void)ignored;
+}
+
+// Tell nullmailer-send that a message is on its way, so that it can
+// warm up the sessions it will be sent over.  This is only a hint, and
+// is dropped if it is not reading its socket.
+void queue_writer::announce()
+{
+  notify(mystring());
+}
+
+// Notes:
+// - temporary file name is unique to the currently running process,
+//   which writes one message at a time
+// - destination file name is unique to the system
+// - if the temporary file previously existed, it did so because
+//   the previous process with this pid crashed, and it can be
+//   safely overwritten
+bool queue_writer::open(bool h, bool f)
+{
+  load();
+  if(!queue_is_dir(msg_dir.c_str()) || !queue_is_dir(tmp_dir.c_str()))
+    return fail("Installation error: queue directory is invalid.");
+  // A message to be delivered at once is let through, as it only
+  // stays in the queue if it cannot be delivered.  One in the fast
+  // lane is not, as it is not waited for.
+  mystring reason;
+  if((!h || f) && !queue_admit(0, reason)) {
+    is_full = true;
+    return fail(reason.c_str());
+  }
+
+  hold = h || f;
+  fast = f;
+  timesecs = time(0);
+  const pid_t self = getpid();
+  if(self != pid) {
+    pid = self;
+    sequence = 0;
+  }
+  // The trace ID passed on by the program the message was injected
+  // through belongs to the first message only; otherwise the message
+  // is taken to start here.
+  const char* trace = sequence == 0 ? getenv(TRACE_ENV) : 0;
+  index.trace = trace ? trace : "";
+  if(!trace || !trace_time(index.trace, index.injected)) {
+    index.injected = trace_clock();
+    index.trace = trace_new(index.injected);
+  }
+  index.queued = 0;
+  const mystring pidstr = itoa(pid);
+  // The temporary file of a message in the fast lane is kept beside it,
+  // as the fast lane is on another file system.
+  tmpfile = fast ? fast_dir + "." + pidstr : tmp_dir + pidstr;
+  dirs = hold ? 0 : queuedirs_read();
+  if(!name_message())
+    return false;
+
+  // Where it is supported, the message is formed in an unnamed file in
+  // the directory it goes into, which saves creating and removing the
+  // temporary file and leaves nothing behind after a crash.
+  // The versioned format is read back to fill in its header line.
+  versioned = queueformat == 2;
+  const int mode = versioned ? O_RDWR : O_WRONLY;
+#ifdef O_TMPFILE
+  if(access("/proc/self/fd", F_OK) == 0)
+    fd = ::open(newdir.c_str(), O_TMPFILE|mode, 0600);
+#endif
+  unnamed = fd >= 0;
+  if(!unnamed)
+    fd = ::open(tmpfile.c_str(), O_CREAT|O_TRUNC|mode, 0600);
+  if(fd < 0)
+    return fail("Could not open temporary file for writing");
+  if(hold && (flock(fd, LOCK_EX) == -1 || (held = dup(fd)) == -1))
+    return fail("Could not lock the held message.");
+  file = new queue_fdobuf(fd);
+  index.offset = 0;
+  index.priority = PRIORITY_NORMAL;
+  sender_durability = header_durability = -1;
+  if(versioned) {
+    if(!(*file << queuefile_format(queuefile_header())))
+      return fail("Could not write the queue file header.");
+    index.offset = QUEUEFILE_HEADER_LENGTH;
+  }
+  if(!hold)
+    announce();
+  stats_phase("envelope");
+  return true;
+}
+
+// Name the message from its time, the process and the number of
+// messages the process wrote before it, and find the file and the
+// directory it goes into.
+bool queue_writer::name_message()
+{
+  msgname = itoa(timesecs);
+  msgname += ".";
+  msgname += itoa(pid);
+  // A process writing more than one message names the later ones
+  // apart; only the part before the first period is the time.
+  if(sequence > 0) {
+    msgname += ".";
+    msgname += itoa(sequence);
+  }
+  ++sequence;
+  const mystring& held_dir = fast ? fast_dir : hold_dir;
+  newdir = hold ? held_dir : mystring(msg_dir + queuedir_of(msgname, dirs));
+  newfile = hold ? mystring(held_dir + msgname)
+    : mystring(msg_dir + queuedir_path(msgname, dirs));
+  if(dirs > 0 && !queue_is_dir(newdir.c_str())) {
+    if(mkdir(newdir.c_str(), 0700) && errno != EEXIST)
+      return fail("Could not create the queue subdirectory.");
+    if(queue_fsyncdir(msg_dir.c_str()))
+      return fail("Error syncing the queue directory.");
+  }
+  return true;
+}
+
+static bool validate_addr(mystring& addr, bool recipient)
+{
+  int i = addr.find_last('@');
+  if(i <= 0)
+    return false;
+  mystring hostname = addr.right(i+1);
+  if (recipient && !!adminaddr && (hostname == me || hostname == "localhost"))
+    addr = adminaddr;
+  else if (!recipient && !!allmailfrom)
+    addr = allmailfrom;
+  else if(hostname.find_first('.') < 0)
+    return false;
+  return true;
+}
+
+// The envelope is buffered; the file is synced when it is committed.
+static bool putline(fdobuf& out, const mystring& str)
+{
+  struct iovec iov[2];
+  iov[0].iov_base = (void*)str.c_str();
+  iov[0].iov_len = str.length();
+  iov[1].iov_base = (void*)"\n";
+  iov[1].iov_len = 1;
+  return out.writev(iov, 2);
+}
+
+bool queue_writer::sender(mystring& addr)
+{
+  if(!!addr && !validate_addr(addr, false))
+    return fail("Envelope sender address is invalid.");
+  if(!putline(*file, addr))
+    return fail("Could not write envelope sender.");
+  index.sender = addr;
+  index.offset += addr.length() + 1;
+  mystring cls;
+  if(!!addr && durability_rules.find(addr, cls))
+    sender_durability = durability_parse(cls);
+  return true;
+}
+
+bool queue_writer::recipient(mystring& addr)
+{
+  if(!validate_addr(addr, true))
+    return fail("Envelope recipient address is invalid.");
+  if(!putline(*file, addr))
+    return fail("Could not write envelope recipient.");
+  index.recipients.append(addr);
+  index.offset += addr.length() + 1;
+  ++recipients;
+  return true;
+}
+
+bool queue_writer::end_envelope()
+{
+  if(recipients == 0)
+    return fail("No envelope recipients read.");
+  if(!(*file << "\n"))
+    return fail("Could not write extra blank line to destination.");
+  ++index.offset;
+  // Only the versioned format can mark the body as compressed.
+  if(versioned && queuecompress > 0 && !qfile()->compress(queuecompress,
+							  index.offset))
+    return fail("Could not start compressing the message.");
+
+  stats_phase("headers");
+  mystring line("Received: (nullmailer pid ");
+  line += itoa(pid);
+  line += " invoked by uid ";
+  line += itoa(uid);
+  line += ")\n\tid ";
+  line += index.trace;
+  line += ";\n\t";
+  char buf[100];
+  if(!strftime(buf, 100, "%a, %d %b %Y %H:%M:%S -0000\n", gmtime(&timesecs)))
+    return fail("Error generating a date string.");
+  line += buf;
+  if(!(*file << line))
+    return fail("Could not write received line to message.");
+  return true;
+}
+
+// The last header line setting the priority wins.
+void queue_writer::header(const mystring& line)
+{
+  mystringview view(line);
+  if(view.starts_with_nocase("message-id:"))
+    index.message_id = line.rstrip();
+  else if(view.starts_with_nocase("x-nullmailer-durability:")) {
+    const int cls = durability_parse(view.right(24).strip().str().lower());
+    if(cls >= 0)
+      header_durability = cls;
+  }
+  else {
+    int priority = priority_header(line);
+    if(priority >= 0)
+      index.priority = priority;
+  }
+}
+
+bool queue_writer::write(const char* data, unsigned length)
+{
+  const char* p = data;
+  const char* const end = data + length;
+  while(in_headers && p < end) {
+    const char* nl = (const char*)memchr(p, '\n', end - p);
+    partial.append(p, (nl ? nl : end) - p);
+    if(!nl)
+      break;
+    if(!partial || partial == "\r")
+      in_headers = false;
+    else
+      header(partial);
+    partial = "";
+    p = nl + 1;
+  }
+  if(!file->write(data, length))
+    return fail("Could not write the message to the queue file.");
+  return true;
+}
+
+#ifdef O_TMPFILE
+// Link an unnamed file into place through its entry in /proc, which
+// unlike AT_EMPTY_PATH needs no special privileges.
+static int link_fd(int fd, const mystring& newfile)
+{
+  const mystring path = "/proc/self/fd/" + mystring(itoa(fd));
+  return linkat(AT_FDCWD, path.c_str(), AT_FDCWD, newfile.c_str(),
+		AT_SYMLINK_FOLLOW);
+}
+#endif
+
+// Ask nullmailer-queued to commit the message, so that it can be
+// synced along with others queued at the same time.  An unnamed file
+// is passed over the socket instead of the temporary file name.
+// Returns false if the service is not running or could not commit it.
+static bool commit_batched(int file, const mystring& tmpname,
+			   const mystring& path)
+{
+  struct sockaddr_un sa;
+  memset(&sa, 0, sizeof sa);
+  sa.sun_family = AF_UNIX;
+  if (commit_path.length() >= sizeof sa.sun_path)
+    return false;
+  strcpy(sa.sun_path, commit_path.c_str());
+  autoclose fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+    return false;
+  // The timeouts also cover connecting while its backlog is full.
+  struct timeval tv = { QUEUED_TIMEOUT, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+  if (connect(fd, (struct sockaddr*)&sa, sizeof sa) == -1)
+    return false;
+  const mystring request = (file >= 0 ? mystring("") : tmpname)
+    + "\n" + path + "\n";
+  struct iovec iov;
+  iov.iov_base = (void*)request.c_str();
+  iov.iov_len = request.length();
+  struct msghdr msg;
+  memset(&msg, 0, sizeof msg);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  char control[CMSG_SPACE(sizeof file)];
+  if (file >= 0) {
+    memset(control, 0, sizeof control);
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof file);
+    memcpy(CMSG_DATA(cmsg), &file, sizeof file);
+  }
+  if (sendmsg(fd, &msg, 0) != (ssize_t)request.length())
+    return false;
+  char reply;
+  return read(fd, &reply, 1) == 1 && reply == 'K';
+}
+
+int queue_writer::durability() const
+{
+  if(hold)
+    return DURABILITY_STRICT;
+  if(sender_durability >= 0)
+    return sender_durability;
+  if(uid_durability >= 0)
+    return uid_durability;
+  if(header_durability >= 0)
+    return header_durability;
+  return DURABILITY_STRICT;
+}
+
+// Sync the filesystem of the queue, and with it the batched messages
+// queued since the last time, if that was long enough ago.  The time
+// of the last sync by any process is that of the stamp file.
+static void batch_sync()
+{
+  struct stat st;
+  if(stat(batchsync_path.c_str(), &st) == 0
+     && time(0) - st.st_mtime < durabilityinterval)
+    return;
+  autoclose fd = open(batchsync_path.c_str(), O_WRONLY|O_CREAT, 0600);
+  if(fd == -1)
+    return;
+  futimens(fd, 0);
+#ifdef HAVE_SYNCFS
+  syncfs(fd);
+#else
+  sync();
+#endif
+}
+
+// Check if the file at a path is the one open on a descriptor.
+static bool same_file(int fd, const mystring& path)
+{
+  struct stat fst, pst;
+  return fstat(fd, &fst) == 0 && stat(path.c_str(), &pst) == 0
+    && fst.st_dev == pst.st_dev && fst.st_ino == pst.st_ino;
+}
+
+// Link the message into the queue, syncing it first and its directory
+// after if asked to.  If nullmailer-queued got as far as linking the
+// message or removing the temporary file before failing, what it did
+// is left in place.  Any other file already under the name is another
+// message, which is never taken for this one.
+bool queue_writer::commit_file(bool sync)
+{
+#ifdef O_TMPFILE
+  if(unnamed) {
+    if(sync && fsync(fd) == -1)
+      return fail("Error syncing the new file.");
+    if(link_fd(fd, newfile) && !(errno == EEXIST && same_file(fd, newfile))) {
+      unlink(envindex_path(msgname).c_str());
+      return fail("Error linking the new file into the queue.");
+    }
+    if(sync && queue_fsyncdir(newdir.c_str()))
+      return fail("Error syncing the new directory.");
+    return true;
+  }
+#endif
+  autoclose rfd = ::open(tmpfile.c_str(), O_RDONLY);
+  if(rfd == -1) {
+    if(errno == ENOENT && queue_is_exist(newfile.c_str()))
+      return true;
+    return fail("Could not reopen the temp file.");
+  }
+  if(sync && fsync(rfd) == -1)
+    return fail("Error syncing the temp file.");
+  if(link(tmpfile.c_str(), newfile.c_str())
+     && !(errno == EEXIST && same_file(rfd, newfile))) {
+    unlink(envindex_path(msgname).c_str());
+    return fail("Error linking the temp file to the new file.");
+  }
+  if(sync && queue_fsyncdir(newdir.c_str()))
+    return fail("Error syncing the new directory.");
+  if(unlink(tmpfile.c_str()))
+    return fail("Error unlinking the temp file.");
+  return true;
+}
+
+// Fill in the header line of a file in the versioned format, finding
+// the end of the message's header block by reading it back.
+bool queue_writer::write_layout(unsigned long size)
+{
+  queuefile_header h;
+  h.offset = index.offset;
+  h.recipients = recipients;
+  if(qfile()->compressed()) {
+    h.header_length = qfile()->body() - h.offset;
+    h.body_size = qfile()->body_size();
+    h.compressed = true;
+    const mystring line = queuefile_format(h);
+    return pwrite(fd, line.c_str(), line.length(), 0)
+      == (ssize_t)line.length();
+  }
+  unsigned long end = size;
+  unsigned long pos = h.offset;
+  unsigned linelen = 0;
+  char last = 0;
+  char buf[4096];
+  while(end == size && pos < size) {
+    ssize_t rd = pread(fd, buf, sizeof buf, pos);
+    if(rd <= 0)
+      return false;
+    for(ssize_t i = 0; i < rd; i++) {
+      const char c = buf[i];
+      if(c != '\n') {
+	++linelen;
+	last = c;
+	continue;
+      }
+      if(linelen == 0 || (linelen == 1 && last == '\r')) {
+	end = pos + i + 1;
+	break;
+      }
+      linelen = 0;
+    }
+    pos += rd;
+  }
+  h.header_length = end - h.offset;
+  h.body_size = size - end;
+  const mystring line = queuefile_format(h);
+  return pwrite(fd, line.c_str(), line.length(), 0)
+    == (ssize_t)line.length();
+}
+
+bool queue_writer::commit()
+{
+  // The file is synced when it is committed.
+  if(!file->flush() || !qfile()->finish())
+    return fail("Error flushing the output file.");
+  // A message that was already queued within the dedup window is
+  // taken as queued, and dropped.
+  const uint64_t digest = hold || dedupwindow == 0 ? 0 : dedup_digest(index);
+  if(digest != 0 && dedup_seen(digest, timesecs, dedupwindow)) {
+    abandon();
+    is_duplicate = true;
+    return true;
+  }
+  struct stat st;
+  if(fstat(fd, &st) == 0)
+    index.size = st.st_size;
+  if(versioned && (index.size == 0 || !write_layout(index.size)))
+    return fail("Could not write the queue file header.");
+  index.queued = trace_clock();
+  // A process that had the same pid earlier in the same second may
+  // have left a message under this name.
+  while(queue_is_exist(newfile.c_str()))
+    if(!name_message())
+      return false;
+  // The index is only an aid to delivery, so a failure to write it is
+  // not an error, but it must be in place before the message is.  It
+  // is left out for the fast lane, which is meant to stay off the disk.
+  if(index.size > 0 && !fast) {
+    const mystring tmpindex = tmpfile + ".index";
+    if(!envindex_write(tmpindex, index)
+       || rename(tmpindex.c_str(), envindex_path(msgname).c_str()))
+      unlink(tmpindex.c_str());
+  }
+  stats_phase("commit");
+  const mystring path = queuedir_path(msgname, dirs);
+  // Only strict messages wait on nullmailer-queued and the syncs, so
+  // that the others do not hold up the flushes of those that need them.
+  const int cls = durability();
+  if(cls != DURABILITY_STRICT) {
+    if(!commit_file(false))
+      return false;
+    if(cls == DURABILITY_BATCHED)
+      batch_sync();
+  }
+  else if((hold || !commit_batched(unnamed ? (int)fd : -1, itoa(pid), path))
+	  && !commit_file(true))
+    return false;
+  // A large message is read only once more, when it is sent, which is
+  // not worth crowding the rest of the page cache for.
+  if(!hold && index.size >= QUEUE_WRITEBACK_SIZE)
+    fdbuf_drop_cache(fd);
+  delete file;
+  file = 0;
+  fd.close();
+  if(digest != 0)
+    dedup_record(digest, timesecs);
+  // Like the index, the journal record is only an aid; nullmailer-send
+  // finds messages missing from the journal when it rescans the queue.
+  if(!hold && index.size > 0)
+    journal_append(journal_queued(path, timesecs, index.size,
+				  index.sender, index.recipients));
+  if(!hold) {
+    stats_phase("trigger");
+    trigger();
+  }
+  return true;
+}
@@ -0,0 +1,152 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2018  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#ifndef NULLMAILER__QUEUEWRITER__H__
+#define NULLMAILER__QUEUEWRITER__H__
+
+#include <time.h>
+#include "autoclose.h"
+#include "envindex.h"
+#include "fdbuf/fdbuf.h"
+#include "mystring/mystring.h"
+
+class queue_fdobuf;
+
+// How hard a message is made to survive a crash once it is queued:
+// synced before it is accepted, synced along with the others of its
+// class every few seconds, or left to the kernel to write back.
+#define DURABILITY_STRICT 0
+#define DURABILITY_BATCHED 1
+#define DURABILITY_RELAXED 2
+#define DURABILITY_CLASSES 3
+
+extern const char* const durability_names[DURABILITY_CLASSES];
+
+// The class with the given name, or -1 if there is none.
+int durability_parse(const mystring& name);
+
+// Writes one message into the queue: the envelope, a Received line,
+// and then whatever the caller writes to out(), before syncing it and
+// linking it into place.  nullmailer-queue uses this on behalf of
+// other users; a program that owns the queue itself can use it
+// directly and save starting nullmailer-queue for every message.
+// Errors are reported to the stream given to the constructor.
+class queue_writer
+{
+ public:
+  queue_writer(fdobuf& errors);
+  ~queue_writer();
+
+  // True if this process owns the queue and so may write into it,
+  // $NULLMAILER_QUEUE does not name another program to use, and there
+  // is no fast lane.
+  static bool usable();
+
+  // Start a new message.  A held message goes into the holding area
+  // instead of the queue, or into the fast lane if fast is set, and
+  // stays locked while this object lives.  Fails, setting full(), if
+  // the queue is over the limits set for it.
+  bool open(bool hold = false, bool fast = false);
+  // The sender, and then each recipient, is checked and rewritten
+  // according to the allmailfrom and adminaddr control files.
+  bool sender(mystring& addr);
+  bool recipient(mystring& addr);
+  bool end_envelope();
+  fdobuf& out() { return *file; }
+  // Note a header line written through out() that the index records:
+  // the Message-Id, and the lines that set the priority class, and
+  // the X-Nullmailer-Durability line.
+  void header(const mystring& line);
+  // Write part of the message, noting the header lines as the header
+  // block goes by.
+  bool write(const char* data, unsigned length);
+  // Finish the message and have nullmailer-send pick it up, unless it
+  // is held.  A copy of a message queued within the window set by the
+  // dedupwindow control file is dropped instead, setting duplicate().
+  bool commit();
+  void trigger();
+  void announce();
+
+  const mystring& name() const { return msgname; }
+  const envelope_index& envelope() const { return index; }
+  time_t queued() const { return timesecs; }
+  bool full() const { return is_full; }
+  bool duplicate() const { return is_duplicate; }
+  // The durability class of the message: that of the first rule in
+  // the durability control file matching its sender or the submitting
+  // user, or else the one named by its header, or else strict.
+  int durability() const;
+
+ private:
+  fdobuf& errout;
+  fdobuf* file;
+  autoclose fd;
+  autoclose held;
+  bool hold;
+  bool fast;
+  bool is_full;
+  bool is_duplicate;
+  bool unnamed;
+  bool versioned;
+  unsigned recipients;
+  bool in_headers;
+  mystring partial;
+  time_t timesecs;
+  mystring msgname;
+  mystring tmpfile;
+  mystring newdir;
+  mystring newfile;
+  int dirs;
+  envelope_index index;
+  int sender_durability;
+  int header_durability;
+
+  queue_fdobuf* qfile();
+  bool fail(const char* msg);
+  void abandon();
+  bool name_message();
+  bool commit_file(bool sync);
+  bool write_layout(unsigned long size);
+
+  // Not copyable.
+  queue_writer(const queue_writer&);
+  queue_writer& operator=(const queue_writer&);
+};
+
+bool queue_is_dir(const char* path);
+bool queue_is_exist(const char* path);
+int queue_fsyncdir(const char* path);
+mystring queue_msg_dir();
+mystring queue_hold_dir();
+mystring queue_fastlane_dir();
+// Copy a message from the fast lane into the queue, syncing it there,
+// and remove it from the fast lane.
+bool queue_spill(const mystring& name);
+// Whether a message of the given size may be added to the queue under
+// the maxqueuefiles, maxqueuesize and minfreespace control files,
+// setting the reason if not.
+bool queue_admit(unsigned long size, mystring& reason);
+
+// The exit code of nullmailer-queue and nullmailer-inject when the
+// queue refuses a message for now.
+#define QUEUE_FULL_EXIT 75
+
+#endif // NULLMAILER__QUEUEWRITER__H__
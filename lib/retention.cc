@@ -0,0 +1,257 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#include "config.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#include "ac/dirent.h"
+#include "autoclose.h"
+#include "itoa.h"
+#include "list.h"
+#include "mystring/mystring.h"
+#include "retention.h"
+
+struct failed_file
+{
+  mystring name;
+  time_t mtime;
+  unsigned long long size;
+};
+
+static int by_age(const void* a, const void* b)
+{
+  const failed_file* fa = *(const failed_file* const*)a;
+  const failed_file* fb = *(const failed_file* const*)b;
+  if (fa->mtime != fb->mtime)
+    return fa->mtime < fb->mtime ? -1 : 1;
+  return strcmp(fa->name.c_str(), fb->name.c_str());
+}
+
+// The day a message failed on, as the name of its archive.
+static mystring archive_name(time_t when)
+{
+  char buf[32];
+  struct tm tm;
+  gmtime_r(&when, &tm);
+  strftime(buf, sizeof buf, RETENTION_ARCHIVE_PREFIX "%Y-%m-%d", &tm);
+  mystring name = buf;
+#ifdef HAVE_LIBZ
+  name += ".gz";
+#endif
+  return name;
+}
+
+// An archive of failed messages, appended to as a netstring of the name
+// of each message followed by a netstring of its contents.  With zlib
+// each batch added is another gzip member of the file.  A batch that
+// cannot be written in full is cut off again, so that the archive only
+// ever holds whole messages.
+class failed_archive
+{
+  int fd;
+  off_t start;
+  bool ok;
+#ifdef HAVE_LIBZ
+  gzFile gz;
+#endif
+  void put(const char* data, unsigned len);
+public:
+  failed_archive() : fd(-1), start(0), ok(false) { }
+  ~failed_archive() { close(); }
+  bool open(int dirfd, const mystring& name);
+  bool add(int dirfd, const failed_file& f);
+  bool close();
+};
+
+bool failed_archive::open(int dirfd, const mystring& name)
+{
+  fd = openat(dirfd, name.c_str(), O_WRONLY|O_CREAT|O_APPEND, 0600);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  start = fstat(fd, &st) == 0 ? st.st_size : -1;
+  ok = start >= 0;
+#ifdef HAVE_LIBZ
+  int gzfd = dup(fd);
+  if ((gz = gzdopen(gzfd, "ab")) == 0) {
+    if (gzfd >= 0)
+      ::close(gzfd);
+    ok = false;
+  }
+#endif
+  return ok;
+}
+
+void failed_archive::put(const char* data, unsigned len)
+{
+  if (!ok)
+    return;
+#ifdef HAVE_LIBZ
+  ok = gzwrite(gz, data, len) == (int)len;
+#else
+  while (ok && len > 0) {
+    ssize_t wr = write(fd, data, len);
+    ok = wr > 0;
+    data += wr;
+    len -= wr;
+  }
+#endif
+}
+
+bool failed_archive::add(int dirfd, const failed_file& f)
+{
+  autoclose in = openat(dirfd, f.name.c_str(), O_RDONLY);
+  if (in < 0)
+    return ok = false;
+  mystring head = itoa(f.name.length());
+  head += ':';
+  head += f.name;
+  head += ',';
+  head += itoa((long)f.size);
+  head += ':';
+  put(head.c_str(), head.length());
+  char buf[64*1024];
+  for (unsigned long long left = f.size; ok && left > 0; ) {
+    ssize_t rd = read(in, buf, left < sizeof buf ? left : sizeof buf);
+    if (rd <= 0)
+      return ok = false;
+    put(buf, rd);
+    left -= rd;
+  }
+  put(",", 1);
+  return ok;
+}
+
+// Finish the batch, returning true only if all of it is on the disk.
+bool failed_archive::close()
+{
+  if (fd < 0)
+    return false;
+#ifdef HAVE_LIBZ
+  if (gz != 0 && gzclose(gz) != Z_OK)
+    ok = false;
+  gz = 0;
+#endif
+  if (ok && fsync(fd) != 0)
+    ok = false;
+  if (!ok && start >= 0 && ftruncate(fd, start) == 0)
+    fsync(fd);
+  ::close(fd);
+  fd = -1;
+  return ok;
+}
+
+static void read_failed(DIR* dir, list<failed_file>& files,
+			unsigned long long& total)
+{
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != 0) {
+    const char* name = entry->d_name;
+    if (name[0] == '.'
+	|| strncmp(name, RETENTION_ARCHIVE_PREFIX,
+		   sizeof RETENTION_ARCHIVE_PREFIX - 1) == 0)
+      continue;
+    struct stat st;
+    if (fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) != 0
+	|| !S_ISREG(st.st_mode))
+      continue;
+    failed_file f;
+    f.name = name;
+    f.mtime = st.st_mtime;
+    f.size = st.st_size;
+    files.append(f);
+    total += f.size;
+  }
+}
+
+// Remove the first count of the messages, archiving them first if
+// asked.  The messages are in order of age, so those of each day are
+// archived in one batch.
+static void remove_failed(int dirfd, failed_file* const files[], unsigned count,
+			  bool archive, unsigned long& removed,
+			  unsigned long long& removed_bytes)
+{
+  unsigned i = 0;
+  while (i < count) {
+    unsigned end = i + 1;
+    if (archive) {
+      const mystring day = archive_name(files[i]->mtime);
+      while (end < count && archive_name(files[end]->mtime) == day)
+	++end;
+      failed_archive a;
+      bool ok = a.open(dirfd, day);
+      for (unsigned j = i; ok && j < end; j++)
+	ok = a.add(dirfd, *files[j]);
+      if (!a.close() || !ok) {
+	i = end;
+	continue;
+      }
+    }
+    for (; i < end; i++)
+      if (unlinkat(dirfd, files[i]->name.c_str(), 0) == 0) {
+	++removed;
+	removed_bytes += files[i]->size;
+      }
+  }
+}
+
+bool retention_enforce(const char* dir, const retention_limits& limits,
+		       time_t now, unsigned long& removed,
+		       unsigned long long& removed_bytes)
+{
+  removed = 0;
+  removed_bytes = 0;
+  DIR* d = opendir(dir);
+  if (d == 0)
+    return false;
+  list<failed_file> found;
+  unsigned long long total = 0;
+  read_failed(d, found, total);
+  const unsigned count = found.count();
+  failed_file** files = new failed_file*[count];
+  unsigned n = 0;
+  for (list<failed_file>::iter i(found); i; i++)
+    files[n++] = &*i;
+  qsort(files, n, sizeof *files, by_age);
+  // Everything up to the first message within all of the limits goes.
+  unsigned long left = n;
+  unsigned cut = 0;
+  for (; cut < n; cut++) {
+    const bool expired = limits.lifetime > 0
+      && files[cut]->mtime + limits.lifetime <= now;
+    if (!expired
+	&& (limits.files == 0 || left <= limits.files)
+	&& (limits.bytes == 0 || total <= limits.bytes))
+      break;
+    --left;
+    total -= files[cut]->size;
+  }
+  remove_failed(dirfd(d), files, cut, limits.archive, removed, removed_bytes);
+  delete[] files;
+  closedir(d);
+  return true;
+}
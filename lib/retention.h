@@ -0,0 +1,49 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#ifndef NULLMAILER__RETENTION__H__
+#define NULLMAILER__RETENTION__H__
+
+#include <time.h>
+
+// The limits on the failed messages kept after they have been bounced.
+// A limit of 0 is no limit.
+struct retention_limits
+{
+  time_t lifetime;		// Seconds since the message failed
+  unsigned long files;
+  unsigned long long bytes;
+  // Whether the messages removed are first packed into an archive for
+  // the day they failed, in the same directory.
+  bool archive;
+};
+
+#define RETENTION_ARCHIVE_PREFIX "archive-"
+
+// Remove the oldest failed messages in dir until what is left is within
+// the limits, adding up the number and size of the messages removed.
+// A message that cannot be archived is kept.  Returns false if the
+// directory could not be read.
+bool retention_enforce(const char* dir, const retention_limits& limits,
+		       time_t now, unsigned long& removed,
+		       unsigned long long& removed_bytes);
+
+#endif // NULLMAILER__RETENTION__H__
@@ -0,0 +1,167 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#include "config.h"
+#include "routetable.h"
+
+// Each pattern is stored under a key made of its kind followed by the
+// part of the address it matches.
+#define KEY_ADDRESS '='
+#define KEY_DOMAIN '@'
+#define KEY_SUBDOMAIN '.'
+#define KEY_USER '!'
+
+static unsigned hash(const mystring& key)
+{
+  // FNV-1a
+  unsigned h = 2166136261U;
+  for (const char* ptr = key.c_str(); *ptr; ++ptr) {
+    h ^= (unsigned char)*ptr;
+    h *= 16777619U;
+  }
+  return h;
+}
+
+static mystring make_key(char kind, const mystring& str)
+{
+  mystring key;
+  key += kind;
+  key += str;
+  return key;
+}
+
+route_table::route_table()
+  : buckets(0), size(0), entries(0)
+{
+}
+
+route_table::~route_table()
+{
+  clear();
+}
+
+void route_table::clear()
+{
+  for (unsigned i = 0; i < size; i++)
+    while (buckets[i]) {
+      entry* next = buckets[i]->next;
+      delete buckets[i];
+      buckets[i] = next;
+    }
+  delete[] buckets;
+  buckets = 0;
+  size = 0;
+  entries = 0;
+}
+
+// Double the number of buckets, keeping them at least twice the number
+// of entries so that the chains stay short.
+void route_table::grow()
+{
+  unsigned newsize = size ? size * 2 : 16;
+  entry** newbuckets = new entry*[newsize];
+  for (unsigned i = 0; i < newsize; i++)
+    newbuckets[i] = 0;
+  for (unsigned i = 0; i < size; i++)
+    while (buckets[i]) {
+      entry* e = buckets[i];
+      buckets[i] = e->next;
+      unsigned b = hash(e->key) & (newsize - 1);
+      e->next = newbuckets[b];
+      newbuckets[b] = e;
+    }
+  delete[] buckets;
+  buckets = newbuckets;
+  size = newsize;
+}
+
+const route_table::entry* route_table::lookup(const mystring& key) const
+{
+  if (size == 0)
+    return 0;
+  for (const entry* e = buckets[hash(key) & (size - 1)]; e; e = e->next)
+    if (e->key == key)
+      return e;
+  return 0;
+}
+
+// Add a pattern to the table.  If the same pattern is given more than
+// once, the first one is kept.  Returns false if the pattern is not
+// one of the recognized forms.
+bool route_table::add(const mystring& pattern, const mystring& group)
+{
+  mystring lower = pattern.lower();
+  int at = lower.find_last('@');
+  if (at <= 0 || !group)
+    return false;
+  mystring user = lower.left(at);
+  mystring domain = lower.right(at+1);
+  mystring key;
+  if (user == "*") {
+    if (domain.left(2) == "*.")
+      key = make_key(KEY_SUBDOMAIN, domain.right(2));
+    else
+      key = make_key(KEY_DOMAIN, domain);
+  }
+  else if (domain == "*")
+    key = make_key(KEY_USER, user);
+  else
+    key = make_key(KEY_ADDRESS, lower);
+  if (key.length() < 2 || key.find_first('*') >= 0)
+    return false;
+  if (lookup(key))
+    return true;
+  if (entries * 2 >= size)
+    grow();
+  entry* e = new entry;
+  e->key = key;
+  e->group = group;
+  unsigned b = hash(key) & (size - 1);
+  e->next = buckets[b];
+  buckets[b] = e;
+  ++entries;
+  return true;
+}
+
+// Find the group an address is routed to.  The parent domains of the
+// address are tried from the longest to the shortest.
+bool route_table::find(const mystring& address, mystring& group) const
+{
+  if (entries == 0)
+    return false;
+  mystring lower = address.lower();
+  int at = lower.find_last('@');
+  if (at < 0)
+    return false;
+  const entry* e = lookup(make_key(KEY_ADDRESS, lower));
+  mystring domain = lower.right(at+1);
+  if (!e)
+    e = lookup(make_key(KEY_DOMAIN, domain));
+  for (int dot = domain.find_first('.'); !e && dot >= 0;
+       dot = domain.find_first('.', dot+1))
+    e = lookup(make_key(KEY_SUBDOMAIN, domain.right(dot+1)));
+  if (!e)
+    e = lookup(make_key(KEY_USER, lower.left(at)));
+  if (!e)
+    return false;
+  group = e->group;
+  return true;
+}
@@ -0,0 +1,66 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#ifndef NULLMAILER__ROUTETABLE__H__
+#define NULLMAILER__ROUTETABLE__H__
+
+#include "mystring/mystring.h"
+
+// A table of address patterns, each of which routes the addresses it
+// matches to a named group of remotes.  The patterns are hashed, so
+// that finding the route for an address takes a fixed number of
+// lookups however many patterns there are:
+//   user@domain   that address only
+//   *@domain      any user at the domain
+//   *@*.domain    any user at any subdomain of the domain
+//   user@*        the user at any domain
+// Addresses are matched without regard to case.  A more specific
+// pattern wins over a less specific one, in the order above.
+class route_table
+{
+public:
+  route_table();
+  ~route_table();
+
+  bool add(const mystring& pattern, const mystring& group);
+  bool find(const mystring& address, mystring& group) const;
+  unsigned count() const { return entries; }
+  void clear();
+
+private:
+  struct entry
+  {
+    mystring key;
+    mystring group;
+    entry* next;
+  };
+  entry** buckets;
+  unsigned size;
+  unsigned entries;
+
+  route_table(const route_table&);
+  void operator=(const route_table&);
+
+  const entry* lookup(const mystring& key) const;
+  void grow();
+};
+
+#endif
@@ -74,6 +74,11 @@ void selfpipe::catchsig(int sig)
   signal(sig, catcher);
 }
 
+int selfpipe::fd() const
+{
+  return fds[0];
+}
+
 int selfpipe::caught()
 {
   int buf;
@@ -11,6 +11,7 @@ class selfpipe
   void catchsig(int sig);
   int caught();
   int waitsig(int timeout = 0);
+  int fd() const;
 };
 
 #endif // NULLMAILER_SELFPIPE__H__
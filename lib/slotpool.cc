@@ -0,0 +1,99 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#include "config.h"
+#include <sys/mman.h>
+#include "slotpool.h"
+
+struct slotpool_tenant
+{
+  int held;
+  int wanted;
+};
+
+struct slotpool
+{
+  int size;
+  int free;
+  unsigned tenants;
+  slotpool_tenant tenant[SLOTPOOL_MAX];
+};
+
+static slotpool* pool = 0;
+
+bool slotpool_open(unsigned tenants, unsigned slots)
+{
+  if (tenants > SLOTPOOL_MAX)
+    return false;
+  void* map = mmap(0, sizeof *pool, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED)
+    return false;
+  pool = (slotpool*)map;
+  pool->size = pool->free = slots;
+  pool->tenants = tenants;
+  return true;
+}
+
+unsigned slotpool_borrow(unsigned tenant, unsigned want)
+{
+  if (pool == 0 || tenant >= pool->tenants || want == 0)
+    return 0;
+  slotpool_tenant& t = pool->tenant[tenant];
+  __sync_lock_test_and_set(&t.wanted, 1);
+  int others = 0;
+  for (unsigned i = 0; i < pool->tenants; i++)
+    if (i != tenant && (pool->tenant[i].wanted || pool->tenant[i].held))
+      ++others;
+  int share = (pool->size + others) / (others + 1);
+  if ((int)want < share)
+    share = want;
+  for (;;) {
+    const int avail = pool->free;
+    const int take = avail < share ? avail : share;
+    if (take <= 0)
+      return 0;
+    if (__sync_bool_compare_and_swap(&pool->free, avail, avail - take)) {
+      __sync_fetch_and_add(&t.held, take);
+      return take;
+    }
+  }
+}
+
+void slotpool_return(unsigned tenant)
+{
+  if (pool == 0 || tenant >= pool->tenants)
+    return;
+  slotpool_tenant& t = pool->tenant[tenant];
+  const int held = __sync_lock_test_and_set(&t.held, 0);
+  __sync_fetch_and_add(&pool->free, held);
+  __sync_lock_test_and_set(&t.wanted, 0);
+}
+
+unsigned slotpool_held(unsigned tenant)
+{
+  return pool != 0 && tenant < pool->tenants ? pool->tenant[tenant].held : 0;
+}
+
+unsigned slotpool_free()
+{
+  return pool != 0 ? pool->free : 0;
+}
@@ -0,0 +1,43 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#ifndef NULLMAILER__SLOTPOOL__H__
+#define NULLMAILER__SLOTPOOL__H__
+
+// The delivery slots shared by the tenants of one nullmailer-send,
+// each served by a process forked from the one that opened the pool.
+// Every tenant may always run one delivery; the pool holds the rest,
+// which a tenant borrows for a queue run and gives back after it.
+// While more than one tenant wants slots, each is held to an even
+// share of the pool, so that a tenant with a large backlog cannot take
+// them all from the others.
+#define SLOTPOOL_MAX 256
+
+bool slotpool_open(unsigned tenants, unsigned slots);
+// Borrow up to want slots for the tenant, returning how many it got.
+unsigned slotpool_borrow(unsigned tenant, unsigned want);
+// Give back the slots the tenant holds.  This is also done for a
+// tenant whose process has died.
+void slotpool_return(unsigned tenant);
+unsigned slotpool_held(unsigned tenant);
+unsigned slotpool_free();
+
+#endif
@@ -0,0 +1,153 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "ac/time.h"
+#include "stats.h"
+
+#define PHASES_MAX 16
+
+#ifdef _REENTRANT
+thread_local run_counters run_stats;
+#else
+run_counters run_stats;
+#endif
+
+struct phase
+{
+  const char* name;
+  double seconds;
+};
+
+static int enabled = -1;
+static struct timeval started;
+static phase phases[PHASES_MAX];
+static unsigned phase_count;
+static phase* current;
+static struct timeval current_started;
+
+static double since(const struct timeval& then)
+{
+  struct timeval now;
+  gettimeofday(&now, 0);
+  return (now.tv_sec - then.tv_sec) + (now.tv_usec - then.tv_usec) / 1e6;
+}
+
+bool stats_enabled()
+{
+  if(enabled < 0) {
+    const char* path = getenv("NULLMAILER_STATS");
+    enabled = path != 0 && *path != 0;
+    if(enabled)
+      gettimeofday(&started, 0);
+  }
+  return enabled;
+}
+
+void stats_phase(const char* name)
+{
+  if(!stats_enabled())
+    return;
+  if(current)
+    current->seconds += since(current_started);
+  current = 0;
+  if(name == 0)
+    return;
+  for(unsigned i = 0; i < phase_count; i++)
+    if(strcmp(phases[i].name, name) == 0)
+      current = &phases[i];
+  if(!current && phase_count < PHASES_MAX) {
+    current = &phases[phase_count++];
+    current->name = name;
+    current->seconds = 0;
+  }
+  gettimeofday(&current_started, 0);
+}
+
+static const char* program_name()
+{
+#ifdef __GLIBC__
+  return program_invocation_short_name;
+#else
+  return "nullmailer";
+#endif
+}
+
+// The record is formatted into one buffer and written in one call, so
+// that records from concurrent processes appending to the same file do
+// not interleave.
+static void stats_write()
+{
+  if(!stats_enabled())
+    return;
+  stats_phase(0);
+  const run_counters c = run_stats;
+  struct rusage usage;
+  if(getrusage(RUSAGE_SELF, &usage) != 0)
+    usage.ru_maxrss = 0;
+  char buf[2048];
+  int len = snprintf(buf, sizeof buf,
+		     "{\"program\":\"%s\",\"pid\":%ld,\"wall\":%.6f,"
+		     "\"allocs\":%lu,\"alloc_bytes\":%lu,"
+		     "\"reads\":%lu,\"read_bytes\":%lu,"
+		     "\"writes\":%lu,\"write_bytes\":%lu,"
+		     "\"transfers\":%lu,\"transfer_bytes\":%lu,"
+		     "\"duplicates\":%lu,"
+		     "\"buffers\":%lu,\"buffer_bytes\":%lu,\"maxrss\":%ld,"
+		     "\"phases\":{",
+		     program_name(), (long)getpid(), since(started),
+		     c.allocs, c.alloc_bytes, c.reads, c.read_bytes,
+		     c.writes, c.write_bytes, c.transfers, c.transfer_bytes,
+		     c.duplicates, c.buffers, c.buffer_bytes,
+		     (long)usage.ru_maxrss);
+  for(unsigned i = 0; i < phase_count && len < (int)sizeof buf; i++)
+    len += snprintf(buf + len, sizeof buf - len, "%s\"%s\":%.6f",
+		    i ? "," : "", phases[i].name, phases[i].seconds);
+  if(len < (int)sizeof buf)
+    len += snprintf(buf + len, sizeof buf - len, "}}\n");
+  if(len >= (int)sizeof buf)
+    return;
+  const char* path = getenv("NULLMAILER_STATS");
+  int fd = strcmp(path, "-") == 0 ? 2
+    : open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if(fd < 0)
+    return;
+  ssize_t written = write(fd, buf, len);
+  (void)written;
+  if(fd != 2)
+    close(fd);
+}
+
+// Written out by a destructor rather than atexit, so that it runs after
+// the program's main returns or it calls exit, but not in children that
+// leave with _exit.
+static struct stats_writer
+{
+  ~stats_writer() { stats_write(); }
+} writer;
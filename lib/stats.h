@@ -0,0 +1,60 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+
+#ifndef NULLMAILER__STATS__H__
+#define NULLMAILER__STATS__H__
+
+// Counters kept by every program.  When $NULLMAILER_STATS names a file,
+// or is "-" for standard error, they are written out at exit as one
+// JSON object per line, along with the peak resident set size in
+// kilobytes and the wall time spent in each phase:
+//   {"program":"nullmailer-inject","pid":42,"wall":0.0031,
+//    "allocs":63,...,"maxrss":3120,
+//    "phases":{"headers":0.0007,"queue":0.0019}}
+struct run_counters
+{
+  unsigned long allocs;		// mystring reps allocated
+  unsigned long alloc_bytes;
+  unsigned long reads;		// read calls made by input buffers
+  unsigned long read_bytes;
+  unsigned long writes;		// write and writev calls made by output buffers
+  unsigned long write_bytes;
+  unsigned long transfers;	// sendfile, splice and copy_file_range calls
+  unsigned long transfer_bytes;
+  unsigned long duplicates;	// repeated envelope recipients dropped
+  unsigned long buffers;	// I/O buffers allocated, not reused
+  unsigned long buffer_bytes;
+};
+
+// Each thread counts for itself; only the main thread's are reported.
+#ifdef _REENTRANT
+extern thread_local run_counters run_stats;
+#else
+extern run_counters run_stats;
+#endif
+
+bool stats_enabled();
+// Charge the time since the last call to the phase that was running,
+// and start timing the named one.  A null name stops timing.
+void stats_phase(const char* name);
+
+#endif // NULLMAILER__STATS__H__
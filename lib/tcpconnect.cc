@@ -21,12 +21,17 @@
 
 #include "config.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/un.h>
+#include <poll.h>
 #include <unistd.h>
+#include "ac/time.h"
 #include "errcodes.h"
 #include "itoa.h"
 #include "connect.h"
@@ -54,74 +59,246 @@ static int err_return(int errn, int dflt)
 
 #ifdef HAVE_GETADDRINFO
 
-static int getaddr(const char* hostname, int port, struct addrinfo** result)
+#define MAX_ADDRS 16
+#define MAX_ATTEMPTS 32
+#define CONNECT_STAGGER 250
+
+// The results of one or more lookups of the same host.
+struct addrlist
+{
+  struct addrinfo* lists[MAX_ADDRS];
+  int count;
+};
+
+static void freeaddrs(addrlist& a)
+{
+  for (int i = 0; i < a.count; i++)
+    freeaddrinfo(a.lists[i]);
+  a.count = 0;
+}
+
+static int getaddr(const char* hostname, const char* service, int flags,
+                   addrlist& a)
 {
-  const char *service = itoa(port, 6);
   struct addrinfo req;
   memset(&req, 0, sizeof(req));
-  req.ai_flags = AI_NUMERICSERV;
+  req.ai_flags = AI_NUMERICSERV | flags;
   req.ai_socktype = SOCK_STREAM;
-  int e = getaddrinfo(hostname, service, &req, result);
-  return e ? err_return(e, ERR_GHBN_TEMP) : 0;
+  int e = getaddrinfo(hostname, service, &req, &a.lists[a.count]);
+  if (e)
+    return err_return(e, ERR_GHBN_TEMP);
+  ++a.count;
+  return 0;
 }
 
-static bool canbind(int family, const struct addrinfo* ai)
+// nullmailer-send passes the addresses it has already looked up for
+// its remotes in $NULLMAILER_RESOLVED, formatted as
+// "host=addr,addr;host=addr".  Returns the list of addresses for the
+// host, terminated by ';' or NUL, or NULL if it is not there.
+static const char* cached_addrs(const char* hostname)
 {
-  for (; ai; ai = ai->ai_next)
-    if (ai->ai_family == family)
-      return true;
-  return false;
+  const char* env = getenv("NULLMAILER_RESOLVED");
+  size_t len = strlen(hostname);
+  while (env && *env) {
+    if (strncmp(env, hostname, len) == 0 && env[len] == '=')
+      return env + len + 1;
+    env = strchr(env, ';');
+    if (env)
+      ++env;
+  }
+  return NULL;
+}
+
+static int getaddrs(const char* hostname, int port, addrlist& a)
+{
+  const char *service = itoa(port, 6);
+  a.count = 0;
+  const char* addrs = cached_addrs(hostname);
+  if (!addrs)
+    return getaddr(hostname, service, 0, a);
+  while (*addrs && *addrs != ';' && a.count < MAX_ADDRS) {
+    char addr[64];
+    size_t len = strcspn(addrs, ",;");
+    if (len > 0 && len < sizeof addr) {
+      memcpy(addr, addrs, len);
+      addr[len] = 0;
+      getaddr(addr, service, AI_NUMERICHOST, a);
+    }
+    addrs += len;
+    if (*addrs == ',')
+      ++addrs;
+  }
+  // Look the host up again if none of the addresses could be used.
+  return a.count > 0 ? 0 : getaddr(hostname, service, 0, a);
 }
 
-static bool bindit(int fd, int family, const struct addrinfo* ai)
+static bool canbind(int family, const addrlist& a)
 {
-  for (; ai; ai = ai->ai_next)
-    if (ai->ai_family == family)
-      if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+  for (int i = 0; i < a.count; i++)
+    for (const struct addrinfo* ai = a.lists[i]; ai; ai = ai->ai_next)
+      if (ai->ai_family == family)
         return true;
   return false;
 }
 
-int tcpconnect(const char* hostname, int port, const char* source)
+static bool bindit(int fd, int family, const addrlist& a)
+{
+  for (int i = 0; i < a.count; i++)
+    for (const struct addrinfo* ai = a.lists[i]; ai; ai = ai->ai_next)
+      if (ai->ai_family == family)
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+          return true;
+  return false;
+}
+
+// Put the addresses in the order to try them, alternating between the
+// address families starting with the family of the first address, and
+// leaving out those the source address cannot be bound for.
+static int order_addrs(const addrlist& a, const addrlist* source,
+                       const struct addrinfo* order[], int max)
+{
+  const struct addrinfo* first[MAX_ATTEMPTS];
+  const struct addrinfo* other[MAX_ATTEMPTS];
+  int nfirst = 0;
+  int nother = 0;
+  int family = -1;
+  for (int i = 0; i < a.count; i++)
+    for (const struct addrinfo* ai = a.lists[i]; ai; ai = ai->ai_next) {
+      if (source && !canbind(ai->ai_family, *source))
+        continue;
+      if (family < 0)
+        family = ai->ai_family;
+      if (ai->ai_family == family) {
+        if (nfirst < MAX_ATTEMPTS)
+          first[nfirst++] = ai;
+      }
+      else if (nother < MAX_ATTEMPTS)
+        other[nother++] = ai;
+    }
+  int count = 0;
+  for (int i = 0; count < max && (i < nfirst || i < nother); i++) {
+    if (i < nfirst)
+      order[count++] = first[i];
+    if (i < nother && count < max)
+      order[count++] = other[i];
+  }
+  return count;
+}
+
+static long long clock_ms()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+// The addresses are raced in the style of RFC 8305 ("Happy Eyeballs"):
+// a new non-blocking connection attempt is started every
+// CONNECT_STAGGER milliseconds, or as soon as an earlier one fails,
+// while the earlier ones are still pending, and the first one to
+// complete is used.  The whole attempt gives up after timeout seconds.
+int tcpconnect(const char* hostname, int port, const char* source, int timeout,
+	       void (*resolved)(void*), void* data)
 {
-  struct addrinfo* res;
-  int err = getaddr(hostname, port, &res);
+  addrlist addrs;
+  int err = getaddrs(hostname, port, addrs);
   if (err)
     return err;
-  struct addrinfo* source_addr = NULL;
+  addrlist source_addrs;
+  source_addrs.count = 0;
   if (source) {
-    err = getaddr(source, 0, &source_addr);
-    if (err)
+    err = getaddrs(source, 0, source_addrs);
+    if (err) {
+      freeaddrs(addrs);
       return err;
+    }
   }
+  if (resolved)
+    resolved(data);
+  const struct addrinfo* order[MAX_ATTEMPTS];
+  int count = order_addrs(addrs, source ? &source_addrs : 0, order, MAX_ATTEMPTS);
+  struct pollfd pending[MAX_ATTEMPTS];
+  int npending = 0;
+  int next = 0;
   int s = -1;
+  int errn = 0;
   err = ERR_CONN_FAILED;
-  struct addrinfo* orig_res = res;
-
-  for (; res; res = res->ai_next ) {
-    if (!source_addr || canbind(res->ai_family, source_addr)) {
-      s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-      if(s > 0) {
-        if(source_addr && !bindit(s, res->ai_family, source_addr)) {
-          close(s);
-          err = ERR_BIND_FAILED;
-          s = -1;
-          break;
-        }
-        if(connect(s, res->ai_addr, res->ai_addrlen) == 0)
-          break;
-        close(s);
-        s = -1;
+  long long deadline = timeout > 0 ? clock_ms() + timeout * 1000LL : -1;
+
+  while (s < 0 && (next < count || npending > 0)) {
+    if (next < count) {
+      const struct addrinfo* ai = order[next++];
+      int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (fd < 0) {
+        errn = errno;
+        continue;
+      }
+      if (source && !bindit(fd, ai->ai_family, source_addrs)) {
+        errn = errno;
+        close(fd);
+        err = ERR_BIND_FAILED;
+        break;
+      }
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+        s = fd;
+        break;
+      }
+      if (errno != EINPROGRESS) {
+        errn = errno;
+        close(fd);
+        continue;
+      }
+      pending[npending].fd = fd;
+      pending[npending].events = POLLOUT;
+      pending[npending].revents = 0;
+      ++npending;
+    }
+    if (npending == 0)
+      continue;
+    int wait = next < count ? CONNECT_STAGGER : -1;
+    if (deadline >= 0) {
+      long long left = deadline - clock_ms();
+      if (left <= 0) {
+        errn = ETIMEDOUT;
+        break;
       }
+      if (wait < 0 || left < wait)
+        wait = left;
+    }
+    int ready = poll(pending, npending, wait);
+    if (ready < 0 && errno != EINTR) {
+      errn = errno;
+      break;
+    }
+    for (int i = 0; ready > 0 && i < npending; ) {
+      if (!pending[i].revents) {
+        ++i;
+        continue;
+      }
+      int soerr = 0;
+      socklen_t len = sizeof soerr;
+      if (getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &soerr, &len) < 0)
+        soerr = errno;
+      if (soerr == 0 && s < 0)
+        s = pending[i].fd;
+      else {
+        errn = soerr;
+        close(pending[i].fd);
+      }
+      pending[i] = pending[--npending];
+      --ready;
     }
   }
 
-  freeaddrinfo(orig_res);
-  if (source_addr)
-    freeaddrinfo(source_addr);
+  while (npending > 0)
+    close(pending[--npending].fd);
+  freeaddrs(addrs);
+  freeaddrs(source_addrs);
 
   if(s < 0)
-    return err_return(errno, err);
+    return err_return(errn, err);
+  fcntl(s, F_SETFL, fcntl(s, F_GETFL) & ~O_NONBLOCK);
   return s;
 }
 
@@ -136,7 +313,8 @@ static int sethostbyname(const char* hostname, struct sockaddr_in& sa)
   return 0;
 }
 
-int tcpconnect(const char* hostname, int port, const char* source)
+int tcpconnect(const char* hostname, int port, const char* source, int,
+	       void (*resolved)(void*), void* data)
 {
   struct sockaddr_in sa;
   memset(&sa, 0, sizeof(sa));
@@ -148,6 +326,8 @@ int tcpconnect(const char* hostname, int port, const char* source)
     e = sethostbyname(source, source_sa);
     if(e) return e;
   }
+  if(resolved)
+    resolved(data);
   sa.sin_family = AF_INET;
   sa.sin_port = htons(port);
   int s = socket(PF_INET, SOCK_STREAM, 0);
@@ -165,3 +345,33 @@ int tcpconnect(const char* hostname, int port, const char* source)
 }
 
 #endif
+
+int unixconnect(const char* path, int timeout)
+{
+  struct sockaddr_un sa;
+  memset(&sa, 0, sizeof sa);
+  if (strlen(path) >= sizeof sa.sun_path)
+    return -ERR_CONN_FAILED;
+  sa.sun_family = AF_UNIX;
+  strcpy(sa.sun_path, path);
+  int s = socket(PF_UNIX, SOCK_STREAM, 0);
+  if (s == -1)
+    return -ERR_SOCKET;
+  // A connection to a listener with a full backlog waits for as long as
+  // a send may.
+  if (timeout > 0) {
+    struct timeval tv = { timeout, 0 };
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+  }
+  if (connect(s, (sockaddr*)&sa, sizeof sa) != 0) {
+    int e = errno;
+    close(s);
+    // A socket that is not there is a server that is not running.
+    if (e == ECONNREFUSED || e == ENOENT)
+      return -ERR_CONN_REFUSED;
+    if (e == EAGAIN || e == ETIMEDOUT)
+      return -ERR_CONN_TIMEDOUT;
+    return -ERR_CONN_FAILED;
+  }
+  return s;
+}
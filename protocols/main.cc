@@ -0,0 +1,88 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+// The standalone protocol programs, which run one session of the
+// engine named by PROTOCOL and exit with its result.
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include "errcodes.h"
+#include "fdbuf/fdbuf.h"
+#include "protocol.h"
+
+#define ENGINE2(P) P##_engine
+#define ENGINE(P) ENGINE2(P)
+
+static const protocol_engine& engine = ENGINE(PROTOCOL);
+const char* cli_program = engine.name;
+
+static void show_help()
+{
+  fout << "usage: " << engine.name << " [flags] < options 3< mail-file\n"
+       << engine.help;
+  for (const engine_option* o = engine_options; o->name; ++o) {
+    fout << "  ";
+    if (o->ch)
+      fout << '-' << o->ch << ", ";
+    else
+      fout << "    ";
+    fout << "--" << o->name
+	 << (o->type == engine_option::string ? "=VALUE"
+	     : o->type == engine_option::integer ? "=INT" : "")
+	 << "\n        " << o->helpstr << '\n';
+    if (o->defaultstr)
+      fout << "        (Defaults to " << o->defaultstr << ")\n";
+  }
+  fout << "\n  -h, --help\n        Display this help and exit" << endl;
+}
+
+static void usage(const char* msg, const char* arg)
+{
+  ferr << engine.name << ": " << msg << arg << endl;
+  exit(ERR_USAGE);
+}
+
+int main(int argc, char* argv[])
+{
+  protocol_session s(engine);
+  int i;
+  for (i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    if (arg[0] != '-')
+      break;
+    if (strcmp(arg, "--") == 0) {
+      i++;
+      break;
+    }
+    if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+      show_help();
+      return 0;
+    }
+    int used = s.option(arg, argv[i+1]);
+    if (used == 0)
+      usage("invalid option: ", arg);
+    i += used - 1;
+  }
+  if (i < argc)
+    usage("too many command-line arguments: ", argv[i]);
+  return protocol_main(s);
+}
@@ -20,135 +20,613 @@
 // <nullmailer-subscribe@lists.untroubled.org>.
 
 #include <config.h>
+#include <ctype.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "ac/time.h"
 #include "connect.h"
 #include "errcodes.h"
+#include "fdbuf/mmapibuf.h"
+#include "fdpass.h"
 #include "list.h"
+#include "itoa.h"
 #include "mystring/mystring.h"
+#include "netstring.h"
 #include "protocol.h"
-#include "cli++/cli++.h"
-
-const char* user = 0;
-const char* pass = 0;
-int port = 0;
-int auth_method = AUTH_DETECT;
-int use_tls = 0;
-int use_starttls = 0;
-const char* remote = 0;
-const char* source = 0;
-const char* cli_help_suffix = "";
-const char* cli_args_usage = "< options 3< mail-file";
-const int cli_args_min = 0;
-const int cli_args_max = 0;
-cli_option cli_options[] = {
-  { 0, "host", cli_option::string, 0, &remote,
+#include "queuefile.h"
+#include "stats.h"
+
+protocol_options::protocol_options()
+  : remote(0), port(0), source(0), user(0), pass(0),
+    auth_method(AUTH_DETECT), connect_timeout(60), io_timeout(0),
+    use_tls(0), use_starttls(0), use_multi(0), use_warm(0), keepalive(0),
+    use_results(0), use_fds(0), index_file(0), cached_caps(0),
+    tls_insecure(0), use_ktls(0), tls_x509certfile(0), tls_x509keyfile(0),
+    tls_x509cafile(0), tls_x509crlfile(0), tls_x509derfmt(0)
+{
+}
+
+#define OPT(NAME) offsetof(protocol_options, NAME)
+
+const engine_option engine_options[] = {
+  { 0, "host", engine_option::string, 0, OPT(remote),
     "Set the hostname for the remote", 0 },
-  { 'p', "port", cli_option::integer, 0, &port,
+  { 'p', "port", engine_option::integer, 0, OPT(port),
     "Set the port number on the remote host to connect to", 0 },
-  { 0, "user", cli_option::string, 0, &user,
+  { 0, "user", engine_option::string, 0, OPT(user),
     "Set the user name for authentication", 0 },
-  { 0, "pass", cli_option::string, 0, &pass,
+  { 0, "pass", engine_option::string, 0, OPT(pass),
     "Set the password for authentication", 0 },
-  { 0, "auth-login", cli_option::flag, AUTH_LOGIN, &auth_method,
+  { 0, "auth-login", engine_option::flag, AUTH_LOGIN, OPT(auth_method),
     "Use AUTH LOGIN instead of auto-detecting in SMTP", 0 },
-  { 0, "source", cli_option::string, 0, &source,
+  { 0, "source", engine_option::string, 0, OPT(source),
     "Source address for connections", 0 },
+  { 0, "connect-timeout", engine_option::integer, 0, OPT(connect_timeout),
+    "Give up connecting after this many seconds", "60" },
+  { 0, "timeout", engine_option::integer, 0, OPT(io_timeout),
+    "Give up waiting on the remote after this many seconds",
+    "the limits from RFC 5321" },
+  { 0, "multi", engine_option::flag, 1, OPT(use_multi),
+    "Read more message file names from standard input", 0 },
+  { 0, "warm", engine_option::flag, 1, OPT(use_warm),
+    "Set up the session before reading the first message file name", 0 },
+  { 0, "keepalive", engine_option::integer, 0, OPT(keepalive),
+    "Keep the connection alive while waiting for the next message",
+    "60 seconds with --warm, otherwise never" },
+  { 0, "results", engine_option::flag, 1, OPT(use_results),
+    "Report results as netstring records", 0 },
+  { 0, "fds", engine_option::flag, 1, OPT(use_fds),
+    "Receive each message file open with its name", 0 },
+  { 0, "index", engine_option::string, 0, OPT(index_file),
+    "Queue index file of the message", 0 },
+  { 0, "caps", engine_option::string, 0, OPT(cached_caps),
+    "Capabilities the remote was last seen with", 0 },
 #ifdef HAVE_TLS
-  { 0, "tls", cli_option::flag, 1, &use_tls,
+  { 0, "tls", engine_option::flag, 1, OPT(use_tls),
     "Connect using TLS (on an alternate port by default)", 0 },
-  { 0, "ssl", cli_option::flag, 1, &use_tls,
+  { 0, "ssl", engine_option::flag, 1, OPT(use_tls),
     "Alias for --tls", 0 },
-  { 0, "starttls", cli_option::flag, 1, &use_starttls,
+  { 0, "starttls", engine_option::flag, 1, OPT(use_starttls),
     "Use STARTTLS command", 0 },
-  { 0, "x509certfile", cli_option::string, 0, &tls_x509certfile,
+  { 0, "x509certfile", engine_option::string, 0, OPT(tls_x509certfile),
     "Client certificate file", 0 },
-  { 0, "x509keyfile", cli_option::string, 0, &tls_x509keyfile,
+  { 0, "x509keyfile", engine_option::string, 0, OPT(tls_x509keyfile),
     "Client certificate private key file", "the same file as --x509certfile" },
-  { 0, "x509cafile", cli_option::string, 0, &tls_x509cafile,
+  { 0, "x509cafile", engine_option::string, 0, OPT(tls_x509cafile),
     "Certificate authority trust file", DEFAULT_CA_FILE },
-  { 0, "x509crlfile", cli_option::string, 0, &tls_x509crlfile,
+  { 0, "x509crlfile", engine_option::string, 0, OPT(tls_x509crlfile),
     "Certificate revocation list file", 0 },
-  { 0, "x509fmtder", cli_option::flag, true, &tls_x509derfmt,
+  { 0, "x509fmtder", engine_option::flag, true, OPT(tls_x509derfmt),
     "X.509 files are in DER format", "PEM format" },
-  { 0, "insecure", cli_option::flag, true, &tls_insecure,
+  { 0, "insecure", engine_option::flag, true, OPT(tls_insecure),
     "Don't abort if server certificate fails validation", 0 },
+  { 0, "ktls", engine_option::flag, true, OPT(use_ktls),
+    "Send through kernel TLS where the system has it enabled", 0 },
 #endif
-  {0, 0, cli_option::flag, 0, 0, 0, 0}
+  {0, 0, engine_option::flag, 0, 0, 0, 0}
+};
+
+static const protocol_engine* engines[] = {
+  &smtp_engine,
+  &qmqp_engine,
+  &lmtp_engine,
+  0
 };
 
-void protocol_fail(int e, const char* msg)
+const protocol_engine* protocol_find(const char* name)
 {
-  fout << msg << endl;
-  ferr << cli_program << ": Failed: " << msg << endl;
-  exit(e);
+  for (const protocol_engine** e = engines; *e; ++e)
+    if (strcmp((*e)->name, name) == 0)
+      return *e;
+  return 0;
 }
 
-void protocol_succ(const char* msg)
+// Set an option from an argument of the form "--name=value", "--flag",
+// "-Xvalue" or "-X value", where the leading dashes may be left off
+// long names.  Returns the number of arguments used, or 0 if the
+// option is not valid.
+int protocol_session::option(const char* arg, const char* next)
 {
-  fout << msg << endl;
-  ferr << cli_program << ": Succeeded: " << msg << endl;
-  exit(0);
+  const engine_option* o;
+  const char* value = 0;
+  int used = 1;
+  if (arg[0] == '-' && arg[1] != '-') {
+    for (o = engine_options; o->name; ++o)
+      if (o->ch != 0 && o->ch == arg[1])
+	break;
+    if (!o->name)
+      return 0;
+    if (o->type != engine_option::flag) {
+      value = arg + 2;
+      if (*value == 0) {
+	value = next;
+	used = 2;
+      }
+    }
+    else if (arg[2] != 0)
+      return 0;
+  }
+  else {
+    if (arg[0] == '-')
+      arg += 2;
+    const char* eq = strchr(arg, '=');
+    size_t len = eq ? (size_t)(eq - arg) : strlen(arg);
+    for (o = engine_options; o->name; ++o)
+      if (strlen(o->name) == len && memcmp(o->name, arg, len) == 0)
+	break;
+    if (!o->name)
+      return 0;
+    if (eq)
+      value = eq + 1;
+  }
+  void* dataptr = (char*)static_cast<protocol_options*>(this) + o->offset;
+  switch (o->type) {
+  case engine_option::flag:
+    if (value)
+      return 0;
+    *(int*)dataptr = o->flag_value;
+    return used;
+  case engine_option::integer: {
+    if (!value || !*value)
+      return 0;
+    char* end;
+    long i = strtol(value, &end, 10);
+    if (*end)
+      return 0;
+    *(int*)dataptr = i;
+    return used;
+  }
+  default:
+    if (!value)
+      return 0;
+    option_values[o - engine_options] = value;
+    *(const char**)dataptr = option_values[o - engine_options].c_str();
+    return used;
+  }
 }
 
-static void plain_send(fdibuf& in, int fd)
+// Read options one per line, up to a blank line.
+bool protocol_session::read_options(fdibuf& in)
 {
-  fdibuf netin(fd);
-  fdobuf netout(fd);
-  if (!netin || !netout)
-    protocol_fail(ERR_MSG_TEMPFAIL, "Error allocating I/O buffers");
-  if (use_starttls) {
-    protocol_starttls(netin, netout);
-    tls_send(in, fd);
+  mystring line;
+  while (in.getline(line, '\n')) {
+    if (line.length() == 0)
+      return true;
+    if (option(line.c_str(), 0) != 1)
+      return false;
   }
-  else
-    protocol_send(in, netin, netout);
+  return in.eof();
 }
 
-static void parse_option(mystring line)
+protocol_session::protocol_session(const protocol_engine& e)
+  : engine(&e), option_values(0), fd(-1), did_starttls(false), tls(0),
+    current(0), have_index(false), have_layout(false), prepared_size(0),
+    data_reader(0), result(0), phase_count(0), phase_current(0)
 {
-  if (line[0] != '-')
-    line = "--" + line;
-  const char* arg = strdup(line.c_str());
-  if (arg == NULL)
-    exit(ERR_CONFIG);
-  const char* args[3] = { argv0, arg, NULL };
-  if (cli_parse_args(2, (char**)args) != 2)
-    exit(ERR_CONFIG);
+  unsigned count = 0;
+  while (engine_options[count].name)
+    ++count;
+  option_values = new mystring[count];
+  phases_reset();
 }
 
-static void parse_options(void)
+protocol_session::~protocol_session()
 {
-  mystring line;
-  while (fin.getline(line, '\n')) {
-    if (line.length() == 0)
+  delete[] option_values;
+  delete data_reader;
+  delete current;
+  tls_free(*this);
+  if (fd >= 0)
+    close(fd);
+}
+
+// Microseconds on the monotonic clock, where there is one, so that the
+// timings are not thrown off by the system clock being set.
+static long long clock_usec(void)
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+#endif
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+// A phase entered more than once has the time of each visit added up.
+void protocol_session::phase_charge(long long now)
+{
+  if (phase_current)
+    phase_current->usec += now - phase_started;
+  phase_started = now;
+}
+
+void protocol_session::phase(const char* name)
+{
+  stats_phase(name);
+  phase_charge(clock_usec());
+  phase_current = 0;
+  if (name == 0)
+    return;
+  for (unsigned i = 0; i < phase_count; i++)
+    if (strcmp(phases[i].name, name) == 0) {
+      phase_current = &phases[i];
       return;
-    parse_option(line);
+    }
+  if (phase_count < MAX_PHASES) {
+    phase_current = &phases[phase_count++];
+    phase_current->name = name;
+    phase_current->usec = 0;
+  }
+}
+
+// Start timing the delivery of a new message.  The phases of the
+// session it shares with earlier messages are not charged to it.
+void protocol_session::phases_reset(void)
+{
+  started = phase_started = clock_usec();
+  phase_count = 0;
+  phase_current = 0;
+}
+
+// The phases as "name=usec" pairs separated by spaces.
+mystring protocol_session::phase_list(void) const
+{
+  mystring list;
+  for (unsigned i = 0; i < phase_count; i++) {
+    if (i > 0)
+      list += ' ';
+    list += phases[i].name;
+    list += '=';
+    list += itoa(phases[i].usec);
+  }
+  return list;
+}
+
+static void connected(void* s)
+{
+  ((protocol_session*)s)->phase("connect");
+}
+
+// The enhanced status code (RFC 3463) following the reply code in a
+// reply from the remote, if there is one.
+static mystring enhanced_status(const char* msg)
+{
+  const char* p = msg;
+  if (!isdigit(p[0]) || !isdigit(p[1]) || !isdigit(p[2])
+      || (p[3] != ' ' && p[3] != '-'))
+    return "";
+  p += 4;
+  if (*p != '2' && *p != '4' && *p != '5')
+    return "";
+  const char* start = p++;
+  for (int part = 0; part < 2; part++) {
+    if (*p++ != '.')
+      return "";
+    int digits = 0;
+    while (isdigit(*p) && digits < 3)
+      ++p, ++digits;
+    if (digits == 0)
+      return "";
   }
-  if (!fin.eof())
-    exit(ERR_CONFIG);
+  if (*p != 0 && *p != ' ' && *p != '\n')
+    return "";
+  return mystring(start, p - start);
 }
 
-int cli_main(int, char*[])
+// The fields common to all result records: netstrings holding the
+// result code, the enhanced status code, and the response text.
+static unsigned long result_size(int e, const mystring& status, const char* msg)
+{
+  return netstring_number_size(e) + netstring_size(status.length())
+    + netstring_size(strlen(msg));
+}
+
+static void result_fields(mystringbuilder& b, int e, const mystring& status,
+			  const char* msg)
+{
+  netstring_append(b, (long)e);
+  netstring_append(b, status);
+  netstring_append(b, msg, strlen(msg));
+}
+
+// The result of one recipient, reported before the result of its
+// message as a netstring holding "R", the address and the result.
+void protocol_session::recipient(const mystring& addr, int e, const char* msg)
+{
+  if (!use_results)
+    return;
+  const mystring status = enhanced_status(msg);
+  mystringbuilder record(1 + netstring_size(addr.length())
+			 + result_size(e, status, msg));
+  record << 'R';
+  netstring_append(record, addr);
+  result_fields(record, e, status, msg);
+  netstring_write(fout, record.c_str(), record.length());
+  fout.flush();
+}
+
+int protocol_session::fail(int e, const char* msg)
+{
+  result = e;
+  response = msg;
+  return e;
+}
+
+// With the results option, each message result is written to standard
+// output as a netstring holding "M", the result, the milliseconds the
+// delivery took, the microseconds spent in each of its phases, and the
+// capabilities of the remote, if they are known.
+// In multi-message mode, each message result is otherwise written to
+// standard output as a single line containing the numeric result code,
+// a space, and the response text with any line breaks replaced by
+// slashes.
+void protocol_session::report(int e, const char* msg)
+{
+  if (use_results) {
+    const long long now = clock_usec();
+    phase_charge(now);
+    const mystring status = enhanced_status(msg);
+    const mystring phases = phase_list();
+    const long ms = (now - started) / 1000;
+    mystringbuilder record(1 + result_size(e, status, msg)
+			   + netstring_number_size(ms)
+			   + netstring_size(phases.length())
+			   + netstring_size(caps.length()));
+    record << 'M';
+    result_fields(record, e, status, msg);
+    netstring_append(record, ms);
+    netstring_append(record, phases);
+    netstring_append(record, caps);
+    netstring_write(fout, record.c_str(), record.length());
+    fout.flush();
+  }
+  else if (use_multi)
+    fout << e << ' ' << mystring(msg).subst('\n', '/') << endl;
+  else
+    fout << msg << endl;
+  ferr << engine->name << (e ? ": Failed: " : ": Succeeded: ") << msg << endl;
+}
+
+// The time to wait in one phase of a session, in milliseconds, which
+// is the default for the phase unless the timeout option is shorter.
+int protocol_session::timeout(int seconds) const
+{
+  if (io_timeout > 0 && io_timeout < seconds)
+    seconds = io_timeout;
+  return seconds * 1000;
+}
+
+// Load the queue's index for a message, which must be at its start,
+// and take off the header line of the versioned queue file format.
+void protocol_session::load_index(fdibuf& in, const mystring& path)
+{
+  unsigned long size;
+  have_index = !!path && in.size_left(size)
+    && envindex_read(path, size, envindex);
+  layout = queuefile_header();
+  have_layout = queuefile_read(in, layout);
+}
+
+const envelope_index* protocol_session::index(void) const
+{
+  return have_index ? &envindex : 0;
+}
+
+// Read the envelope of a message, from its index where there is one,
+// leaving the message positioned at the data after the envelope.
+bool protocol_session::envelope(fdibuf& msg, mystring& sender,
+				list<mystring>& recipients)
+{
+  recipients.empty();
+  if (have_index) {
+    sender = envindex.sender;
+    for (list<mystring>::const_iter i(envindex.recipients); i; i++)
+      recipients.append(*i);
+    return msg.seek(envindex.offset);
+  }
+  if (!msg.getline(sender))
+    return false;
+  mystring tmp;
+  while (msg.getline(tmp)) {
+    if (!tmp)
+      return true;
+    recipients.append(tmp);
+  }
+  return false;
+}
+
+// Position the message at the data after the envelope.
+bool protocol_session::skip_envelope(fdibuf& msg)
+{
+  if (have_index)
+    return msg.seek(envindex.offset);
+  if (have_layout)
+    return msg.seek(layout.offset);
+  if (!msg.rewind())
+    return false;
+  mystring tmp;
+  while (msg.getline(tmp))
+    if (!tmp)
+      break;
+  return msg;
+}
+
+fdibuf& protocol_session::data(fdibuf& msg)
+{
+  delete data_reader;
+  data_reader = 0;
+  if (!have_layout || !layout.compressed)
+    return msg;
+  data_reader = new queuefile_data(msg, layout);
+  return data_reader->in();
+}
+
+// The size of the message after the envelope, where it is known
+// without reading the message through.  The index gives the size of a
+// compressed file, not of the message in it.
+bool protocol_session::size(unsigned long& size) const
+{
+  if (have_layout && layout.compressed)
+    size = layout.header_length + layout.body_size;
+  else if (have_index)
+    size = envindex.size - envindex.offset;
+  else if (have_layout)
+    size = layout.header_length + layout.body_size;
+  else
+    return false;
+  return true;
+}
+
+// Read the name of the next message, and with the fds option the
+// message itself, open on the descriptor that came with the name.  A
+// name that arrived along with the options has no descriptor with it.
+static bool next_job(protocol_session& s, mystring& filename, int& fd)
+{
+  fd = -1;
+  if (s.use_fds && fin.buffered() == 0)
+    return fdpass_recv(0, filename, fd) > 0 && !!filename;
+  return fin.getline(filename, '\n') && !!filename;
+}
+
+// Fetch the next message to send in multi-message mode.  The previous
+// message (other than the original one on FD 3) is closed.  While
+// waiting for the name of the message, the idle function is called
+// every keepalive seconds to keep the connection open.  A message that
+// cannot be opened or prepared has its result reported and is skipped.
+bool protocol_session::next(fdibuf*& in, int (*idle)(void*), void* data)
+{
+  delete data_reader;
+  data_reader = 0;
+  delete current;
+  current = in = 0;
+  result = 0;
+  if (!use_multi)
+    return false;
+  mystring filename;
+  for (;;) {
+    if (idle != 0 && keepalive > 0 && fin.buffered() == 0) {
+      struct pollfd p = { 0, POLLIN, 0 };
+      if (poll(&p, 1, keepalive * 1000) == 0) {
+	if (idle(data) != 0)
+	  return false;
+	continue;
+      }
+    }
+    int fd;
+    if (!next_job(*this, filename, fd))
+      break;
+    if (fd < 0)
+      fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      report(ERR_MSG_OPEN, "Could not open message");
+      continue;
+    }
+    current = new mmapibuf(fd, true);
+    phases_reset();
+    load_index(*current, envindex_path(filename));
+    int e = prep(*current);
+    if (e) {
+      report(e, response.c_str());
+      result = 0;
+      delete current;
+      current = 0;
+      continue;
+    }
+    in = current;
+    return true;
+  }
+  return false;
+}
+
+int protocol_session::prep(fdibuf& in)
+{
+  return engine->prep(*this, in);
+}
+
+int protocol_session::starttls(fdibuf& netin, fdobuf& netout)
+{
+  return engine->starttls(*this, netin, netout);
+}
+
+int protocol_session::send(fdibuf& in, fdibuf& netin, fdobuf& netout)
+{
+  return engine->send(*this, in, netin, netout);
+}
+
+int protocol_session::plain_send(fdibuf& in)
+{
+  fdibuf netin(fd);
+  fdobuf netout(fd);
+  if (!netin || !netout)
+    return fail(ERR_MSG_TEMPFAIL, "Error allocating I/O buffers");
+  if (use_starttls) {
+    int e = starttls(netin, netout);
+    return e ? e : tls_send(*this, in);
+  }
+  return send(in, netin, netout);
+}
+
+int protocol_session::run(fdibuf& in)
 {
-  parse_options();
   if (remote == 0)
-    protocol_fail(ERR_USAGE, "Remote host not set");
+    return fail(ERR_USAGE, "Remote host not set");
   if (port == 0)
-    port = use_tls ? default_tls_port : default_port;
+    port = use_tls ? engine->default_tls_port : engine->default_port;
   if (port < 0)
-    protocol_fail(ERR_USAGE, "Invalid value for port");
-  if (use_tls || use_starttls)
-    tls_init(remote);
-  fdibuf in(3, true);
-  protocol_prep(in);
-  int fd = tcpconnect(remote, port, source);
-  if(fd < 0)
-    protocol_fail(-fd, "Connect failed");
-  if (use_tls)
-    tls_send(in, fd);
-  else
-    plain_send(in, fd);
-  return 0;
+    return fail(ERR_USAGE, "Invalid value for port");
+  if (use_warm && !use_multi)
+    return fail(ERR_USAGE, "The warm option needs the multi option");
+  if (use_warm && keepalive == 0)
+    keepalive = 60;
+  int e;
+  if ((use_tls || use_starttls) && (e = tls_init(*this)) != 0)
+    return e;
+  // A warm session has no first message; the engine fetches it with
+  // next once it is ready to send.
+  if (!use_warm) {
+    load_index(in, index_file != 0 ? index_file : "");
+    if ((e = prep(in)) != 0)
+      return e;
+  }
+  // A remote given as an absolute path is a local socket, with nothing
+  // to look up.
+  if (remote[0] == '/') {
+    phase("connect");
+    fd = unixconnect(remote, connect_timeout);
+  }
+  else {
+    phase("dns");
+    fd = tcpconnect(remote, port, source, connect_timeout, connected, this);
+  }
+  if (fd < 0)
+    return fail(-fd, "Connect failed");
+  // Make sure a single write of a large block cannot block for longer
+  // than a block is allowed to take.
+  struct timeval tv = { timeout(TIMEOUT_BLOCK) / 1000, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+  return use_tls ? tls_send(*this, in) : plain_send(in);
 }
 
+// The options are read from standard input.  In multi-message mode the
+// results of the messages are reported as they are sent, and only a
+// failure of the session itself is reported at the end.  The result is
+// the exit status of the protocol.
+int protocol_main(protocol_session& s)
+{
+  s.phase("setup");
+  if (!s.read_options(fin))
+    return ERR_CONFIG;
+  mmapibuf in(3, true);
+  int e = s.run(in);
+  if (e || !s.use_multi)
+    s.report(e, s.response.c_str());
+  return e;
+}
@@ -1,37 +1,189 @@
 #ifndef NULLMAILER__PROTOCOL__H__
 #define NULLMAILER__PROTOCOL__H__
 
+#include "envindex.h"
 #include "fdbuf/fdbuf.h"
+#include "queuefile.h"
 
 #define DEFAULT_CA_FILE "/etc/ssl/certs/ca-certificates.crt"
 
-extern const int default_port;
-extern const int default_tls_port;
-extern void protocol_fail(int e, const char* msg);
-extern void protocol_succ(const char* msg);
+struct protocol_session;
+
+// A protocol built into the engine library.  The standalone protocol
+// programs and nullmailer-send both run sessions through these.  Each
+// function returns zero, or the error code with the message left in
+// the session's response.
+struct protocol_engine
+{
+  const char* name;
+  const char* help;
+  int default_port;
+  int default_tls_port;
+  int (*prep)(protocol_session& s, fdibuf& in);
+  int (*starttls)(protocol_session& s, fdibuf& netin, fdobuf& netout);
+  int (*send)(protocol_session& s, fdibuf& in, fdibuf& netin, fdobuf& netout);
+};
+extern const protocol_engine smtp_engine;
+extern const protocol_engine qmqp_engine;
+extern const protocol_engine lmtp_engine;
+extern const protocol_engine* protocol_find(const char* name);
 
 #define AUTH_DETECT 0
 #define AUTH_LOGIN 1
 #define AUTH_PLAIN 2
-extern const char* user;
-extern const char* pass;
-extern int auth_method;
-extern int port;
-extern int use_tls;
-extern int use_starttls;
-extern int tls_insecure;
-
-extern void protocol_prep(fdibuf& in);
-extern void protocol_send(fdibuf& in, fdibuf& netin, fdobuf& netout);
-extern void protocol_starttls(fdibuf& netin, fdobuf& netout);
-
-extern int tls_insecure;
-extern const char* tls_x509certfile;
-extern const char* tls_x509keyfile;
-extern const char* tls_x509cafile;
-extern const char* tls_x509crlfile;
-extern int tls_x509derfmt;
-extern void tls_init(const char* remote);
-extern void tls_send(fdibuf& in, int fd);
+
+// The settings of a session, which the engine options are stored into.
+struct protocol_options
+{
+  const char* remote;
+  int port;
+  const char* source;
+  const char* user;
+  const char* pass;
+  int auth_method;
+  int connect_timeout;
+  int io_timeout;
+  int use_tls;
+  int use_starttls;
+  int use_multi;
+  int use_warm;
+  int keepalive;
+  int use_results;
+  int use_fds;
+  const char* index_file;
+  const char* cached_caps;
+  int tls_insecure;
+  int use_ktls;
+  const char* tls_x509certfile;
+  const char* tls_x509keyfile;
+  const char* tls_x509cafile;
+  const char* tls_x509crlfile;
+  int tls_x509derfmt;
+  protocol_options();
+};
+
+struct engine_option
+{
+  char ch;
+  const char* name;
+  enum { flag, integer, string } type;
+  int flag_value;
+  unsigned offset;		// Of the setting in protocol_options
+  const char* helpstr;
+  const char* defaultstr;
+};
+extern const engine_option engine_options[];
+
+// Limits on waiting for the remote in the phases of a session, in
+// seconds, from RFC 5321 section 4.5.3.2.
+#define TIMEOUT_GREETING (5*60)
+#define TIMEOUT_COMMAND (5*60)
+#define TIMEOUT_DATA (2*60)
+#define TIMEOUT_BLOCK (3*60)
+#define TIMEOUT_FINAL (10*60)
+
+#define MAX_PHASES 16
+struct phase_time
+{
+  const char* name;
+  long long usec;
+};
+
+struct tls_state;
+
+// One session with a remote: its settings, the connection, the message
+// being sent and the results.  Nothing in it is shared with any other
+// session, and failures are returned as error codes rather than ending
+// the process.
+struct protocol_session : public protocol_options
+{
+  const protocol_engine* engine;
+  // The values of the string options, one for each of engine_options,
+  // which the settings point into.  Setting one again replaces it.
+  mystring* option_values;
+
+  // The connection.
+  int fd;
+  bool did_starttls;
+  tls_state* tls;
+
+  // The message being sent, and its index where the queue has one.
+  fdibuf* current;
+  envelope_index envindex;
+  bool have_index;
+  queuefile_header layout;
+  bool have_layout;
+  // What the engine worked out about the message before sending it.
+  mystring prepared;
+  unsigned long prepared_size;
+  // The reader of the message after its envelope, if it is compressed.
+  queuefile_data* data_reader;
+
+  // The last result set, and the capabilities of the remote reported
+  // with the results, for nullmailer-send to pass back with the caps
+  // option next time.
+  int result;
+  mystring response;
+  mystring caps;
+
+  // The start of the delivery of the current message, and the time
+  // spent in each phase of it so far.
+  long long started;
+  phase_time phases[MAX_PHASES];
+  unsigned phase_count;
+  phase_time* phase_current;
+  long long phase_started;
+
+  protocol_session(const protocol_engine& e);
+  ~protocol_session();
+
+  int option(const char* arg, const char* next);
+  bool read_options(fdibuf& in);
+  // Connect and send the message in, and in multi-message mode the
+  // ones that follow it.
+  int run(fdibuf& in);
+
+  // Set the result, returning its code.
+  int fail(int e, const char* msg);
+  void report(int e, const char* msg);
+  // Start timing the named phase of the delivery of the current
+  // message, ending the one before it.  The phases are reported with
+  // the result.
+  void phase(const char* name);
+  void recipient(const mystring& addr, int e, const char* msg);
+  int timeout(int seconds) const;
+
+  // Fetch the next message in multi-message mode.  If the idle
+  // function fails, the session is left with its result.
+  bool next(fdibuf*& in, int (*idle)(void*) = 0, void* data = 0);
+  const envelope_index* index(void) const;
+  bool envelope(fdibuf& msg, mystring& sender, list<mystring>& recipients);
+  bool skip_envelope(fdibuf& msg);
+  // The message after its envelope, which msg must be positioned at,
+  // with its body inflated if it is compressed in the queue.
+  fdibuf& data(fdibuf& msg);
+  bool size(unsigned long& size) const;
+
+  int prep(fdibuf& in);
+  int starttls(fdibuf& netin, fdobuf& netout);
+  int send(fdibuf& in, fdibuf& netin, fdobuf& netout);
+
+private:
+  void phase_charge(long long now);
+  void phases_reset(void);
+  mystring phase_list(void) const;
+  void load_index(fdibuf& in, const mystring& path);
+  int plain_send(fdibuf& in);
+  protocol_session(const protocol_session&);
+  protocol_session& operator=(const protocol_session&);
+};
+
+// Run one protocol session, with the options read from standard input
+// and the first message on FD 3, reporting its result.
+extern int protocol_main(protocol_session& s);
+
+extern int tls_init(protocol_session& s);
+extern int tls_send(protocol_session& s, fdibuf& in);
+extern void tls_free(protocol_session& s);
 
 #endif
@@ -20,33 +20,30 @@
 // <nullmailer-subscribe@lists.untroubled.org>.
 
 #include "config.h"
+#include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include "errcodes.h"
 #include "fdbuf/fdbuf.h"
 #include "hostname.h"
-#include "itoa.h"
+#include "list.h"
 #include "mystring/mystring.h"
 #include "netstring.h"
 #include "protocol.h"
 
-const int default_port = 628;
-const int default_tls_port = -1; // No standard for QMQP over SSL exists
-const char* cli_program = "qmqp";
-const char* cli_help_prefix = "Send an emal message via QMQP\n";
-
 class qmqp 
 {
+  protocol_session& s;
   fdibuf& in;
   fdobuf& out;
 public:
-  qmqp(fdibuf& netin, fdobuf& netout);
+  qmqp(protocol_session& sess, fdibuf& netin, fdobuf& netout);
   ~qmqp();
-  void send(fdibuf& msg, unsigned long size, const mystring& env);
+  int send(fdibuf& msg, unsigned long size, const mystring& env);
 };
 
-qmqp::qmqp(fdibuf& netin, fdobuf& netout)
-  : in(netin), out(netout)
+qmqp::qmqp(protocol_session& sess, fdibuf& netin, fdobuf& netout)
+  : s(sess), in(netin), out(netout)
 {
 }
 
@@ -54,43 +51,44 @@ qmqp::~qmqp()
 {
 }
 
-bool skip_envelope(fdibuf& msg)
-{
-  if(!msg.rewind())
-    return false;
-  mystring tmp;
-  while(msg.getline(tmp))
-    if(!tmp)
-      break;
-  return msg;
-}
-  
-void qmqp::send(fdibuf& msg, unsigned long size, const mystring& env)
+int qmqp::send(fdibuf& msg, unsigned long size, const mystring& env)
 {
-  if(!skip_envelope(msg))
-    protocol_fail(ERR_MSG_READ, "Error re-reading message");
-  unsigned long fullsize = strlen(itoa(size)) + 1 + size + 1 + env.length();
-  out << itoa(fullsize) << ":";	// Start the "outer" netstring
-  out << itoa(size) << ":";	// Start the message netstring
-  fdbuf_copy(msg, out, true);	// Send out the message
+  s.phase("data");
+  if(!s.skip_envelope(msg))
+    return s.fail(ERR_MSG_READ, "Error re-reading message");
+  out.set_timeout(s.timeout(TIMEOUT_BLOCK));
+  in.set_timeout(s.timeout(TIMEOUT_FINAL));
+  unsigned long fullsize = netstring_size(size) + env.length();
+  netstring_begin(out, fullsize);	// Start the "outer" netstring
+  netstring_begin(out, size);	// Start the message netstring
+  fdbuf_copy(s.data(msg), out, true);	// Send out the message
   out << ","			// End the message netstring
       << env			// The envelope is already encoded
       << ",";			// End the "outer" netstring
-  if(!out.flush())
-    protocol_fail(ERR_MSG_WRITE, "Error sending message to remote");
+  if(!out.flush()) {
+    if(out.error_number() == ETIMEDOUT)
+      return s.fail(ERR_TIMEOUT, "Timed out sending to remote");
+    return s.fail(ERR_MSG_WRITE, "Error sending message to remote");
+  }
+  s.phase("final");
   mystring response;
-  if(!in.getnetstring(response))
-    protocol_fail(ERR_PROTO, "Response from remote was not a netstring");
+  if(!in.getnetstring(response)) {
+    if(in.error_number() == ETIMEDOUT)
+      return s.fail(ERR_TIMEOUT, "Timed out waiting for a reply from remote");
+    return s.fail(ERR_PROTO, "Response from remote was not a netstring");
+  }
   switch(response[0]) {
-  case 'K': protocol_succ(response.c_str()+1); break;
-  case 'Z': protocol_fail(ERR_MSG_TEMPFAIL, response.c_str()+1); break;
-  case 'D': protocol_fail(ERR_MSG_PERMFAIL, response.c_str()+1); break;
-  default: protocol_fail(ERR_PROTO, "Invalid status byte in response");
+  case 'K': return s.fail(0, response.c_str()+1);
+  case 'Z': return s.fail(ERR_MSG_TEMPFAIL, response.c_str()+1);
+  case 'D': return s.fail(ERR_MSG_PERMFAIL, response.c_str()+1);
+  default: return s.fail(ERR_PROTO, "Invalid status byte in response");
   }
 }
 
-bool compute_size(fdibuf& msg, unsigned long& size)
+static bool compute_size(protocol_session& s, fdibuf& msg, unsigned long& size)
 {
+  if(s.size(size) || msg.size_left(size))
+    return size > 0;
   char buf[4096];
   size = 0;
   while(msg.read(buf, 4096))
@@ -100,42 +98,60 @@ bool compute_size(fdibuf& msg, unsigned long& size)
   return size > 0;
 }
 
-bool make_envelope(fdibuf& msg, mystring& env)
+static bool make_envelope(protocol_session& s, fdibuf& msg, mystring& env)
 {
-  mystring tmp;
-  while(msg.getline(tmp)) {
-    if(!tmp)
-      return true;
-    env += str2net(tmp);
-  }
-  return false;
+  mystring sender;
+  list<mystring> recipients;
+  if(!s.envelope(msg, sender, recipients))
+    return false;
+  // The envelope is encoded once, into a string of its exact size.
+  unsigned long size = netstring_size(sender.length());
+  for(list<mystring>::const_iter i(recipients); i; i++)
+    size += netstring_size((*i).length());
+  mystringbuilder b(size);
+  netstring_append(b, sender);
+  for(list<mystring>::const_iter i(recipients); i; i++)
+    netstring_append(b, *i);
+  env = b.str();
+  return true;
 }
     
-bool preload_data(fdibuf& msg, unsigned long& size, mystring& env)
+static bool preload_data(protocol_session& s, fdibuf& msg,
+			 unsigned long& size, mystring& env)
 {
-  return make_envelope(msg, env) &&
-    compute_size(msg, size);
+  return make_envelope(s, msg, env) &&
+    compute_size(s, msg, size);
 }
 
-static unsigned long msg_size;
-static mystring msg_envelope;
-
-void protocol_prep(fdibuf& in)
+static int qmqp_prep(protocol_session& s, fdibuf& in)
 {
-  if(!preload_data(in, msg_size, msg_envelope))
-    protocol_fail(ERR_MSG_READ, "Error reading message");
+  if(!preload_data(s, in, s.prepared_size, s.prepared))
+    return s.fail(ERR_MSG_READ, "Error reading message");
+  return 0;
 }
 
-void protocol_starttls(fdibuf& netin, fdobuf& netout)
+static int qmqp_starttls(protocol_session& s, fdibuf& netin, fdobuf& netout)
 {
-  protocol_fail(ERR_USAGE, "QMQP does not support STARTTLS");
   (void)netin;
   (void)netout;
+  return s.fail(ERR_USAGE, "QMQP does not support STARTTLS");
 }
 
-void protocol_send(fdibuf& in, fdibuf& netin, fdobuf& netout)
+static int qmqp_send(protocol_session& s, fdibuf& in, fdibuf& netin, fdobuf& netout)
 {
+  if (s.use_warm)
+    return s.fail(ERR_USAGE, "QMQP does not support warm sessions");
   alarm(60*60);			// Connection must close after an hour
-  qmqp conn(netin, netout);
-  conn.send(in, msg_size, msg_envelope);
+  qmqp conn(s, netin, netout);
+  return conn.send(in, s.prepared_size, s.prepared);
 }
+
+const protocol_engine qmqp_engine = {
+  "qmqp",
+  "Send an emal message via QMQP\n",
+  628,
+  -1, // No standard for QMQP over SSL exists
+  qmqp_prep,
+  qmqp_starttls,
+  qmqp_send,
+};
@@ -20,235 +20,756 @@
 // <nullmailer-subscribe@lists.untroubled.org>.
 
 #include "config.h"
+#include <ctype.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include "base64.h"
 #include "connect.h"
+#include "dotstuff.h"
 #include "errcodes.h"
 #include "fdbuf/fdbuf.h"
 #include "itoa.h"
+#include "list.h"
 #include "mystring/mystring.h"
+#include "mystring/builder.h"
 #include "protocol.h"
 
-const int default_port = 25;
-const int default_tls_port = 465;
-const char* cli_program = "smtp";
-const char* cli_help_prefix = "Send an email message via SMTP\n";
+// The service extensions a remote announced in its reply to EHLO,
+// parsed once per connection.  They are also written out as a list of
+// keywords, such as "EHLO PIPELINING SIZE=10240000 AUTH=PLAIN,LOGIN",
+// which nullmailer-send keeps for the remote and hands back with the
+// caps option on later connections.
+struct smtp_caps
+{
+  enum {
+    PIPELINING = 1, CHUNKING = 2, EIGHTBITMIME = 4, STARTTLS = 8,
+    SIZE = 16, AUTHPLAIN = 32, AUTHLOGIN = 64,
+  };
+  bool known;
+  bool esmtp;
+  unsigned flags;
+  unsigned long size;		// The SIZE limit, or 0 if there is none
+  smtp_caps() : known(false), esmtp(false), flags(0), size(0) { }
+  bool has(unsigned flag) const { return (flags & flag) != 0; }
+  bool too_big(unsigned long bytes) const
+  {
+    return has(SIZE) && size > 0 && bytes > size;
+  }
+  void add(const mystringview& keyword, const mystringview& params,
+	   char sep);
+  void start(bool ehlo);
+  void parse_line(const mystringview& line);
+  void parse_list(const char* list);
+  mystring str() const;
+};
+
+static const struct { const char* name; unsigned flag; } cap_names[] = {
+  { "PIPELINING", smtp_caps::PIPELINING },
+  { "CHUNKING", smtp_caps::CHUNKING },
+  { "8BITMIME", smtp_caps::EIGHTBITMIME },
+  { "STARTTLS", smtp_caps::STARTTLS },
+  { 0, 0 }
+};
+
+static int issep(char ch)
+{
+  return ch == ' ' || ch == '\n' || ch == '\0';
+}
+
+// Add one extension, with its parameters separated by sep.
+void smtp_caps::add(const mystringview& keyword, const mystringview& params,
+		    char sep)
+{
+  for (int i = 0; cap_names[i].name; i++)
+    if (keyword.equal_nocase(cap_names[i].name))
+      flags |= cap_names[i].flag;
+  if (keyword.equal_nocase("SIZE")) {
+    flags |= SIZE;
+    size = 0;
+    for (unsigned i = 0; i < params.length() && isdigit(params[i]); i++)
+      size = size * 10 + params[i] - '0';
+  }
+  else if (keyword.equal_nocase("AUTH")) {
+    for (unsigned start = 0; start <= params.length(); ) {
+      int end = params.find_first(sep, start);
+      if (end < 0)
+	end = params.length();
+      const mystringview mech = params.sub(start, end - start);
+      if (mech.equal_nocase("PLAIN"))
+	flags |= AUTHPLAIN;
+      else if (mech.equal_nocase("LOGIN"))
+	flags |= AUTHLOGIN;
+      start = end + 1;
+    }
+  }
+}
+
+// Start over on the reply to EHLO (or HELO), whose lines after the
+// first are then given to parse_line as they are read.
+void smtp_caps::start(bool ehlo)
+{
+  *this = smtp_caps();
+  known = true;
+  esmtp = ehlo;
+}
+
+// Parse one line of the reply to EHLO, such as "250-SIZE 10240000",
+// where it sits in the input buffer.
+void smtp_caps::parse_line(const mystringview& line)
+{
+  if (!esmtp || line.length() < 4)
+    return;
+  const mystringview ext = line.right(4);
+  const int end = ext.find_first(' ');
+  if (end < 0)
+    add(ext, mystringview(), ' ');
+  else
+    add(ext.left(end), ext.right(end + 1), ' ');
+}
+
+// Parse a list of keywords written out by str.
+void smtp_caps::parse_list(const char* list)
+{
+  *this = smtp_caps();
+  if (strncmp(list, "EHLO", 4) == 0)
+    esmtp = true;
+  else if (strncmp(list, "HELO", 4) != 0)
+    return;
+  known = true;
+  for (const char* s = list + 4; *s == ' '; ) {
+    const char* end = ++s;
+    while (!issep(*end) && *end != '=')
+      ++end;
+    const mystringview keyword(s, end - s);
+    if (*end == '=')
+      ++end;
+    for (s = end; !issep(*s); ++s)
+      ;
+    add(keyword, mystringview(end, s - end), ',');
+  }
+}
+
+mystring smtp_caps::str() const
+{
+  if (!known)
+    return "";
+  mystring list = esmtp ? "EHLO" : "HELO";
+  for (int i = 0; cap_names[i].name; i++)
+    if (has(cap_names[i].flag)) {
+      list += ' ';
+      list += cap_names[i].name;
+    }
+  if (has(SIZE)) {
+    list += " SIZE=";
+    list += itoa(size);
+  }
+  if (has(AUTHPLAIN | AUTHLOGIN)) {
+    list += " AUTH=";
+    if (has(AUTHPLAIN))
+      list += has(AUTHLOGIN) ? "PLAIN,LOGIN" : "PLAIN";
+    else
+      list += "LOGIN";
+  }
+  return list;
+}
+
+#define INBUF_SIZE (64*1024)
+#define OUTBUF_SIZE (INBUF_SIZE * 2 + 2)
+// The most BDAT chunks sent ahead of their replies with PIPELINING.
+#define BDAT_WINDOW 2
+
+// Returned by get and put when the remote did not answer in time, with
+// the reason in the result.
+#define TIMED_OUT -2
 
 class smtp 
 {
+  protocol_session& s;
   fdibuf& in;
   fdobuf& out;
-  mystring caps;
+  // Whether the session speaks LMTP (RFC 2033) rather than SMTP.
+  const bool lmtp;
+  // The reply being read, kept to reuse its storage.
+  mystringbuilder reply;
+  // The recipients of the current message that the remote accepted.
+  list<mystring> rcpts;
+  // The capabilities of the current connection once it has got that
+  // far.
+  smtp_caps live_set;
+  char* inbuf;
+  char* outbuf;
 public:
-  smtp(fdibuf& netin, fdobuf& netout);
+  smtp(protocol_session& sess, fdibuf& netin, fdobuf& netout);
   ~smtp();
-  int get(mystring& str);
-  int put(mystring cmd, mystring& result);
-  void docmd(mystring cmd, int range, mystring& result);
-  void docmd(mystring cmd, int range);
-  void dohelo(bool ehlo);
-  bool hascap(const char* name, const char* word = NULL);
-  void auth_login(void);
-  void auth_plain(void);
-  void send_data(fdibuf& msg);
-  void send_envelope(fdibuf& msg);
-  void send(fdibuf& msg);
+  int get(mystring& str, int quiet = 0, smtp_caps* caps = 0);
+  int put(const mystring& cmd, mystring& result, int quiet = 0,
+	  smtp_caps* caps = 0);
+  int trycmd(const mystring& cmd, int range, mystring& result,
+	     int quiet = 0, smtp_caps* caps = 0);
+  int docmd(const mystring& cmd, int range, mystring& result,
+	    int quiet = 0);
+  int docmd(const mystring& cmd, int range);
+  int dohelo(bool ehlo);
+  bool hascap(unsigned flag) const { return live_set.has(flag); }
+  mystring mail_from(const mystring& sender);
+  int auth_login(void);
+  int auth_plain(void);
+  int auth(void);
+  int encode_block(fdibuf& msg, dotstuffer& enc, bool& last,
+		   unsigned& len, mystring& result);
+  int send_data(fdibuf& msg, mystring& result);
+  int send_bdat(fdibuf& msg, mystring& result);
+  int send_envelope(fdibuf& msg, mystring& result);
+  int send_envelope_pipelined(fdibuf& msg, mystring& result);
+  int lmtp_replies(const mystring& cmd, mystring& result);
+  int send(fdibuf& msg, mystring& result);
+  void quit();
+  void expect(int seconds);
+  int write_failed(mystring& result);
 };
 
-smtp::smtp(fdibuf& netin, fdobuf& netout)
-  : in(netin), out(netout)
+smtp::smtp(protocol_session& sess, fdibuf& netin, fdobuf& netout)
+  : s(sess), in(netin), out(netout), lmtp(s.engine == &lmtp_engine),
+    inbuf(0), outbuf(0)
+{
+  out.set_timeout(s.timeout(TIMEOUT_BLOCK));
+  expect(TIMEOUT_COMMAND);
+}
+
+// Set how long to wait for the next replies.
+void smtp::expect(int seconds)
+{
+  in.set_timeout(s.timeout(seconds));
+}
+
+int smtp::write_failed(mystring& result)
 {
+  if (out.error_number() == ETIMEDOUT) {
+    result = "Timed out sending to remote";
+    return ERR_TIMEOUT;
+  }
+  result = "Error sending message to remote";
+  return ERR_MSG_WRITE;
 }
 
 smtp::~smtp()
 {
+  delete[] inbuf;
+  delete[] outbuf;
 }
 
-int smtp::get(mystring& str)
+// Read one reply, taking its code and whether another line follows
+// from each line where it sits in the input buffer.  Only the text the
+// caller wants is copied out: none at all for a reply with a code in
+// quiet (quiet..quiet+99), and otherwise the lines joined by newlines.
+// The lines after the first of a quiet reply go to caps.
+int smtp::get(mystring& str, int quiet, smtp_caps* caps)
 {
-  mystring tmp;
-  str = "";
+  const char* data;
+  unsigned len;
   int code = -1;
-  while(in.getline(tmp)) {
-    if(tmp[tmp.length()-1] == '\r')
-      tmp = tmp.left(tmp.length()-1);
-    code = atoi(tmp.c_str());
-    if(!!str)
-      str += "\n";
-    str += tmp;
-    if(tmp[3] != '-')
+  bool keep = true;
+  reply.clear();
+  while(in.getline(data, len)) {
+    mystringview line(data, len);
+    if(!!line && line[line.length()-1] == '\r')
+      line = line.left(line.length()-1);
+    if(code < 0) {
+      code = 0;
+      for(unsigned i = 0; i < line.length() && isdigit(line[i]); i++)
+	code = code * 10 + line[i] - '0';
+      keep = !quiet || code < quiet || code >= quiet + 100;
+    }
+    else if(!keep && caps)
+      caps->parse_line(line);
+    if(keep) {
+      if(!reply.empty())
+	reply << '\n';
+      reply << line;
+    }
+    if(line.length() < 4 || line[3] != '-')
       break;
   }
+  if(!in && in.error_number() == ETIMEDOUT) {
+    str = "Timed out waiting for a reply from remote";
+    return TIMED_OUT;
+  }
+  str = mystring(reply.c_str(), reply.length());
   return code;
 }
 
-int smtp::put(mystring cmd, mystring& result)
+int smtp::put(const mystring& cmd, mystring& result, int quiet,
+	      smtp_caps* caps)
 {
-  out << cmd << "\r\n";
-  if(!out.flush())
+  struct iovec iov[2];
+  iov[0].iov_base = (void*)cmd.c_str();
+  iov[0].iov_len = cmd.length();
+  iov[1].iov_base = (void*)"\r\n";
+  iov[1].iov_len = 2;
+  if(!out.writev(iov, 2) || !out.flush()) {
+    if(out.error_number() == ETIMEDOUT) {
+      write_failed(result);
+      return TIMED_OUT;
+    }
     return -1;
-  return get(result);
+  }
+  return get(result, quiet, caps);
 }
 
-void smtp::docmd(mystring cmd, int range, mystring& result)
+// Returns zero if the response code was in range, otherwise the error
+// code to report.
+int smtp::trycmd(const mystring& cmd, int range, mystring& result,
+		 int quiet, smtp_caps* caps)
 {
   int code;
   if(!cmd)
-    code = get(result);
+    code = get(result, quiet, caps);
   else
-    code = put(cmd, result);
-  if(code < range || code >= (range+100)) {
-    int e;
-    if(code >= 500)
-      e = ERR_MSG_PERMFAIL;
-    else if(code >= 400)
-      e = ERR_MSG_TEMPFAIL;
-    else
-      e = ERR_PROTO;
-    out << "QUIT\r\n";
-    out.flush();
-    protocol_fail(e, result.c_str());
+    code = put(cmd, result, quiet, caps);
+  if(code >= range && code < (range+100))
+    return 0;
+  if(code == TIMED_OUT)
+    return ERR_TIMEOUT;
+  if(code >= 500)
+    return ERR_MSG_PERMFAIL;
+  if(code >= 400)
+    return ERR_MSG_TEMPFAIL;
+  return ERR_PROTO;
+}
+
+// Run a command that the session cannot go on without, ending the
+// session if it fails.
+int smtp::docmd(const mystring& cmd, int range, mystring& result, int quiet)
+{
+  int e = trycmd(cmd, range, result, quiet);
+  if(e) {
+    quit();
+    return s.fail(e, result.c_str());
   }
+  return 0;
 }
 
-void smtp::docmd(mystring cmd, int range)
+// The text of the reply is only kept if the command fails.
+int smtp::docmd(const mystring& cmd, int range)
 {
   mystring msg;
-  docmd(cmd, range, msg);
+  return docmd(cmd, range, msg, range);
 }
 
-void smtp::dohelo(bool ehlo)
+int smtp::dohelo(bool ehlo)
 {
   mystring hh = getenv("HELOHOST");
-  if (!hh) protocol_fail(1, "$HELOHOST is not set");
-  docmd((ehlo ? "EHLO " : "HELO ") + hh, 200, caps);
+  if (!hh) return s.fail(1, "$HELOHOST is not set");
+  // The extensions go into the capability set as the lines of a good
+  // reply are read, and the text is only kept if it fails.
+  mystring result;
+  live_set.start(ehlo);
+  int e = trycmd((lmtp ? "LHLO " : ehlo ? "EHLO " : "HELO ") + hh, 200,
+		 result, 200, &live_set);
+  // Fall back to HELO for servers that do not know about ESMTP.  LMTP
+  // has no older greeting to fall back to.
+  if (e == ERR_MSG_PERMFAIL && ehlo && !lmtp) {
+    ehlo = false;
+    live_set.start(ehlo);
+    e = trycmd("HELO " + hh, 200, result, 200);
+  }
+  if (e) {
+    quit();
+    return s.fail(e, result.c_str());
+  }
+  // What the remote says now replaces what nullmailer-send has cached
+  // for it, through the results, whether it has changed or not.
+  s.caps = live_set.str();
+  return 0;
 }
 
-static int issep(char ch)
+int smtp::auth_login(void)
 {
-  return ch == ' ' || ch == '\n' || ch == '\0';
+  mystring encoded;
+  base64_encode(s.user, encoded);
+  int e = docmd("AUTH LOGIN " + encoded, 300);
+  if (e)
+    return e;
+  encoded = "";
+  base64_encode(s.pass, encoded);
+  return docmd(encoded, 200);
 }
 
-bool smtp::hascap(const char* name, const char* word)
+int smtp::auth_plain(void)
 {
-  const size_t namelen = strlen(name);
-  int i = -1;
-  do {
-    const char* s = caps.c_str() + i + 5;
-    if (strncasecmp(s, name, namelen) == 0) {
-      if (s[namelen] == '\n')
-	return word == NULL;
-      else if (s[namelen] == ' ') {
-	if (word == NULL)
-	  return true;
-	s += namelen + 1;
-	const size_t wordlen = strlen(word);
-	do {
-	  if (strncasecmp(s, word, wordlen) == 0 && issep(s[wordlen]))
-	    return true;
-	  while (!issep(*s))
-	    ++s;
-	} while (*s++ == ' ');
-	return false;
-      }
+  const unsigned userlen = strlen(s.user), passlen = strlen(s.pass);
+  mystringbuilder plain(userlen * 2 + passlen + 2);
+  plain << s.user << '\0' << s.user << '\0' << s.pass;
+  // The command keeps the room reserved for it, so the encoding is
+  // appended in place.
+  mystringbuilder cmd(11 + (plain.length() + 2) / 3 * 4);
+  cmd << "AUTH PLAIN ";
+  mystring encoded = cmd.str();
+  base64_encode(plain.str(), encoded);
+  return docmd(encoded, 200);
+}
+
+int smtp::auth(void)
+{
+  s.phase("auth");
+  if (s.auth_method == AUTH_LOGIN)
+    return auth_login();
+  if (s.auth_method == AUTH_PLAIN)
+    return auth_plain();
+  // Detect method
+  if (hascap(smtp_caps::AUTHPLAIN))
+    return auth_plain();
+  if (hascap(smtp_caps::AUTHLOGIN))
+    return auth_login();
+  return s.fail(ERR_MSG_TEMPFAIL, "Server does not advertise any supported authentication methods");
+}
+
+// The result of the recipients of a message, given the first error
+// from a recipient.  When results are reported per recipient, the
+// message goes to the recipients that were accepted and nullmailer-send
+// deals with the others.  Otherwise any rejected recipient fails the
+// whole message.
+static int rcpt_result(const protocol_session& s, int e, unsigned accepted,
+		       const mystring& reply, mystring& result)
+{
+  if (!e || (s.use_results && accepted > 0))
+    return 0;
+  result = reply;
+  return e;
+}
+
+// The MAIL FROM command, declaring the size of the message where the
+// remote takes it and it is known up front (RFC 1870).
+mystring smtp::mail_from(const mystring& sender)
+{
+  mystring cmd = "MAIL FROM:<" + sender + ">";
+  unsigned long size;
+  if (hascap(smtp_caps::SIZE) && s.size(size)) {
+    cmd += " SIZE=";
+    cmd += itoa(size);
+  }
+  return cmd;
+}
+
+// Send MAIL FROM and all the RCPT TO commands in one batch, and then
+// read the replies in order.  DATA is held back until all of them have
+// been read.  When results are reported per recipient, it is then sent
+// to the recipients that were accepted and the others are reported
+// back; otherwise any rejected recipient fails the whole envelope.
+int smtp::send_envelope_pipelined(fdibuf& msg, mystring& result)
+{
+  mystring sender;
+  list<mystring> recipients;
+  s.envelope(msg, sender, recipients);
+  rcpts.empty();
+  out << mail_from(sender) << "\r\n";
+  for (list<mystring>::const_iter i(recipients); i; i++)
+    out << "RCPT TO:<" << *i << ">\r\n";
+  if(!out.flush())
+    return write_failed(result);
+  int e = trycmd("", 200, result);
+  unsigned accepted = 0;
+  int rcpt_e = 0;
+  mystring rcpt_reply;
+  for (list<mystring>::const_iter i(recipients); i; i++) {
+    mystring reply;
+    int r = trycmd("", 200, reply);
+    s.recipient(*i, r, reply.c_str());
+    if (!r) {
+      ++accepted;
+      rcpts.append(*i);
+    }
+    else if (!rcpt_e) {
+      rcpt_e = r;
+      rcpt_reply = reply;
     }
-    i = caps.find_first('\n', i+1);
-  } while (i > 0);
-  return false;
+  }
+  if (e)
+    return e;
+  return rcpt_result(s, rcpt_e, accepted, rcpt_reply, result);
 }
 
-void smtp::auth_login(void)
+int smtp::send_envelope(fdibuf& msg, mystring& result)
 {
-  mystring encoded;
-  base64_encode(user, encoded);
-  docmd("AUTH LOGIN " + encoded, 300);
-  encoded = "";
-  base64_encode(pass, encoded);
-  docmd(encoded, 200);
+  expect(TIMEOUT_COMMAND);
+  if (hascap(smtp_caps::PIPELINING))
+    return send_envelope_pipelined(msg, result);
+  mystring sender;
+  list<mystring> recipients;
+  s.envelope(msg, sender, recipients);
+  rcpts.empty();
+  int e = trycmd(mail_from(sender), 200, result);
+  if (e)
+    return e;
+  unsigned accepted = 0;
+  mystring rcpt_reply;
+  for (list<mystring>::const_iter i(recipients); i; i++) {
+    mystring reply;
+    int r = trycmd("RCPT TO:<" + *i + ">", 200, reply);
+    s.recipient(*i, r, reply.c_str());
+    if (!r) {
+      ++accepted;
+      rcpts.append(*i);
+    }
+    else if (!e) {
+      e = r;
+      rcpt_reply = reply;
+      if (!s.use_results)
+	break;
+    }
+  }
+  return rcpt_result(s, e, accepted, rcpt_reply, result);
 }
 
-void smtp::auth_plain(void)
+// Send the command that ends the data, and read the reply an LMTP
+// server gives to it for each accepted recipient in turn.  Each
+// recipient gets its own result, and the message as a whole succeeds
+// or fails as it would have on the replies to RCPT.
+int smtp::lmtp_replies(const mystring& cmd, mystring& result)
 {
-  mystring plain(user);
-  plain += '\0';
-  plain += user;
-  plain += '\0';
-  plain += pass;
-  mystring encoded = "AUTH PLAIN ";
-  base64_encode(plain, encoded);
-  docmd(encoded, 200);
+  unsigned delivered = 0;
+  int e = 0;
+  mystring next = cmd;
+  mystring failed_reply;
+  for (list<mystring>::const_iter i(rcpts); i; i++) {
+    mystring reply;
+    int r = trycmd(next, 200, reply);
+    next = "";
+    s.recipient(*i, r, reply.c_str());
+    if (!r) {
+      ++delivered;
+      result = reply;
+    }
+    else if (!e) {
+      e = r;
+      failed_reply = reply;
+    }
+  }
+  return rcpt_result(s, e, delivered, failed_reply, result);
+}
+
+// Read the next block of the message and convert it into outbuf,
+// setting len to the length of the converted block.
+int smtp::encode_block(fdibuf& msg, dotstuffer& enc, bool& last,
+		       unsigned& len, mystring& result)
+{
+  if (!inbuf) {
+    inbuf = new char[INBUF_SIZE];
+    outbuf = new char[OUTBUF_SIZE];
+  }
+  last = !msg.read(inbuf, INBUF_SIZE);
+  if(last && !msg.eof()) {
+    result = "Error reading message";
+    return ERR_MSG_READ;
+  }
+  len = enc.encode(inbuf, msg.last_count(), outbuf);
+  if(last)
+    len += enc.finish(outbuf + len);
+  return 0;
+}
+
+int smtp::send_data(fdibuf& msg, mystring& result)
+{
+  s.phase("data");
+  expect(TIMEOUT_DATA);
+  int e = trycmd("DATA", 300, result);
+  if(e)
+    return e;
+  dotstuffer enc;
+  bool last;
+  do {
+    unsigned len;
+    if((e = encode_block(msg, enc, last, len, result)) != 0)
+      return e;
+    if(!out.write(outbuf, len))
+      return write_failed(result);
+  } while(!last);
+  s.phase("final");
+  expect(TIMEOUT_FINAL);
+  return lmtp ? lmtp_replies(".", result) : trycmd(".", 200, result);
 }
 
-void smtp::send_envelope(fdibuf& msg)
+// Send the message body in large BDAT chunks.  No dot-stuffing is
+// needed, only the conversion of line endings to CRLF.  With PIPELINING
+// the next chunk goes out while the reply to the one before it is on
+// its way, up to BDAT_WINDOW chunks ahead of the replies, so that
+// neither end fills its socket buffers waiting on the other.  The first
+// negative reply stops the message; the replies to the chunks already
+// sent are still read, to keep the session in step.
+int smtp::send_bdat(fdibuf& msg, mystring& result)
 {
-  mystring tmp;
-  msg.getline(tmp);
-  docmd("MAIL FROM:<" + tmp + ">", 200);
-  while(msg.getline(tmp) && !!tmp)
-    docmd("RCPT TO:<" + tmp + ">", 200);
+  const unsigned window = hascap(smtp_caps::PIPELINING) ? BDAT_WINDOW : 1;
+  dotstuffer enc(false);
+  s.phase("data");
+  expect(TIMEOUT_FINAL);
+  unsigned pending = 0;
+  int e = 0;
+  for (;;) {
+    bool last;
+    unsigned len;
+    if((e = encode_block(msg, enc, last, len, result)) != 0)
+      return e;
+    // The chunk goes out with its command in one write, straight
+    // from the encoding buffer.
+    mystring cmd = mystringjoin("BDAT ") + itoa(len) + (last ? " LAST\r\n" : "\r\n");
+    struct iovec iov[2];
+    iov[0].iov_base = (void*)cmd.c_str();
+    iov[0].iov_len = cmd.length();
+    iov[1].iov_base = outbuf;
+    iov[1].iov_len = len;
+    if(!out.writev(iov, 2) || !out.flush())
+      return write_failed(result);
+    ++pending;
+    if (last)
+      s.phase("final");
+    // With LMTP the last chunk is answered for each recipient.
+    if (lmtp && last)
+      --pending;
+    while (pending >= window || (pending > 0 && (last || e))) {
+      mystring reply;
+      int r = trycmd("", 200, reply);
+      --pending;
+      if (!e) {
+	e = r;
+	result = reply;
+      }
+    }
+    if (lmtp && last && !e)
+      e = lmtp_replies("", result);
+    if (e || last)
+      return e;
+  }
 }
 
-void smtp::send_data(fdibuf& msg)
+// The message that a remote will not take for its size, without trying.
+static const char too_big_msg[] = "Message is larger than the remote's size limit";
+
+int smtp::send(fdibuf& msg, mystring& result)
 {
-  docmd("DATA", 300);
-  mystring tmp;
-  while(msg.getline(tmp)) {
-    if((tmp[0] == '.' && !(out << ".")) ||
-       !(out << tmp << "\r\n"))
-      protocol_fail(ERR_MSG_WRITE, "Error sending message to remote");
+  s.phase("envelope");
+  unsigned long size;
+  if (s.size(size) && live_set.too_big(size)) {
+    result = too_big_msg;
+    return ERR_MSG_PERMFAIL;
   }
-  docmd(".", 200, tmp);
+  int e = send_envelope(msg, result);
+  if (e)
+    return e;
+  fdibuf& data = s.data(msg);
+  return hascap(smtp_caps::CHUNKING)
+    ? send_bdat(data, result) : send_data(data, result);
+}
+
+void smtp::quit()
+{
   out << "QUIT\r\n";
   out.flush();
-  protocol_succ(tmp.c_str());
 }
 
-void smtp::send(fdibuf& msg)
+// Before connecting, check the size of the message against the limit
+// the remote was last seen with, as nullmailer-send passed it in.  Once
+// connected, the limit the remote gave is checked as each message is
+// sent.
+static int smtp_prep(protocol_session& s, fdibuf&)
 {
-  send_envelope(msg);
-  send_data(msg);
+  if (!!s.caps || s.cached_caps == 0)
+    return 0;
+  smtp_caps cached_set;
+  cached_set.parse_list(s.cached_caps);
+  unsigned long size;
+  if (s.size(size) && cached_set.too_big(size))
+    return s.fail(ERR_MSG_PERMFAIL, too_big_msg);
+  return 0;
 }
 
-void protocol_prep(fdibuf&)
+static int smtp_starttls(protocol_session& s, fdibuf& netin, fdobuf& netout)
 {
+  smtp conn(s, netin, netout);
+  s.phase("greeting");
+  conn.expect(TIMEOUT_GREETING);
+  int e = conn.docmd("", 200);
+  if (e)
+    return e;
+  s.phase("helo");
+  conn.expect(TIMEOUT_COMMAND);
+  if ((e = conn.dohelo(true)) != 0)
+    return e;
+  s.phase("starttls");
+  if ((e = conn.docmd("STARTTLS", 200)) != 0)
+    return e;
+  s.did_starttls = true;
+  return 0;
 }
 
-static int did_starttls = 0;
-
-void protocol_starttls(fdibuf& netin, fdobuf& netout)
+// Keep an idle connection open between messages.
+static int smtp_keepalive(void* conn)
 {
-  smtp conn(netin, netout);
-  conn.docmd("", 200);
-  conn.dohelo(true);
-  conn.docmd("STARTTLS", 200);
-  did_starttls = 1;
+  return ((smtp*)conn)->docmd("NOOP", 200);
 }
 
-void protocol_send(fdibuf& in, fdibuf& netin, fdobuf& netout)
+static int smtp_send(protocol_session& s, fdibuf& in, fdibuf& netin, fdobuf& netout)
 {
-  smtp conn(netin, netout);
-  if (!did_starttls)
-    conn.docmd("", 200);
+  smtp conn(s, netin, netout);
+  int e;
+  if (!s.did_starttls) {
+    s.phase("greeting");
+    conn.expect(TIMEOUT_GREETING);
+    if ((e = conn.docmd("", 200)) != 0)
+      return e;
+    conn.expect(TIMEOUT_COMMAND);
+  }
+
+  s.phase("helo");
+  if ((e = conn.dohelo(true)) != 0)
+    return e;
+  if (s.user != 0 && s.pass != 0 && (e = conn.auth()) != 0)
+    return e;
 
-  if (user != 0 && pass != 0) {
-    conn.dohelo(true);
-    if (auth_method == AUTH_LOGIN)
-      conn.auth_login();
-    else if (auth_method == AUTH_PLAIN)
-      conn.auth_plain();
-    else {
-      // Detect method
-      if (conn.hascap("AUTH", "PLAIN"))
-	conn.auth_plain();
-      else if (conn.hascap("AUTH", "LOGIN"))
-	conn.auth_login();
-      else
-	protocol_fail(ERR_MSG_TEMPFAIL, "Server does not advertise any supported authentication methods");
+  fdibuf* msg = &in;
+  mystring result;
+  if (s.use_warm && !s.next(msg, smtp_keepalive, &conn)) {
+    if (!s.result)
+      conn.quit();
+    return s.result;
+  }
+  for (;;) {
+    e = conn.send(*msg, result);
+    if (!s.use_multi) {
+      conn.quit();
+      return s.fail(e, result.c_str());
     }
+    s.report(e, result.c_str());
+    if (!s.next(msg, smtp_keepalive, &conn))
+      break;
+    if (e && (e = conn.docmd("RSET", 200)) != 0)
+      return e;
   }
-  else
-    conn.dohelo(false);
-
-  conn.send(in);
+  // The keepalive failing while waiting ends the session.
+  if (s.result)
+    return s.result;
+  conn.quit();
+  return 0;
 }
+const protocol_engine smtp_engine = {
+  "smtp",
+  "Send an email message via SMTP\n",
+  25,
+  465,
+  smtp_prep,
+  smtp_starttls,
+  smtp_send,
+};
+
+// LMTP is SMTP with its own greeting and a result for each recipient at
+// the end of the data, for delivery to a local mail store.
+const protocol_engine lmtp_engine = {
+  "lmtp",
+  "Send an email message via LMTP\n",
+  24,
+  -1, // No standard for LMTP over SSL exists
+  smtp_prep,
+  smtp_starttls,
+  smtp_send,
+};
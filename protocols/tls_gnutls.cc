@@ -20,123 +20,257 @@
 // <nullmailer-subscribe@lists.untroubled.org>.
 
 #include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include "configio.h"
+#include "defines.h"
 #include "errcodes.h"
+#include "itoa.h"
 #include "mystring/mystring.h"
 #include "protocol.h"
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
+#ifdef HAVE_GNUTLS_KTLS
+#include <gnutls/socket.h>
+#endif
 #include "fdbuf/tlsibuf.h"
 #include "fdbuf/tlsobuf.h"
 
-int tls_insecure = false;
-const char* tls_x509certfile = NULL;
-const char* tls_x509keyfile = NULL;
-const char* tls_x509cafile = NULL;
-const char* tls_x509crlfile = NULL;
-int tls_x509derfmt = false;
-
-static int gnutls_wrap(int ret, const char* msg)
+// The TLS state of one session.  Sessions are saved per remote host
+// and port in the spool so that the next protocol run can resume them
+// with an abbreviated handshake.  Only sessions whose server
+// certificate was verified are saved.
+struct tls_state
 {
-  if (ret < 0) {
-    mystring m = msg;
-    m += ": ";
-    m += gnutls_strerror(ret);
-    protocol_fail(ERR_MSG_TEMPFAIL, m.c_str());
+  protocol_session& s;
+  gnutls_certificate_credentials_t creds;
+  gnutls_session_t session;
+  bool have_creds;
+  bool have_session;
+  bool trust_loaded;
+  bool verify_failed;
+  mystring session_file;
+  bool session_established;
+  tls_state(protocol_session& sess)
+    : s(sess), have_creds(false), have_session(false), trust_loaded(false),
+      verify_failed(false), session_established(false)
+  {
   }
-  return ret;
+};
+
+static int tls_error(tls_state& t, int ret, const char* msg)
+{
+  mystring m = msg;
+  m += ": ";
+  m += gnutls_strerror(ret);
+  return t.s.fail(ERR_MSG_TEMPFAIL, m.c_str());
 }
 
-static int cert_verify(gnutls_session_t session)
+#define TLS_CHECK(T,CALL,MSG) do { \
+    int r_ = (CALL); \
+    if (r_ < 0) \
+      return tls_error(T, r_, MSG); \
+  } while (0)
+
+// The trust store is only needed to verify a server certificate, which
+// is not sent when a saved session is resumed, so it is not parsed
+// until a full handshake asks for it.
+static int load_trust(tls_state& t)
+{
+  if (t.trust_loaded)
+    return 0;
+  t.trust_loaded = true;
+  gnutls_x509_crt_fmt_t x509fmt = t.s.tls_x509derfmt ? GNUTLS_X509_FMT_DER : GNUTLS_X509_FMT_PEM;
+  TLS_CHECK(t, gnutls_certificate_set_x509_trust_file(t.creds, t.s.tls_x509cafile, x509fmt),
+	    "Error loading SSL/TLS X.509 trust file");
+  if (t.s.tls_x509crlfile != NULL)
+    TLS_CHECK(t, gnutls_certificate_set_x509_crl_file(t.creds, t.s.tls_x509crlfile, x509fmt),
+	      "Error loading SSL/TLS X.509 CRL file");
+  return 0;
+}
+
+static int check_cert(tls_state& t, gnutls_session_t session)
 {
-  if (tls_x509cafile != NULL && !tls_insecure) {
-    // Verify the certificate
-    unsigned int status = 0;
-    gnutls_wrap(gnutls_certificate_verify_peers2(session, &status),
-		"Could not verify SSL/TLS certificate");
-    if (status != 0)
-      protocol_fail(ERR_MSG_TEMPFAIL, "Server SSL/TLS certificate is untrusted");
-
-    // Verify the hostname
-    unsigned int cert_list_size = 0;
-    const gnutls_datum_t* cert_list = gnutls_certificate_get_peers(session, &cert_list_size);
-    const char* hostname = (const char*)gnutls_session_get_ptr(session);
-    gnutls_x509_crt_t crt;
-    gnutls_wrap(gnutls_x509_crt_init(&crt),
-		"Error allocating memory");
-    gnutls_wrap(gnutls_x509_crt_import(crt, &cert_list[0], GNUTLS_X509_FMT_DER),
-		"Error decoding SSL/TLS certificate");
-    if (gnutls_x509_crt_check_hostname(crt, hostname) == 0)
-      protocol_fail(ERR_MSG_TEMPFAIL, "Server SSL/TLS certificate does not match hostname");
+  protocol_session& s = t.s;
+  if (s.tls_x509cafile == NULL || s.tls_insecure)
+    return 0;
+  int e = load_trust(t);
+  if (e)
+    return e;
+  // Verify the certificate
+  unsigned int status = 0;
+  TLS_CHECK(t, gnutls_certificate_verify_peers2(session, &status),
+	    "Could not verify SSL/TLS certificate");
+  if (status != 0)
+    return s.fail(ERR_MSG_TEMPFAIL, "Server SSL/TLS certificate is untrusted");
+
+  // Verify the hostname
+  unsigned int cert_list_size = 0;
+  const gnutls_datum_t* cert_list = gnutls_certificate_get_peers(session, &cert_list_size);
+  gnutls_x509_crt_t crt;
+  TLS_CHECK(t, gnutls_x509_crt_init(&crt),
+	    "Error allocating memory");
+  int r = gnutls_x509_crt_import(crt, &cert_list[0], GNUTLS_X509_FMT_DER);
+  if (r < 0) {
     gnutls_x509_crt_deinit(crt);
+    return tls_error(t, r, "Error decoding SSL/TLS certificate");
   }
-  // All verification errors cause protocol to exit
+  r = gnutls_x509_crt_check_hostname(crt, s.remote);
+  gnutls_x509_crt_deinit(crt);
+  if (r == 0)
+    return s.fail(ERR_MSG_TEMPFAIL, "Server SSL/TLS certificate does not match hostname");
   return 0;
 }
 
-static gnutls_session_t tls_session;
+#ifdef HAVE_GNUTLS_SET_VERIFY_FUNCTION
+// A failure leaves its result in the session and fails the handshake.
+static int cert_verify(gnutls_session_t session)
+{
+  tls_state& t = *(tls_state*)gnutls_session_get_ptr(session);
+  if (check_cert(t, session) == 0)
+    return 0;
+  t.verify_failed = true;
+  return -1;
+}
+#endif
 
-void tls_init(const char* remote)
+static void session_load(tls_state& t)
 {
-  gnutls_certificate_credentials_t creds;
-  gnutls_wrap(gnutls_global_init(),
-	      "Error initializing TLS library");
-  gnutls_wrap(gnutls_certificate_allocate_credentials(&creds),
-	      "Error allocating TLS certificate");
-  gnutls_wrap(gnutls_init(&tls_session, GNUTLS_CLIENT),
-	      "Error creating TLS session");
+  char* buf = new char[64*1024];
+  fdibuf in(t.session_file.c_str());
+  if (!!in) {
+    in.read(buf, 64*1024);
+    if (in.eof() && in.last_count() > 0)
+      gnutls_session_set_data(t.session, buf, in.last_count());
+  }
+  delete[] buf;
+}
+
+static void session_save(tls_state& t)
+{
+  if (!t.session_established || !t.session_file)
+    return;
+  gnutls_datum_t data;
+  if (gnutls_session_get_data2(t.session, &data) < 0)
+    return;
+  const mystring tmpfile = t.session_file + "." + itoa(getpid());
+  fdobuf out(tmpfile.c_str(), fdobuf::create | fdobuf::trunc, 0600);
+  if (!out.write((const char*)data.data, data.size) || !out.close()
+      || rename(tmpfile.c_str(), t.session_file.c_str()) != 0)
+    unlink(tmpfile.c_str());
+  gnutls_free(data.data);
+}
+
+int tls_init(protocol_session& s)
+{
+  tls_state& t = *(s.tls = new tls_state(s));
+  TLS_CHECK(t, gnutls_global_init(),
+	    "Error initializing TLS library");
+  TLS_CHECK(t, gnutls_certificate_allocate_credentials(&t.creds),
+	    "Error allocating TLS certificate");
+  t.have_creds = true;
+  TLS_CHECK(t, gnutls_init(&t.session, GNUTLS_CLIENT),
+	    "Error creating TLS session");
+  t.have_session = true;
 #ifdef HAVE_GNUTLS_PRIORITY_FUNCS
-  gnutls_wrap(gnutls_priority_set_direct(tls_session, "NORMAL", NULL),
-	      "Error setting TLS options");
+  TLS_CHECK(t, gnutls_priority_set_direct(t.session, "NORMAL", NULL),
+	    "Error setting TLS options");
 #else
-  gnutls_wrap(gnutls_set_default_priority(tls_session),
-	      "Error setting TLS options");
+  TLS_CHECK(t, gnutls_set_default_priority(t.session),
+	    "Error setting TLS options");
 #endif
-  gnutls_wrap(gnutls_credentials_set(tls_session, GNUTLS_CRD_CERTIFICATE, creds),
-	      "Error setting TLS credentials");
-  gnutls_wrap(gnutls_server_name_set(tls_session, GNUTLS_NAME_DNS, remote, strlen(remote)),
-	      "Error setting TLS server name");
-  gnutls_session_set_ptr(tls_session, (void*)remote);
+  TLS_CHECK(t, gnutls_credentials_set(t.session, GNUTLS_CRD_CERTIFICATE, t.creds),
+	    "Error setting TLS credentials");
+  TLS_CHECK(t, gnutls_server_name_set(t.session, GNUTLS_NAME_DNS, s.remote, strlen(s.remote)),
+	    "Error setting TLS server name");
+  gnutls_session_set_ptr(t.session, (void*)&t);
 #ifdef HAVE_GNUTLS_SET_VERIFY_FUNCTION
-  gnutls_certificate_set_verify_function(creds, cert_verify);
+  gnutls_certificate_set_verify_function(t.creds, cert_verify);
 #endif
-  gnutls_certificate_set_verify_flags(creds, 0);
-
-  gnutls_x509_crt_fmt_t x509fmt = tls_x509derfmt ? GNUTLS_X509_FMT_DER : GNUTLS_X509_FMT_PEM;
-  if (tls_x509keyfile == NULL)
-    tls_x509keyfile = tls_x509certfile;
-  if (tls_x509certfile != NULL)
-    gnutls_wrap(gnutls_certificate_set_x509_key_file(creds, tls_x509certfile, tls_x509keyfile, x509fmt),
-		"Error setting SSL/TLS X.509 client certificate");
-  if (tls_x509cafile == NULL && access(DEFAULT_CA_FILE, R_OK) == 0)
-    tls_x509cafile = DEFAULT_CA_FILE;
-  if (tls_x509cafile != NULL)
-    gnutls_wrap(gnutls_certificate_set_x509_trust_file(creds, tls_x509cafile, x509fmt),
-		"Error loading SSL/TLS X.509 trust file");
-  if (tls_x509crlfile != NULL)
-    gnutls_wrap(gnutls_certificate_set_x509_crl_file(creds, tls_x509crlfile, x509fmt),
-		"Error loading SSL/TLS X.509 CRL file");
+  gnutls_certificate_set_verify_flags(t.creds, 0);
+
+  gnutls_x509_crt_fmt_t x509fmt = s.tls_x509derfmt ? GNUTLS_X509_FMT_DER : GNUTLS_X509_FMT_PEM;
+  if (s.tls_x509keyfile == NULL)
+    s.tls_x509keyfile = s.tls_x509certfile;
+  if (s.tls_x509certfile != NULL)
+    TLS_CHECK(t, gnutls_certificate_set_x509_key_file(t.creds, s.tls_x509certfile, s.tls_x509keyfile, x509fmt),
+	      "Error setting SSL/TLS X.509 client certificate");
+  if (s.tls_x509cafile == NULL && access(DEFAULT_CA_FILE, R_OK) == 0)
+    s.tls_x509cafile = DEFAULT_CA_FILE;
+  if (s.tls_x509cafile != NULL && access(s.tls_x509cafile, R_OK) != 0)
+    return s.fail(ERR_MSG_TEMPFAIL, "Error loading SSL/TLS X.509 trust file");
+
+  if (s.tls_x509cafile != NULL && !s.tls_insecure) {
+    mystring name = mystring(s.remote).subst('/', '_') + ":" + itoa(s.port);
+    t.session_file = CONFIG_PATH(QUEUE, "tls", name.c_str());
+  }
+  return 0;
 }
 
-void tls_send(fdibuf& in, int fd)
+// The session is saved for resuming once it has finished, whatever
+// its result.
+int tls_send(protocol_session& s, fdibuf& in)
 {
+  tls_state& t = *s.tls;
   int r;
 
-  gnutls_transport_set_ptr(tls_session, (gnutls_transport_ptr_t)(long)fd);
+  s.phase("tls");
+  gnutls_transport_set_ptr(t.session, (gnutls_transport_ptr_t)(long)s.fd);
+  if (!!t.session_file)
+    session_load(t);
+#ifdef HAVE_GNUTLS_HANDSHAKE_SET_TIMEOUT
+  gnutls_handshake_set_timeout(t.session, s.timeout(TIMEOUT_GREETING));
+#endif
 
   do {
-    r = gnutls_handshake(tls_session);
+    r = gnutls_handshake(t.session);
+    if (t.verify_failed)
+      return s.result;
     if (gnutls_error_is_fatal(r))
-      gnutls_wrap(r, "Error completing TLS handshake");
+      return tls_error(t, r, "Error completing TLS handshake");
   } while (r < 0);
 #ifndef HAVE_GNUTLS_SET_VERIFY_FUNCTION
-  cert_verify(tls_session);
+  if ((r = check_cert(t, t.session)) != 0)
+    return r;
 #endif
+  t.session_established = true;
 
-  tlsibuf tlsin(tls_session);
-  tlsobuf tlsout(tls_session);
+  tlsibuf tlsin(t.session);
+  tlsobuf tlsout(t.session);
   if (!tlsin || !tlsout)
-    protocol_fail(ERR_MSG_TEMPFAIL, "Error allocating I/O buffers");
+    return s.fail(ERR_MSG_TEMPFAIL, "Error allocating I/O buffers");
+
+#ifdef HAVE_GNUTLS_KTLS
+  // Once the kernel has the keys, data written to the socket is
+  // encrypted there, so the message goes out through a plain buffer
+  // and copies from the queue file can use sendfile.  Replies are
+  // still read through the library, which handles the control records
+  // the kernel passes up.
+  if (s.use_ktls
+      && (gnutls_transport_is_ktls_enabled(t.session) & GNUTLS_KTLS_SEND)) {
+    fdobuf ktlsout(s.fd);
+    if (!ktlsout)
+      return s.fail(ERR_MSG_TEMPFAIL, "Error allocating I/O buffers");
+    r = s.send(in, tlsin, ktlsout);
+  }
+  else
+#endif
+  r = s.send(in, tlsin, tlsout);
+  session_save(t);
+  return r;
+}
 
-  protocol_send(in, tlsin, tlsout);
+void tls_free(protocol_session& s)
+{
+  tls_state* t = s.tls;
+  if (t == 0)
+    return;
+  if (t->have_session)
+    gnutls_deinit(t->session);
+  if (t->have_creds)
+    gnutls_certificate_free_credentials(t->creds);
+  gnutls_global_deinit();
+  delete t;
+  s.tls = 0;
 }
@@ -22,15 +22,18 @@
 #include "errcodes.h"
 #include "protocol.h"
 
-void tls_init(const char* remote)
+int tls_init(protocol_session& s)
 {
-  protocol_fail(ERR_USAGE, "SSL/TLS not supported in this build");
-  (void)remote;
+  return s.fail(ERR_USAGE, "SSL/TLS not supported in this build");
 }
 
-void tls_send(fdibuf& in, int fd)
+int tls_send(protocol_session& s, fdibuf& in)
 {
-  protocol_fail(ERR_USAGE, "SSL/TLS not supported in this build");
   (void)in;
-  (void)fd;
+  return s.fail(ERR_USAGE, "SSL/TLS not supported in this build");
+}
+
+void tls_free(protocol_session& s)
+{
+  (void)s;
 }
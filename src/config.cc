@@ -0,0 +1,198 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2018  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#include "config.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "configdb.h"
+#include "configio.h"
+#include "defines.h"
+#include "fdbuf/fdbuf.h"
+#include "itoa.h"
+#include "list.h"
+#include "mystring/mystring.h"
+
+const char* cli_program = "nullmailer-config";
+
+#define fail(X) do{ fout << "nullmailer-config: " << X << endl; return 1; }while(0)
+
+struct entry
+{
+  mystring name;
+  mystring data;
+  uint32_t hash;
+  uint32_t pos;
+};
+
+typedef list<entry> elist;
+
+static unsigned skipped = 0;
+
+static bool read_file(const char* name, mystring& data)
+{
+  int fd = open(name, O_RDONLY);
+  if(fd < 0)
+    return false;
+  struct stat st;
+  bool ok = fstat(fd, &st) == 0;
+  if(ok) {
+    char* buf = new char[st.st_size + 1];
+    ssize_t rd = read(fd, buf, st.st_size + 1);
+    ok = rd >= 0 && rd <= st.st_size;
+    if(ok)
+      data = mystring(buf, rd);
+    delete[] buf;
+  }
+  close(fd);
+  return ok;
+}
+
+static bool scan_dir(elist& entries)
+{
+  DIR* dir = opendir(".");
+  if(!dir)
+    return false;
+  struct dirent* de;
+  while((de = readdir(dir)) != 0) {
+    const char* name = de->d_name;
+    if(name[0] == '.'
+       || strncmp(name, CONFIGDB_NAME, strlen(CONFIGDB_NAME)) == 0)
+      continue;
+    struct stat st;
+    if(stat(name, &st) != 0 || !S_ISREG(st.st_mode))
+      continue;
+    // Control files that not everyone may read, such as remotes
+    // holding passwords, are left out so that the database can be.
+    if(!(st.st_mode & S_IROTH)) {
+      fout << "nullmailer-config: Skipped " << name
+	   << ": not world-readable" << endl;
+      ++skipped;
+      continue;
+    }
+    entry e;
+    e.name = name;
+    if(!read_file(name, e.data)) {
+      fout << "nullmailer-config: Could not read " << name << ": "
+	   << strerror(errno) << endl;
+      ++skipped;
+      continue;
+    }
+    e.hash = configdb_hash(e.name.c_str(), e.name.length());
+    entries.append(e);
+  }
+  closedir(dir);
+  return true;
+}
+
+static bool write_db(fdobuf& out, elist& entries)
+{
+  unsigned counts[256];
+  memset(counts, 0, sizeof counts);
+  uint32_t pos = CONFIGDB_HEADER;
+  for(elist::iter i(entries); i; i++) {
+    (*i).pos = pos;
+    pos += 8 + (*i).name.length() + (*i).data.length();
+    ++counts[(*i).hash & 255];
+  }
+
+  unsigned char header[CONFIGDB_HEADER];
+  uint32_t tpos = pos;
+  for(unsigned b = 0; b < 256; ++b) {
+    configdb_put(header + b * 8, tpos);
+    configdb_put(header + b * 8 + 4, counts[b] * 2);
+    tpos += counts[b] * 2 * 8;
+  }
+  if(!out.write(header, sizeof header))
+    return false;
+
+  for(elist::const_iter i(entries); i; i++) {
+    unsigned char lengths[8];
+    configdb_put(lengths, (*i).name.length());
+    configdb_put(lengths + 4, (*i).data.length());
+    if(!out.write(lengths, 8)
+       || !out.write((*i).name.c_str(), (*i).name.length())
+       || !out.write((*i).data.c_str(), (*i).data.length()))
+      return false;
+  }
+
+  for(unsigned b = 0; b < 256; ++b) {
+    if(counts[b] == 0)
+      continue;
+    const unsigned slots = counts[b] * 2;
+    unsigned char* table = new unsigned char[slots * 8];
+    memset(table, 0, slots * 8);
+    for(elist::const_iter i(entries); i; i++) {
+      if(((*i).hash & 255) != b)
+	continue;
+      unsigned slot = ((*i).hash >> 8) % slots;
+      while(configdb_get(table + slot * 8 + 4) != 0)
+	if(++slot == slots)
+	  slot = 0;
+      configdb_put(table + slot * 8, (*i).hash);
+      configdb_put(table + slot * 8 + 4, (*i).pos);
+    }
+    const bool written = out.write(table, slots * 8);
+    delete[] table;
+    if(!written)
+      return false;
+  }
+  return out.sync();
+}
+
+static int compile()
+{
+  const mystring dir = CONFIG_PATH(CONFIG, NULL, "");
+  if(chdir(dir.c_str()))
+    fail("Cannot change directory to " << dir << ": " << strerror(errno));
+  elist entries;
+  if(!scan_dir(entries))
+    fail("Cannot open config directory: " << strerror(errno));
+
+  const char* tmpname = CONFIGDB_NAME ".tmp";
+  fdobuf out(tmpname, fdobuf::create | fdobuf::trunc, 0644);
+  if(!out || !out.chmod(0644) || !write_db(out, entries) || !out.close()) {
+    const int err = errno;
+    unlink(tmpname);
+    fail("Could not write " << tmpname << ": " << strerror(err));
+  }
+  if(rename(tmpname, CONFIGDB_NAME)) {
+    const int err = errno;
+    unlink(tmpname);
+    fail("Could not rename " << tmpname << ": " << strerror(err));
+  }
+  fout << "Compiled " << itoa(entries.count()) << " control file(s) into "
+       << dir << CONFIGDB_NAME << '.' << endl;
+  return skipped > 0;
+}
+
+int main(int argc, char* argv[])
+{
+  if(argc != 2 || strcmp(argv[1], "compile") != 0) {
+    fout << "usage: nullmailer-config compile" << endl;
+    return 1;
+  }
+  return compile();
+}
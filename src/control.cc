@@ -0,0 +1,76 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#include "config.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "autoclose.h"
+#include "configio.h"
+#include "defines.h"
+#include "fdbuf/fdbuf.h"
+#include "mystring/mystring.h"
+
+const char* cli_program = "nullmailer-control";
+
+#define fail(X) do{ fout << "nullmailer-control: " << X << endl; return 1; }while(0)
+
+int main(int argc, char* argv[])
+{
+  if(argc < 2) {
+    fout << "usage: nullmailer-control command [argument ...]" << endl;
+    return 1;
+  }
+  mystring line = argv[1];
+  for(int i = 2; i < argc; i++)
+    line = line + " " + argv[i];
+  line = line + "\n";
+
+  const mystring path = CONFIG_PATH(QUEUE, NULL, "control");
+  struct sockaddr_un sa;
+  memset(&sa, 0, sizeof sa);
+  sa.sun_family = AF_UNIX;
+  if(path.length() >= sizeof sa.sun_path)
+    fail("Control socket path is too long.");
+  strcpy(sa.sun_path, path.c_str());
+  autoclose fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0)
+    fail("Could not create socket: " << strerror(errno));
+  if(connect(fd, (struct sockaddr*)&sa, sizeof sa) < 0)
+    fail("Could not connect to nullmailer-send: " << strerror(errno));
+  if(write(fd, line.c_str(), line.length()) != (ssize_t)line.length())
+    fail("Could not send the command: " << strerror(errno));
+
+  mystring reply;
+  char buf[4096];
+  ssize_t rd;
+  while((rd = read(fd, buf, sizeof buf)) > 0)
+    reply += mystring(buf, rd);
+  if(rd < 0)
+    fail("Could not read the reply: " << strerror(errno));
+  if(!reply)
+    fail("No reply from nullmailer-send.");
+  fout << reply;
+  fout.flush();
+  return reply.left(2) == "ok" ? 0 : 1;
+}
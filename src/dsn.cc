@@ -35,12 +35,10 @@
 #include "list.h"
 #include "mystring/mystring.h"
 #include "fdbuf/fdbuf.h"
-#include "canonicalize.h"
-#include "configio.h"
-#include "hostname.h"
+#include "fdbuf/mmapibuf.h"
+#include "dsn.h"
 #include "makefield.h"
-
-typedef list<mystring> slist;
+#include "queuefile.h"
 
 static time_t opt_timestamp = 0;
 static time_t opt_last_attempt = 0;
@@ -50,7 +48,7 @@ static const char* opt_status = 0;
 static const char* opt_remote = 0;
 static const char* opt_diagnostic_code = 0;
 static int opt_lines = -1;
-static bool opt_ddn = false;
+static int opt_maxbytes = -1;
 
 const char* cli_program = "nullmailer-dsn";
 const char* cli_help_prefix =
@@ -80,21 +78,15 @@ cli_option cli_options[] = {
   { 0, "max-lines", cli_option::integer, 0, &opt_lines,
     "Maximum number of lines of the original message to copy",
     "the whole message" },
+  { 0, "max-bytes", cli_option::integer, 0, &opt_maxbytes,
+    "Maximum number of bytes of the original message to copy",
+    "the whole message" },
   {0, 0, cli_option::flag, 0, 0, 0, 0}
 };
 
 #define die1sys(MSG) do{ fout << "nullmailer-dsn: " << MSG << strerror(errno) << endl; exit(111); }while(0)
 #define die1(MSG) do{ fout << "nullmailer-dsn: " << MSG << endl; exit(111); }while(0)
 
-static mystring sender;
-static mystring bounceto;
-static mystring doublebounceto;
-static mystring line;
-static slist recipients;
-
-static mystring idhost;
-static const mystring boundary = make_boundary();
-
 int cli_main(int, char* argv[])
 {
   struct stat msgstat;
@@ -112,112 +104,47 @@ int cli_main(int, char* argv[])
       || !isdigit(opt_status[4])
       || opt_status[5] != '\0')
     die1("Status must be in the format 4.#.# or 5.#.#");
-  opt_ddn = opt_status[0] == '4';
-  if (opt_lines < 0)
-    config_readint("bouncelines", opt_lines);
-
-  if (!config_read("doublebounceto", doublebounceto)
-      || !doublebounceto)
-    config_read("adminaddr", doublebounceto);
-  read_hostnames();
-  if (!config_read("idhost", idhost))
-    idhost = me;
-  else
-    canonicalize(idhost);
-  config_read("bounceto", bounceto);
 
-  if (!fin.getline(sender))
+  dsn_config config;
+  dsn_read_config(config);
+  if (opt_lines >= 0)
+    config.lines = opt_lines;
+  if (opt_maxbytes >= 0)
+    config.maxbytes = opt_maxbytes;
+
+  // The message is a queue file, which can be read through a mapping.
+  mmapibuf in(0);
+  list<dsn_message> msgs;
+  dsn_message& msg = msgs.emplace();
+  msg.in = &in;
+  queuefile_read(in, msg.layout);
+  if (!in.getline(msg.sender))
     die1sys("Could not read sender address from message: ");
-  if (!sender && !doublebounceto)
-    die1("Nowhere to send double bounce");
-  while (fin.getline(line)) {
+  mystring line;
+  while (in.getline(line)) {
     if (!line)
       break;
-    recipients.append(line);
+    msg.recipients.append(line);
   }
-  if (recipients.count() == 0)
+  if (msg.recipients.count() == 0)
     die1("No recipients were read from message");
-
-  if (!!sender)
-    // Bounces either go to the sender or bounceto, if configured
-    fout << '\n' << (!!bounceto ? bounceto : sender);
-  else
-    fout << "#@[]\n" << doublebounceto;
-
-  fout << "\n"
-    "\n"
-    "From: Message Delivery Subsystem <MAILER-DAEMON@" << me << ">\n"
-    "To: <" << sender << ">\n"
-    "Subject: Returned mail: Could not send message\n"
-    "Date: " << make_date() << "\n"
-    "Message-Id: " << make_messageid(idhost) << "\n"
-    "MIME-Version: 1.0\n"
-    "Content-Type: multipart/report; report-type=delivery-status;\n"
-    "\tboundary=\"" << boundary << "\"\n";
-
-  /* Human readable text portion */
-  fout << "\n"
-    "--" << boundary << "\n"
-    "Content-Type: text/plain; charset=us-ascii\n"
-    "\n"
-    "This is the nullmailer delivery system.  The message attached below\n"
-       << (opt_ddn
-	   ? "has not been"
-	   : "could not be")
-       << " delivered to one or more of the intended recipients:\n"
-    "\n";
-  for (slist::const_iter recipient(recipients); recipient; recipient++)
-    fout << "\t<" << (*recipient) << ">\n";
-  if (opt_ddn) {
-    if (opt_retry_until > 0)
-      fout << "\nDelivery will continue to be attempted until "
-	   << make_date(opt_retry_until) << '\n';
-    fout << "\n"
-      "A final delivery status notification will be generated if delivery\n"
-      "proves to be impossible within the configured time limit.\n";
-  }
-
-  /* delivery-status portion */
-  fout << "\n"
-    "--" << boundary << "\n"
-    "Content-Type: message/delivery-status\n"
-    "\n"
-    "Reporting-MTA: x-local-hostname; " << me << "\n"
-    "Arrival-Date: " << make_date(opt_timestamp) << "\n";
+  msg.timestamp = opt_timestamp;
+  msg.last_attempt = opt_last_attempt;
+  msg.retry_until = opt_retry_until;
+  msg.status = opt_status;
   if (opt_envelope_id != 0)
-    fout << "Original-Envelope-Id: " << opt_envelope_id << '\n';
-
-  for (slist::const_iter recipient(recipients); recipient; recipient++) {
-    fout << "\n"
-      "Final-Recipient: rfc822; " << (*recipient) << "\n"
-      "Action: " << (opt_ddn ? "delayed": "failed") << "\n"
-      "Status: " << opt_status << "\n"
-      "Last-Attempt-Date: " << make_date(opt_last_attempt) << '\n';
-    if (opt_remote != 0)
-      fout << "Remote-MTA: dns; " << opt_remote << '\n';
-    if (opt_diagnostic_code != 0)
-      fout << "Diagnostic-Code: " << opt_diagnostic_code << '\n';
-    if (opt_ddn and opt_retry_until > 0)
-      fout << "Will-Retry-Until: " << make_date(opt_retry_until) << '\n';
-  }
-
-  // Copy the message
-  fout << "\n"
-    "--" << boundary << "\n"
-    "Content-Type: message/rfc822\n"
+    msg.envelope_id = opt_envelope_id;
+  if (opt_remote != 0)
+    msg.remote = opt_remote;
+  if (opt_diagnostic_code != 0)
+    msg.diagnostic_code = opt_diagnostic_code;
+
+  mystring from, to;
+  if (!dsn_envelope(config, msg.sender, from, to))
+    die1("Nowhere to send double bounce");
+  fout << from << '\n' << to << "\n"
     "\n";
-  // Copy the header
-  while (fin.getline(line) && !!line)
-    fout << line << '\n';
-  // Optionally copy the body
-  if (opt_lines) {
-    fout << '\n';
-    for (int i = 0; (opt_lines < 0 || i < opt_lines) && fin.getline(line); i++)
-      fout << line << '\n';
-  }
-
-  fout << "\n"
-    "--" << boundary << "--\n";
+  dsn_write(fout, config, msgs, make_messageid(config.idhost));
 
   return 0;
 }
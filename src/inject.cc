@@ -23,22 +23,30 @@
 #include "defines.h"
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <pwd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include "mystring/mystring.h"
+#include "mystring/builder.h"
 #include "list.h"
 #include "hostname.h"
 #include "fdbuf/fdbuf.h"
 #include "itoa.h"
 #include "address.h"
+#include "arena.h"
 #include "canonicalize.h"
 #include "configio.h"
 #include "cli++/cli++.h"
 #include "makefield.h"
 #include "forkexec.h"
+#include "priority.h"
+#include "queuewriter.h"
+#include "routetable.h"
+#include "setenv.h"
+#include "stats.h"
 
 enum {
   use_args, use_both, use_either, use_header
@@ -46,7 +54,9 @@ enum {
 static int use_recips = use_either;
 static int show_message = false;
 static int show_envelope = false;
+static int direct = false;
 static const char* o_from = 0;
+static const char* o_priority = 0;
 
 const char* cli_program = "nullmailer-inject";
 const char* cli_help_prefix = "Reformat and inject a message into the nullmailer queue\n";
@@ -63,8 +73,12 @@ cli_option cli_options[] = {
     "Use either command-line and message header for recipients", 0 },
   { 'h', "use-header", cli_option::flag, use_header, &use_recips,
     "Use only message header for recipients", 0 },
+  { 'd', "direct", cli_option::flag, 1, &direct,
+    "Deliver the message immediately, queueing it only if deferred", 0 },
   { 'f', "from", cli_option::string, 0, &o_from,
     "Set the sender address", 0 },
+  { 'p', "priority", cli_option::string, 0, &o_priority,
+    "Set the priority class: urgent, normal or bulk", 0 },
   { 'n', "no-queue", cli_option::flag, 1, &show_message,
     "Send the formatted message to standard output", 0 },
   { 'v', "show-envelope", cli_option::flag, 1, &show_envelope,
@@ -76,7 +90,6 @@ cli_option cli_options[] = {
 #define fail_sys(MSG) do{ ferr << "nullmailer-inject: " << MSG << ": " << strerror(errno) << endl; return false; }while(0)
 #define bad_hdr(LINE,MSG) do{ header_has_errors = true; ferr << "nullmailer-inject: Invalid header line:\n  " << LINE << "\n  " MSG << endl; }while(0)
 
-typedef list<mystring> slist;
 // static bool do_debug = false;
 
 static mystring cur_line;
@@ -88,6 +101,45 @@ static mystring idhost;
 
 extern void canonicalize(mystring& domain);
 
+// The recipient rewriting rules from the rewrites control file, each
+// mapping a pattern to the addresses, one to a line, that replace the
+// recipients it matches.  The table is hashed, so that each recipient
+// takes the same few lookups however many rules there are.
+static route_table rewrites;
+
+// Each rule is PATTERN:ADDRESS, where the pattern is an address, a
+// bare user name for that user at this host, or @FQDN for any user at
+// the domain, and the address may be a comma-separated list.
+static void read_rewrites()
+{
+  list<mystring> rules;
+  if(!config_readlist("rewrites", rules))
+    return;
+  for(list<mystring>::const_iter r(rules); r; r++) {
+    const mystring& rule = *r;
+    if(!rule || rule[0] == '#')
+      continue;
+    int colon = rule.find_first(':');
+    mystring pattern = colon > 0 ? rule.left(colon).strip() : mystring();
+    mystring targets = colon > 0 ? rule.right(colon+1) : mystring();
+    mystring list;
+    bool ok = !!pattern && parse_addresses(targets, list) && !!list;
+    if(ok) {
+      if(pattern[0] == '@')
+	ok = rewrites.add("*" + pattern, list);
+      else if(pattern.find_first('@') < 0)
+	ok = rewrites.add(pattern + "@" + defaulthost, list)
+	  && rewrites.add(pattern + "@" + me, list)
+	  && rewrites.add(pattern + "@localhost", list);
+      else
+	ok = rewrites.add(pattern, list);
+    }
+    if(!ok)
+      ferr << "nullmailer-inject: Invalid rewrite rule, ignoring: "
+	   << rule << endl;
+  }
+}
+
 void read_config()
 {
   mystring tmp;
@@ -96,23 +148,141 @@ void read_config()
     idhost = me;
   else
     canonicalize(idhost);
+  read_rewrites();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 // Envelope processing
 ///////////////////////////////////////////////////////////////////////////////
-static slist recipients;
+// The envelope recipients and the header lines live as long as the
+// message, so they are kept in one arena.
+static arena message_arena;
+static arena_strlist recipients(message_arena);
 static mystring sender;
 static bool use_header_recips = true;
 static bool use_header_sender = true;
 
+// The recipients listed so far, hashed so that an address given more
+// than once, such as in both To and Cc or on the command line and in
+// the header, is only sent to once.  Domains are compared without
+// regard to case; local parts are compared exactly, since only the
+// receiving host knows whether case matters in them.
+struct recipient_entry
+{
+  const char* str;
+  unsigned length;
+  unsigned hash;
+  recipient_entry* next;
+};
+static recipient_entry** recipient_buckets = 0;
+static unsigned recipient_size = 0;
+
+static unsigned recipient_hash(const char* str, unsigned length,
+			       unsigned domain)
+{
+  // FNV-1a
+  unsigned h = 2166136261U;
+  for (unsigned i = 0; i < length; i++) {
+    unsigned char ch = str[i];
+    if (i >= domain)
+      ch = tolower(ch);
+    h ^= ch;
+    h *= 16777619U;
+  }
+  return h;
+}
+
+static unsigned domain_start(const char* str, unsigned length)
+{
+  for (unsigned i = length; i > 0; --i)
+    if (str[i-1] == '@')
+      return i;
+  return length;
+}
+
+static bool same_recipient(const recipient_entry* e, const char* str,
+			   unsigned length, unsigned domain)
+{
+  return e->length == length
+    && memcmp(e->str, str, domain) == 0
+    && strncasecmp(e->str + domain, str + domain, length - domain) == 0;
+}
+
+// Keep the buckets at least twice the number of recipients.  The old
+// bucket array is left in the arena.
+static void grow_recipients()
+{
+  unsigned newsize = recipient_size ? recipient_size * 2 : 64;
+  recipient_entry** newbuckets =
+    (recipient_entry**)message_arena.alloc(newsize * sizeof *newbuckets);
+  for (unsigned i = 0; i < newsize; i++)
+    newbuckets[i] = 0;
+  for (unsigned i = 0; i < recipient_size; i++)
+    while (recipient_buckets[i]) {
+      recipient_entry* e = recipient_buckets[i];
+      recipient_buckets[i] = e->next;
+      unsigned b = e->hash & (newsize - 1);
+      e->next = newbuckets[b];
+      newbuckets[b] = e;
+    }
+  recipient_buckets = newbuckets;
+  recipient_size = newsize;
+}
+
+static void add_rewritten(const char* str, unsigned length)
+{
+  const unsigned domain = domain_start(str, length);
+  const unsigned h = recipient_hash(str, length, domain);
+  if (recipient_size > 0)
+    for (const recipient_entry* e = recipient_buckets[h & (recipient_size - 1)];
+	 e; e = e->next)
+      if (e->hash == h && same_recipient(e, str, length, domain)) {
+	++run_stats.duplicates;
+	return;
+      }
+  if (recipients.count() * 2 >= recipient_size)
+    grow_recipients();
+  recipients.append(str, length);
+  recipient_entry* e = (recipient_entry*)message_arena.alloc(sizeof *e);
+  e->str = recipients.last()->str;
+  e->length = length;
+  e->hash = h;
+  unsigned b = h & (recipient_size - 1);
+  e->next = recipient_buckets[b];
+  recipient_buckets[b] = e;
+}
+
+// Add a recipient, or the addresses a rewriting rule replaces it with.
+// The replacements are not rewritten again.
+static void add_recipient(const char* str, unsigned length)
+{
+  mystring list;
+  if(rewrites.count() == 0 || !rewrites.find(mystring(str, length), list)) {
+    add_rewritten(str, length);
+    return;
+  }
+  int start = 0;
+  int end;
+  while((end = list.find_first('\n', start)) >= 0) {
+    add_rewritten(list.c_str() + start, end - start);
+    start = end+1;
+  }
+}
+
+static void clear_recipients()
+{
+  recipients.empty();
+  for (unsigned i = 0; i < recipient_size; i++)
+    recipient_buckets[i] = 0;
+}
+
 void parse_recips(const mystring& list)
 {
   if(!!list) {
     int start = 0;
     int end;
     while((end = list.find_first('\n', start)) >= 0) {
-      recipients.append(list.sub(start, end-start));
+      add_recipient(list.c_str() + start, end - start);
       start = end+1;
     }
   }
@@ -140,7 +310,56 @@ bool parse_sender(const mystring& list)
 ///////////////////////////////////////////////////////////////////////////////
 // Header processing
 ///////////////////////////////////////////////////////////////////////////////
-static slist headers;
+// The header lines read are passed through to the output in order.
+// They are held in memory until there are more than HEADER_SPOOL_MAX
+// bytes of them, and then moved to an unlinked temporary file, so that
+// a message with a huge header needs no more memory than a small one.
+// The lines of the fields inspected below that hold no addresses are
+// also kept for the queue index, and the lines added to the header
+// are held until it is sent.
+#define HEADER_SPOOL_MAX (64*1024)
+static arena_strlist spooled(message_arena);
+static unsigned spooled_bytes = 0;
+static int spool_fd = -1;
+static fdobuf* spool = 0;
+static arena_strlist kept(message_arena);
+static arena_strlist headers(message_arena);
+
+static bool open_spool()
+{
+  const char* dir = getenv("TMPDIR");
+  mystring path = mystringjoin(dir && *dir ? dir : "/tmp")
+    + "/nullmailer-inject.XXXXXX";
+  char* tmpl = (char*)message_arena.alloc(path.length() + 1);
+  memcpy(tmpl, path.c_str(), path.length() + 1);
+  spool_fd = mkstemp(tmpl);
+  if(spool_fd < 0)
+    fail_sys("Could not create a temporary file for the header");
+  unlink(tmpl);
+  fcntl(spool_fd, F_SETFD, FD_CLOEXEC);
+  spool = new fdobuf(spool_fd);
+  for(const arena_strlist::node* n = spooled.first(); n; n = n->next)
+    if(!spool->write(n->str, n->length) || !(*spool << '\n'))
+      fail_sys("Could not write the header to a temporary file");
+  spooled.empty();
+  return true;
+}
+
+static bool spool_header(const mystring& line)
+{
+  if(spool_fd < 0) {
+    if(spooled_bytes + line.length() + 1 <= HEADER_SPOOL_MAX) {
+      spooled.append(line);
+      spooled_bytes += line.length() + 1;
+      return true;
+    }
+    if(!open_spool())
+      return false;
+  }
+  if(!spool->write(line.c_str(), line.length()) || !(*spool << '\n'))
+    fail_sys("Could not write the header to a temporary file");
+  return true;
+}
 
 static bool header_is_resent = false;
 static bool header_has_errors = false;
@@ -172,7 +391,7 @@ struct header_field
 	  if(use_header_sender)
             sender = "";
 	  if(use_header_recips)
-	    recipients.empty();
+	    clear_recipients();
 	}
 	header_is_resent = true;
       }
@@ -231,6 +450,9 @@ static header_field header_fields[] = {
   X(Resent-Date,       F,F,F,T,F), // 18
   X(Resent-Message-Id, F,F,F,T,F), // 19
   X(Content-Length,    F,F,F,F,T), // 20
+  X(Priority,          F,F,F,F,F), // 21
+  X(X-Priority,        F,F,F,F,F), // 22
+  X(Precedence,        F,F,F,F,F), // 23
 };
 #undef X
 #undef F
@@ -249,6 +471,8 @@ static bool& header_has_rmid = header_fields[19].present;
 static header_field& header_field_from = header_fields[1];
 static header_field& header_field_mid = header_fields[17];
 static header_field& header_field_rpath = header_fields[3];
+static header_field& header_field_priority = header_fields[21];
+static header_field& header_field_xpriority = header_fields[22];
 
 static bool use_name_address_style = true;
 static mystring from;
@@ -311,13 +535,16 @@ bool parse_line(mystring& line)
     //bad_hdr(line, "Missing field name.");
     return false;
   bool remove = false;
-  for(unsigned i = 0; i < header_field_count; i++) {
-    header_field& h = header_fields[i];
-    if(h.parse(line, remove))
-      break;
-  }
-  if(!remove)
-    headers.append(line);
+  const header_field* field = 0;
+  for(unsigned i = 0; i < header_field_count && !field; i++)
+    if(header_fields[i].parse(line, remove))
+      field = &header_fields[i];
+  if(remove)
+    return true;
+  if(field && !field->is_address)
+    kept.append(line);
+  if(!spool_header(line))
+    header_has_errors = true;
   return true;
 }
 
@@ -351,7 +578,8 @@ bool read_header()
       //if(!whole)
       //bad_hdr(cur_line, "First line cannot be a continuation line.");
       //else
-      whole += "\n" + cur_line;
+      whole += '\n';
+      whole += cur_line;
     }
     else if(!is_header(cur_line)) {
       cur_line += '\n';
@@ -371,21 +599,32 @@ bool read_header()
 
 mystring make_recipient_list()
 {
-  mystring result;
-  bool first = true;
-  for(slist::iter iter(recipients); iter; iter++) {
-    if(!first)
-      result = result + ", " + *iter;
-    else
-      result = *iter;
-    first = false;
+  unsigned length = 0;
+  for(const arena_strlist::node* n = recipients.first(); n; n = n->next)
+    length += n->length + 2;
+  mystringbuilder list(length);
+  for(const arena_strlist::node* n = recipients.first(); n; n = n->next) {
+    if(!list.empty())
+      list << ", ";
+    list.append(n->str, n->length);
   }
-  return result;
+  return list.str();
 }
 
+// The priority class set on the command line, or -1 to leave the
+// header as it is.
+static int priority = -1;
+
+// The values of the Priority: header from RFC 2156 for each class.
+static const char* const priority_values[PRIORITY_CLASSES] = {
+  "urgent", "normal", "non-urgent"
+};
+
 bool fix_header()
 {
   setup_from();
+  if(priority >= 0)
+    headers.append(mystringjoin("Priority: ") + priority_values[priority]);
   if(!header_is_resent) {
     if(!header_has_date)
       headers.append("Date: " + make_date());
@@ -424,8 +663,8 @@ bool send_env(fdobuf& out)
 {
   if(!(out << sender << "\n"))
     fail("Error sending sender to nullmailer-queue.");
-  for(slist::iter iter(recipients); iter; iter++)
-    if(!(out << *iter << "\n"))
+  for(const arena_strlist::node* n = recipients.first(); n; n = n->next)
+    if(!out.write(n->str, n->length) || !(out << "\n"))
       fail("Error sending recipients to nullmailer-queue.");
   if(!(out << endl))
     fail("Error sending recipients to nullmailer-queue.");
@@ -434,8 +673,18 @@ bool send_env(fdobuf& out)
 
 bool send_header(fdobuf& out)
 {
-  for(slist::iter iter(headers); iter; iter++)
-    if(!(out << *iter << "\n"))
+  for(const arena_strlist::node* n = spooled.first(); n; n = n->next)
+    if(!out.write(n->str, n->length) || !(out << "\n"))
+      fail("Error sending header to nullmailer-queue.");
+  if(spool_fd >= 0) {
+    if(!spool->flush() || lseek(spool_fd, 0, SEEK_SET) != 0)
+      fail_sys("Could not read back the header");
+    fdibuf in(spool_fd);
+    if(!fdbuf_copy(in, out, true))
+      fail("Error sending header to nullmailer-queue.");
+  }
+  for(const arena_strlist::node* n = headers.first(); n; n = n->next)
+    if(!out.write(n->str, n->length) || !(out << "\n"))
       fail("Error sending header to nullmailer-queue.");
   if(!(out << endl))
     fail("Error sending header to nullmailer-queue.");
@@ -459,23 +708,98 @@ bool send_message_stdout()
   return true;
 }
 
+// The queue is opened before the message is read: nullmailer-queue is
+// started, or the queue file is created when inject owns the queue,
+// so that this overlaps with reading and fixing the header.  The
+// envelope is written once the header has been read.
+static queue_pipe* nq = 0;
+static int nq_fd = -1;
+static queue_writer* qw = 0;
+
+static bool start_queue()
+{
+  if (show_message)
+    return true;
+  if (!direct && queue_writer::usable()) {
+    qw = new queue_writer(ferr);
+    return qw->open();
+  }
+  nq = new queue_pipe;
+  nq_fd = nq->start(direct);
+  return nq_fd >= 0;
+}
+
+// Throw away what start_queue opened, if the message was not sent.
+// nullmailer-queue gives up on a message cut short by the end of its
+// input.
+static void cancel_queue()
+{
+  delete qw;
+  qw = 0;
+  if (nq) {
+    if (nq_fd >= 0) {
+      close(nq_fd);
+      nq_fd = -1;
+      nq->wait_status();
+    }
+    delete nq;
+    nq = 0;
+  }
+}
+
 bool send_message_nqueue()
 {
-  queue_pipe nq;
-  autoclose wfd = nq.start();
-  if (wfd < 0)
-    return false;
+  autoclose wfd = nq_fd;
+  nq_fd = -1;
   fdobuf nqout(wfd);
   if (!send_env(nqout) || !send_header(nqout) || !send_body(nqout))
     return false;
   nqout.flush();
   wfd.close();
-  return nq.wait();
+  stats_phase("queue");
+  if (direct) {
+    int status = nq->wait_status();
+    if (status >= 0 && WIFEXITED(status) && WEXITSTATUS(status) == 2)
+      fail("The message was rejected permanently.");
+    if (status < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      fail("nullmailer-queue failed.");
+    return true;
+  }
+  return nq->wait();
+}
+
+// The owner of the queue writes the message into it itself, rather
+// than through nullmailer-queue.
+bool send_message_queue()
+{
+  queue_writer& qw = *::qw;
+  mystring addr = sender;
+  if (!qw.sender(addr))
+    return false;
+  for (const arena_strlist::node* n = recipients.first(); n; n = n->next) {
+    addr = mystring(n->str, n->length);
+    if (!qw.recipient(addr))
+      return false;
+  }
+  if (!qw.end_envelope())
+    return false;
+  for (const arena_strlist::node* n = kept.first(); n; n = n->next)
+    qw.header(mystring(n->str, n->length));
+  for (const arena_strlist::node* n = headers.first(); n; n = n->next)
+    qw.header(mystring(n->str, n->length));
+  if (!send_header(qw.out()) || !send_body(qw.out()))
+    return false;
+  stats_phase("queue");
+  return qw.commit();
 }
 
 bool send_message()
 {
-  return show_message ? send_message_stdout() : send_message_nqueue();
+  if (show_message)
+    return send_message_stdout();
+  if (qw)
+    return send_message_queue();
+  return send_message_nqueue();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -487,6 +811,7 @@ bool parse_flags()
       flagstr && *flagstr; flagstr++) {
     switch(*flagstr) {
     case 'c': use_name_address_style=false; break;
+    case 'd': direct = true; break;
     case 'f': header_field_from.ignore=header_field_from.remove=true; break;
     case 'i': header_field_mid.ignore=header_field_mid.remove=true; break;
     case 's': header_field_rpath.ignore=header_field_rpath.remove=true; break;
@@ -515,6 +840,16 @@ bool parse_args(int argc, char* argv[])
     }
     use_header_sender = false;
   }
+  if(!o_priority)
+    o_priority = getenv("NULLMAILER_PRIORITY");
+  if(o_priority && *o_priority) {
+    if((priority = priority_parse(o_priority)) < 0) {
+      ferr << "nullmailer-inject: Invalid priority: " << o_priority << endl;
+      return false;
+    }
+    header_field_priority.ignore = header_field_priority.remove = true;
+    header_field_xpriority.ignore = header_field_xpriority.remove = true;
+  }
   use_header_recips = (use_recips != use_args);
   if(use_recips == use_header)
     return true;
@@ -532,16 +867,38 @@ bool parse_args(int argc, char* argv[])
 
 int cli_main(int argc, char* argv[])
 {
+  // The message is traced from here, through nullmailer-queue.
+  setenv(TRACE_ENV, trace_new(trace_clock()).c_str(), 1);
+  stats_phase("config");
   read_config();
-  if(!parse_args(argc, argv) ||
-     !read_header() ||
-     !fix_header())
+  if(!parse_args(argc, argv))
     return 1;
+  // Refuse the message before reading it if the queue is already full,
+  // so that the sender can back off and try again later.
+  mystring reason;
+  if(!show_message && !direct && !queue_admit(0, reason)) {
+    ferr << "nullmailer-inject: " << reason << endl;
+    return QUEUE_FULL_EXIT;
+  }
+  stats_phase("start");
+  if(!start_queue()) {
+    const bool full = qw && qw->full();
+    cancel_queue();
+    return full ? QUEUE_FULL_EXIT : 1;
+  }
+  stats_phase("headers");
+  if(!read_header() ||
+     !fix_header()) {
+    cancel_queue();
+    return 1;
+  }
   if(recipients.count() == 0) {
     ferr << "No recipients were listed." << endl;
+    cancel_queue();
     return 1;
   }
-  if(!send_message())
-    return 1;
-  return 0;
+  stats_phase("send");
+  const bool sent = send_message();
+  cancel_queue();
+  return sent ? 0 : 1;
 }
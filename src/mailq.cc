@@ -21,51 +21,430 @@
 
 #include "config.h"
 #include <dirent.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+#include "cli++/cli++.h"
 #include "configio.h"
 #include "defines.h"
 #include "fdbuf/fdbuf.h"
+#include "fdbuf/mmapibuf.h"
 #include "itoa.h"
+#include "journal.h"
+#include "list.h"
 #include "mystring/mystring.h"
+#include "poller.h"
+#include "queuedirs.h"
+#include "queuefile.h"
+
+static bool opt_summary = false;
+static bool opt_json = false;
+
+const char* cli_program = "mailq";
+const char* cli_help_prefix =
+"List the messages in the nullmailer queue\n";
+const char* cli_help_suffix = "";
+const char* cli_args_usage = "";
+const int cli_args_min = 0;
+const int cli_args_max = 0;
+cli_option cli_options[] = {
+  { 's', "summary", cli_option::flag, true, &opt_summary,
+    "Summarize the queue instead of listing each message", 0 },
+  { 'j', "json", cli_option::flag, true, &opt_json,
+    "List the messages as a JSON array", 0 },
+  {0, 0, cli_option::flag, 0, 0, 0, 0}
+};
 
 #define fail(X) do{ fout << X << endl; return 1; }while(0)
 
-int main(int, char*[])
+// Queues with more messages than this are read by several processes
+// at once, as reading each message is mostly waiting on the disk.
+#define READER_MIN 256
+#define READERS_MAX 4
+
+static void list_time(time_t time)
+{
+  char timebuf[100];
+  strftime(timebuf, 100, "%Y-%m-%d %H:%M:%S ", localtime(&time));
+  fout << timebuf;
+}
+
+// Read the envelope of a message into a journal record, which is how
+// the readers pass their results back.
+static mystring read_message(const mystring& path)
 {
+  struct stat statbuf;
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return "";
+  mmapibuf in(fd, true);
+  if (fstat(fd, &statbuf) == -1)
+    return "";
+  mystring sender;
+  list<mystring> recipients;
   mystring line;
+  queuefile_skip(in);
+  if (in.getline(sender))
+    while (in.getline(line) && !!line)
+      recipients.append(line);
+  return journal_queued(path, atoi(queuedir_name(path).c_str()),
+			statbuf.st_size, sender, recipients);
+}
 
-  mystring msg_dir = CONFIG_PATH(QUEUE, NULL, "queue");
-  if(chdir(msg_dir.c_str()))
-    fail("Cannot change directory to queue.");
-  DIR* dir = opendir(".");
+// Find the messages in a queue directory, and in the subdirectories
+// of the queue itself.
+static bool scan_dir(const mystring& prefix, list<mystring>& paths)
+{
+  DIR* dir = opendir(!prefix ? "." : prefix.c_str());
   if(!dir)
-    fail("Cannot open queue directory.");
+    return false;
   struct dirent* entry;
   while((entry = readdir(dir)) != 0) {
     const char* name = entry->d_name;
     if(name[0] == '.')
       continue;
-    time_t time = atoi(name);
-    char timebuf[100];
-    strftime(timebuf, 100, "%Y-%m-%d %H:%M:%S ", localtime(&time));
-    fout << timebuf;
-    struct stat statbuf;
-    if(stat(name, &statbuf) == -1) 
-      fout << "?????";
-    else
-      fout << itoa(statbuf.st_size);
-    fout << " bytes";
-    fdibuf in(name);
-    if (in.getline(line)) {
-      fout << " from <" << line << '>';
-      while (in.getline(line) && !!line)
-	fout << "\n  to <" << line << '>';
+    if(!prefix && queuedir_is_subdir(name)) {
+      scan_dir(name, paths);
+      continue;
     }
-    fout << endl;
+    paths.append(!prefix ? mystring(name) : mystring(prefix + "/" + name));
   }
   closedir(dir);
+  return true;
+}
+
+// Start a reader for every count'th message starting at the first,
+// writing its records to a pipe.
+static int start_reader(const list<mystring>& paths,
+			unsigned first, unsigned count, pid_t& pid)
+{
+  int fds[2];
+  if (pipe(fds) == -1)
+    return -1;
+  if ((pid = fork()) == -1) {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    fdobuf out(fds[1]);
+    unsigned n = 0;
+    for (list<mystring>::const_iter i(paths); i; i++, n++)
+      if (n % count == first)
+	out << read_message(*i);
+    _exit(out.flush() ? 0 : 1);
+  }
+  close(fds[1]);
+  return fds[0];
+}
+
+// Read the envelopes of all the messages in the queue.  Large queues
+// are split up between a bounded number of reader processes.
+static bool scan_queue(queue_journal& journal)
+{
+  list<mystring> paths;
+  if (!scan_dir("", paths))
+    return false;
+  unsigned readers = paths.count() / READER_MIN;
+  if (readers > READERS_MAX)
+    readers = READERS_MAX;
+  mystring records[READERS_MAX];
+  pid_t pids[READERS_MAX];
+  int fds[READERS_MAX];
+  poller events;
+  unsigned running = 0;
+  for (unsigned r = 0; r < readers; r++) {
+    if ((fds[r] = start_reader(paths, r, readers, pids[r])) < 0
+	|| !events.add(fds[r]))
+      return false;
+    ++running;
+  }
+  if (readers == 0) {
+    for (list<mystring>::const_iter i(paths); i; i++)
+      records[0] += read_message(*i);
+    readers = 1;
+  }
+  while (running > 0) {
+    int ready[READERS_MAX];
+    int n = events.wait(-1, ready, READERS_MAX);
+    if (n < 0)
+      return false;
+    for (int i = 0; i < n; i++) {
+      unsigned r;
+      for (r = 0; fds[r] != ready[i]; r++)
+	;
+      char buf[8192];
+      ssize_t rd = read(fds[r], buf, sizeof buf);
+      if (rd > 0) {
+	records[r].append(buf, rd);
+	continue;
+      }
+      events.remove(fds[r]);
+      close(fds[r]);
+      --running;
+      int status;
+      if (waitpid(pids[r], &status, 0) != pids[r]
+	  || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	return false;
+    }
+  }
+  for (unsigned r = 0; r < readers; r++)
+    if (!journal.replay(records[r].c_str(), records[r].length()))
+      return false;
+  return true;
+}
+
+static void list_messages(const queue_journal& journal)
+{
+  for(journal_entry* e = journal.first(); e; e = e->next) {
+    if(!e->live)
+      continue;
+    list_time(e->queued);
+    fout << itoa(e->size) << " bytes from <" << e->sender << '>';
+    for(list<mystring>::const_iter i(e->recipients); i; i++)
+      fout << "\n  to <" << *i << '>';
+    fout << endl;
+  }
+}
+
+static void json_string(const mystring& str)
+{
+  static const char hex[] = "0123456789abcdef";
+  fout << '"';
+  for (const char* ptr = str.c_str(); *ptr; ++ptr) {
+    const unsigned char ch = *ptr;
+    if (ch == '"' || ch == '\\')
+      fout << '\\' << (char)ch;
+    else if (ch < 0x20)
+      fout << "\\u00" << hex[ch >> 4] << hex[ch & 15];
+    else
+      fout << (char)ch;
+  }
+  fout << '"';
+}
+
+static void list_json(const queue_journal& journal)
+{
+  const char* sep = "\n";
+  fout << '[';
+  for(journal_entry* e = journal.first(); e; e = e->next) {
+    if(!e->live)
+      continue;
+    fout << sep << "{\"path\":";
+    json_string(e->path);
+    fout << ",\"queued\":" << itoa(e->queued);
+    fout << ",\"size\":" << itoa(e->size);
+    fout << ",\"attempts\":" << itoa(e->attempts);
+    fout << ",\"next_attempt\":" << itoa(e->next_attempt);
+    fout << ",\"sender\":";
+    json_string(e->sender);
+    fout << ",\"recipients\":[";
+    const char* rsep = "";
+    for(list<mystring>::const_iter i(e->recipients); i; i++) {
+      fout << rsep;
+      json_string(*i);
+      rsep = ",";
+    }
+    fout << "]}";
+    sep = ",\n";
+  }
+  fout << "\n]" << endl;
+}
+
+struct domain_stat
+{
+  mystring domain;
+  unsigned recipients;
+  unsigned messages;
+  unsigned long bytes;
+  const journal_entry* last;	// The last message counted
+  domain_stat* chain;
+};
+
+// The recipient domains seen, hashed on the domain name.
+class domain_table
+{
+public:
+  domain_table() : buckets(0), size(0), count(0) { }
+  ~domain_table();
+  domain_stat* find(const mystring& domain);
+  unsigned items() const { return count; }
+  void sorted(domain_stat** out) const;
+private:
+  domain_stat** buckets;
+  unsigned size;
+  unsigned count;
+  void grow();
+};
+
+domain_table::~domain_table()
+{
+  for (unsigned i = 0; i < size; i++)
+    while (buckets[i]) {
+      domain_stat* next = buckets[i]->chain;
+      delete buckets[i];
+      buckets[i] = next;
+    }
+  delete[] buckets;
+}
+
+static unsigned hash(const mystring& key)
+{
+  // FNV-1a
+  unsigned h = 2166136261U;
+  for (const char* ptr = key.c_str(); *ptr; ++ptr) {
+    h ^= (unsigned char)*ptr;
+    h *= 16777619U;
+  }
+  return h;
+}
+
+void domain_table::grow()
+{
+  unsigned newsize = size ? size * 2 : 64;
+  domain_stat** newbuckets = new domain_stat*[newsize];
+  for (unsigned i = 0; i < newsize; i++)
+    newbuckets[i] = 0;
+  for (unsigned i = 0; i < size; i++)
+    while (buckets[i]) {
+      domain_stat* d = buckets[i];
+      buckets[i] = d->chain;
+      unsigned b = hash(d->domain) & (newsize - 1);
+      d->chain = newbuckets[b];
+      newbuckets[b] = d;
+    }
+  delete[] buckets;
+  buckets = newbuckets;
+  size = newsize;
+}
+
+domain_stat* domain_table::find(const mystring& domain)
+{
+  if (size > 0)
+    for (domain_stat* d = buckets[hash(domain) & (size - 1)]; d; d = d->chain)
+      if (d->domain == domain)
+	return d;
+  if (count * 2 >= size)
+    grow();
+  domain_stat* d = new domain_stat;
+  d->domain = domain;
+  d->recipients = d->messages = 0;
+  d->bytes = 0;
+  d->last = 0;
+  unsigned b = hash(domain) & (size - 1);
+  d->chain = buckets[b];
+  buckets[b] = d;
+  ++count;
+  return d;
+}
+
+static int by_recipients(const void* a, const void* b)
+{
+  const domain_stat* da = *(const domain_stat* const*)a;
+  const domain_stat* db = *(const domain_stat* const*)b;
+  if (da->recipients != db->recipients)
+    return da->recipients > db->recipients ? -1 : 1;
+  return strcmp(da->domain.c_str(), db->domain.c_str());
+}
+
+// Fill in the domains, most recipients first.
+void domain_table::sorted(domain_stat** out) const
+{
+  unsigned n = 0;
+  for (unsigned i = 0; i < size; i++)
+    for (domain_stat* d = buckets[i]; d; d = d->chain)
+      out[n++] = d;
+  qsort(out, n, sizeof *out, by_recipients);
+}
+
+static const struct
+{
+  time_t age;
+  const char* label;
+} age_buckets[] = {
+  { 3600, "under 1 hour" },
+  { 6*3600, "1 to 6 hours" },
+  { 24*3600, "6 to 24 hours" },
+  { 7*24*3600, "1 to 7 days" },
+  { 0, "over 7 days" },
+};
+#define AGE_BUCKETS (sizeof age_buckets / sizeof age_buckets[0])
+
+static void list_summary(const queue_journal& journal)
+{
+  const time_t now = time(0);
+  unsigned messages = 0;
+  unsigned long bytes = 0;
+  unsigned ages[AGE_BUCKETS] = { 0 };
+  const journal_entry* oldest = 0;
+  domain_table domains;
+  for(journal_entry* e = journal.first(); e; e = e->next) {
+    if(!e->live)
+      continue;
+    ++messages;
+    bytes += e->size;
+    if (!oldest || e->queued < oldest->queued)
+      oldest = e;
+    const time_t age = now - e->queued;
+    unsigned a;
+    for (a = 0; a < AGE_BUCKETS - 1 && age >= age_buckets[a].age; a++)
+      ;
+    ++ages[a];
+    for(list<mystring>::const_iter i(e->recipients); i; i++) {
+      const int at = (*i).find_last('@');
+      domain_stat* d = domains.find(at < 0 ? mystring("(none)")
+				    : (*i).right(at + 1).lower());
+      ++d->recipients;
+      if (d->last != e) {
+	d->last = e;
+	++d->messages;
+	d->bytes += e->size;
+      }
+    }
+  }
+  fout << "Messages: " << itoa(messages) << '\n';
+  fout << "Bytes: " << itoa(bytes) << '\n';
+  if (oldest) {
+    fout << "Oldest: ";
+    list_time(oldest->queued);
+    fout << oldest->path << '\n';
+  }
+  fout << "Age:\n";
+  for (unsigned a = 0; a < AGE_BUCKETS; a++)
+    fout << "  " << age_buckets[a].label << ": " << itoa(ages[a]) << '\n';
+  fout << "Domains:\n";
+  domain_stat** sorted = new domain_stat*[domains.items() + 1];
+  domains.sorted(sorted);
+  for (unsigned i = 0; i < domains.items(); i++) {
+    fout << "  " << sorted[i]->domain
+	 << ": " << itoa(sorted[i]->recipients) << " recipients";
+    fout << " in " << itoa(sorted[i]->messages) << " messages";
+    fout << ", " << itoa(sorted[i]->bytes) << " bytes\n";
+  }
+  delete[] sorted;
+  fout.flush();
+}
+
+int cli_main(int, char*[])
+{
+  queue_journal journal;
+  if(!journal.load(journal_path())) {
+    mystring msg_dir = CONFIG_PATH(QUEUE, NULL, "queue");
+    if(chdir(msg_dir.c_str()))
+      fail("Cannot change directory to queue.");
+    if(!scan_queue(journal))
+      fail("Cannot read queue directory.");
+  }
+  if (opt_summary)
+    list_summary(journal);
+  else if (opt_json)
+    list_json(journal);
+  else
+    list_messages(journal);
   return 0;
 }
@@ -0,0 +1,46 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2018  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#include "config.h"
+#include <string.h>
+#include "multicall.h"
+
+// The name the library, and the unprefixed cli++ messages it uses,
+// report errors under.
+const char* cli_program = "sendmail";
+
+int multicall_inject(int argc, char* argv[])
+{
+  cli_program = "nullmailer-inject";
+  return inject_main(argc, argv);
+}
+
+// sendmail and nullmailer-inject as one program, which runs the one it
+// is called as.  Any other name, such as that of a link to it from
+// /usr/lib/sendmail, runs sendmail.
+int main(int argc, char* argv[])
+{
+  const char* name = strrchr(argv[0], '/');
+  name = name ? name + 1 : argv[0];
+  if (strcmp(name, "nullmailer-inject") == 0)
+    return multicall_inject(argc, argv);
+  return sendmail_main(argc, argv);
+}
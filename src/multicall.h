@@ -0,0 +1,34 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2018  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#ifndef NULLMAILER__MULTICALL__H__
+#define NULLMAILER__MULTICALL__H__
+
+// The programs built into the multi-call binary, each entered as its
+// own main() would be.  Each one is compiled with its own copy of the
+// cli++ library, renamed by CLI_PREFIX.
+int inject_main(int argc, char* argv[]);
+int sendmail_main(int argc, char* argv[]);
+
+// Run nullmailer-inject, with the library reporting errors as it.
+int multicall_inject(int argc, char* argv[]);
+
+#endif // NULLMAILER__MULTICALL__H__
@@ -22,183 +22,208 @@
 #include "config.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
-#include <time.h>
+#include <sys/wait.h>
 #include <unistd.h>
-#include "autoclose.h"
 #include "configio.h"
-#include "itoa.h"
 #include "defines.h"
+#include "envindex.h"
+#include "forkexec.h"
 #include "mystring/mystring.h"
 #include "fdbuf/fdbuf.h"
-#include "configio.h"
-#include "hostname.h"
+#include "journal.h"
+#include "queuedirs.h"
+#include "queuewriter.h"
+#include "stats.h"
 
 const char* cli_program = "nullmailer-queue";
 
 #define fail(MSG) do{ fout << "nullmailer-queue: " << MSG << endl; return false; }while(0)
 
-pid_t pid = getpid();
-uid_t uid = getuid();
-time_t timesecs = time(0);
-mystring adminaddr;
-mystring allmailfrom;
-
-static mystring trigger_path;
-static mystring msg_dir;
-static mystring tmp_dir;
-
-bool is_dir(const char* path)
-{
-  struct stat buf;
-  return !stat(path, &buf) && S_ISDIR(buf.st_mode);
-}
-
-bool is_exist(const char* path)
-{
-  struct stat buf;
-  return !stat(path, &buf);
-}
-
-int fsyncdir(const char* path)
-{
-  autoclose fd = open(path, O_RDONLY);
-  if(fd == -1)
-    return 0;
-  int result = fsync(fd);
-  if(result == -1 && errno != EIO)
-    result = 0;
-  return result;
-}
-
-void trigger()
-{
-  autoclose fd = open(trigger_path.c_str(), O_WRONLY|O_NONBLOCK, 0666);
-  if(fd == -1)
-    return;
-  char x = 0;
-  write(fd, &x, 1);
-}
-
-bool validate_addr(mystring& addr, bool recipient)
-{
-  int i = addr.find_last('@');
-  if(i <= 0)
-    return false;
-  mystring hostname = addr.right(i+1);
-  if (recipient && !!adminaddr && (hostname == me || hostname == "localhost"))
-    addr = adminaddr;
-  else if (!recipient && !!allmailfrom)
-    addr = allmailfrom;
-  else if(hostname.find_first('.') < 0)
-    return false;
-  return true;
-}
-
-bool copyenv(fdobuf& out)
+bool copyenv(queue_writer& qw)
 {
   mystring str;
   if(!fin.getline(str))
     fail("Could not read envelope sender.");
-  if(!!str && !validate_addr(str, false))
-    fail("Envelope sender address is invalid.");
-  if(!(out << str << endl))
-    fail("Could not write envelope sender.");
-  unsigned count=0;
-  while(fin.getline(str) && !!str) {
-    if(!validate_addr(str, true))
-      fail("Envelope recipient address is invalid.");
-    if(!(out << str << endl))
-      fail("Could not write envelope recipient.");
-    ++count;
-  }
-  if(count == 0)
-    fail("No envelope recipients read.");
-  if(!(out << "\n"))
-    fail("Could not write extra blank line to destination.");
-  return true;
+  if(!qw.sender(str))
+    return false;
+  while(fin.getline(str) && !!str)
+    if(!qw.recipient(str))
+      return false;
+  return qw.end_envelope();
 }
 
-bool makereceived(fdobuf& out)
+// Copy the header block, noting the lines the index records.
+bool copyheaders(queue_writer& qw)
 {
-  mystring line("Received: (nullmailer pid ");
-  line += itoa(pid);
-  line += " invoked by uid ";
-  line += itoa(uid);
-  line += ");\n\t";
-  char buf[100];
-  if(!strftime(buf, 100, "%a, %d %b %Y %H:%M:%S -0000\n", gmtime(&timesecs)))
-    fail("Error generating a date string.");
-  line += buf;
-  if(!(out << line))
-    fail("Could not write received line to message.");
+  fdobuf& out = qw.out();
+  mystring line;
+  while(fin.getline(line)) {
+    qw.header(line);
+    if(!(out << line))
+      fail("Could not write header to message.");
+    // The last line of a message with no body may have no newline.
+    if(fin.eof())
+      break;
+    if(!(out << '\n'))
+      fail("Could not write header to message.");
+    if(!line)
+      break;
+  }
   return true;
 }
 
-bool dump(int fd)
+// Queue the message, or if hold is set put it into the holding area to
+// be delivered at once, or if fast is set into the fast lane, keeping it
+// locked while it is there.
+bool deliver(queue_writer& qw, bool hold, bool fast)
 {
-  fdobuf out(fd);
-  if(!copyenv(out))
+  if(!qw.open(hold, fast) || !copyenv(qw) || !copyheaders(qw))
     return false;
-  if(!makereceived(out))
-    return false;
-  if(!fdbuf_copy(fin, out))
+  stats_phase("body");
+  if(!fdbuf_copy(fin, qw.out()))
     fail("Error copying the message to the queue file.");
-  if(!out.sync())
-    fail("Error flushing the output file.");
-  if(!out.close())
-    fail("Error closing the output file.");
-  return true;
+  return qw.commit();
 }
 
-bool deliver()
+// Have nullmailer-send deliver the held message.  It is removed if it
+// was delivered or rejected, and otherwise moved into the queue to be
+// retried.  Returns the exit code for the result.
+int send_held(queue_writer& qw)
 {
-  if(!is_dir(msg_dir.c_str()) || !is_dir(tmp_dir.c_str()))
-    fail("Installation error: queue directory is invalid.");
+  const mystring& name = qw.name();
+  const mystring msg_dir = queue_msg_dir();
+  const mystring heldfile = queue_hold_dir() + name;
+  const mystring program = CONFIG_PATH(SBIN, NULL, "nullmailer-send");
+  const char* args[] = { program.c_str(), "--direct", name.c_str(), 0 };
+  int redirs[] = { REDIRECT_NULL };
+  fork_exec send("nullmailer-send");
+  int status = -1;
+  if(send.start(args, 1, redirs))
+    status = send.wait_status();
+  const int result = (status >= 0 && WIFEXITED(status))
+    ? WEXITSTATUS(status) : 1;
+  if(result == 0 || result == 2) {
+    unlink(heldfile.c_str());
+    unlink(envindex_path(name).c_str());
+    if(result == 0)
+      return 0;
+    fout << "nullmailer-queue: The message was rejected permanently." << endl;
+    return 2;
+  }
 
-  // Notes:
-  // - temporary file name is unique to the currently running
-  //   nullmailer-queue program
-  // - destination file name is unique to the system
-  // - if the temporary file previously existed, it did so because
-  //   the previous nullmailer-queue process crashed, and it can be
-  //   safely overwritten
-  const mystring pidstr = itoa(pid);
-  const mystring tmpfile = tmp_dir + pidstr;
-  const mystring newfile = msg_dir + itoa(timesecs) + "." + pidstr;
+  // The message is safely held, so if it cannot be moved it is left for
+  // nullmailer-send to move when it next rescans the queue.
+  const int dirs = queuedirs_read();
+  const mystring newdir = msg_dir + queuedir_of(name, dirs);
+  const mystring newfile = msg_dir + queuedir_path(name, dirs);
+  if(dirs > 0 && !queue_is_dir(newdir.c_str()))
+    mkdir(newdir.c_str(), 0700);
+  if(rename(heldfile.c_str(), newfile.c_str())
+     || queue_fsyncdir(newdir.c_str())) {
+    fout << "nullmailer-queue: Could not move the held message into the queue." << endl;
+    return 0;
+  }
+  // The envelope may have been rewritten, dropping the index, if some
+  // of the recipients were delivered to.
+  const envelope_index& envindex = qw.envelope();
+  if(queue_is_exist(envindex_path(name).c_str()))
+    journal_append(journal_queued(queuedir_path(name, dirs), qw.queued(),
+				  envindex.size, envindex.sender,
+				  envindex.recipients));
+  qw.trigger();
+  return 0;
+}
 
-  int out = open(tmpfile.c_str(), O_CREAT|O_WRONLY|O_TRUNC, 0600);
-  if(out < 0)
-    fail("Could not open temporary file for writing");
-  if(!dump(out)) {
-    unlink(tmpfile.c_str());
-    return false;
+static void catch_alrm(int) { }
+
+// Run "nullmailer-send --fastlane NAME" on a message in the fast lane,
+// giving up on it after the fastlanetime control file says.  Returns
+// its exit code, or -1 if it did not finish.
+static int run_fast(const mystring& name)
+{
+  int limit;
+  if(!config_readint("fastlanetime", limit) || limit <= 0)
+    limit = 30;
+  const mystring program = CONFIG_PATH(SBIN, NULL, "nullmailer-send");
+  const char* args[] = { program.c_str(), "--fastlane", name.c_str(), 0 };
+  int redirs[] = { REDIRECT_NULL };
+  fork_exec send("nullmailer-send");
+  if(!send.start(args, 1, redirs))
+    return -1;
+  // The alarm interrupts the wait rather than restarting it.
+  struct sigaction sa;
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = catch_alrm;
+  sigaction(SIGALRM, &sa, 0);
+  alarm(limit);
+  int status = send.wait_status();
+  alarm(0);
+  if(status < 0) {
+    send.kill(SIGTERM);
+    send.wait_status();
+    return -1;
   }
-  if(link(tmpfile.c_str(), newfile.c_str()))
-    fail("Error linking the temp file to the new file.");
-  if(fsyncdir(msg_dir.c_str()))
-    fail("Error syncing the new directory.");
-  if(unlink(tmpfile.c_str()))
-    fail("Error unlinking the temp file.");
-  return true;
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
 }
 
-int main(int, char*[])
+// Deliver the message in the fast lane in the background, and report it
+// queued straight away.  It is removed if it was delivered, and
+// otherwise copied into the queue to be retried or bounced from there.
+int send_fast(queue_writer& qw)
 {
-  trigger_path = CONFIG_PATH(QUEUE, NULL, "trigger");
-  msg_dir = CONFIG_PATH(QUEUE, "queue", "");
-  tmp_dir = CONFIG_PATH(QUEUE, "tmp", "");
+  const mystring& name = qw.name();
+  const pid_t pid = fork();
+  if(pid > 0)
+    return 0;
+  if(pid == 0) {
+    setsid();
+    const int null = open("/dev/null", O_RDWR);
+    if(null >= 0) {
+      dup2(null, 0);
+      dup2(null, 1);
+      dup2(null, 2);
+      if(null > 2)
+	close(null);
+    }
+    const int result = run_fast(name);
+    if(result == 0) {
+      unlink(mystring(queue_fastlane_dir() + name).c_str());
+      return 0;
+    }
+  }
+  // A message that cannot be copied is left for nullmailer-send to copy
+  // when it next rescans the queue.
+  if(!queue_spill(name)) {
+    fout << "nullmailer-queue: Could not copy the message into the queue." << endl;
+    return 0;
+  }
+  qw.trigger();
+  return 0;
+}
 
+int main(int argc, char* argv[])
+{
   umask(077);
-  if(config_read("adminaddr", adminaddr) && !!adminaddr) {
-    adminaddr = adminaddr.subst(',', '\n');
-    read_hostnames();
+  // Messages are only held for direct delivery if the holding area has
+  // been set up, and are queued as usual otherwise.  The others go into
+  // the fast lane if it has been set up.
+  const bool direct = argc > 1 && strcmp(argv[1], "--direct") == 0;
+  const bool hold = direct && queue_is_dir(queue_hold_dir().c_str());
+  const bool fast = !direct && queue_is_dir(queue_fastlane_dir().c_str());
+  queue_writer qw(fout);
+  if(!deliver(qw, hold, fast))
+    return qw.full() ? QUEUE_FULL_EXIT : 1;
+  if(hold) {
+    stats_phase("send");
+    return send_held(qw);
+  }
+  if(fast) {
+    stats_phase("send");
+    return send_fast(qw);
   }
-  config_read("allmailfrom", allmailfrom);
-  
-  if(!deliver())
-    return 1;
-  trigger();
   return 0;
 }
@@ -0,0 +1,352 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "autoclose.h"
+#include "configio.h"
+#include "defines.h"
+#include "fdbuf/fdbuf.h"
+#include "iobatch.h"
+#include "itoa.h"
+#include "mystring/mystring.h"
+#include "poller.h"
+#include "queuedirs.h"
+
+const char* cli_program = "nullmailer-queued";
+
+#define fail(MSG) do{ fout << "nullmailer-queued: " << MSG << endl; return 1; }while(0)
+#define failsys(MSG) do{ fout << "nullmailer-queued: " << MSG << strerror(errno) << endl; return 1; }while(0)
+
+// The most clients waiting to have a message committed at once.
+#define CLIENTS_MAX 256
+
+static mystring msg_dir;
+static mystring tmp_dir;
+static poller events;
+
+struct client
+{
+  int fd;
+  int file;			// The unnamed message file, if passed
+  bool ready;			// The request has been read
+  bool ok;
+  mystring tmpfile;
+  mystring newfile;
+  mystring newdir;
+};
+
+static client clients[CLIENTS_MAX];
+static unsigned nclients = 0;
+
+static bool is_digits(const mystring& str, size_t start, size_t end)
+{
+  if (start >= end)
+    return false;
+  for (size_t i = start; i < end; i++)
+    if (str[i] < '0' || str[i] > '9')
+      return false;
+  return true;
+}
+
+// Message names are TIME.PID, or TIME.PID.SEQ for the later messages
+// from a process that queues more than one, optionally in a queue
+// subdirectory.  A path naming anything else, such as "../1.2", would
+// reach outside the queue.
+static bool valid_path(const mystring& path)
+{
+  size_t start = 0;
+  if (path.length() > 3 && path[2] == '/') {
+    if (!queuedir_is_subdir(path.left(2).c_str()))
+      return false;
+    start = 3;
+  }
+  int dot = path.find_first('.', start);
+  if (dot <= 0 || !is_digits(path, start, dot))
+    return false;
+  int seq = path.find_first('.', dot + 1);
+  if (seq < 0)
+    return is_digits(path, dot + 1, path.length());
+  return is_digits(path, dot + 1, seq)
+    && is_digits(path, seq + 1, path.length());
+}
+
+// A request is the name of the temporary file and the path of the
+// message in the queue, each on a line.  The file may instead be
+// passed over the socket, with an empty name.
+static bool read_request(client& c)
+{
+  char buf[256];
+  struct iovec iov;
+  iov.iov_base = buf;
+  iov.iov_len = sizeof buf - 1;
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof msg);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof control;
+  ssize_t rd = recvmsg(c.fd, &msg, 0);
+  if (rd <= 0)
+    return false;
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET
+      && cmsg->cmsg_type == SCM_RIGHTS
+      && cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+    memcpy(&c.file, CMSG_DATA(cmsg), sizeof(int));
+  buf[rd] = 0;
+  char* nl1 = strchr(buf, '\n');
+  char* nl2 = nl1 ? strchr(nl1 + 1, '\n') : 0;
+  if (nl2 == 0 || nl2 + 1 != buf + rd)
+    return false;
+  const mystring tmpname(buf, nl1 - buf);
+  const mystring path(nl1 + 1, nl2 - nl1 - 1);
+  if (!valid_path(path))
+    return false;
+#ifdef O_TMPFILE
+  if (!tmpname && c.file < 0)
+    return false;
+#else
+  if (c.file >= 0)
+    return false;
+#endif
+  if (!!tmpname && (c.file >= 0 || !is_digits(tmpname, 0, tmpname.length())))
+    return false;
+  c.tmpfile = tmp_dir + tmpname;
+  c.newfile = msg_dir + path;
+  c.newdir = path[2] == '/' ? mystring(msg_dir + path.left(2)) : msg_dir;
+  c.ready = true;
+  c.ok = true;
+  return true;
+}
+
+static void drop_client(unsigned i)
+{
+  events.remove(clients[i].fd);
+  close(clients[i].fd);
+  if (clients[i].file >= 0)
+    close(clients[i].file);
+  clients[i] = clients[--nclients];
+}
+
+static void accept_clients(int sock)
+{
+  int fd;
+  while (nclients < CLIENTS_MAX && (fd = accept(sock, 0, 0)) >= 0) {
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0 || !events.add(fd)) {
+      close(fd);
+      continue;
+    }
+    client& c = clients[nclients++];
+    c.fd = fd;
+    c.file = -1;
+    c.ready = false;
+  }
+}
+
+// Commit all the messages whose requests have been read together: the
+// files are synced, linked into the queue, and each directory they
+// went into is synced once, before any client is told that its
+// message is safely queued.  Each step is made for all the messages
+// in one batch of calls.
+static unsigned commit_batch()
+{
+  unsigned count = 0;
+  bool synced = false;
+#ifdef HAVE_SYNCFS
+  {
+    autoclose fd = open(tmp_dir.c_str(), O_RDONLY);
+    synced = fd >= 0 && syncfs(fd) == 0;
+  }
+#endif
+  io_batch batch;
+  int fds[CLIENTS_MAX];
+  int slots[CLIENTS_MAX];
+  for (unsigned i = 0; i < nclients; i++) {
+    client& c = clients[i];
+    fds[i] = slots[i] = -1;
+    if (!c.ready)
+      continue;
+    ++count;
+    if (synced)
+      continue;
+    if (c.file >= 0)
+      fds[i] = dup(c.file);
+    else
+      slots[i] = batch.open(c.tmpfile.c_str(), O_RDONLY);
+  }
+  batch.submit();
+  for (unsigned i = 0; i < nclients; i++)
+    if (slots[i] >= 0)
+      fds[i] = batch.result(slots[i]);
+  batch.clear();
+  for (unsigned i = 0; i < nclients; i++) {
+    client& c = clients[i];
+    slots[i] = -1;
+    if (!c.ready || synced)
+      continue;
+    if (fds[i] < 0)
+      c.ok = false;
+    else
+      slots[i] = batch.fsync(fds[i]);
+  }
+  batch.submit();
+  for (unsigned i = 0; i < nclients; i++) {
+    if (slots[i] >= 0 && batch.result(slots[i]) < 0)
+      clients[i].ok = false;
+    if (fds[i] >= 0)
+      close(fds[i]);
+  }
+  batch.clear();
+
+  mystring procpaths[CLIENTS_MAX];
+  for (unsigned i = 0; i < nclients; i++) {
+    client& c = clients[i];
+    slots[i] = -1;
+    if (!c.ready || !c.ok)
+      continue;
+#ifdef O_TMPFILE
+    // An unnamed file is linked into place through its entry in /proc,
+    // which unlike AT_EMPTY_PATH needs no special privileges.
+    if (c.file >= 0) {
+      procpaths[i] = "/proc/self/fd/" + mystring(itoa(c.file));
+      slots[i] = batch.link(procpaths[i].c_str(), c.newfile.c_str(),
+			    AT_SYMLINK_FOLLOW);
+      continue;
+    }
+#endif
+    slots[i] = batch.link(c.tmpfile.c_str(), c.newfile.c_str());
+  }
+  batch.submit();
+  for (unsigned i = 0; i < nclients; i++)
+    if (slots[i] >= 0 && batch.result(slots[i]) < 0)
+      clients[i].ok = false;
+  batch.clear();
+
+  // A directory that cannot be opened is not synced, and only an I/O
+  // error syncing it fails the messages in it.
+  for (unsigned i = 0; i < nclients; i++) {
+    client& c = clients[i];
+    fds[i] = slots[i] = -1;
+    if (!c.ready || !c.ok)
+      continue;
+    bool seen = false;
+    for (unsigned j = 0; j < i && !seen; j++)
+      seen = clients[j].ready && clients[j].ok
+	&& clients[j].newdir == c.newdir;
+    if (!seen && (fds[i] = open(c.newdir.c_str(), O_RDONLY)) >= 0)
+      slots[i] = batch.fsync(fds[i]);
+  }
+  batch.submit();
+  for (unsigned i = 0; i < nclients; i++) {
+    if (fds[i] >= 0)
+      close(fds[i]);
+    if (slots[i] < 0 || batch.result(slots[i]) != -EIO)
+      continue;
+    const client& c = clients[i];
+    for (unsigned j = i; j < nclients; j++)
+      if (clients[j].ready && clients[j].newdir == c.newdir) {
+	// Leave the message for the client to commit itself.
+	unlink(clients[j].newfile.c_str());
+	clients[j].ok = false;
+      }
+  }
+  batch.clear();
+
+  for (unsigned i = 0; i < nclients; i++) {
+    const client& c = clients[i];
+    if (c.ready && c.ok && c.file < 0)
+      batch.unlink(c.tmpfile.c_str());
+  }
+  batch.submit();
+  for (unsigned i = nclients; i-- > 0; ) {
+    client& c = clients[i];
+    if (!c.ready)
+      continue;
+    // A client that gave up waiting finds its message in the queue.
+    if (write(c.fd, c.ok ? "K" : "Z", 1) != 1)
+      fout << "nullmailer-queued: Could not reply to a client: "
+	   << strerror(errno) << endl;
+    drop_client(i);
+  }
+  return count;
+}
+
+int main(int, char*[])
+{
+  msg_dir = CONFIG_PATH(QUEUE, "queue", "");
+  tmp_dir = CONFIG_PATH(QUEUE, "tmp", "");
+  const mystring sock_path = CONFIG_PATH(QUEUE, "queue", ".commit");
+
+  umask(077);
+  signal(SIGPIPE, SIG_IGN);
+  struct sockaddr_un sa;
+  memset(&sa, 0, sizeof sa);
+  sa.sun_family = AF_UNIX;
+  if (sock_path.length() >= sizeof sa.sun_path)
+    fail("Commit socket path is too long.");
+  strcpy(sa.sun_path, sock_path.c_str());
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0)
+    failsys("Could not create commit socket: ");
+  unlink(sa.sun_path);
+  if (bind(sock, (struct sockaddr*)&sa, sizeof sa) < 0
+      || chmod(sa.sun_path, 0600) < 0
+      || listen(sock, SOMAXCONN) < 0
+      || fcntl(sock, F_SETFL, O_NONBLOCK) < 0
+      || fcntl(sock, F_SETFD, FD_CLOEXEC) < 0
+      || !events || !events.add(sock))
+    failsys("Could not set up commit socket: ");
+  fout << "nullmailer-queued: Listening for messages to commit." << endl;
+
+  // Requests that arrive while a batch is being committed wait for the
+  // next one, so the batches grow with the load.
+  for (;;) {
+    int ready[CLIENTS_MAX + 1];
+    int n = events.wait(-1, ready, CLIENTS_MAX + 1);
+    if (n < 0)
+      failsys("Error waiting for clients: ");
+    for (int r = 0; r < n; r++) {
+      if (ready[r] == sock) {
+	accept_clients(sock);
+	continue;
+      }
+      for (unsigned i = 0; i < nclients; i++)
+	if (clients[i].fd == ready[r]) {
+	  if (clients[i].ready || !read_request(clients[i]))
+	    drop_client(i);
+	  break;
+	}
+    }
+    const unsigned count = commit_batch();
+    if (count > 0)
+      fout << "nullmailer-queued: Committed " << itoa(count)
+	   << " message(s)." << endl;
+  }
+}
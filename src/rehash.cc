@@ -0,0 +1,142 @@
+// nullmailer -- a simple relay-only MTA
+// Copyright (C) 2016  Bruce Guenter <bruce@untroubled.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// You can contact me at <bruce@untroubled.org>.  There is also a mailing list
+// available to discuss this package.  To subscribe, send an email to
+// <nullmailer-subscribe@lists.untroubled.org>.
+
+#include "config.h"
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "configio.h"
+#include "defines.h"
+#include "fdbuf/fdbuf.h"
+#include "itoa.h"
+#include "journal.h"
+#include "list.h"
+#include "mystring/mystring.h"
+#include "queuedirs.h"
+
+const char* cli_program = "nullmailer-rehash";
+
+#define fail(X) do{ fout << "nullmailer-rehash: " << X << endl; return 1; }while(0)
+
+typedef list<mystring> slist;
+
+static int dirs;
+static unsigned moved = 0;
+static unsigned errors = 0;
+
+// Collect the messages in a queue directory, and in the subdirectories
+// of the queue itself.  The names are collected before any are moved,
+// so that none is seen twice.
+static bool scan_dir(const mystring& prefix, slist& paths, slist& subdirs)
+{
+  DIR* dir = opendir(!prefix ? "." : prefix.c_str());
+  if(!dir)
+    return false;
+  struct dirent* entry;
+  while((entry = readdir(dir)) != 0) {
+    const char* name = entry->d_name;
+    if(name[0] == '.')
+      continue;
+    if(!prefix && queuedir_is_subdir(name)) {
+      subdirs.append(name);
+      if(!scan_dir(name, paths, subdirs)) {
+	fout << "nullmailer-rehash: Cannot open queue directory " << name
+	     << ": " << strerror(errno) << endl;
+	++errors;
+      }
+      continue;
+    }
+    paths.append(!prefix ? mystring(name) : mystring(prefix + "/" + name));
+  }
+  closedir(dir);
+  return true;
+}
+
+static void move_message(const mystring& path)
+{
+  const mystring name = queuedir_name(path);
+  const mystring newpath = queuedir_path(name, dirs);
+  if(newpath == path)
+    return;
+  if(dirs > 0) {
+    const mystring sub = queuedir_of(name, dirs);
+    if(mkdir(sub.c_str(), 0700) && errno != EEXIST) {
+      fout << "nullmailer-rehash: Could not create " << sub << ": "
+	   << strerror(errno) << endl;
+      ++errors;
+      return;
+    }
+  }
+  if(rename(path.c_str(), newpath.c_str())) {
+    fout << "nullmailer-rehash: Could not move " << path << " to "
+	 << newpath << ": " << strerror(errno) << endl;
+    ++errors;
+    return;
+  }
+  ++moved;
+}
+
+// Subdirectories that are no longer used are removed once they are
+// empty.  Ones still in use are kept, since nullmailer-queue only
+// creates them when they are missing.
+static bool in_use(const mystring& sub)
+{
+  return strtol(sub.c_str(), 0, 16) < dirs;
+}
+
+int main(int argc, char*[])
+{
+  if(argc > 1) {
+    fout << "usage: nullmailer-rehash" << endl;
+    return 1;
+  }
+  mystring msg_dir = CONFIG_PATH(QUEUE, NULL, "queue");
+  if(chdir(msg_dir.c_str()))
+    fail("Cannot change directory to queue.");
+  dirs = queuedirs_read();
+  slist paths;
+  slist subdirs;
+  if(!scan_dir("", paths, subdirs))
+    fail("Cannot open queue directory.");
+  for(slist::const_iter i(paths); i; i++)
+    move_message(*i);
+  // The journal records where each message was, so it is removed to
+  // have nullmailer-send scan the queue and write it out again.
+  if(moved > 0 && unlink(journal_path().c_str()) && errno != ENOENT) {
+    fout << "nullmailer-rehash: Could not remove the queue journal: "
+	 << strerror(errno) << endl;
+    ++errors;
+  }
+  for(slist::const_iter i(subdirs); i; i++)
+    if(!in_use(*i) && rmdir((*i).c_str()) && errno != ENOTEMPTY
+       && errno != EEXIST) {
+      fout << "nullmailer-rehash: Could not remove " << *i << ": "
+	   << strerror(errno) << endl;
+      ++errors;
+    }
+  fout << "Moved " << itoa(moved) << " message(s) into "
+       << itoa(dirs) << " queue subdirectories." << endl;
+  return errors > 0;
+}
@@ -23,73 +23,393 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 #include "ac/time.h"
 #include "argparse.h"
 #include "autoclose.h"
+#include "blocklist.h"
+#include "cgroup.h"
+#include "configdb.h"
 #include "configio.h"
 #include "defines.h"
+#include "dsn.h"
+#include "envindex.h"
 #include "errcodes.h"
 #include "fdbuf/fdbuf.h"
+#include "fdbuf/logobuf.h"
+#include "fdbuf/mmapibuf.h"
+#include "fdpass.h"
 #include "forkexec.h"
 #include "hostname.h"
+#include "iobatch.h"
 #include "itoa.h"
+#include "journal.h"
 #include "list.h"
+#include "mystring/builder.h"
+#include "makefield.h"
+#include "metrics.h"
+#include "mx.h"
+#include "netstring.h"
+#include "poller.h"
+#include "priority.h"
+#include "protocol.h"
+#include "queuefile.h"
+#include "queuedirs.h"
+#include "queuewriter.h"
+#include "retention.h"
+#include "routetable.h"
 #include "selfpipe.h"
 #include "setenv.h"
+#include "slotpool.h"
+#include "stats.h"
 
 const char* cli_program = "nullmailer-send";
 
 selfpipe selfpipe;
+// The event loop: the trigger, queue watcher, notification socket,
+// self-pipe and the output of the running protocols are all waited on
+// here.
+static poller events;
 
 typedef enum { tempfail=-1, permfail=0, success=1 } tristate;
 
+// The names of the queued messages, packed end to end in one buffer.
+// A message refers to its name by offset, so that the record itself
+// holds no pointers and costs no allocation of its own.
+class name_table
+{
+  char* buf;
+  unsigned used;
+  unsigned alloc;
+  unsigned released;
+public:
+  name_table() : buf(0), used(0), alloc(0), released(0) { }
+  ~name_table() { delete[] buf; }
+  unsigned add(const char* str, unsigned length);
+  const char* operator[](unsigned offset) const { return buf + offset; }
+  // Note that a name is no longer used, to tell when the table is worth
+  // rebuilding.
+  void release(unsigned offset) { released += strlen(buf + offset) + 1; }
+  bool mostly_released() const { return released > used / 2; }
+  void swap(name_table& that);
+};
+
+unsigned name_table::add(const char* str, unsigned length)
+{
+  if (used + length + 1 > alloc) {
+    unsigned newalloc = alloc ? alloc : 4096;
+    while (used + length + 1 > newalloc)
+      newalloc *= 2;
+    char* newbuf = new char[newalloc];
+    memcpy(newbuf, buf, used);
+    delete[] buf;
+    buf = newbuf;
+    alloc = newalloc;
+  }
+  unsigned offset = used;
+  memcpy(buf + used, str, length);
+  buf[used + length] = 0;
+  used += length + 1;
+  return offset;
+}
+
+void name_table::swap(name_table& that)
+{
+  char* b = buf; buf = that.buf; that.buf = b;
+  unsigned u = used; used = that.used; that.used = u;
+  unsigned a = alloc; alloc = that.alloc; that.alloc = a;
+  unsigned r = released; released = that.released; that.released = r;
+}
+
+static name_table message_names;
+
+// The distinct remote groups messages are routed to.  A message holds
+// the index of its group, with 0 for the default group.
+class group_table
+{
+  mystring* names;
+  unsigned count;
+  unsigned alloc;
+public:
+  group_table() : names(0), count(0), alloc(0) { }
+  ~group_table() { delete[] names; }
+  unsigned short intern(const mystring& name);
+  const mystring& operator[](unsigned short index) const;
+};
+
+unsigned short group_table::intern(const mystring& name)
+{
+  if (!name)
+    return 0;
+  for (unsigned i = 0; i < count; i++)
+    if (names[i] == name)
+      return i + 1;
+  if (count == alloc) {
+    alloc = alloc ? alloc * 2 : 8;
+    mystring* newnames = new mystring[alloc];
+    for (unsigned i = 0; i < count; i++)
+      newnames[i] = names[i];
+    delete[] names;
+    names = newnames;
+  }
+  names[count] = name;
+  return ++count;
+}
+
+const mystring& group_table::operator[](unsigned short index) const
+{
+  static const mystring none;
+  return index ? names[index - 1] : none;
+}
+
+static group_table message_groups;
+
+// The trace of a message that has been tried: its ID, when it was
+// injected and queued, and when this nullmailer-send first tried it,
+// in microseconds since the epoch (0 if not known).
+struct message_trace
+{
+  mystring id;
+  long long injected;
+  long long queued;
+  long long first;
+};
+
 struct message
 {
   time_t timestamp;
-  mystring filename;
+  time_t last_attempt;
+  time_t next_attempt;
+  // The offset of the file name in message_names.
+  unsigned name_offset;
+  unsigned attempts;
+  // The generation of the routes the message was found with (0 if it
+  // has not been routed).
+  unsigned routed;
+  // The members of a balanced set of remotes the message has been tried
+  // on in the current queue run.
+  unsigned tried;
+  // The group of remotes the message is routed to, in message_groups.
+  unsigned short group;
+  bool done;
+  bool seen;
+  // Set when the timestamp was taken from the file itself rather than
+  // its name.
+  bool stated;
+  // Set once a delay notice has been sent for the message.
+  bool warned;
+  // The position of the message in the expiry queue.
+  unsigned expiry_slot;
+  // The sort key for the order of delivery, once keyed is set: a hash
+  // of the domain of the first recipient, and the size of the file.
+  // The size may be known before then, from the journal or when the
+  // message arrived, for the usage file.
+  bool keyed;
+  unsigned domain;
+  unsigned size;
+  // Set while the message is sent to the mail exchangers of its domain.
+  bool picked;
+  // The priority class of the message, found with the priority rules
+  // of the given generation (0 if it has not been found yet).
+  unsigned char priority;
+  unsigned prioritized;
+  // The descriptor holding the claim on the message while it is being
+  // sent (or -1), and whether another nullmailer-send holds it.
+  int claim;
+  bool busy;
+  // Set once the message has been handed to a protocol in the current
+  // queue run.
+  bool attempted;
+  // The remote that spilled the message over to the next one in its
+  // group in the current queue run, and so passes it by.
+  const struct remote* spilled;
+  message_trace* trace;
+  message(time_t t, const mystring& f, bool s)
+    : timestamp(t), last_attempt(0), next_attempt(0),
+      name_offset(message_names.add(f.c_str(), f.length())),
+      attempts(0), routed(0), tried(0), group(0),
+      done(false), seen(true), stated(s), warned(false), expiry_slot(0),
+      keyed(false), domain(0), size(0), picked(false),
+      priority(PRIORITY_NORMAL), prioritized(0), claim(-1), busy(false),
+      attempted(false), spilled(0), trace(0)
+  {
+  }
+  const char* name() const { return message_names[name_offset]; }
+  mystring filename() const { return name(); }
+  const mystring& group_name() const { return message_groups[group]; }
 };
 
 typedef list<mystring> slist;
-typedef list<struct message> msglist;
+typedef blocklist<struct message> msglist;
+typedef blocklist<message*> duelist;
+
+// The log, which is written without ever holding up deliveries.
+static logobuf flog(1);
 
-#define msg1(MSG) do{ fout << MSG << endl; }while(0)
-#define msg2(MSG1,MSG2) do{ fout << MSG1 << MSG2 << endl; }while(0)
-#define msg1sys(MSG) do{ fout << MSG << strerror(errno) << endl; }while(0)
+#define msg1(MSG) do{ flog << MSG << endl; }while(0)
+#define msg2(MSG1,MSG2) do{ flog << MSG1 << MSG2 << endl; }while(0)
+#define msg1sys(MSG) do{ flog << MSG << strerror(errno) << endl; }while(0)
 #define fail(MSG) do { msg1(MSG); return false; } while(0)
 #define fail2(MSG1,MSG2) do{ msg2(MSG1,MSG2); return false; }while(0)
 #define fail1sys(MSG) do{ msg1sys(MSG); return false; }while(0)
 #define tempfail1sys(MSG) do{ msg1sys(MSG); return tempfail; }while(0)
 
 static mystring trigger_path;
+static mystring notify_path;
+static mystring control_path;
 static mystring msg_dir;
 
+// The number of records appended to the queue journal since it was
+// last compacted.
+static unsigned journal_appended = 0;
+
+// Set when delivering a single held message for nullmailer-queue, with
+// the result of the last attempt.  Such a message is not in the queue,
+// so it is left to nullmailer-queue to dispose of and not journaled.
+static bool direct = false;
+// Set when the message delivered with direct is in the fast lane
+// rather than the holding area.
+static bool fastlane = false;
+static tristate direct_result = tempfail;
+
+static void journal_record(const mystring& record)
+{
+  if (direct)
+    return;
+  if (journal_append(record))
+    ++journal_appended;
+}
+
+// The phases of a delivery timed by the built-in protocols.
+#define DELIVERY_PHASES 11
+static const char* const delivery_phases[DELIVERY_PHASES] = {
+  "setup", "dns", "connect", "greeting", "helo", "starttls", "tls", "auth",
+  "envelope", "data", "final",
+};
+
 struct remote
 {
   static const mystring default_proto;
   
   mystring host;
+  mystring source;
   mystring proto;
   mystring program;
   mystring options;
+  mystring group;
+  bool multi;
+  // An mx remote stands for the mail exchangers of the domains of the
+  // recipients.  They are sent to through remotes made from its
+  // arguments with their own host names, which have mxhost set.
+  bool mx;
+  bool mxhost;
+  slist args;
+  int maxconcurrency;
+  // How long a multi session may be kept open and idle, from the warm
+  // option, so that the next messages need not wait for it to be set
+  // up.
+  int warm;
+  // Remotes in the same group with a weight are balanced: messages are
+  // spread across them in proportion to their weights.  current is the
+  // running total of the smooth weighted round-robin.
+  int weight;
+  int current;
+  // Health of the remote: after a connection failure it is skipped for
+  // the rest of the queue run and until down_until.
+  unsigned failures;
+  time_t down_until;
+  bool down;
+  // A remote that replied that it is throttling the deliveries is put
+  // into a deferral window until throttled_until, and the messages for
+  // it wait that out without counting an attempt.  throttles counts the
+  // throttling replies in a row.
+  unsigned throttles;
+  time_t throttled_until;
+  // Pacing, from the rate and byterate options: token buckets of
+  // messages and bytes a second, each holding up to a second's worth.
+  // The bytes of a message are taken once it is opened, so that bucket
+  // can go into debt, which the next message waits out.
+  double rate;
+  double byterate;
+  double tokens;
+  double bytetokens;
+  long long refilled;
+  // Adaptive concurrency, from the adaptive option: window is how many
+  // deliveries may run at once, grown by one for each window's worth of
+  // successes and halved on a temporary failure or a slow handshake.
+  // handshake is the running average of the handshake time in
+  // microseconds.
+  bool adaptive;
+  double window;
+  long handshake;
+  // Spillover, from the spillover and spillwait options: the most due
+  // messages the remote takes in a queue run, and the most seconds of
+  // deliveries it is given at the running average time of one, taken
+  // in milliseconds.  The rest are left to the next remote in its
+  // group.
+  unsigned spillover;
+  int spillwait;
+  long delivery_ms;
+  // The capabilities a built-in protocol last reported for the remote,
+  // and when, passed back to it on the next connection.
+  mystring caps;
+  time_t caps_seen;
+  // The results of delivery attempts made to the remote (indexed by
+  // tristate + 1) and how long they and their phases took, for the
+  // metrics file.
+  unsigned long results[3];
+  metrics_histogram latency;
+  metrics_histogram phase_latency[DELIVERY_PHASES];
+  // Deliveries to the remote that were killed for running past their
+  // deadline.
+  unsigned long deadline_hits;
   remote(const slist& list);
   ~remote();
+  void failed(const char* what = "Could not connect to");
+  void throttled(long hint);
+  void succeeded();
 };
 
 const mystring remote::default_proto = "smtp";
 
 remote::remote(const slist& lst)
+  : multi(false), mx(false), mxhost(false), maxconcurrency(0), warm(0),
+    weight(0), current(0),
+    failures(0), down_until(0), down(false), throttles(0),
+    throttled_until(0), rate(0), byterate(0),
+    tokens(0), bytetokens(0), refilled(0), adaptive(false), window(1),
+    handshake(0), spillover(0), spillwait(0), delivery_ms(0), caps_seen(0),
+    deadline_hits(0)
 {
+  results[0] = results[1] = results[2] = 0;
   slist::const_iter iter = lst;
   host = *iter;
-  options = "host=" + host + "\n";
+  if (host == "mx") {
+    mx = true;
+    args = slist(lst);
+  }
+  // Room for every word of the line, as most are options.
+  unsigned size = 7;
+  for (slist::const_iter i(lst); i; i++)
+    size += (*i).length() + 1;
+  mystringbuilder opts(size);
+  opts << "host=" << host << '\n';
   ++iter;
   if(!iter)
     proto = default_proto;
@@ -100,11 +420,53 @@ remote::remote(const slist& lst)
       // Strip prefix "--"
       if (option[0] == '-' && option[1] == '-')
 	option = option.right(2);
-      options += option;
-      options += '\n';
+      mystringview opt(option);
+      if (option == "multi")
+	multi = true;
+      if (opt.starts_with("source="))
+	source = opt.right(7).str();
+      // Options handled here are not passed on to the protocol
+      if (opt.starts_with("maxconcurrency=")) {
+	maxconcurrency = atoi(option.c_str() + 15);
+	continue;
+      }
+      if (opt.starts_with("group=")) {
+	group = opt.right(6).str();
+	continue;
+      }
+      if (opt.starts_with("warm=")) {
+	warm = atoi(option.c_str() + 5);
+	continue;
+      }
+      if (opt.starts_with("weight=")) {
+	weight = atoi(option.c_str() + 7);
+	continue;
+      }
+      if (opt.starts_with("rate=")) {
+	rate = atof(option.c_str() + 5);
+	continue;
+      }
+      if (opt.starts_with("byterate=")) {
+	byterate = atof(option.c_str() + 9);
+	continue;
+      }
+      if (option == "adaptive") {
+	adaptive = true;
+	continue;
+      }
+      if (opt.starts_with("spillover=")) {
+	spillover = atoi(option.c_str() + 10);
+	continue;
+      }
+      if (opt.starts_with("spillwait=")) {
+	spillwait = atoi(option.c_str() + 10);
+	continue;
+      }
+      opts << option << '\n';
     }
   }
-  options += '\n';
+  opts << '\n';
+  options = opts.str();
   program = CONFIG_PATH(PROTOCOLS, NULL, proto.c_str());
 }
 
@@ -114,392 +476,5482 @@ typedef list<remote> rlist;
 
 static rlist remotes;
 static int minpause = 60;
-static int pausetime = minpause;
 static int maxpause = 24*60*60;
 static int sendtimeout = 60*60;
+static int sendtimeoutpermb = 0;
 static int queuelifetime = 7*24*60*60;
+static int maxconcurrency = 1;
+// The index of the tenant this process serves in the shared slot pool,
+// or -1 if it serves the only queue.
+static int tenant_index = -1;
+// The program named in structured log records, which tells the tenants
+// apart.
+static mystring tenant_program = "nullmailer-send";
+static int dnscachetime = 5*60;
+static int rejectcachetime = 5*60;
+static int builtinprotocols = 1;
+static int queuedirs = 0;
+static int bounceaggregate = 1;
+static int delaynotify = 0;
+static int metrics = 0;
+static int failedlifetime = 0;
+static int maxfailedfiles = 0;
+static int maxfailedsize = 0;
+static int failedarchive = 0;
+static bool queuelimits = false;
+static int sortqueue = 0;
+static int urgentslots = 0;
+static int mergerecipients = 0;
+#define PREFETCH_MAX 16
+static int prefetch = 2;
+static int maxwarm = 0;
+static dsn_config dsn_conf;
+
+// The defaults of maxconcurrency, prefetch and maxwarm, sized to the
+// CPU quota and memory limit of the control group nullmailer-send runs
+// in, if it has either.  Deliveries mostly wait on the network, so a
+// few are run for each CPU, up to as many as the memory limit leaves
+// room for.
+#define WORKERS_PER_CPU 4
+#define WORKER_MEMORY (16UL << 20)
+#define WORKERS_MAX 64
+static cgroup_limits limits;
+static int sized_workers = 1;
+static int sized_prefetch = 2;
+static int sized_warm = 0;
+
+static void size_defaults()
+{
+  sized_workers = 1;
+  sized_prefetch = 2;
+  sized_warm = 0;
+  if (!cgroup_read_limits(limits))
+    return;
+  const unsigned long cpus = limits.millicpus > 0
+    ? (limits.millicpus + 999) / 1000 : cgroup_online_cpus();
+  unsigned long workers = cpus * WORKERS_PER_CPU;
+  if (limits.memory > 0 && workers > limits.memory / WORKER_MEMORY)
+    workers = limits.memory / WORKER_MEMORY;
+  if (workers < 1)
+    workers = 1;
+  else if (workers > WORKERS_MAX)
+    workers = WORKERS_MAX;
+  sized_workers = workers;
+  sized_prefetch = workers < PREFETCH_MAX ? workers : PREFETCH_MAX;
+  sized_warm = workers;
+  static int logged = 0;
+  if (sized_workers != logged) {
+    logged = sized_workers;
+    flog << "Sized to the control group limits: " << itoa(sized_workers)
+	 << " worker(s), prefetch " << itoa(sized_prefetch) << '.' << endl;
+  }
+}
+
+// The routing rules from the remotes file.  They are only compiled
+// again when the rules change, and each change starts a new generation
+// so that the messages are routed again.
+static route_table sender_routes;
+static route_table recipient_routes;
+// The size rules, largest first, each sending the messages larger than
+// its size to its group.
+struct size_route
+{
+  unsigned long size;
+  mystring group;
+};
+static list<size_route> size_routes;
+static mystring route_rules;
+static unsigned route_generation = 0;
+// Set when some remotes are not in a group.  Messages that are not
+// routed to a group are then only sent to those remotes; otherwise
+// they may be sent to any remote.
+static bool have_default_group;
+
+// The priority rules from the priorities control file, which set the
+// class of the messages from each sender pattern.  Like the routes,
+// each change starts a new generation, so that the messages are
+// classed again.
+static route_table priority_rules;
+static mystring priority_text;
+static unsigned priority_generation = 0;
+
+// Mark the remote as down, doubling the time it is skipped for with
+// each consecutive failure from pausetime up to maxpause.
+void remote::failed(const char* what)
+{
+  time_t delay = minpause;
+  for (unsigned i = 0; i < failures && delay < maxpause; i++)
+    delay *= 2;
+  if (delay > maxpause)
+    delay = maxpause;
+  ++failures;
+  down = true;
+  down_until = time(0) + delay;
+  flog << what << ' ' << host << ", skipping it for "
+       << itoa(delay) << " seconds." << endl;
+}
+
+// Put the remote into a deferral window after a throttling reply: for
+// as long as the reply asked, up to maxpause, or else for a time that
+// doubles with each throttling reply in a row from pausetime, less up
+// to a quarter at random so that the senders sharing a relay do not
+// all come back to it at once.
+void remote::throttled(long hint)
+{
+  time_t delay;
+  if (hint > 0)
+    delay = hint < maxpause ? hint : maxpause;
+  else {
+    delay = minpause;
+    for (unsigned i = 0; i < throttles && delay < maxpause; i++)
+      delay *= 2;
+    if (delay > maxpause)
+      delay = maxpause;
+    delay -= random() % (delay / 4 + 1);
+  }
+  ++throttles;
+  down = true;
+  down_until = throttled_until = time(0) + delay;
+  flog << "Throttled by " << host << ", deferring it for "
+       << itoa(delay) << " seconds." << endl;
+}
+
+void remote::succeeded()
+{
+  failures = 0;
+  down_until = 0;
+  throttles = 0;
+}
+
+// Keep the health, balancing and pacing state and counters of a remote
+// that was in the previous configuration.
+static void copy_health(rlist& lst, remote& r)
+{
+  for(rlist::iter i(lst); i; i++)
+    if ((*i).program == r.program && (*i).options == r.options) {
+      r.failures = (*i).failures;
+      r.down_until = (*i).down_until;
+      r.throttles = (*i).throttles;
+      r.throttled_until = (*i).throttled_until;
+      r.current = (*i).current;
+      r.tokens = (*i).tokens;
+      r.bytetokens = (*i).bytetokens;
+      r.refilled = (*i).refilled;
+      r.window = (*i).window;
+      r.handshake = (*i).handshake;
+      r.delivery_ms = (*i).delivery_ms;
+      r.caps = (*i).caps;
+      r.caps_seen = (*i).caps_seen;
+      for (int j = 0; j < 3; j++)
+	r.results[j] = (*i).results[j];
+      r.latency = (*i).latency;
+      r.deadline_hits = (*i).deadline_hits;
+      for (int j = 0; j < DELIVERY_PHASES; j++)
+	r.phase_latency[j] = (*i).phase_latency[j];
+      return;
+    }
+}
+
+static bool have_group(const mystring& group)
+{
+  for(rlist::const_iter r(remotes); r; r++)
+    if ((*r).group == group)
+      return true;
+  return false;
+}
+
+// A routing rule has the form "[from|to] PATTERN -> GROUP", or
+// "larger SIZE -> GROUP" for messages by their size.
+static bool is_rule(const arglist& parts)
+{
+  arglist::const_iter i(parts);
+  if (*i == "from" || *i == "to" || *i == "larger")
+    i++;
+  if (!i)
+    return false;
+  i++;
+  return i && *i == "->";
+}
+
+// A size is a number of bytes, or of kilobytes or megabytes with a K
+// or M after it.  Returns 0 if it is not one.
+static unsigned long parse_size(const mystring& text)
+{
+  char* end;
+  unsigned long size = strtoul(text.c_str(), &end, 10);
+  if (end == text.c_str())
+    return 0;
+  if (*end == 'k' || *end == 'K')
+    size *= 1024, ++end;
+  else if (*end == 'm' || *end == 'M')
+    size *= 1024 * 1024, ++end;
+  return *end == 0 ? size : 0;
+}
+
+static void compile_size_rule(const arglist& parts, const mystring& rule)
+{
+  arglist::const_iter i(parts);
+  i++;
+  size_route route;
+  route.size = parse_size(*i);
+  i++;
+  i++;
+  route.group = i ? *i : mystring();
+  if (route.size == 0)
+    flog << "Invalid size, ignoring route: " << rule << endl;
+  else if (!have_group(route.group))
+    flog << "No remotes in group '" << route.group
+	 << "', ignoring route: " << rule << endl;
+  else {
+    list<size_route> sorted;
+    bool added = false;
+    for (list<size_route>::const_iter s(size_routes); s; s++) {
+      if (!added && route.size > (*s).size) {
+	sorted.append(route);
+	added = true;
+      }
+      sorted.append(*s);
+    }
+    if (!added)
+      sorted.append(route);
+    size_routes.empty();
+    for (list<size_route>::const_iter s(sorted); s; s++)
+      size_routes.append(*s);
+  }
+}
+
+static void compile_rules(const slist& rules)
+{
+  mystring text;
+  for(slist::const_iter r(rules); r; r++) {
+    text += *r;
+    text += '\n';
+  }
+  // A rule is dropped when its group has no remotes, so the groups are
+  // part of what the rules depend on.
+  for(rlist::const_iter r(remotes); r; r++) {
+    text += (*r).group;
+    text += '\n';
+  }
+  if (route_generation > 0 && text == route_rules)
+    return;
+  route_rules = text;
+  ++route_generation;
+  sender_routes.clear();
+  recipient_routes.clear();
+  size_routes.empty();
+  for(slist::const_iter r(rules); r; r++) {
+    arglist parts;
+    parse_args(parts, *r);
+    arglist::const_iter i(parts);
+    if (*i == "larger") {
+      compile_size_rule(parts, *r);
+      continue;
+    }
+    route_table* table = &recipient_routes;
+    if (*i == "from" || *i == "to") {
+      if (*i == "from")
+	table = &sender_routes;
+      i++;
+    }
+    mystring pattern = *i;
+    i++;
+    i++;
+    mystring group = i ? *i : mystring();
+    if (!have_group(group))
+      flog << "No remotes in group '" << group
+	   << "', ignoring route: " << *r << endl;
+    else if (!table->add(pattern, group))
+      flog << "Invalid route pattern, ignoring route: " << *r << endl;
+  }
+}
 
 bool load_remotes()
 {
   slist rtmp;
   config_readlist("remotes", rtmp);
-  remotes.empty();
+  rlist fresh;
+  slist rules;
+  bool default_group = false;
   for(slist::const_iter r(rtmp); r; r++) {
     if((*r)[0] == '#')
       continue;
     arglist parts;
     if (!parse_args(parts, *r))
       continue;
-    remotes.append(remote(parts));
+    if (is_rule(parts)) {
+      rules.append(*r);
+      continue;
+    }
+    remote rem(parts);
+    copy_health(remotes, rem);
+    if (!rem.group)
+      default_group = true;
+    fresh.append(rem);
+  }
+  // A reload that leaves nothing to deliver to keeps the remotes and
+  // rules that were in use, rather than stopping delivery.
+  if (fresh.count() == 0) {
+    if (remotes.count() == 0)
+      fail("No remote hosts listed for delivery");
+    msg1("No remote hosts listed for delivery, keeping the previous ones");
+    return true;
   }
-  if (remotes.count() == 0)
-    fail("No remote hosts listed for delivery");
+  remotes.empty();
+  for(rlist::const_iter r(fresh); r; r++)
+    remotes.append(*r);
+  have_default_group = default_group;
+  compile_rules(rules);
   return true;
 }
 
+#ifdef HAVE_GETADDRINFO
+// The addresses of the remote hosts are looked up here and handed to
+// the protocols in $NULLMAILER_RESOLVED, so that a queue run does not
+// repeat the same lookup for every message.  A failed lookup is not
+// cached; the protocol then looks the host up itself, and the remote
+// is skipped for a while if that fails too.
+struct resolved
+{
+  mystring host;
+  mystring addrs;
+  time_t expires;
+};
+
+static list<resolved> resolved_hosts;
+
+static bool lookup_host(const mystring& host, mystring& addrs)
+{
+  struct addrinfo req;
+  memset(&req, 0, sizeof req);
+  req.ai_socktype = SOCK_STREAM;
+  struct addrinfo* res;
+  if (getaddrinfo(host.c_str(), NULL, &req, &res) != 0)
+    return false;
+  addrs = "";
+  for (struct addrinfo* ai = res; ai; ai = ai->ai_next) {
+    char buf[NI_MAXHOST];
+    if (getnameinfo(ai->ai_addr, ai->ai_addrlen, buf, sizeof buf,
+		    NULL, 0, NI_NUMERICHOST) != 0)
+      continue;
+    if (!!addrs)
+      addrs += ',';
+    addrs += buf;
+  }
+  freeaddrinfo(res);
+  return !!addrs;
+}
+
+static void resolve(const mystring& host)
+{
+  time_t now = time(0);
+  for (list<resolved>::iter i(resolved_hosts); i; i++)
+    if ((*i).host == host) {
+      if ((*i).expires > now)
+	return;
+      resolved_hosts.remove(i);
+      break;
+    }
+  resolved r;
+  r.host = host;
+  r.expires = now + dnscachetime;
+  if (dnscachetime > 0 && lookup_host(host, r.addrs))
+    resolved_hosts.append(r);
+  mystring env;
+  for (list<resolved>::const_iter i(resolved_hosts); i; i++) {
+    if (!!env)
+      env += ';';
+    env += (*i).host + "=" + (*i).addrs;
+  }
+  setenv("NULLMAILER_RESOLVED", env.c_str(), 1);
+}
+
+static void resolve_remote(const remote& r)
+{
+  // A local socket has no name to look up.
+  if (r.host[0] == '/')
+    return;
+  resolve(r.host);
+  if (!!r.source)
+    resolve(r.source);
+}
+#else
+static void resolve_remote(const remote&) { }
+#endif
+
+// Set when the config files may have changed since they were last
+// read: on SIGHUP, or when the watcher sees a change in the config
+// directory.  Without a watch on the directory, the files read last
+// time are checked for changes before each queue run instead.
+static bool config_dirty = true;
+static bool config_loaded = false;
+// Set on SIGHUP until the config is read again.  A queue run that is
+// under way stops starting deliveries, lets the ones in flight finish,
+// and hands the messages it has not tried to a new run with the new
+// config.
+static bool reload_wanted = false;
+static int config_wd = -1;
+
+static void load_priorities()
+{
+  slist rules;
+  config_readlist("priorities", rules);
+  mystring text;
+  for(slist::const_iter r(rules); r; r++) {
+    text += *r;
+    text += '\n';
+  }
+  if (priority_generation > 0 && text == priority_text)
+    return;
+  priority_text = text;
+  ++priority_generation;
+  priority_rules.clear();
+  for(slist::const_iter r(rules); r; r++) {
+    if((*r)[0] == '#')
+      continue;
+    arglist parts;
+    parse_args(parts, *r);
+    arglist::const_iter i(parts);
+    mystring pattern = i ? *i : mystring();
+    i++;
+    if (parts.count() != 2 || priority_parse(*i) < 0
+	|| !priority_rules.add(pattern, *i))
+      flog << "Invalid priority rule, ignoring: " << *r << endl;
+  }
+}
+
 bool load_config()
 {
+  if (!config_dirty && (config_wd >= 0 || !config_changed()))
+    return config_loaded;
+  config_dirty = false;
+  reload_wanted = false;
+  config_track();
+
   mystring hh;
 
   if (!config_read("helohost", hh))
     hh = me;
   setenv("HELOHOST", hh.c_str(), 1);
 
-  int oldminpause = minpause;
   if(!config_readint("pausetime", minpause))
     minpause = 60;
   if(!config_readint("maxpause", maxpause))
     maxpause = 24*60*60;
   if(!config_readint("sendtimeout", sendtimeout))
     sendtimeout = 60*60;
+  if(!config_readint("sendtimeoutpermb", sendtimeoutpermb) || sendtimeoutpermb < 0)
+    sendtimeoutpermb = 0;
+  size_defaults();
+  if(!config_readint("prefetch", prefetch) || prefetch < 0)
+    prefetch = sized_prefetch;
+  if (prefetch > PREFETCH_MAX)
+    prefetch = PREFETCH_MAX;
   if(!config_readint("queuelifetime", queuelifetime))
     queuelifetime = 7*24*60*60;
+  if(!config_readint("maxconcurrency", maxconcurrency) || maxconcurrency < 1)
+    maxconcurrency = sized_workers;
+  if(!config_readint("maxwarm", maxwarm) || maxwarm < 0)
+    maxwarm = sized_warm;
+  if(!config_readint("dnscachetime", dnscachetime))
+    dnscachetime = 5*60;
+  if(!config_readint("rejectcachetime", rejectcachetime) || rejectcachetime < 0)
+    rejectcachetime = 5*60;
+  if(!config_readint("builtinprotocols", builtinprotocols))
+    builtinprotocols = 1;
+  if(!config_readint("bounceaggregate", bounceaggregate) || bounceaggregate < 1)
+    bounceaggregate = 1;
+  if(!config_readint("delaynotify", delaynotify) || delaynotify < 0)
+    delaynotify = 0;
+  if(!config_readint("metrics", metrics))
+    metrics = 0;
+  if(!config_readint("failedlifetime", failedlifetime) || failedlifetime < 0)
+    failedlifetime = 0;
+  if(!config_readint("maxfailedfiles", maxfailedfiles) || maxfailedfiles < 0)
+    maxfailedfiles = 0;
+  if(!config_readint("maxfailedsize", maxfailedsize) || maxfailedsize < 0)
+    maxfailedsize = 0;
+  if(!config_readint("failedarchive", failedarchive))
+    failedarchive = 0;
+  mystring logformat;
+  config_read("logformat", logformat);
+  if (logformat == "json")
+    flog.set_format(logobuf::json, tenant_program.c_str());
+  else if (logformat == "keyvalue")
+    flog.set_format(logobuf::keyvalue, tenant_program.c_str());
+  else
+    flog.set_format(logobuf::text, 0);
+  int maxqueuefiles, maxqueuesize;
+  queuelimits = (config_readint("maxqueuefiles", maxqueuefiles)
+		 && maxqueuefiles > 0)
+    || (config_readint("maxqueuesize", maxqueuesize) && maxqueuesize > 0);
+  if(!config_readint("sortqueue", sortqueue))
+    sortqueue = 0;
+  if(!config_readint("urgentslots", urgentslots) || urgentslots < 0)
+    urgentslots = 0;
+  if(!config_readint("mergerecipients", mergerecipients) || mergerecipients < 0)
+    mergerecipients = 0;
+  int bufferbudget;
+  if(!config_readint("bufferbudget", bufferbudget) || bufferbudget < 0)
+    bufferbudget = FDBUF_POOL_BUDGET / 1024;
+  fdbuf_pool_budget(bufferbudget * 1024UL);
+  load_priorities();
+  queuedirs = queuedirs_read();
+  dsn_read_config(dsn_conf);
 
-  if (minpause != oldminpause)
-    pausetime = minpause;
-
-  return load_remotes();
+  config_loaded = load_remotes();
+  return config_loaded;
 }
 
 static msglist messages;
 static bool reload_messages = false;
+// Set when the queue has been read, after which a pending event or
+// notification may name a message that is already known.  Only then is
+// the whole list checked for it.
+static bool queue_scanned = false;
+static time_t last_scan = 0;
+// How often to rescan the queue when new messages are tracked with
+// the queue watcher, to pick up anything it missed.
+static const int rescan_interval = 60*60;
+static bool flush_messages = false;
 
 void catch_alrm(int)
 {
   signal(SIGALRM, catch_alrm);
   reload_messages = true;
+  flush_messages = true;
 }
 
-bool load_messages()
+// The retry schedule: a binary heap of the queued messages that are
+// waiting for another attempt, ordered by the time each one is next
+// due.
+class schedule
 {
-  reload_messages = false;
-  fout << "Rescanning queue." << endl;
-  DIR* dir = opendir(".");
-  if(!dir)
-    fail1sys("Cannot open queue directory: ");
-  messages.empty();
-  struct dirent* entry;
-  while((entry = readdir(dir)) != 0) {
-    const char* name = entry->d_name;
-    if (name[0] == '.')
-      continue;
-    struct stat st;
-    if (stat(name, &st) < 0) {
-      fout << "Could not stat " << name << ", skipping." << endl;
-      continue;
-    }
-    struct message m = { st.st_mtime, name };
-    messages.append(m);
+  message** heap;
+  unsigned size;
+  unsigned alloc;
+  void sift_up(unsigned i);
+  void sift_down(unsigned i);
+public:
+  schedule() : heap(0), size(0), alloc(0) { }
+  ~schedule() { delete[] heap; }
+  unsigned count() const { return size; }
+  void clear() { size = 0; }
+  void push(message* msg);
+  message* top() const { return size ? heap[0] : 0; }
+  message* pop();
+};
+
+void schedule::sift_up(unsigned i)
+{
+  message* msg = heap[i];
+  while (i > 0) {
+    unsigned parent = (i - 1) / 2;
+    if (heap[parent]->next_attempt <= msg->next_attempt)
+      break;
+    heap[i] = heap[parent];
+    i = parent;
   }
-  closedir(dir);
-  return true;
+  heap[i] = msg;
 }
 
-tristate catchsender(fork_exec& fp)
+void schedule::sift_down(unsigned i)
 {
+  message* msg = heap[i];
   for (;;) {
-    switch (selfpipe.waitsig(sendtimeout)) {
-    case 0:			// timeout
-      fout << "Sending timed out, killing protocol" << endl;
-      fp.kill(SIGTERM);
-      selfpipe.waitsig();	// catch the signal from killing the child
-      return tempfail;
-    case -1:
-      msg1sys("Error waiting for the child signal: ");
-      return tempfail;
-    case SIGCHLD:
+    unsigned child = i * 2 + 1;
+    if (child >= size)
       break;
-    default:
-      continue;
-    }
-    break;
+    if (child + 1 < size
+	&& heap[child + 1]->next_attempt < heap[child]->next_attempt)
+      ++child;
+    if (msg->next_attempt <= heap[child]->next_attempt)
+      break;
+    heap[i] = heap[child];
+    i = child;
   }
+  heap[i] = msg;
+}
 
-  int status = fp.wait_status();
-  if(status < 0) {
-    fout << "Error catching the child process return value: "
-	 << strerror(errno) << endl;
-    return tempfail;
-  }
-  else {
-    if(WIFEXITED(status)) {
-      status = WEXITSTATUS(status);
-      if(status) {
-	fout << "Sending failed: " << errorstr(status) << endl;
-	return (status & ERR_PERMANENT_FLAG) ? permfail : tempfail;
-      }
-      else {
-	fout << "Sent file." << endl;
-	return success;
-      }
-    }
-    else {
-      fout << "Sending process crashed or was killed." << endl;
-      return tempfail;
-    }
+void schedule::push(message* msg)
+{
+  if (size == alloc) {
+    alloc = alloc ? alloc * 2 : 64;
+    message** newheap = new message*[alloc];
+    for (unsigned i = 0; i < size; i++)
+      newheap[i] = heap[i];
+    delete[] heap;
+    heap = newheap;
   }
+  heap[size] = msg;
+  sift_up(size++);
 }
 
-bool log_msg(mystring& filename, remote& remote, int fd)
+message* schedule::pop()
 {
-  fout << "Starting delivery:"
-       << " host: " << remote.host
-       << " protocol: " << remote.proto
-       << " file: " << filename << endl;
-  fdibuf in(fd);
-  mystring line;
-  mystring msg;
-  if (in.getline(line, '\n')) {
-    msg = "From: <";
-    msg += line;
-    msg += '>';
-    bool has_to = false;
-    while (in.getline(line, '\n')) {
-      if (!line)
-        break;
-      msg += has_to ? ", " : " to: ";
-      has_to = true;
-      msg += '<';
-      msg += line;
-      msg += '>';
-    }
-    fout << msg << endl;
-    while (in.getline(line, '\n')) {
-      if (!line)
-        break;
-      if (line.left(11).lower() == "message-id:")
-        fout << line << endl;
-    }
-    lseek(fd, 0, SEEK_SET);
-    return true;
+  if (size == 0)
+    return 0;
+  message* msg = heap[0];
+  if (--size > 0) {
+    heap[0] = heap[size];
+    sift_down(0);
   }
-  fout << endl << "Can't read message" << endl;
-  return false;
+  return msg;
 }
 
-static bool copy_output(int fd, mystring& output)
+static schedule sched;
+
+// The messages ordered by the time they were queued, so that the ones
+// that have outlived the queue lifetime are found without looking at
+// the rest.  Each message records where it is in the heap, so that one
+// leaving the queue can be taken out of it.
+class expiry_queue
 {
-  output = "";
-  char buf[256];
-  ssize_t rd;
-  while ((rd = read(fd, buf, sizeof buf)) > 0)
-    output += mystring(buf, rd);
-  return rd == 0;
+  message** heap;
+  unsigned size;
+  unsigned alloc;
+  void place(unsigned i, message* msg) { heap[i] = msg; msg->expiry_slot = i; }
+  void sift_up(unsigned i);
+  void sift_down(unsigned i);
+public:
+  expiry_queue() : heap(0), size(0), alloc(0) { }
+  ~expiry_queue() { delete[] heap; }
+  void clear() { size = 0; }
+  void push(message* msg);
+  message* top() const { return size ? heap[0] : 0; }
+  message* pop();
+  void remove(message* msg);
+};
+
+void expiry_queue::sift_up(unsigned i)
+{
+  message* msg = heap[i];
+  while (i > 0) {
+    unsigned parent = (i - 1) / 2;
+    if (heap[parent]->timestamp <= msg->timestamp)
+      break;
+    place(i, heap[parent]);
+    i = parent;
+  }
+  place(i, msg);
 }
 
-tristate send_one(mystring filename, remote& remote, mystring& output)
+void expiry_queue::sift_down(unsigned i)
 {
-  autoclose fd = open(filename.c_str(), O_RDONLY);
-  if(fd < 0) {
-    fout << "Can't open file '" << filename << "'" << endl;
-    return tempfail;
+  message* msg = heap[i];
+  for (;;) {
+    unsigned child = i * 2 + 1;
+    if (child >= size)
+      break;
+    if (child + 1 < size
+	&& heap[child + 1]->timestamp < heap[child]->timestamp)
+      ++child;
+    if (msg->timestamp <= heap[child]->timestamp)
+      break;
+    place(i, heap[child]);
+    i = child;
   }
-  log_msg(filename, remote, fd);
+  place(i, msg);
+}
 
-  fork_exec fp(remote.proto.c_str());
-  int redirs[] = { REDIRECT_PIPE_TO, REDIRECT_PIPE_FROM, REDIRECT_NONE, fd };
-  if (!fp.start(remote.program.c_str(), 4, redirs))
-    return tempfail;
+void expiry_queue::push(message* msg)
+{
+  if (size == alloc) {
+    alloc = alloc ? alloc * 2 : 64;
+    message** newheap = new message*[alloc];
+    for (unsigned i = 0; i < size; i++)
+      newheap[i] = heap[i];
+    delete[] heap;
+    heap = newheap;
+  }
+  heap[size] = msg;
+  sift_up(size++);
+}
 
-  if (write(redirs[0], remote.options.c_str(), remote.options.length()) != (ssize_t)remote.options.length())
-    fout << "Warning: Writing options to protocol failed" << endl;
-  close(redirs[0]);
+message* expiry_queue::pop()
+{
+  if (size == 0)
+    return 0;
+  message* msg = heap[0];
+  remove(msg);
+  return msg;
+}
 
-  tristate result = catchsender(fp);
-  if (!copy_output(redirs[1], output))
-    fout << "Warning: Could not read output from protocol" << endl;
-  close(redirs[1]);
-  return result;
+void expiry_queue::remove(message* msg)
+{
+  const unsigned i = msg->expiry_slot;
+  if (i >= size || heap[i] != msg)
+    return;
+  if (--size > i) {
+    heap[i] = heap[size];
+    sift_down(i);
+    sift_up(heap[i]->expiry_slot);
+  }
 }
 
-static void parse_output(const mystring& output, const remote& remote, mystring& status, mystring& diag)
+static expiry_queue expiry;
+
+// Put every queued message on the schedule again, closing the holes
+// left in the queue by the messages that are gone first, since nothing
+// else refers to the messages by address once the schedule is cleared.
+static void schedule_all()
 {
-  diag = remote.proto.upper();
-  diag += "; ";
-  diag += output.strip();
-  diag.subst('\n', '/');
-  status = "5.0.0";
-  for (unsigned i = 0; i < output.length()-5; i++)
-    if (isdigit(output[i])
-        && output[i+1] == '.'
-        && isdigit(output[i+2])
-        && output[i+3] == '.'
-        && isdigit(output[i+4])) {
-      status = output.sub(i, 5);
-      break;
-    }
+  sched.clear();
+  expiry.clear();
+  messages.compact();
+  // The names of the messages that are gone are dropped at the same
+  // time.
+  name_table names;
+  for(msglist::iter msg(messages); msg; msg++) {
+    const char* name = (*msg).name();
+    (*msg).name_offset = names.add(name, strlen(name));
+    sched.push(&*msg);
+    expiry.push(&*msg);
+  }
+  message_names.swap(names);
 }
 
-bool bounce_msg(const message& msg, const remote& remote, const mystring& output)
+// Get the time a message was queued.  nullmailer-queue names the files
+// "TIMESECS.PID", so the time is taken from the name where possible,
+// saving a stat of every file in the queue.
+static bool name_time(const char* name, time_t& timestamp)
 {
-  mystring failed = "../failed/";
-  failed += msg.filename;
-  fout << "Moving message " << msg.filename << " into failed" << endl;
-  if (rename(msg.filename.c_str(), failed.c_str()) == -1) {
-    fout << "Can't rename file: " << strerror(errno) << endl;
-    return false;
+  const char* base = strrchr(name, '/');
+  base = base ? base + 1 : name;
+  const char* ptr = base;
+  time_t t = 0;
+  while (isdigit(*ptr))
+    t = t * 10 + (*ptr++ - '0');
+  if (ptr > base && *ptr == '.') {
+    timestamp = t;
+    return true;
   }
-  autoclose fd = open(failed.c_str(), O_RDONLY);
-  if (fd < 0)
-    fout << "Can't open file '" << failed << "' to create bounce message" << endl;
-  else {
-    fout << "Generating bounce for '" << msg.filename << "'" << endl;
-    queue_pipe qp;
-    autoclose pfd = qp.start();
-    if (pfd > 0) {
-      mystring program = program_path("nullmailer-dsn");
-      fork_exec dsn("nullmailer-dsn");
-      int redirs[] = { fd, pfd };
-      mystring status_code, diag_code;
-      parse_output(output, remote, status_code, diag_code);
-      const char* args[] = { program.c_str(),
-                             "--last-attempt", itoa(time(NULL)),
-                             "--remote", remote.host.c_str(),
-                             "--diagnostic-code", diag_code.c_str(),
-                             status_code.c_str(), NULL };
-      dsn.start(args, 2, redirs);
-      // Everything else cleans up itself
-    }
+  return false;
+}
+
+static bool queue_time(const char* name, time_t& timestamp, bool& stated)
+{
+  if (name_time(name, timestamp)) {
+    stated = false;
+    return true;
   }
+  struct stat st;
+  if (stat(name, &st) < 0)
+    return false;
+  timestamp = st.st_mtime;
+  stated = true;
   return true;
 }
 
-void send_all()
+// Find a message from the previous scan.  The directory order rarely
+// changes between scans, so the search starts where the last one
+// matched.
+static message* find_message(message* old[], unsigned count,
+			     unsigned& cursor, const char* name)
 {
-  if(!load_config()) {
-    fout << "Could not load the config" << endl;
-    return;
+  for (unsigned n = 0; n < count; n++, cursor++) {
+    if (cursor >= count)
+      cursor = 0;
+    if (strcmp(old[cursor]->name(), name) == 0)
+      return old[cursor++];
   }
-  if(remotes.count() <= 0) {
-    fout << "No remote hosts listed for delivery";
-    return;
+  return 0;
+}
+
+static void watch_subdir(const char* name);
+static void forget_own_files();
+
+// The messages found by a scan without the time they were queued in
+// their names, which are stated together once a batch of them is
+// found and at the end of the scan.
+static io_batch scan_stats;
+static mystring scan_stat_paths[IOBATCH_MAX];
+static struct stat scan_stat_st[IOBATCH_MAX];
+
+typedef void (*scan_add_fn)(const mystring& path, time_t timestamp,
+			    bool stated);
+
+static void scan_flush(scan_add_fn add)
+{
+  scan_stats.submit();
+  for (unsigned i = 0; i < scan_stats.count(); i++) {
+    if (scan_stats.result(i) < 0)
+      flog << "Could not stat " << scan_stat_paths[i] << ", skipping."
+	   << endl;
+    else
+      add(scan_stat_paths[i], scan_stat_st[i].st_mtime, true);
+    scan_stat_paths[i] = mystring();
+  }
+  scan_stats.clear();
+}
+
+static void scan_found(const mystring& path, scan_add_fn add)
+{
+  time_t timestamp;
+  if (name_time(path.c_str(), timestamp)) {
+    add(path, timestamp, false);
+    return;
+  }
+  if (scan_stats.full())
+    scan_flush(add);
+  const unsigned i = scan_stats.count();
+  scan_stat_paths[i] = path;
+  scan_stats.stat(scan_stat_paths[i].c_str(), &scan_stat_st[i]);
+}
+
+static void scan_add(const mystring& path, time_t timestamp, bool stated)
+{
+  messages.append(message(timestamp, path, stated));
+}
+
+// Scan a queue directory for messages, and the subdirectories of the
+// queue itself.
+static bool scan_dir(const mystring& prefix, message* old[],
+		     unsigned oldcount, unsigned& cursor)
+{
+  DIR* dir = opendir(!prefix ? "." : prefix.c_str());
+  if(!dir)
+    return false;
+  struct dirent* entry;
+  while((entry = readdir(dir)) != 0) {
+    const char* name = entry->d_name;
+    if (name[0] == '.')
+      continue;
+    if (!prefix && queuedir_is_subdir(name)) {
+      watch_subdir(name);
+      if (!scan_dir(name, old, oldcount, cursor))
+	flog << "Cannot open queue directory " << name << ": "
+	     << strerror(errno) << endl;
+      continue;
+    }
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+    if (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN)
+      continue;
+#endif
+    const mystring path = !prefix ? mystring(name)
+      : mystring(prefix + "/" + name);
+    message* found = find_message(old, oldcount, cursor, path.c_str());
+    if (found) {
+      found->seen = true;
+      continue;
+    }
+    scan_found(path, scan_add);
+  }
+  closedir(dir);
+  return true;
+}
+
+bool load_messages()
+{
+  reload_messages = false;
+  queue_scanned = true;
+  forget_own_files();
+  last_scan = time(0);
+  flog << "Rescanning queue." << endl;
+  // Keep the retry state of the messages that are still queued.
+  unsigned oldcount = messages.count();
+  message** old = new message*[oldcount + 1];
+  unsigned n = 0;
+  for(msglist::iter msg(messages); msg; msg++, n++) {
+    (*msg).seen = false;
+    old[n] = &*msg;
+  }
+  unsigned cursor = 0;
+  if (!scan_dir("", old, oldcount, cursor)) {
+    delete[] old;
+    fail1sys("Cannot open queue directory: ");
+  }
+  scan_flush(scan_add);
+  delete[] old;
+  for(msglist::iter msg(messages); msg; ) {
+    if (!(*msg).seen)
+      messages.remove(msg);
+    else
+      msg++;
+  }
+  schedule_all();
+  return true;
+}
+
+// The scan of the queue at startup when there is no journal, which is
+// read a batch at a time with the messages found so far delivered in
+// between, so that a large queue starts going out straight away.  The
+// messages found are due at the time they were queued, so that each
+// run takes the oldest of them first.  The names of the messages that
+// arrive meanwhile are kept, so that the scan does not add them again.
+#define SCAN_BATCH 1000
+
+static bool scanning = false;
+static DIR* scan_handle = 0;
+static mystring scan_prefix;
+static slist scan_subdirs;
+static slist scan_arrived;
+
+static bool start_scan()
+{
+  scan_handle = opendir(".");
+  if (!scan_handle)
+    fail1sys("Cannot open queue directory: ");
+  scan_prefix = mystring();
+  scanning = true;
+  last_scan = time(0);
+  return true;
+}
+
+static bool scan_arrival(const mystring& path)
+{
+  for (slist::iter i(scan_arrived); i; i++)
+    if (*i == path) {
+      scan_arrived.remove(i);
+      return true;
+    }
+  return false;
+}
+
+static void scan_batch_add(const mystring& path, time_t timestamp,
+			   bool stated)
+{
+  message msg(timestamp, path, stated);
+  msg.next_attempt = timestamp;
+  messages.append(msg);
+  sched.push(&messages.last());
+  expiry.push(&messages.last());
+}
+
+// Add the next batch of messages from the scan, and end the scan when
+// the queue and its subdirectories have all been read.
+static void scan_batch()
+{
+  unsigned found = 0;
+  queue_scanned = true;
+  while (found < SCAN_BATCH) {
+    struct dirent* entry = readdir(scan_handle);
+    if (!entry) {
+      closedir(scan_handle);
+      scan_handle = 0;
+      while (!scan_handle && scan_subdirs.count() > 0) {
+	slist::iter first(scan_subdirs);
+	scan_prefix = *first;
+	scan_subdirs.remove(first);
+	scan_handle = opendir(scan_prefix.c_str());
+	if (!scan_handle)
+	  flog << "Cannot open queue directory " << scan_prefix << ": "
+	       << strerror(errno) << endl;
+      }
+      if (!scan_handle)
+	break;
+      continue;
+    }
+    const char* name = entry->d_name;
+    if (name[0] == '.')
+      continue;
+    if (!scan_prefix && queuedir_is_subdir(name)) {
+      watch_subdir(name);
+      scan_subdirs.append(name);
+      continue;
+    }
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+    if (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN)
+      continue;
+#endif
+    const mystring path = !scan_prefix ? mystring(name)
+      : mystring(scan_prefix + "/" + name);
+    if (scan_arrived.count() > 0 && scan_arrival(path))
+      continue;
+    scan_found(path, scan_batch_add);
+    ++found;
+  }
+  scan_flush(scan_batch_add);
+  if (scan_handle)
+    return;
+  scanning = false;
+  scan_arrived.empty();
+  flog << "Queue scan complete, " << itoa(messages.count())
+       << " message(s) in queue." << endl;
+}
+
+static tristate exit_result(int status)
+{
+  if(status) {
+    flog << "Sending failed: " << errorstr(status) << endl;
+    return (status & ERR_PERMANENT_FLAG) ? permfail : tempfail;
+  }
+  flog << "Sent file." << endl;
+  return success;
+}
+
+static tristate status_result(int status)
+{
+  if(status < 0) {
+    flog << "Error catching the child process return value: "
+	 << strerror(errno) << endl;
+    return tempfail;
+  }
+  else {
+    if(WIFEXITED(status))
+      return exit_result(WEXITSTATUS(status));
+    else {
+      flog << "Sending process crashed or was killed." << endl;
+      return tempfail;
+    }
+  }
+}
+
+// The most deliveries that may ever run at once on a remote:
+// maxconcurrency or the remote's lower cap.
+static int max_concurrency(const remote& r)
+{
+  return r.maxconcurrency > 0 && r.maxconcurrency < maxconcurrency
+    ? r.maxconcurrency : maxconcurrency;
+}
+
+// The most deliveries that may run at once on a remote now, limited by
+// its window if it is adaptive.
+static int concurrency(const remote& r)
+{
+  int cap = max_concurrency(r);
+  if (r.adaptive && r.window < cap)
+    cap = r.window < 1 ? 1 : (int)r.window;
+  return cap;
+}
+
+// Track the health of a remote from a protocol exit code.  Only
+// temporary failures to reach the remote at all mark it as down.
+static void update_health(remote& remote, int code)
+{
+  switch (code) {
+  case 0:
+    remote.succeeded();
+    break;
+  case ERR_HOST_NOT_FOUND:
+  case ERR_NO_ADDRESS:
+  case ERR_GHBN_TEMP:
+  case ERR_CONN_REFUSED:
+  case ERR_CONN_TIMEDOUT:
+  case ERR_CONN_UNREACHABLE:
+  case ERR_CONN_FAILED:
+    if (!remote.down)
+      remote.failed();
+    break;
+  }
+}
+
+// A delivery that ran past its deadline marks the remote as down, as
+// a failure to connect does.  The protocols time out each phase
+// themselves, so this is a remote that trickles its replies or takes
+// the data too slowly for the size of the message.
+static void deadline_hit(remote& remote)
+{
+  ++remote.deadline_hits;
+  if (!remote.down)
+    remote.failed("Sending timed out to");
+}
+
+// Put the envelope of the message into text for the log: its sender
+// and recipients, and its Message-Id if it has one.
+static bool describe_msg(const mystring& filename, int fd, mystring& text)
+{
+  struct stat st;
+  envelope_index index;
+  if (fstat(fd, &st) == 0
+      && envindex_read(envindex_path(filename), st.st_size, index)) {
+    unsigned size = index.sender.length() + index.message_id.length() + 16;
+    for (list<mystring>::const_iter i(index.recipients); i; i++)
+      size += (*i).length() + 4;
+    mystringbuilder b(size);
+    b << "From: <" << index.sender << '>';
+    const char* sep = " to: ";
+    for (list<mystring>::const_iter i(index.recipients); i; i++) {
+      b << sep << '<' << *i << '>';
+      sep = ", ";
+    }
+    b << '\n';
+    if (!!index.message_id)
+      b << index.message_id << '\n';
+    text = b.str();
+    return true;
+  }
+  mmapibuf in(fd);
+  mystring line;
+  queuefile_skip(in);
+  if (in.getline(line, '\n')) {
+    mystringbuilder b(256);
+    b << "From: <" << line << '>';
+    bool has_to = false;
+    while (in.getline(line, '\n')) {
+      if (!line)
+	break;
+      b << (has_to ? ", " : " to: ") << '<' << line << '>';
+      has_to = true;
+    }
+    b << '\n';
+    while (in.getline(line, '\n')) {
+      if (!line)
+	break;
+      if (mystringview(line).starts_with_nocase("message-id:"))
+	b << line << '\n';
+    }
+    text = b.str();
+    lseek(fd, 0, SEEK_SET);
+    return true;
+  }
+  return false;
+}
+
+// Log the start of a delivery, with the envelope of the message taken
+// from text if it was read ahead.
+bool log_msg(const mystring& filename, remote& remote, int fd,
+	     const mystring* text = 0)
+{
+  flog << "Starting delivery:"
+       << " host: " << remote.host
+       << " protocol: " << remote.proto
+       << " file: " << filename << endl;
+  mystring described;
+  if (!text) {
+    if (!describe_msg(filename, fd, described)) {
+      flog << endl << "Can't read message" << endl;
+      return false;
+    }
+    text = &described;
+  }
+  flog << *text;
+  flog.flush();
+  return true;
+}
+
+// The queue watcher reports files moved into the queue directory, so
+// that new messages can be added without rescanning the whole queue.
+static int watcher = -1;
+
+// The queue subdirectories being watched, by watch descriptor.
+struct watched_dir
+{
+  int wd;
+  mystring name;
+  watched_dir(int w, const mystring& n) : wd(w), name(n) { }
+};
+static list<watched_dir> watched_dirs;
+
+static void watch_subdir(const char* name)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+  if (watcher < 0)
+    return;
+  int wd = inotify_add_watch(watcher, name, IN_CREATE | IN_MOVED_TO);
+  if (wd < 0) {
+    flog << "Could not watch queue directory " << name << ": "
+	 << strerror(errno) << endl;
+    return;
+  }
+  for(list<watched_dir>::const_iter i(watched_dirs); i; i++)
+    if ((*i).wd == wd)
+      return;
+  watched_dirs.append(watched_dir(wd, name));
+#else
+  (void)name;
+#endif
+}
+
+// The path relative to the queue of a file reported by the watcher, or
+// the empty string if it is not in a watched directory.
+static mystring watched_path(int wd, const char* name)
+{
+  for(list<watched_dir>::const_iter i(watched_dirs); i; i++)
+    if ((*i).wd == wd)
+      return (*i).name + "/" + name;
+  return mystring();
+}
+
+static void unwatch_subdir(int wd)
+{
+  for(list<watched_dir>::iter i(watched_dirs); i; i++)
+    if ((*i).wd == wd) {
+      watched_dirs.remove(i);
+      return;
+    }
+}
+
+static int queue_wd = -1;
+
+static void open_watcher()
+{
+#ifdef HAVE_SYS_INOTIFY_H
+  watcher = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (watcher < 0)
+    msg1sys("Could not watch the queue, falling back to rescanning: ");
+  else if ((queue_wd = inotify_add_watch(watcher, ".",
+					 IN_CREATE | IN_MOVED_TO)) < 0) {
+    msg1sys("Could not watch the queue, falling back to rescanning: ");
+    close(watcher);
+    watcher = -1;
+  }
+  if (watcher >= 0) {
+    events.add(watcher);
+    const mystring dir = CONFIG_PATH(CONFIG, NULL, "");
+    config_wd = inotify_add_watch(watcher, dir.c_str(),
+				  IN_CLOSE_WRITE | IN_CREATE | IN_DELETE
+				  | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB
+				  | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (config_wd < 0)
+      msg1sys("Could not watch the config, checking it before each run: ");
+  }
+#endif
+}
+
+static bool have_message(const char* name)
+{
+  for(msglist::const_iter msg(messages); msg; msg++)
+    if (strcmp((*msg).name(), name) == 0)
+      return true;
+  return false;
+}
+
+// The names of the files nullmailer-send has itself put into the
+// watched queue, by splitting or rewriting a message it already knows,
+// so that the events for them are passed over without looking through
+// all the messages.  A name is forgotten when its event is read.
+#define OWN_BUCKETS 64
+
+static slist own_names[OWN_BUCKETS];
+
+static slist& own_bucket(const char* name)
+{
+  return own_names[configdb_hash(name, strlen(name)) % OWN_BUCKETS];
+}
+
+static void own_file(const mystring& name)
+{
+  if (watcher >= 0)
+    own_bucket(name.c_str()).append(name);
+}
+
+static bool own_event(const char* name)
+{
+  slist& bucket = own_bucket(name);
+  for (slist::iter i(bucket); i; i++)
+    if (*i == name) {
+      bucket.remove(i);
+      return true;
+    }
+  return false;
+}
+
+static void forget_own_files()
+{
+  for (unsigned i = 0; i < OWN_BUCKETS; i++)
+    own_names[i].empty();
+}
+
+static bool known_message(const char* name, bool scanned)
+{
+  return own_event(name) || (scanned && have_message(name));
+}
+
+// The count of messages added to the queue, so that a delivery run can
+// tell when new ones have arrived.
+static unsigned arrivals = 0;
+
+static void add_message(const char* name)
+{
+  if (name[0] == '.')
+    return;
+  time_t timestamp;
+  bool stated;
+  if (!queue_time(name, timestamp, stated))
+    return;
+  ++arrivals;
+  if (scanning)
+    scan_arrived.append(name);
+  messages.append(message(timestamp, name, stated));
+  struct stat st;
+  if (queuelimits && stat(name, &st) == 0)
+    messages.last().size = st.st_size > UINT_MAX ? UINT_MAX : st.st_size;
+  sched.push(&messages.last());
+  expiry.push(&messages.last());
+}
+
+static void read_watcher()
+{
+#ifdef HAVE_SYS_INOTIFY_H
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  const bool scanned = queue_scanned || scanning;
+  queue_scanned = false;
+  ssize_t rd;
+  while ((rd = read(watcher, buf, sizeof buf)) > 0) {
+    for (char* ptr = buf; ptr < buf + rd; ) {
+      const struct inotify_event* event = (const struct inotify_event*)ptr;
+      if (event->mask & IN_Q_OVERFLOW)
+	reload_messages = config_dirty = true;
+      else if (event->wd == config_wd) {
+	config_dirty = true;
+	if (event->mask & IN_IGNORED)
+	  config_wd = -1;
+      }
+      else if (event->mask & IN_IGNORED)
+	unwatch_subdir(event->wd);
+      else if (event->len == 0)
+	;
+      else if (event->wd == queue_wd) {
+	// A new subdirectory may have had messages put into it before it
+	// was watched, so the queue is scanned again.
+	if (event->mask & IN_ISDIR) {
+	  if (queuedir_is_subdir(event->name))
+	    reload_messages = true;
+	}
+	// Messages split by nullmailer-send itself are already known.
+	else if (!known_message(event->name, scanned))
+	  add_message(event->name);
+      }
+      else {
+	mystring path = watched_path(event->wd, event->name);
+	if (!!path && !known_message(path.c_str(), scanned))
+	  add_message(path.c_str());
+      }
+      ptr += sizeof *event + event->len;
+    }
+  }
+#endif
+}
+
+// nullmailer-queue sends the name of each new message to the
+// notification socket, so that it can be delivered without a rescan.
+// It also sends an empty name when it starts writing one, so that the
+// warm sessions can be set up meanwhile.
+static int notify = -1;
+static bool warm_wanted = false;
+
+static void open_notify()
+{
+  struct sockaddr_un sa;
+  memset(&sa, 0, sizeof sa);
+  sa.sun_family = AF_UNIX;
+  if (notify_path.length() >= sizeof sa.sun_path) {
+    msg1("Notification socket path is too long, using only the trigger");
+    return;
+  }
+  strcpy(sa.sun_path, notify_path.c_str());
+  if ((notify = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+    msg1sys("Could not create notification socket: ");
+    return;
+  }
+  unlink(sa.sun_path);
+  if (bind(notify, (struct sockaddr*)&sa, sizeof sa) < 0
+      || chmod(sa.sun_path, 0600) < 0
+      || fcntl(notify, F_SETFL, O_NONBLOCK) < 0
+      || fcntl(notify, F_SETFD, FD_CLOEXEC) < 0) {
+    msg1sys("Could not set up notification socket: ");
+    close(notify);
+    notify = -1;
+  }
+  else
+    events.add(notify);
+}
+
+static void read_notify()
+{
+  char name[256];
+  const bool scanned = queue_scanned || scanning;
+  if (watcher < 0)
+    queue_scanned = false;
+  ssize_t rd;
+  while ((rd = recv(notify, name, sizeof name - 1, 0)) >= 0) {
+    // An empty name announces a message that is still being written.
+    if (rd == 0) {
+      warm_wanted = true;
+      continue;
+    }
+    name[rd] = 0;
+    // The queue watcher has already seen the new file.
+    if (watcher >= 0)
+      continue;
+    if (rd == 0 || (size_t)rd != strlen(name) || strchr(name, '/') != 0)
+      continue;
+    mystring path = queuedir_path(name, queuedirs);
+    if (!scanned || !have_message(path.c_str()))
+      add_message(path.c_str());
+  }
+}
+
+static int trigger;
+#ifdef NAMEDPIPEBUG
+static int trigger2;
+#endif
+
+bool open_trigger()
+{
+  trigger = open(trigger_path.c_str(), O_RDONLY|O_NONBLOCK);
+#ifdef NAMEDPIPEBUG
+  trigger2 = open(trigger_path.c_str(), O_WRONLY|O_NONBLOCK);
+#endif
+  if(trigger == -1)
+    fail1sys("Could not open trigger file: ");
+  events.add(trigger);
+  return true;
+}
+
+bool read_trigger()
+{
+  if(trigger != -1) {
+    char buf[1024];
+    read(trigger, buf, sizeof buf);
+#ifdef NAMEDPIPEBUG
+    close(trigger2);
+#endif
+    events.remove(trigger);
+    close(trigger);
+  }
+  return open_trigger();
+}
+
+static bool drop_warm(int fd);
+static bool control_ready(int fd);
+
+// Wait for input and handle any that arrives on the trigger, the queue
+// watcher, the notification socket, the control socket or an idle warm
+// session.  The other ready descriptors are
+// left in ready, with their count in others.  Returns the total number
+// of ready descriptors, 0 on timeout or interruption, or -1 on error.
+static int wait_events(int timeout, int ready[], int max, int& others)
+{
+  others = 0;
+  // Idle time is when the log is written out.  What the reader has no
+  // room for yet is tried again shortly rather than left waiting.
+  flog.drain();
+  if (flog.pending() > 0 && (timeout < 0 || timeout > LOGOBUF_FLUSH_MS))
+    timeout = LOGOBUF_FLUSH_MS;
+  int n = events.wait(timeout, ready, max);
+  for (int i = 0; i < n; i++) {
+    int fd = ready[i];
+    if (fd == trigger) {
+      flog << "Trigger pulled." << endl;
+      read_trigger();
+      if (watcher < 0)
+	reload_messages = true;
+    }
+    else if (fd == watcher)
+      read_watcher();
+    else if (fd == notify)
+      read_notify();
+    else if (control_ready(fd))
+      continue;
+    else if (drop_warm(fd))
+      continue;
+    else if (fd == selfpipe.fd()) {
+      // Child exits are checked for after each wait.
+      int sig;
+      while ((sig = selfpipe.caught()) != 0)
+	if (sig == SIGHUP)
+	  config_dirty = reload_wanted = true;
+    }
+    else
+      ready[others++] = fd;
+  }
+  return n;
+}
+
+// The current time in milliseconds, for delivery deadlines.
+static long long clock_ms()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+// The milliseconds left until a deadline, limited to what the event
+// loop can wait for.
+static int time_left(long long deadline)
+{
+  long long left = deadline - clock_ms();
+  if (left < 0)
+    return 0;
+  if (left > 24*60*60*1000)
+    return 24*60*60*1000;
+  return left;
+}
+
+// The deadline for sending the message open on fd, starting now:
+// sendtimeout plus sendtimeoutpermb for each megabyte of the message,
+// or 0 if there is none.
+static long long send_deadline(int fd)
+{
+  if (sendtimeout <= 0)
+    return 0;
+  long long seconds = sendtimeout;
+  struct stat st;
+  if (sendtimeoutpermb > 0 && fstat(fd, &st) == 0)
+    seconds += (long long)sendtimeoutpermb * ((st.st_size + 1048575) >> 20);
+  return clock_ms() + seconds * 1000;
+}
+
+// The milliseconds to wait before the next message may be started on
+// a paced remote, or 0 if it may go now.
+static int pace_delay(remote& r)
+{
+  if (r.rate <= 0 && r.byterate <= 0)
+    return 0;
+  const long long now = clock_ms();
+  if (r.refilled == 0) {
+    r.tokens = r.rate > 1 ? r.rate : 1;
+    r.bytetokens = r.byterate;
+  }
+  else {
+    const double elapsed = (now - r.refilled) / 1000.0;
+    const double most = r.rate > 1 ? r.rate : 1;
+    r.tokens += elapsed * r.rate;
+    if (r.tokens > most)
+      r.tokens = most;
+    r.bytetokens += elapsed * r.byterate;
+    if (r.bytetokens > r.byterate)
+      r.bytetokens = r.byterate;
+  }
+  r.refilled = now;
+  double wait = 0;
+  if (r.rate > 0 && r.tokens < 1)
+    wait = (1 - r.tokens) / r.rate;
+  if (r.byterate > 0 && r.bytetokens < 0 && -r.bytetokens / r.byterate > wait)
+    wait = -r.bytetokens / r.byterate;
+  return wait > 0 ? (int)(wait * 1000) + 1 : 0;
+}
+
+// Take a message, open on the descriptor, from a paced remote's buckets.
+static void pace_take(remote& r, int fd)
+{
+  if (r.rate > 0)
+    r.tokens -= 1;
+  struct stat st;
+  if (r.byterate > 0 && fstat(fd, &st) == 0)
+    r.bytetokens -= st.st_size;
+}
+
+// Wait, handling events, until a paced remote may take another message.
+static void pace_wait(remote& r)
+{
+  int wait;
+  while ((wait = pace_delay(r)) > 0) {
+    int ready[8];
+    int others;
+    if (wait_events(wait, ready, 8, others) < 0)
+      break;
+  }
+}
+
+static ssize_t read_output(int fd, mystring& output)
+{
+  char buf[256];
+  ssize_t rd = read(fd, buf, sizeof buf);
+  if (rd > 0)
+    output += mystring(buf, rd);
+  return rd;
+}
+
+// The result of a message as reported by the protocol, with the
+// recipients that the remote did not accept.
+struct proto_result
+{
+  int code;
+  mystring status;		// The enhanced status code, if any
+  mystring reply;
+  slist deferred;
+  slist failed;
+  mystring failed_status;	// The result of the first failed recipient
+  mystring failed_reply;
+  // The failed recipients whose domain was rejected as a whole, with
+  // the result of each.
+  slist gone;
+  slist gone_status;
+  slist gone_reply;
+  mystring phases;		// "name=usec" pairs separated by spaces
+  mystring caps;		// The capabilities of the remote, if known
+  proto_result() : code(0) { }
+};
+
+// Check if the enhanced status code of a permanent failure is about the
+// recipient's domain rather than the mailbox (RFC 3463, RFC 7505): a
+// bad destination system, a domain with a null MX, or one that cannot
+// be routed to.
+static bool domain_rejected(const mystring& status)
+{
+  return status == "5.1.2" || status == "5.1.10" || status == "5.4.4";
+}
+
+// Decode the netstring fields of a result record.
+static bool result_fields(mystring& record, int& code, mystring& status,
+			  mystring& reply)
+{
+  mystring field;
+  if (net2str(record, field) <= 0)
+    return false;
+  code = atoi(field.c_str());
+  return net2str(record, status) > 0 && net2str(record, reply) > 0;
+}
+
+// Take the next "name=usec" pair out of a list of phase timings.
+static bool next_phase(const mystring& list, unsigned& pos, mystring& name,
+		       long& usec)
+{
+  while (pos < list.length() && list[pos] == ' ')
+    ++pos;
+  if (pos >= list.length())
+    return false;
+  int end = list.find_first(' ', pos);
+  if (end < 0)
+    end = list.length();
+  mystring pair = list.sub(pos, end - pos);
+  pos = end;
+  int eq = pair.find_first('=');
+  if (eq <= 0)
+    return false;
+  name = pair.left(eq);
+  usec = atol(pair.c_str() + eq + 1);
+  return true;
+}
+
+// The phase timings in milliseconds, as logged.
+static mystring phase_summary(const mystring& list)
+{
+  mystring summary;
+  unsigned pos = 0;
+  mystring name;
+  long usec;
+  while (next_phase(list, pos, name, usec)) {
+    char ms[32];
+    snprintf(ms, sizeof ms, " %.1fms", usec / 1000.0);
+    if (!!summary)
+      summary += ", ";
+    summary += name;
+    summary += ms;
+  }
+  return summary;
+}
+
+// Consume the result records written by a built-in protocol, logging
+// the result of each recipient.  Returns 1 when the result of a message
+// was read, 0 if more output is needed, or -1 if the output is not
+// valid.
+static int read_results(mystring& buffer, proto_result& result)
+{
+  for (;;) {
+    mystring record;
+    int r = net2str(buffer, record);
+    if (r <= 0)
+      return r;
+    mystring addr;
+    mystring ms;
+    int code;
+    mystring status;
+    mystring reply;
+    switch (record[0]) {
+    case 'R':
+      record = record.right(1);
+      if (net2str(record, addr) <= 0
+	  || !result_fields(record, code, status, reply))
+	return -1;
+      flog << "Recipient: <" << addr << "> " << reply.subst('\n', '/') << endl;
+      if (code & ERR_PERMANENT_FLAG) {
+	if (result.failed.count() == 0) {
+	  result.failed_status = status;
+	  result.failed_reply = reply;
+	}
+	result.failed.append(addr);
+	if (domain_rejected(status)) {
+	  result.gone.append(addr);
+	  result.gone_status.append(status);
+	  result.gone_reply.append(reply);
+	}
+      }
+      else if (code)
+	result.deferred.append(addr);
+      break;
+    case 'M':
+      record = record.right(1);
+      if (!result_fields(record, result.code, result.status, result.reply)
+	  || net2str(record, ms) <= 0)
+	return -1;
+      // The phase timings and capabilities were added later, and may
+      // not be there.
+      if (!!record && net2str(record, result.phases) <= 0)
+	return -1;
+      if (!!record && net2str(record, result.caps) <= 0)
+	return -1;
+      flog << "Delivery took " << ms << "ms";
+      if (!!result.phases)
+	flog << " (" << phase_summary(result.phases) << ")";
+      flog << endl;
+      return 1;
+    default:
+      return -1;
+    }
+  }
+}
+
+// Counters for the metrics file, from the start of this process.
+static unsigned long queue_runs = 0;
+static unsigned long bounces_generated = 0;
+static unsigned long delay_notices = 0;
+static unsigned long messages_expired = 0;
+// The time from the injection of messages to their final outcome.
+static const char* const trace_outcomes[3] = { "expired", "bounced", "delivered" };
+static metrics_histogram message_latency[3];
+static unsigned active_workers = 0;
+static time_t metrics_written = 0;
+
+// Start the trace of a message the first time it is tried, from its
+// index.
+static void trace_attempt(message& msg)
+{
+  if (direct || msg.trace)
+    return;
+  msg.trace = new message_trace;
+  msg.trace->first = trace_clock();
+  msg.trace->injected = msg.trace->queued = 0;
+  struct stat st;
+  envelope_index index;
+  if (stat(msg.name(), &st) == 0
+      && envindex_read(envindex_path(msg.filename()), st.st_size, index)) {
+    msg.trace->id = index.trace;
+    msg.trace->injected = index.injected;
+    msg.trace->queued = index.queued;
+  }
+}
+
+static const char* trace_usec(long long usec)
+{
+  return usec > 0 ? itoa(usec) : "-";
+}
+
+// Log the trace of a message that has reached its final outcome, for
+// the latency of the queue to be worked out from the log.
+static void trace_done(message& msg, tristate result)
+{
+  message_trace* t = msg.trace;
+  if (!t)
+    return;
+  const long long now = trace_clock();
+  flog << "Trace: id=" << (!t->id ? "-" : t->id.c_str())
+       << " file=" << msg.filename()
+       << " outcome=" << trace_outcomes[result + 1];
+  flog << " injected=" << trace_usec(t->injected);
+  flog << " queued=" << trace_usec(t->queued);
+  flog << " first=" << trace_usec(t->first);
+  flog << " done=" << trace_usec(now) << endl;
+  const long long from = t->injected > 0 ? t->injected : t->queued;
+  if (from > 0 && now >= from)
+    message_latency[result + 1].observe((now - from) / 1e6);
+  delete t;
+  msg.trace = 0;
+}
+
+static void count_result(remote& remote, tristate result, long long started)
+{
+  ++remote.results[result + 1];
+  const long ms = clock_ms() - started;
+  remote.latency.observe(ms / 1000.0);
+  remote.delivery_ms = remote.delivery_ms > 0
+    ? (remote.delivery_ms * 7 + ms) / 8 : (ms > 0 ? ms : 1);
+}
+
+static void count_phases(remote& remote, const proto_result& result)
+{
+  unsigned pos = 0;
+  mystring name;
+  long usec;
+  while (next_phase(result.phases, pos, name, usec))
+    for (int i = 0; i < DELIVERY_PHASES; i++)
+      if (name == delivery_phases[i]) {
+	remote.phase_latency[i].observe(usec / 1e6);
+	break;
+      }
+}
+
+// How long the capabilities reported for a remote are trusted for.
+#define CAPS_LIFETIME (60*60)
+
+// Keep the capabilities reported for a remote, to hand back to the
+// protocol on the next connection.
+static void learn_caps(remote& remote, const proto_result& result)
+{
+  if (!result.caps)
+    return;
+  remote.caps = result.caps;
+  remote.caps_seen = time(0);
+}
+
+// Adjust the window of an adaptive remote from the result of a
+// delivery: increase it additively while deliveries succeed, and
+// decrease it multiplicatively on a temporary failure (a throttling
+// reply or a failure to connect) or when the handshake took more than
+// twice as long as usual.
+static void adapt_window(remote& remote, tristate result,
+			 const mystring& phases)
+{
+  if (!remote.adaptive)
+    return;
+  long handshake = 0;
+  unsigned pos = 0;
+  mystring name;
+  long usec;
+  while (next_phase(phases, pos, name, usec))
+    if (name == "connect" || name == "greeting" || name == "helo")
+      handshake += usec;
+  bool slow = false;
+  if (handshake > 0) {
+    // Handshakes of a few milliseconds are too noisy to compare.
+    slow = remote.handshake > 0 && handshake > 2 * remote.handshake
+      && handshake > 10000;
+    remote.handshake = remote.handshake > 0
+      ? (remote.handshake * 7 + handshake) / 8 : handshake;
+  }
+  if (result == tempfail || slow) {
+    remote.window /= 2;
+    if (remote.window < 1)
+      remote.window = 1;
+  }
+  else if (result == success) {
+    const int cap = max_concurrency(remote);
+    remote.window += 1 / remote.window;
+    if (remote.window > cap)
+      remote.window = cap;
+  }
+}
+
+// Write out the metrics file, if it is enabled.  While a queue run is
+// busy it is only written every few seconds.
+static void write_metrics(bool force)
+{
+  if (!metrics || direct)
+    return;
+  const time_t now = time(0);
+  if (!force && now - metrics_written < 5)
+    return;
+  metrics_written = now;
+  metrics_file mf(CONFIG_PATH(QUEUE, NULL, "metrics"));
+  if (!mf.open()) {
+    msg1sys("Could not write the metrics file: ");
+    return;
+  }
+  const mystring none;
+  mf.family("nullmailer_queue_messages", "gauge",
+	    "Messages in the queue.");
+  mf.value("nullmailer_queue_messages", none,
+	   (unsigned long)messages.count());
+  mf.family("nullmailer_queue_oldest_seconds", "gauge",
+	    "Age of the oldest message in the queue.");
+  mf.value("nullmailer_queue_oldest_seconds", none,
+	   (unsigned long)(expiry.top() ? now - expiry.top()->timestamp : 0));
+  mf.family("nullmailer_workers_active", "gauge",
+	    "Protocol processes delivering messages.");
+  mf.value("nullmailer_workers_active", none, (unsigned long)active_workers);
+  mf.family("nullmailer_workers_max", "gauge",
+	    "Protocol processes that may deliver messages at once.");
+  mf.value("nullmailer_workers_max", none, (unsigned long)maxconcurrency);
+  if (tenant_index >= 0) {
+    mf.family("nullmailer_tenant_slots_borrowed", "gauge",
+	      "Delivery slots borrowed from the pool shared by the tenants.");
+    mf.value("nullmailer_tenant_slots_borrowed",
+	     metrics_label("tenant", config_tenant()),
+	     (unsigned long)slotpool_held(tenant_index));
+  }
+  mf.family("nullmailer_prefetch_max", "gauge",
+	    "Messages that may be opened ahead of their delivery.");
+  mf.value("nullmailer_prefetch_max", none, (unsigned long)prefetch);
+  mf.family("nullmailer_warm_sessions_max", "gauge",
+	    "Idle sessions that may be kept open (0 for no limit).");
+  mf.value("nullmailer_warm_sessions_max", none, (unsigned long)maxwarm);
+  mf.family("nullmailer_cgroup_cpu_millis", "gauge",
+	    "CPU quota of the control group, in thousandths of a CPU.");
+  mf.value("nullmailer_cgroup_cpu_millis", none, limits.millicpus);
+  mf.family("nullmailer_cgroup_memory_bytes", "gauge",
+	    "Memory limit of the control group.");
+  mf.value("nullmailer_cgroup_memory_bytes", none,
+	   (unsigned long)limits.memory);
+  mf.family("nullmailer_queue_runs_total", "counter", "Queue runs started.");
+  mf.value("nullmailer_queue_runs_total", none, queue_runs);
+  mf.family("nullmailer_bounces_total", "counter",
+	    "Bounces generated for failed messages.");
+  mf.value("nullmailer_bounces_total", none, bounces_generated);
+  mf.family("nullmailer_delay_notices_total", "counter",
+	    "Delay notices generated.");
+  mf.value("nullmailer_delay_notices_total", none, delay_notices);
+  mf.family("nullmailer_expired_total", "counter",
+	    "Messages bounced for outliving the queue lifetime.");
+  mf.value("nullmailer_expired_total", none, messages_expired);
+  mf.family("nullmailer_message_seconds", "histogram",
+	    "Time from the injection of messages to their final outcome.");
+  for (int i = 0; i < 3; i++)
+    if (message_latency[i].count > 0)
+      mf.histogram("nullmailer_message_seconds",
+		   metrics_label("outcome", trace_outcomes[i]),
+		   message_latency[i]);
+  mf.family("nullmailer_log_dropped_lines_total", "counter",
+	    "Log lines dropped because the log was not read fast enough.");
+  mf.value("nullmailer_log_dropped_lines_total", none, flog.dropped());
+
+  static const char* const outcomes[3] = { "tempfail", "permfail", "success" };
+  mf.family("nullmailer_remote_up", "gauge",
+	    "Whether the remote is being delivered to.");
+  for (rlist::const_iter r(remotes); r; r++)
+    mf.value("nullmailer_remote_up", metrics_label("host", (*r).host) + ","
+	     + metrics_label("protocol", (*r).proto),
+	     (unsigned long)((*r).down_until <= now));
+  mf.family("nullmailer_remote_concurrency", "gauge",
+	    "Deliveries an adaptive remote may run at once.");
+  for (rlist::const_iter r(remotes); r; r++)
+    if ((*r).adaptive)
+      mf.value("nullmailer_remote_concurrency",
+	       metrics_label("host", (*r).host) + ","
+	       + metrics_label("protocol", (*r).proto),
+	       (unsigned long)concurrency(*r));
+  mf.family("nullmailer_delivery_attempts_total", "counter",
+	    "Delivery attempts, by remote and result.");
+  for (rlist::const_iter r(remotes); r; r++)
+    for (int i = 0; i < 3; i++)
+      mf.value("nullmailer_delivery_attempts_total",
+	       metrics_label("host", (*r).host) + ","
+	       + metrics_label("protocol", (*r).proto) + ","
+	       + metrics_label("result", outcomes[i]),
+	       (*r).results[i]);
+  mf.family("nullmailer_deadline_hits_total", "counter",
+	    "Deliveries killed for running past their deadline, by remote.");
+  for (rlist::const_iter r(remotes); r; r++)
+    mf.value("nullmailer_deadline_hits_total",
+	     metrics_label("host", (*r).host) + ","
+	     + metrics_label("protocol", (*r).proto),
+	     (*r).deadline_hits);
+  mf.family("nullmailer_delivery_seconds", "histogram",
+	    "Time taken by delivery attempts, by remote.");
+  for (rlist::const_iter r(remotes); r; r++)
+    mf.histogram("nullmailer_delivery_seconds",
+		 metrics_label("host", (*r).host) + ","
+		 + metrics_label("protocol", (*r).proto),
+		 (*r).latency);
+  mf.family("nullmailer_delivery_phase_seconds", "histogram",
+	    "Time taken by each phase of delivery attempts, by remote.");
+  for (rlist::const_iter r(remotes); r; r++)
+    for (int i = 0; i < DELIVERY_PHASES; i++)
+      if ((*r).phase_latency[i].count > 0)
+	mf.histogram("nullmailer_delivery_phase_seconds",
+		     metrics_label("host", (*r).host) + ","
+		     + metrics_label("protocol", (*r).proto) + ","
+		     + metrics_label("phase", delivery_phases[i]),
+		     (*r).phase_latency[i]);
+  if (!mf.commit())
+    msg1sys("Could not write the metrics file: ");
+}
+
+// Write out the number of messages in the queue and their total size
+// for nullmailer-queue to check the maxqueuefiles and maxqueuesize
+// limits against, if either is set.  Messages whose size has not been
+// looked up yet count as empty.  It is only rewritten when it changes,
+// and while a queue run is busy at most once a second.
+static void write_usage(bool force)
+{
+  static time_t written = 0;
+  static unsigned long last_files = ~0UL;
+  static unsigned long last_bytes = ~0UL;
+  if (!queuelimits || direct)
+    return;
+  unsigned long files = 0;
+  unsigned long bytes = 0;
+  for (msglist::iter msg(messages); msg; msg++)
+    if (!(*msg).done) {
+      ++files;
+      bytes += (*msg).size;
+    }
+  const time_t now = time(0);
+  if (files == last_files && bytes == last_bytes)
+    return;
+  if (!force && now == written)
+    return;
+  written = now;
+  last_files = files;
+  last_bytes = bytes;
+  const mystring path = CONFIG_PATH(QUEUE, NULL, "usage");
+  const mystring tmppath = path + "." + itoa(getpid());
+  bool ok;
+  {
+    fdobuf out(tmppath.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    ok = out && out << itoa(files) << ' ' << itoa(bytes) << '\n'
+      && out.flush();
+  }
+  if (!ok || rename(tmppath.c_str(), path.c_str()) == -1) {
+    msg1sys("Could not write the usage file: ");
+    unlink(tmppath.c_str());
+  }
+}
+
+// A single-message delivery, one of up to maxconcurrency running at
+// once.  The protocol output is collected as it arrives.
+struct delivery
+{
+  fork_exec* fp;
+  message* msg;
+  remote* rem;
+  int fromfd;
+  long long deadline;
+  long long started;
+  bool framed;
+  mystring output;
+  delivery()
+    : fp(0), msg(0), rem(0), fromfd(-1), deadline(0), started(0),
+      framed(false)
+  {
+  }
+  void close_output();
+};
+
+void delivery::close_output()
+{
+  events.remove(fromfd);
+  close(fromfd);
+  fromfd = -1;
+}
+
+// The child side of a built-in protocol, which takes the place of the
+// protocol program and so starts with the signal handling it would.
+static int run_engine(void* engine)
+{
+  signal(SIGALRM, SIG_DFL);
+  signal(SIGCHLD, SIG_DFL);
+  flog.discard();
+  protocol_session s(*(const protocol_engine*)engine);
+  return protocol_main(s);
+}
+
+// Start the protocol for a remote with the given redirections, running
+// the built-in protocol engine in a child process where there is one,
+// or the protocol program otherwise.  The engine is not run in this
+// process: the child is what lets deliveries run side by side without
+// threads, lets a delivery that is stuck past its timeout be killed,
+// and keeps a crash in a protocol or the TLS library from taking the
+// queue runner down with it.  Only the exec is saved.
+static bool start_protocol(fork_exec& fp, const remote& r, int redirs[])
+{
+  const protocol_engine* engine = 0;
+  if (builtinprotocols)
+    engine = protocol_find(r.proto.c_str());
+  // Keep the log in order with what the protocol writes to it.
+  flog.drain();
+  if (engine != 0)
+    return fp.start(run_engine, (void*)engine, 4, redirs);
+  return fp.start(r.program.c_str(), 4, redirs);
+}
+
+// Check if a remote is delivered to by a built-in protocol, which
+// reports its results as netstring records.
+static bool builtin(const remote& r)
+{
+  return builtinprotocols && protocol_find(r.proto.c_str()) != 0;
+}
+
+// The options written to the protocol for a message.  The built-in
+// protocols are also told where the index of the message is, to
+// report their results as records and what the remote was last seen
+// to be capable of, ahead of the blank line that ends the options.
+// A warm session, started without a filename, is told so with the warm
+// option, and a session that is passed the later messages as open files
+// with the fds option.
+static mystring message_options(const remote& r, const mystring& filename,
+				bool fds = false)
+{
+  if (!builtin(r) && !!filename)
+    return r.options;
+  mystring options = r.options.left(r.options.length() - 1);
+  if (!filename)
+    options += "warm\n";
+  if (builtin(r)) {
+    options += "results\n";
+    if (fds)
+      options += "fds\n";
+    if (!!filename) {
+      options += "index=";
+      options += envindex_path(filename);
+      options += '\n';
+    }
+    if (!!r.caps && time(0) - r.caps_seen < CAPS_LIFETIME) {
+      options += "caps=";
+      options += r.caps;
+      options += '\n';
+    }
+  }
+  options += '\n';
+  return options;
+}
+
+// Messages opened ahead of their turn while the delivery before them
+// runs, so that the next delivery need not wait on the disk to start:
+// their files are read into the page cache in the background, and
+// their envelopes are read for the log.  Each is taken when its own
+// delivery starts, and the rest are closed once the remote is done
+// with, before any message can leave the queue.
+// The most messages looked through for ones to read ahead, so that a
+// long run of messages routed elsewhere is not walked each time.
+#define PREFETCH_SCAN 64
+
+struct prefetched
+{
+  message* msg;
+  int fd;
+  bool described;
+  mystring text;
+};
+static prefetched ahead[PREFETCH_MAX];
+static int ahead_count = 0;
+
+static bool routed_to(const message& msg, const remote& remote);
+static bool bounce_rejected(message& msg, remote& remote);
+static bool skip_oversized(message& msg, remote& remote);
+
+static bool is_ahead(const message& msg)
+{
+  for (int i = 0; i < ahead_count; i++)
+    if (ahead[i].msg == &msg)
+      return true;
+  return false;
+}
+
+// Open the message for its delivery, taking the file read ahead for it
+// if there is one along with its envelope.
+static int open_queued(message& msg, mystring& text, bool& described)
+{
+  for (int i = 0; i < ahead_count; i++)
+    if (ahead[i].msg == &msg) {
+      const int fd = ahead[i].fd;
+      described = ahead[i].described;
+      text = ahead[i].text;
+      ahead[i] = ahead[--ahead_count];
+      return fd;
+    }
+  described = false;
+  return open(msg.name(), O_RDONLY);
+}
+
+// Read ahead the messages after msg that are to be sent to the remote,
+// up to prefetch of them.
+static void read_ahead(duelist::iter msg, const remote& remote)
+{
+  if (direct)
+    return;
+  for (int scanned = 0; msg && ahead_count < prefetch
+	 && scanned < PREFETCH_SCAN; msg++, scanned++) {
+    message& m = **msg;
+    if (m.done || m.busy || m.attempted || !routed_to(m, remote)
+	|| is_ahead(m))
+      continue;
+    const int fd = open(m.name(), O_RDONLY|O_CLOEXEC);
+    if (fd < 0)
+      continue;
+    fdbuf_advise_willneed(fd);
+    prefetched& p = ahead[ahead_count++];
+    p.msg = &m;
+    p.fd = fd;
+    p.described = describe_msg(m.filename(), fd, p.text);
+  }
+}
+
+// Close the file read ahead for a message that has been rewritten.
+static void forget_ahead(const message& msg)
+{
+  for (int i = 0; i < ahead_count; i++)
+    if (ahead[i].msg == &msg) {
+      close(ahead[i].fd);
+      ahead[i] = ahead[--ahead_count];
+      return;
+    }
+}
+
+static void drop_ahead(void)
+{
+  while (ahead_count > 0)
+    close(ahead[--ahead_count].fd);
+}
+
+// Check if a message that could not be opened has left the queue, as
+// when it was taken from the journal after being removed by hand, and
+// if so forget it.
+static bool vanished(message& msg)
+{
+  if (errno != ENOENT)
+    return false;
+  flog << "Message " << msg.filename() << " has left the queue" << endl;
+  journal_record(journal_delivered(msg.filename()));
+  msg.done = true;
+  return true;
+}
+
+// Claim a message with an exclusive lock on an open file of it, held
+// until the message has been disposed of, so that the other instances
+// of nullmailer-send sharing the queue leave it alone.  The lock goes
+// with the process holding it, so one that dies leaves no stale claims
+// behind.  A message claimed elsewhere is marked busy and left for the
+// rest of the queue run.
+static bool claim_fd(message& msg, int fd)
+{
+  if (direct || msg.claim >= 0)
+    return true;
+  if (flock(fd, LOCK_EX|LOCK_NB) == -1) {
+    if (errno != EWOULDBLOCK)
+      return true;
+    flog << "Skipping " << msg.filename()
+	 << ", another nullmailer-send is sending it." << endl;
+    msg.busy = true;
+    return false;
+  }
+  // Another instance may have disposed of the message between the open
+  // and the lock.
+  struct stat held, st;
+  if (fstat(fd, &held) == -1 || stat(msg.name(), &st) == -1
+      || held.st_ino != st.st_ino || held.st_dev != st.st_dev) {
+    if (!vanished(msg))
+      msg.busy = true;
+    return false;
+  }
+  // Without a descriptor of its own the lock would go with fd, so the
+  // message is left alone rather than sent unclaimed.
+  if ((msg.claim = dup(fd)) == -1) {
+    flog << "Skipping " << msg.filename() << ", it could not be claimed: "
+	 << strerror(errno) << endl;
+    msg.busy = true;
+    return false;
+  }
+  fcntl(msg.claim, F_SETFD, FD_CLOEXEC);
+  return true;
+}
+
+static bool claim_msg(message& msg)
+{
+  if (direct || msg.claim >= 0)
+    return true;
+  autoclose fd = open(msg.name(), O_RDONLY);
+  return fd < 0 || claim_fd(msg, fd);
+}
+
+static void release_claim(message& msg)
+{
+  if (msg.claim >= 0) {
+    close(msg.claim);
+    msg.claim = -1;
+  }
+}
+
+static bool start_one(delivery& d, message& msg, remote& remote)
+{
+  if (skip_oversized(msg, remote) || bounce_rejected(msg, remote))
+    return false;
+  mystring text;
+  bool described;
+  autoclose fd = open_queued(msg, text, described);
+  if(fd < 0) {
+    flog << "Can't open file '" << msg.filename() << "'" << endl;
+    vanished(msg);
+    return false;
+  }
+  if (!claim_fd(msg, fd))
+    return false;
+  msg.attempted = true;
+  trace_attempt(msg);
+  log_msg(msg.filename(), remote, fd, described ? &text : 0);
+  pace_take(remote, fd);
+
+  fork_exec* fp = new fork_exec(remote.proto.c_str());
+  int redirs[] = { REDIRECT_PIPE_TO, REDIRECT_PIPE_FROM, REDIRECT_NONE, fd };
+  if (!start_protocol(*fp, remote, redirs)) {
+    delete fp;
+    return false;
+  }
+
+  mystring options = message_options(remote, msg.filename());
+  if (write(redirs[0], options.c_str(), options.length()) != (ssize_t)options.length())
+    flog << "Warning: Writing options to protocol failed" << endl;
+  close(redirs[0]);
+
+  d.fp = fp;
+  d.msg = &msg;
+  d.rem = &remote;
+  d.framed = builtin(remote);
+  d.fromfd = redirs[1];
+  d.started = clock_ms();
+  d.deadline = send_deadline(fd);
+  events.add(d.fromfd);
+  ++active_workers;
+  return true;
+}
+
+// A multi-message protocol session: the first message is passed on FD
+// 3 as with a single delivery, subsequent message file names are
+// written to the protocol's standard input, and a result is read back
+// from its standard output for each message.  The result is a set of
+// records from the built-in protocols, or a single line otherwise.
+// The built-in protocols have a socket for their standard input, and
+// each file name is sent with the message already open attached to it,
+// which the protocol reads instead of opening the file again.
+class multi_session
+{
+  fork_exec fp;
+  int tofd;
+  int fromfd;
+  bool framed;
+  mystring buffer;
+  int parse_result(proto_result& result);
+public:
+  multi_session(const remote& r);
+  ~multi_session();
+  bool start(const remote& r, const mystring& filename, int fd);
+  bool next(const mystring& filename, int fd);
+  int result(proto_result& result, long long deadline);
+  int finish(mystring& output);
+  int output_fd() const { return fromfd; }
+};
+
+multi_session::multi_session(const remote& r)
+  : fp(r.proto.c_str()), tofd(-1), fromfd(-1), framed(builtin(r))
+{
+}
+
+multi_session::~multi_session()
+{
+  if (tofd >= 0)
+    close(tofd);
+  if (fromfd >= 0) {
+    events.remove(fromfd);
+    close(fromfd);
+  }
+}
+
+bool multi_session::start(const remote& r, const mystring& filename, int fd)
+{
+  int redirs[] = { framed ? REDIRECT_SOCKET_TO : REDIRECT_PIPE_TO,
+		   REDIRECT_PIPE_FROM, REDIRECT_NONE, fd };
+  if (!start_protocol(fp, r, redirs))
+    return false;
+  tofd = redirs[0];
+  fromfd = redirs[1];
+  events.add(fromfd);
+  mystring options = message_options(r, filename, framed);
+  if (write(tofd, options.c_str(), options.length()) != (ssize_t)options.length())
+    flog << "Warning: Writing options to protocol failed" << endl;
+  return true;
+}
+
+bool multi_session::next(const mystring& filename, int fd)
+{
+  if (framed)
+    return fdpass_send(tofd, filename, fd);
+  mystring line = filename;
+  line += '\n';
+  return write(tofd, line.c_str(), line.length()) == (ssize_t)line.length();
+}
+
+// Take a complete result out of the buffered output.  A result line
+// holds the numeric result code, a space and the response text.
+int multi_session::parse_result(proto_result& result)
+{
+  if (framed)
+    return read_results(buffer, result);
+  int i = buffer.find_first('\n');
+  if (i < 0)
+    return 0;
+  mystringview line(buffer.c_str(), i);
+  result.code = atoi(line.data());
+  i = line.find_first(' ');
+  result.reply = i < 0 ? mystring() : line.right(i+1).str();
+  buffer = buffer.right(line.length()+1);
+  return 1;
+}
+
+// Returns 1 if a result was read, 0 at end of file, -1 if the protocol
+// failed, or -2 if it ran past the deadline.
+int multi_session::result(proto_result& result, long long deadline)
+{
+  for (;;) {
+    int r = parse_result(result);
+    if (r != 0)
+      return r;
+    if (deadline && clock_ms() >= deadline) {
+      flog << "Sending timed out, killing protocol" << endl;
+      fp.kill(SIGTERM);
+      return -2;
+    }
+    int ready[8];
+    int others;
+    if (wait_events(deadline ? time_left(deadline) : -1, ready, 8, others) < 0) {
+      msg1sys("Error waiting for the protocol: ");
+      return -1;
+    }
+    for (int r = 0; r < others; r++)
+      if (ready[r] == fromfd) {
+	ssize_t rd = read_output(fromfd, buffer);
+	if (rd < 0 && errno == EINTR)
+	  continue;
+	if (rd <= 0)
+	  return rd;
+      }
+  }
+}
+
+// Shut down the session and return the protocol's exit status, for use
+// when no result line was received.
+int multi_session::finish(mystring& output)
+{
+  if (tofd >= 0) {
+    close(tofd);
+    tofd = -1;
+  }
+  output = buffer;
+  return fp.wait_status();
+}
+
+// The sessions kept open to remotes with the warm option between
+// queue runs, with when each is closed if it is not used.  They are
+// matched to the remotes the way their health is, so they outlast a
+// reload of the config.
+struct warm_session
+{
+  mystring program;
+  mystring options;
+  multi_session* session;
+  time_t idle_until;
+};
+
+static list<warm_session> warm_sessions;
+
+static void close_warm(list<warm_session>::iter& w)
+{
+  mystring output;
+  (*w).session->finish(output);
+  delete (*w).session;
+  warm_sessions.remove(w);
+}
+
+// Park a session that has run out of messages to send, closing the one
+// parked longest ago if there are already maxwarm of them.
+static void keep_warm(const remote& r, multi_session* session)
+{
+  if (maxwarm > 0 && warm_sessions.count() >= (unsigned)maxwarm) {
+    list<warm_session>::iter oldest(warm_sessions);
+    close_warm(oldest);
+  }
+  warm_session w;
+  w.program = r.program;
+  w.options = r.options;
+  w.session = session;
+  w.idle_until = time(0) + r.warm;
+  warm_sessions.append(w);
+}
+
+// Take the warm session for the remote, if it has one that is still
+// waiting for a message.  The protocol only writes to a warm session
+// when it ends, as when the remote closes the connection.
+static multi_session* take_warm(const remote& r)
+{
+  for (list<warm_session>::iter w(warm_sessions); w; w++)
+    if ((*w).program == r.program && (*w).options == r.options) {
+      struct pollfd p = { (*w).session->output_fd(), POLLIN, 0 };
+      if (poll(&p, 1, 0) != 0) {
+	close_warm(w);
+	return 0;
+      }
+      multi_session* session = (*w).session;
+      warm_sessions.remove(w);
+      return session;
+    }
+  return 0;
+}
+
+// Close the warm session that the protocol has written to.  Returns
+// false if the descriptor is not that of a warm session.
+static bool drop_warm(int fd)
+{
+  for (list<warm_session>::iter w(warm_sessions); w; w++)
+    if ((*w).session->output_fd() == fd) {
+      flog << "Warm session closed by the protocol." << endl;
+      close_warm(w);
+      return true;
+    }
+  return false;
+}
+
+// Close the warm sessions that have been idle for too long, and return
+// the seconds until the next one is due to be closed, or -1 if none is.
+static int expire_warm(time_t now)
+{
+  int pause = -1;
+  for (list<warm_session>::iter w(warm_sessions); w; ) {
+    if ((*w).idle_until <= now) {
+      close_warm(w);
+      continue;
+    }
+    if (pause < 0 || (*w).idle_until - now < pause)
+      pause = (*w).idle_until - now;
+    w++;
+  }
+  return pause;
+}
+
+static void parse_output(const mystring& output, const remote& remote, mystring& status, mystring& diag)
+{
+  diag = remote.proto.upper();
+  diag += "; ";
+  diag += output.strip();
+  diag.subst('\n', '/');
+  status = "5.0.0";
+  for (unsigned i = 0; i + 5 <= output.length(); i++)
+    if (isdigit(output[i])
+        && output[i+1] == '.'
+        && isdigit(output[i+2])
+        && output[i+3] == '.'
+        && isdigit(output[i+4])) {
+      status = output.sub(i, 5);
+      break;
+    }
+}
+
+// Queue one notification reporting on the messages, which share the
+// same sender, straight into the queue.
+static void write_bounce(list<dsn_message>& msgs)
+{
+  const dsn_message& first = *list<dsn_message>::const_iter(msgs);
+  mystring from, to;
+  if (!dsn_envelope(dsn_conf, first.sender, from, to)) {
+    flog << "Nowhere to send double bounce for '" << first.path << "'" << endl;
+    return;
+  }
+  queue_writer qw(flog);
+  if (!qw.open() || !qw.sender(from) || !qw.recipient(to)
+      || !qw.end_envelope())
+    return;
+  const mystring messageid = make_messageid(dsn_conf.idhost);
+  qw.header("Message-Id: " + messageid);
+  if (!dsn_write(qw.out(), dsn_conf, msgs, messageid)) {
+    flog << "Could not write the bounce message" << endl;
+    return;
+  }
+  qw.commit();
+}
+
+// Failures waiting to be reported together at the end of a queue run,
+// in groups that share a bounce envelope.
+struct bounce_group
+{
+  mystring from;
+  mystring to;
+  list<dsn_message> msgs;
+};
+static list<bounce_group> bounce_groups;
+
+static void write_group(bounce_group& group)
+{
+  flog << "Generating a bounce for " << itoa(group.msgs.count())
+       << " message(s) to <" << group.to << ">" << endl;
+  write_bounce(group.msgs);
+}
+
+static void add_bounce(const dsn_message& msg)
+{
+  mystring from, to;
+  if (!dsn_envelope(dsn_conf, msg.sender, from, to)) {
+    flog << "Nowhere to send double bounce for '" << msg.path << "'" << endl;
+    return;
+  }
+  list<bounce_group>::iter g(bounce_groups);
+  while (g && ((*g).from != from || (*g).to != to))
+    g++;
+  if (!g) {
+    bounce_group& ng = bounce_groups.emplace();
+    ng.from = from;
+    ng.to = to;
+    ng.msgs.append(msg);
+    return;
+  }
+  (*g).msgs.append(msg);
+  if ((*g).msgs.count() >= (unsigned)bounceaggregate) {
+    write_group(*g);
+    bounce_groups.remove(g);
+  }
+}
+
+static void flush_bounces()
+{
+  for (list<bounce_group>::iter g(bounce_groups); g; g++)
+    write_group(*g);
+  bounce_groups.empty();
+}
+
+// Generate a bounce for a message in the failed queue, or with a time
+// until which delivery will be retried, a delay notice for a message
+// still in the queue.  The status is the enhanced status code reported
+// by the protocol, or empty to look for one in its output.  When this
+// process owns the queue the notice is written into it directly, and a
+// bounce may be held back to be reported along with others to the same
+// address; otherwise nullmailer-dsn and nullmailer-queue write it.
+static void generate_dsn(const mystring& path, const mystring& host,
+			 mystring status_code, const mystring& diag_code,
+			 time_t retry_until)
+{
+  const char* kind = retry_until ? "delay notice" : "bounce";
+  autoclose fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    flog << "Can't open file '" << path << "' to create " << kind << " message" << endl;
+    return;
+  }
+  ++(retry_until ? delay_notices : bounces_generated);
+  // The message is still being retried, however the remote put it.
+  if (retry_until && status_code[0] != '4')
+    status_code = "4" + status_code.right(1);
+  if (queue_writer::usable()) {
+    dsn_message msg;
+    struct stat st;
+    fdibuf in(fd);
+    if (fstat(fd, &st) < 0 || !dsn_read_envelope(in, msg)) {
+      flog << "Can't read the envelope of '" << path << "' to create " << kind << " message" << endl;
+      return;
+    }
+    msg.path = path;
+    msg.timestamp = st.st_ctime;
+    msg.last_attempt = time(NULL);
+    msg.retry_until = retry_until;
+    msg.status = status_code;
+    msg.remote = host;
+    msg.diagnostic_code = diag_code;
+    if (bounceaggregate > 1 && !retry_until) {
+      flog << "Holding the bounce for '" << path << "' to report with others" << endl;
+      add_bounce(msg);
+      return;
+    }
+    flog << "Generating " << kind << " for '" << path << "'" << endl;
+    list<dsn_message> msgs;
+    msgs.append(msg);
+    write_bounce(msgs);
+    return;
+  }
+  flog << "Generating " << kind << " for '" << path << "'" << endl;
+  queue_pipe qp;
+  autoclose pfd = qp.start();
+  if (pfd > 0) {
+    mystring program = program_path("nullmailer-dsn");
+    fork_exec dsn("nullmailer-dsn");
+    int redirs[] = { fd, pfd };
+    const mystring retry = itoa(retry_until);
+    const char* args[] = { program.c_str(),
+			   "--last-attempt", itoa(time(NULL)),
+			   "--remote", host.c_str(),
+			   "--diagnostic-code", diag_code.c_str(),
+			   "--retry-until", retry.c_str(),
+			   status_code.c_str(), NULL };
+    dsn.start(args, 2, redirs);
+    // Everything else cleans up itself
+  }
+}
+
+static void generate_dsn(const mystring& path, const remote& remote,
+			 const mystring& output, const mystring& status,
+			 time_t retry_until = 0)
+{
+  mystring status_code, diag_code;
+  parse_output(output, remote, status_code, diag_code);
+  if (!!status)
+    status_code = status;
+  generate_dsn(path, remote.host, status_code, diag_code, retry_until);
+}
+
+// Move a message into the failed queue.
+static bool fail_msg(const message& msg, mystring& failed)
+{
+  failed = "../failed/";
+  failed += queuedir_name(msg.filename());
+  flog << "Moving message " << msg.filename() << " into failed" << endl;
+  if (rename(msg.name(), failed.c_str()) == -1) {
+    flog << "Can't rename file: " << strerror(errno) << endl;
+    return false;
+  }
+  unlink(envindex_path(msg.filename()).c_str());
+  journal_record(journal_bounced(msg.filename()));
+  return true;
+}
+
+// Move a message into the failed queue and generate a bounce for it.
+bool bounce_msg(const message& msg, const remote& remote,
+		const mystring& output, const mystring& status)
+{
+  mystring failed;
+  if (!fail_msg(msg, failed))
+    return false;
+  generate_dsn(failed, remote, output, status);
+  return true;
+}
+
+// Write a copy of a message with the envelope recipients replaced.
+// A compressed body is copied as it is, under a header line giving the
+// new offset of the message.
+static bool copy_msg(const mystring& from, const mystring& to,
+		     const slist& recipients)
+{
+  mmapibuf in(from.c_str());
+  mystring line;
+  queuefile_header layout;
+  queuefile_read(in, layout);
+  if (!in || !in.getline(line))
+    return false;
+  fdobuf out(to.c_str(), O_CREAT|O_WRONLY|O_TRUNC, 0600);
+  if (!out)
+    return false;
+  if (layout.compressed) {
+    layout.offset = QUEUEFILE_HEADER_LENGTH + line.length() + 2;
+    for (slist::const_iter i(recipients); i; i++)
+      layout.offset += (*i).length() + 1;
+    layout.recipients = recipients.count();
+    out << queuefile_format(layout);
+  }
+  out << line << '\n';
+  for (slist::const_iter i(recipients); i; i++)
+    out << *i << '\n';
+  out << '\n';
+  while (in.getline(line))
+    if (!line)
+      break;
+  if (!fdbuf_copy(in, out) || !out.sync() || !out.close()) {
+    unlink(to.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Deal with the recipients of a delivered message that the remote did
+// not accept.  The rejected ones are bounced from a copy of the message
+// in the failed queue, and the message is rewritten to hold only the
+// deferred ones, so that only they are retried.
+static tristate partial_msg(message& msg, const remote& remote,
+			    const proto_result& reported)
+{
+  if (reported.failed.count() > 0) {
+    mystring failed = "../failed/";
+    failed += queuedir_name(msg.filename());
+    failed += '.';
+    failed += itoa(time(0));
+    flog << "Bouncing " << reported.failed.count() << " recipient(s) of "
+	 << msg.filename() << endl;
+    if (copy_msg(msg.filename(), failed, reported.failed))
+      generate_dsn(failed, remote, reported.failed_reply,
+		      reported.failed_status);
+    else
+      flog << "Can't copy message for the bounce: " << strerror(errno) << endl;
+  }
+  if (reported.deferred.count() == 0)
+    return success;
+  flog << "Deferring " << reported.deferred.count() << " recipient(s) of "
+       << msg.filename() << endl;
+  // A message in the fast lane is rewritten there, as the temporary
+  // directory is on another file system.
+  mystring tmp = fastlane ? "../fastlane/." : "../tmp/";
+  tmp += queuedir_name(msg.filename());
+  if (!copy_msg(msg.filename(), tmp, reported.deferred)
+      || rename(tmp.c_str(), msg.name()) == -1) {
+    flog << "Can't rewrite message, retrying all recipients: "
+	 << strerror(errno) << endl;
+    unlink(tmp.c_str());
+  }
+  else {
+    own_file(msg.name());
+    journal_record(journal_recipients(msg.filename(), reported.deferred));
+    msg.keyed = false;
+  }
+  unlink(envindex_path(msg.filename()).c_str());
+  return tempfail;
+}
+
+// Check if a message has been in the queue too long.  A time taken
+// from the file name is confirmed against the file before giving up.
+static bool expired(message& msg)
+{
+  if (time(0) - msg.timestamp <= queuelifetime)
+    return false;
+  if (!msg.stated) {
+    msg.stated = true;
+    struct stat st;
+    if (stat(msg.name(), &st) == 0) {
+      msg.timestamp = st.st_mtime;
+      expiry.remove(&msg);
+      expiry.push(&msg);
+      return time(0) - msg.timestamp > queuelifetime;
+    }
+  }
+  return true;
+}
+
+// Set when messages that were still on the retry schedule have left
+// the queue, so that the schedule must be rebuilt before they are
+// swept away.
+static bool unscheduled = false;
+
+// Bounce the messages that have been in the queue for longer than its
+// lifetime, without another attempt to deliver them.  Returns the
+// number bounced.
+static unsigned expire_messages(time_t now)
+{
+  unsigned count = 0;
+  message* msg;
+  while ((msg = expiry.top()) != 0 && now - msg->timestamp > queuelifetime) {
+    expiry.pop();
+    if (msg->done || !expired(*msg))
+      continue;
+    // Another instance sending the message sees to it.
+    if (!claim_msg(*msg)) {
+      msg->busy = false;
+      continue;
+    }
+    flog << "Message " << msg->filename() << " has expired" << endl;
+    mystring failed;
+    const bool moved = fail_msg(*msg, failed);
+    release_claim(*msg);
+    if (!moved)
+      continue;
+    msg->done = true;
+    unscheduled = true;
+    ++count;
+    ++messages_expired;
+    generate_dsn(failed, mystring(), "5.4.7",
+		 "X-NULLMAILER; Message was queued for longer than "
+		 + mystring(itoa(queuelifetime)) + " seconds",
+		 0);
+  }
+  return count;
+}
+
+static bool read_envelope(const mystring& filename, mystring& sender,
+			  slist& recipients);
+
+// Check if a message is old enough for a delay notice and has not had
+// one.  Notices are not sent about notices or bounces.
+static bool delay_due(const message& msg)
+{
+  return delaynotify > 0 && !msg.warned
+    && time(0) - msg.timestamp >= delaynotify;
+}
+
+static void notify_delay(message& msg, const remote& remote,
+			 const mystring& output, const mystring& status)
+{
+  msg.warned = true;
+  journal_record(journal_warned(msg.filename()));
+  mystring sender;
+  slist recipients;
+  if (!read_envelope(msg.filename(), sender, recipients) || !sender)
+    return;
+  generate_dsn(msg.filename(), remote, output, status,
+	       msg.timestamp + queuelifetime);
+}
+
+// Dispose of a message after a delivery attempt, marking it done once
+// it has left the queue.
+// A deferred message is not read again until it is retried, so its
+// pages are let go.  Those of a delivered message go when it is
+// unlinked.
+static void uncache(const message& msg)
+{
+  autoclose fd = open(msg.name(), O_RDONLY);
+  if (fd >= 0)
+    fdbuf_drop_cache(fd);
+}
+
+static void finish_msg(message& msg, remote& remote,
+		       tristate result, const mystring& output,
+		       const mystring& status = mystring())
+{
+  if (msg.done || msg.busy)
+    return;
+  if (direct) {
+    direct_result = result;
+    msg.done = result != tempfail;
+    return;
+  }
+  switch (result) {
+  case tempfail:
+    if (expired(msg))
+      msg.done = bounce_msg(msg, remote, output, status);
+    else if (delay_due(msg))
+      notify_delay(msg, remote, output, status);
+    if (!msg.done)
+      uncache(msg);
+    break;
+  case permfail:
+    msg.done = bounce_msg(msg, remote, output, status);
+    break;
+  default:
+    if(unlink(msg.name()) == -1)
+      flog << "Can't unlink file: " << strerror(errno) << endl;
+    else {
+      unlink(envindex_path(msg.filename()).c_str());
+      journal_record(journal_delivered(msg.filename()));
+      msg.done = true;
+    }
+  }
+  if (msg.done)
+    trace_done(msg, result);
+  // A deferred message is claimed again when it is next tried.
+  release_claim(msg);
+}
+
+// Dispose of a message given the result reported by the protocol, which
+// may have been delivered to only some of its recipients.
+static void learn_rejected(const remote& remote, const proto_result& result);
+
+// The number of seconds a reply asks to wait, as in "retry in 60s" or
+// "try again in 5 minutes", or 0 if it gives none.
+static long reply_delay(const mystring& reply)
+{
+  const mystring text = reply.lower();
+  const char* const start = text.c_str();
+  for (const char* p = start; *p; ++p) {
+    if (!isdigit(*p) || (p > start && (isalnum(p[-1]) || p[-1] == '.')))
+      continue;
+    char* end;
+    const long n = strtol(p, &end, 10);
+    while (*end == ' ')
+      ++end;
+    const char* unit = end;
+    while (isalpha(*end))
+      ++end;
+    const mystring u(unit, end - unit);
+    if (u == "s" || u == "sec" || u == "secs" || u == "second"
+	|| u == "seconds")
+      return n;
+    if (u == "m" || u == "min" || u == "mins" || u == "minute"
+	|| u == "minutes")
+      return n * 60;
+    if (u == "h" || u == "hr" || u == "hrs" || u == "hour" || u == "hours")
+      return n * 3600;
+  }
+  return 0;
+}
+
+// Check if a temporary failure is the remote asking for mail to come
+// more slowly rather than a problem with the message: a 421 reply,
+// which closes the connection, the 4.7.28 status of a sender sending
+// too much, or a reply that says it is rate limiting.  Greylisting,
+// which is about the message, is not.
+static bool throttle_reply(const proto_result& reported)
+{
+  static const char* const markers[] = {
+    "rate limit", "ratelimit", "rate-limit", "throttl", "too many",
+    "too fast", "slow down", "too much mail", 0
+  };
+  if (reported.code != ERR_MSG_TEMPFAIL)
+    return false;
+  const mystring text = reported.reply.lower();
+  if (strstr(text.c_str(), "greylist") != 0)
+    return false;
+  if (strncmp(text.c_str(), "421", 3) == 0 || reported.status == "4.7.28")
+    return true;
+  for (int i = 0; markers[i]; i++)
+    if (strstr(text.c_str(), markers[i]) != 0)
+      return true;
+  return false;
+}
+
+static void finish_reported(message& msg, remote& remote, tristate result,
+			    const proto_result& reported)
+{
+  learn_rejected(remote, reported);
+  if (result == tempfail && !remote.down && !direct
+      && throttle_reply(reported))
+    remote.throttled(reply_delay(reported.reply));
+  if (result == success
+      && (reported.deferred.count() > 0 || reported.failed.count() > 0))
+    result = partial_msg(msg, remote, reported);
+  finish_msg(msg, remote, result, reported.reply, reported.status);
+}
+
+// The messages due to be tried in the current queue run.
+static duelist due;
+
+// Remove the messages that are done from the list.
+static void sweep_messages()
+{
+  for(msglist::iter msg(messages); msg; ) {
+    if ((*msg).done) {
+      release_claim(*msg);
+      delete (*msg).trace;
+      message_names.release((*msg).name_offset);
+      expiry.remove(&*msg);
+      messages.remove(msg);
+    }
+    else
+      msg++;
+  }
+  // Every message left is on the schedule, so the schedule can be
+  // rebuilt once the holes have been closed.
+  if (unscheduled || messages.holes() > messages.count()
+      || message_names.mostly_released())
+    schedule_all();
+  unscheduled = false;
+}
+
+static void sweep_due()
+{
+  for(duelist::iter msg(due); msg; ) {
+    if ((*msg)->done)
+      due.remove(msg);
+    else
+      msg++;
+  }
+}
+
+// Put a message that failed back on the schedule, doubling the time
+// until the next attempt from pausetime up to maxpause.
+static void reschedule(message& msg, time_t now)
+{
+  time_t delay = minpause;
+  for (unsigned i = 1; i < msg.attempts && delay < maxpause; i++)
+    delay *= 2;
+  if (delay > maxpause)
+    delay = maxpause;
+  msg.last_attempt = now;
+  msg.next_attempt = now + delay;
+  // A message due a delay notice is tried again when it comes due, so
+  // that the notice goes out on time and reports a fresh attempt.
+  if (delaynotify > 0 && !msg.warned) {
+    const time_t notify_at = msg.timestamp + delaynotify;
+    if (notify_at > now && notify_at < msg.next_attempt)
+      msg.next_attempt = notify_at;
+  }
+  sched.push(&msg);
+  journal_record(journal_attempt(msg.filename(), msg.attempts,
+				 msg.next_attempt));
+}
+
+static void finish_one(delivery& d, tristate result)
+{
+  remote& remote = *d.rem;
+  if (d.fromfd >= 0) {
+    ssize_t rd;
+    while ((rd = read_output(d.fromfd, d.output)) > 0)
+      ;
+    if (rd < 0)
+      flog << "Warning: Could not read output from protocol" << endl;
+    d.close_output();
+  }
+  delete d.fp;
+  --active_workers;
+  count_result(remote, result, d.started);
+  proto_result reported;
+  if (d.framed && read_results(d.output, reported) > 0) {
+    count_phases(remote, reported);
+    learn_caps(remote, reported);
+    adapt_window(remote, result, reported.phases);
+    finish_reported(*d.msg, remote, result, reported);
+  }
+  else {
+    adapt_window(remote, result, mystring());
+    finish_msg(*d.msg, remote, result, d.output);
+  }
+  d = delivery();
+}
+
+// Read the envelope of a message, from its index if it has one.
+static bool read_envelope(const mystring& filename, mystring& sender,
+			  slist& recipients)
+{
+  struct stat st;
+  envelope_index index;
+  if (stat(filename.c_str(), &st) == 0
+      && envindex_read(envindex_path(filename), st.st_size, index)) {
+    sender = index.sender;
+    for (slist::const_iter i(index.recipients); i; i++)
+      recipients.append(*i);
+    return true;
+  }
+  mmapibuf in(filename.c_str());
+  mystring line;
+  queuefile_skip(in);
+  if (!in.getline(line))
+    return false;
+  sender = line;
+  while (in.getline(line) && !!line)
+    recipients.append(line);
+  return true;
+}
+
+// Record a message that nullmailer-queue did not record in the journal.
+static bool journal_message(queue_journal& journal, const message& msg)
+{
+  struct stat st;
+  mystring sender;
+  slist recipients;
+  if (stat(msg.name(), &st) == -1
+      || !read_envelope(msg.filename(), sender, recipients))
+    return false;
+  journal_entry* e = journal.add(msg.filename());
+  e->queued = msg.timestamp;
+  e->size = st.st_size;
+  e->sender = sender;
+  for (slist::const_iter i(recipients); i; i++)
+    e->recipients.append(*i);
+  e->attempts = msg.attempts;
+  e->next_attempt = msg.next_attempt;
+  e->warned = msg.warned;
+  return true;
+}
+
+static void journal_message(const message& msg)
+{
+  queue_journal journal;
+  if (!journal_message(journal, msg))
+    return;
+  journal_entry* e = journal.find(msg.filename());
+  journal_record(journal_queued(e->path, e->queued, e->size, e->sender,
+				e->recipients));
+  if (e->warned)
+    journal_record(journal_warned(e->path));
+}
+
+// Bring the journal into line with the messages known to be in the
+// queue: the ones it is missing are added, and the ones that are not
+// known are dropped if they have left the queue and otherwise added to
+// the messages to be sent.
+static bool reconcile_journal(queue_journal& journal, bool, void*)
+{
+  for (journal_entry* e = journal.first(); e; e = e->next)
+    e->mark = false;
+  for(msglist::const_iter msg(messages); msg; msg++) {
+    if ((*msg).done)
+      continue;
+    journal_entry* e = journal.find((*msg).filename());
+    if (e) {
+      e->attempts = (*msg).attempts;
+      e->next_attempt = (*msg).next_attempt;
+      e->warned = (*msg).warned;
+    }
+    else if (!journal_message(journal, *msg))
+      continue;
+    journal.find((*msg).filename())->mark = true;
+  }
+  for (journal_entry* e = journal.first(); e; e = e->next) {
+    if (!e->live || e->mark)
+      continue;
+    if (access(e->path.c_str(), F_OK) == -1)
+      journal.remove(e->path);
+    else {
+      message msg(e->queued, e->path, false);
+      msg.attempts = e->attempts;
+      msg.next_attempt = e->next_attempt;
+      msg.warned = e->warned;
+      msg.size = e->size > UINT_MAX ? UINT_MAX : e->size;
+      messages.append(msg);
+      sched.push(&messages.last());
+      expiry.push(&messages.last());
+    }
+  }
+  return true;
+}
+
+static void compact_journal()
+{
+  if (!journal_compact(reconcile_journal, 0))
+    msg1sys("Could not write the queue journal: ");
+  journal_appended = 0;
+}
+
+// Take the messages from the journal at startup, instead of scanning
+// the queue, if there is a journal.
+static bool load_journal(queue_journal& journal, bool existed, void*)
+{
+  queue_scanned = true;
+  if (!existed) {
+    flog << "No queue journal, scanning the queue." << endl;
+    if (!load_messages())
+      return false;
+  }
+  else {
+    flog << "Loading " << itoa(journal.live())
+	 << " message(s) from the queue journal." << endl;
+    for (journal_entry* e = journal.first(); e; e = e->next) {
+      if (!e->live)
+	continue;
+      message msg(e->queued, e->path, false);
+      msg.attempts = e->attempts;
+      msg.next_attempt = e->next_attempt;
+      msg.warned = e->warned;
+      messages.append(msg);
+      sched.push(&messages.last());
+      expiry.push(&messages.last());
+    }
+    last_scan = time(0);
+  }
+  return reconcile_journal(journal, existed, 0);
+}
+
+// Find the group of remotes a recipient is routed to, or the empty
+// string for the default.
+static mystring recipient_group(const mystring& recipient)
+{
+  mystring group;
+  recipient_routes.find(recipient, group);
+  return group;
+}
+
+// The domain of a recipient, which addresses are split up by for
+// delivery to the mail exchangers of their domains.
+static mystring recipient_domain(const mystring& recipient)
+{
+  return recipient.right(recipient.find_last('@') + 1).lower();
+}
+
+// The recipient domains each remote has rejected as a whole, kept for
+// rejectcachetime seconds.  The recipients in them are bounced in that
+// time with the reply the remote gave, without connecting to it again.
+struct rejected_domain
+{
+  mystring domain;
+  mystring host;
+  mystring status;
+  mystring reply;
+  time_t expires;
+};
+
+#define REJECT_BUCKETS 256
+
+static list<rejected_domain> rejected_domains[REJECT_BUCKETS];
+static unsigned rejected_count = 0;
+
+static list<rejected_domain>& reject_bucket(const mystring& domain)
+{
+  return rejected_domains[configdb_hash(domain.c_str(), domain.length())
+			  % REJECT_BUCKETS];
+}
+
+static rejected_domain* find_rejected(const mystring& domain,
+				      const remote& remote, time_t now)
+{
+  list<rejected_domain>& bucket = reject_bucket(domain);
+  for (list<rejected_domain>::iter d(bucket); d; ) {
+    if ((*d).expires <= now) {
+      bucket.remove(d);
+      --rejected_count;
+      continue;
+    }
+    if ((*d).domain == domain && (*d).host == remote.host)
+      return &*d;
+    d++;
+  }
+  return 0;
+}
+
+// Remember the domains the remote rejected in a delivery.
+static void learn_rejected(const remote& remote, const proto_result& result)
+{
+  if (rejectcachetime <= 0 || direct)
+    return;
+  const time_t now = time(0);
+  slist::const_iter status(result.gone_status);
+  slist::const_iter reply(result.gone_reply);
+  for (slist::const_iter r(result.gone); r; r++, status++, reply++) {
+    const mystring domain = recipient_domain(*r);
+    rejected_domain* d = find_rejected(domain, remote, now);
+    if (d == 0) {
+      rejected_domain fresh;
+      fresh.domain = domain;
+      fresh.host = remote.host;
+      reject_bucket(domain).append(fresh);
+      ++rejected_count;
+      d = &reject_bucket(domain).last();
+      flog << "Bouncing mail to " << domain << " without sending it to "
+	   << remote.host << " for " << itoa(rejectcachetime)
+	   << " seconds." << endl;
+    }
+    d->status = *status;
+    d->reply = *reply;
+    d->expires = now + rejectcachetime;
+  }
+}
+
+// Bounce the recipients of a message in the domains the remote has
+// rejected lately, before it is sent.  Returns true if that leaves
+// nothing to send, and otherwise the message holds the rest of its
+// recipients.
+static bool bounce_rejected(message& msg, remote& remote)
+{
+  if (rejected_count == 0 || direct)
+    return false;
+  mystring sender;
+  slist recipients;
+  if (!read_envelope(msg.filename(), sender, recipients))
+    return false;
+  const time_t now = time(0);
+  proto_result local;
+  for (slist::const_iter r(recipients); r; r++) {
+    const rejected_domain* d = find_rejected(recipient_domain(*r), remote, now);
+    if (d == 0)
+      local.deferred.append(*r);
+    else {
+      if (local.failed.count() == 0) {
+	local.failed_status = d->status;
+	local.failed_reply = d->reply;
+      }
+      local.failed.append(*r);
+    }
+  }
+  if (local.failed.count() == 0 || !claim_msg(msg) || msg.busy)
+    return false;
+  flog << "Not sending " << itoa(local.failed.count()) << " recipient(s) of "
+       << msg.filename() << " to " << remote.host
+       << ", their domain was rejected." << endl;
+  forget_ahead(msg);
+  trace_attempt(msg);
+  if (local.deferred.count() == 0) {
+    finish_msg(msg, remote, permfail, local.failed_reply,
+	       local.failed_status);
+    return true;
+  }
+  partial_msg(msg, remote, local);
+  release_claim(msg);
+  return false;
+}
+
+// The size of the message in a queue file after its envelope, as the
+// protocols declare it: from the header line of the versioned format,
+// which gives the size of a compressed body once it is inflated, or
+// else from the size of the file.
+static bool data_size(const mystring& filename, unsigned long& size)
+{
+  autoclose fd = open(filename.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) == -1)
+    return false;
+  mmapibuf in(fd);
+  queuefile_header layout;
+  if (queuefile_read(in, layout)) {
+    size = layout.header_length + layout.body_size;
+    return true;
+  }
+  const char* line;
+  unsigned len;
+  unsigned long offset = 0;
+  while (in.getline(line, len)) {
+    offset += len + 1;
+    if (len == 0)
+      break;
+  }
+  size = (unsigned long)st.st_size > offset ? st.st_size - offset : 0;
+  return true;
+}
+
+// The SIZE limit a remote announced when it was last seen, or 0 if it
+// gave none or that was too long ago.
+static unsigned long size_limit(const remote& r)
+{
+  if (!r.caps || time(0) - r.caps_seen >= CAPS_LIFETIME)
+    return 0;
+  const char* at = strstr(r.caps.c_str(), " SIZE=");
+  return at == 0 ? 0 : strtoul(at + 6, 0, 10);
+}
+
+// Leave a message that is larger than the remote will take, as it was
+// last seen, to the next remote in its group that might take it, or
+// bounce it if there is none, rather than sending it only to have it
+// refused.
+static bool skip_oversized(message& msg, remote& remote)
+{
+  const unsigned long limit = size_limit(remote);
+  unsigned long size;
+  if (limit == 0 || direct || !data_size(msg.filename(), size)
+      || size <= limit)
+    return false;
+  bool later = false;
+  for (rlist::const_iter r(remotes); r; r++) {
+    if (&*r == &remote)
+      later = true;
+    else if (later && routed_to(msg, *r) && !(*r).mxhost) {
+      const unsigned long other = size_limit(*r);
+      if (other == 0 || size <= other) {
+	flog << "Not sending " << msg.filename() << " to " << remote.host
+	     << ", it is larger than its size limit." << endl;
+	return true;
+      }
+    }
+  }
+  if (!claim_msg(msg) || msg.busy)
+    return true;
+  flog << "Bouncing " << msg.filename() << ", it is larger than the size"
+       " limit of " << remote.host << "." << endl;
+  forget_ahead(msg);
+  trace_attempt(msg);
+  finish_msg(msg, remote, permfail,
+	     "Message is larger than the remote's size limit", "5.3.4");
+  return true;
+}
+
+// Give the recipients in each part but the first their own copy of the
+// message, and rewrite the message to hold only the recipients in the
+// first part.  The part of each recipient is given by part_of: either
+// its group, which the copies are then routed to, or its domain.  The
+// copies are added to the queue and to the messages due.  Returns
+// false, leaving the message as it was, if the copies cannot be made.
+static bool split_claimed(message& msg, const slist& recipients,
+			  const slist& groups,
+			  mystring (*part_of)(const mystring&), bool route)
+{
+  const mystring tmp = "../tmp/" + queuedir_name(msg.filename());
+  unsigned n = 0;
+  slist names;
+  slist::const_iter group(groups);
+  for (group++; group; group++) {
+    slist part;
+    for (slist::const_iter r(recipients); r; r++)
+      if (part_of(*r) == *group)
+	part.append(*r);
+    if (!copy_msg(msg.filename(), tmp, part))
+      break;
+    mystring name;
+    do {
+      mystring base = queuedir_name(msg.filename()) + "." + itoa(++n);
+      name = queuedir_path(base, queuedirs);
+      if (queuedirs > 0)
+	mkdir(queuedir_of(base, queuedirs).c_str(), 0700);
+    } while (link(tmp.c_str(), name.c_str()) == -1 && errno == EEXIST);
+    unlink(tmp.c_str());
+    if (access(name.c_str(), F_OK) == -1)
+      break;
+    names.append(name);
+    own_file(name);
+  }
+  slist first;
+  for (slist::const_iter r(recipients); r; r++)
+    if (part_of(*r) == *slist::const_iter(groups))
+      first.append(*r);
+  if (names.count() + 1 < groups.count()
+      || !copy_msg(msg.filename(), tmp, first)
+      || rename(tmp.c_str(), msg.name()) == -1) {
+    flog << "Can't split message " << msg.filename() << ": "
+	 << strerror(errno) << endl;
+    unlink(tmp.c_str());
+    for (slist::const_iter i(names); i; i++)
+      unlink((*i).c_str());
+    return false;
+  }
+  own_file(msg.name());
+  unlink(envindex_path(msg.filename()).c_str());
+  journal_record(journal_recipients(msg.filename(), first));
+  msg.keyed = false;
+  slist::const_iter g(groups);
+  g++;
+  for (slist::const_iter i(names); i; i++, g++) {
+    flog << (route ? "Routing recipients of " : "Splitting recipients of ")
+	 << msg.filename() << " to " << *g << " in " << *i << endl;
+    message split(msg.timestamp, *i, msg.stated);
+    split.group = route ? message_groups.intern(*g) : msg.group;
+    split.warned = msg.warned;
+    if (msg.trace)
+      split.trace = new message_trace(*msg.trace);
+    split.routed = route_generation;
+    messages.append(split);
+    due.append(&messages.last());
+    expiry.push(&messages.last());
+    journal_message(split);
+  }
+  return true;
+}
+
+static bool split_msg(message& msg, const slist& recipients,
+		      const slist& groups,
+		      mystring (*part_of)(const mystring&), bool route)
+{
+  // Only the instance that holds the message may split it.  It is
+  // routed again once it is free.
+  if (!claim_msg(msg)) {
+    msg.routed = 0;
+    return false;
+  }
+  const bool split = split_claimed(msg, recipients, groups, part_of, route);
+  release_claim(msg);
+  return split;
+}
+
+// Find the group of remotes a message is routed to.  The size routes
+// come first, then the sender routes, then the recipient routes.  A message whose recipients
+// are routed to different groups is split into one message for each.
+static void route_msg(message& msg)
+{
+  msg.group = 0;
+  msg.routed = route_generation;
+  if (sender_routes.count() == 0 && recipient_routes.count() == 0
+      && size_routes.count() == 0)
+    return;
+  unsigned long size;
+  if (size_routes.count() > 0 && data_size(msg.filename(), size))
+    for (list<size_route>::const_iter r(size_routes); r; r++)
+      if (size > (*r).size) {
+	msg.group = message_groups.intern((*r).group);
+	return;
+      }
+  if (sender_routes.count() == 0 && recipient_routes.count() == 0)
+    return;
+  mystring sender;
+  slist recipients;
+  if (!read_envelope(msg.filename(), sender, recipients))
+    return;
+  mystring sender_group;
+  if (sender_routes.find(sender, sender_group)) {
+    msg.group = message_groups.intern(sender_group);
+    return;
+  }
+  slist groups;
+  for (slist::const_iter r(recipients); r; r++) {
+    mystring group = recipient_group(*r);
+    bool found = false;
+    for (slist::const_iter g(groups); g && !found; g++)
+      found = *g == group;
+    if (!found)
+      groups.append(group);
+  }
+  if (groups.count() > 0)
+    msg.group = message_groups.intern(*slist::const_iter(groups));
+  if (groups.count() > 1)
+    split_msg(msg, recipients, groups, recipient_group, true);
+}
+
+static void route_due()
+{
+  for(duelist::iter msg(due); msg; msg++)
+    if ((*msg)->routed != route_generation)
+      route_msg(**msg);
+}
+
+// Fill in the sort key of a message.
+static void key_msg(message& msg)
+{
+  msg.keyed = true;
+  struct stat st;
+  msg.size = stat(msg.name(), &st) == -1 ? 0
+    : st.st_size > UINT_MAX ? UINT_MAX : st.st_size;
+  msg.domain = 0;
+  mystring sender;
+  slist recipients;
+  if (!read_envelope(msg.filename(), sender, recipients)
+      || recipients.count() == 0)
+    return;
+  const mystring& first = *slist::const_iter(recipients);
+  int at = first.find_last('@');
+  unsigned h = 5381;
+  for (const char* p = first.c_str() + at + 1; *p; ++p)
+    h = ((h << 5) + h) ^ (unsigned char)tolower(*p);
+  msg.domain = h;
+}
+
+// The messages due with the size of the smallest message to the same
+// domain, which the domains are ordered by.
+struct due_entry
+{
+  message* msg;
+  unsigned smallest;
+};
+
+static int by_domain(const void* a, const void* b)
+{
+  const message* ma = ((const due_entry*)a)->msg;
+  const message* mb = ((const due_entry*)b)->msg;
+  if (ma->domain != mb->domain)
+    return ma->domain < mb->domain ? -1 : 1;
+  if (ma->size != mb->size)
+    return ma->size < mb->size ? -1 : 1;
+  return ma->timestamp < mb->timestamp ? -1 : ma->timestamp > mb->timestamp;
+}
+
+static int by_smallest(const void* a, const void* b)
+{
+  const due_entry* ea = (const due_entry*)a;
+  const due_entry* eb = (const due_entry*)b;
+  if (ea->smallest != eb->smallest)
+    return ea->smallest < eb->smallest ? -1 : 1;
+  return by_domain(a, b);
+}
+
+// Put the messages due in the order set by sortqueue: the messages to
+// each recipient domain together, so that a session to the remote can
+// send them in one run, smallest first, with the domains in order of
+// their smallest message.
+static void sort_due()
+{
+  if (!sortqueue || due.count() < 2)
+    return;
+  const unsigned count = due.count();
+  due_entry* entries = new due_entry[count];
+  unsigned n = 0;
+  for(duelist::iter msg(due); msg; msg++) {
+    if (!(*msg)->keyed)
+      key_msg(**msg);
+    entries[n++].msg = *msg;
+  }
+  qsort(entries, n, sizeof *entries, by_domain);
+  for (unsigned i = 0; i < n; i++)
+    entries[i].smallest =
+      i > 0 && entries[i].msg->domain == entries[i-1].msg->domain
+      ? entries[i-1].smallest : entries[i].msg->size;
+  qsort(entries, n, sizeof *entries, by_smallest);
+  due.empty();
+  for (unsigned i = 0; i < n; i++)
+    due.append(entries[i].msg);
+  delete[] entries;
+}
+
+// Messages that are the same but for their recipients, as from a
+// program that injects a message once for each of its recipients, are
+// merged into one with all of their recipients when mergerecipients is
+// set, so that it is sent once.  Only messages that have not been tried
+// yet are merged, and only with others from the same sender, routed to
+// the same remotes and with the same priority.  Their contents are
+// compared by a digest of the message, leaving out the header fields
+// that differ each time a message is injected: Received, Message-Id
+// and Date.  The merged message keeps those of the oldest one.
+// The most messages looked through for ones to merge in a queue run.
+#define MERGE_SCAN 1024
+
+struct merge_candidate
+{
+  message* msg;
+  mystring sender;
+  slist recipients;
+  uint64_t digest;
+  bool digested;
+  bool merged;
+};
+
+static bool merge_skipped(const mystring& line)
+{
+  mystringview view(line);
+  return view.starts_with_nocase("received:")
+    || view.starts_with_nocase("message-id:")
+    || view.starts_with_nocase("date:");
+}
+
+static uint64_t fnv_add(uint64_t h, const char* data, unsigned len)
+{
+  for (unsigned i = 0; i < len; i++) {
+    h ^= (unsigned char)data[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// The digest of the message in a queue file after its envelope, with
+// the body inflated if it was compressed, or 0 if it cannot be read.
+static uint64_t merge_digest(const mystring& filename)
+{
+  mmapibuf file(filename.c_str());
+  queuefile_header layout;
+  queuefile_read(file, layout);
+  mystring line;
+  while (file.getline(line) && !!line)
+    ;
+  if (!file)
+    return 0;
+  queuefile_data data(file, layout);
+  fdibuf& in = data.in();
+  uint64_t h = 14695981039346656037ULL;
+  bool skipping = false;
+  while (in.getline(line)) {
+    const bool blank = !line || line == "\r";
+    // A continuation line goes with the field it continues.
+    if (blank || (line[0] != ' ' && line[0] != '\t'))
+      skipping = !blank && merge_skipped(line);
+    if (!skipping)
+      h = fnv_add(h, line.c_str(), line.length() + 1);
+    if (blank)
+      break;
+  }
+  char buf[4096];
+  while (in.read(buf, sizeof buf) || in.last_count() > 0)
+    h = fnv_add(h, buf, in.last_count());
+  return h ? h : 1;
+}
+
+static int by_merge_key(const void* a, const void* b)
+{
+  const merge_candidate* ca = *(const merge_candidate* const*)a;
+  const merge_candidate* cb = *(const merge_candidate* const*)b;
+  if (ca->msg->group != cb->msg->group)
+    return ca->msg->group < cb->msg->group ? -1 : 1;
+  if (ca->msg->priority != cb->msg->priority)
+    return ca->msg->priority < cb->msg->priority ? -1 : 1;
+  const int c = strcmp(ca->sender.c_str(), cb->sender.c_str());
+  if (c != 0)
+    return c;
+  return ca->msg->timestamp < cb->msg->timestamp ? -1
+    : ca->msg->timestamp > cb->msg->timestamp;
+}
+
+static bool same_merge_key(const merge_candidate& a, const merge_candidate& b)
+{
+  return a.msg->group == b.msg->group && a.msg->priority == b.msg->priority
+    && a.sender == b.sender;
+}
+
+static bool digest_of(merge_candidate& c)
+{
+  if (!c.digested) {
+    c.digested = true;
+    c.digest = merge_digest(c.msg->filename());
+  }
+  return c.digest != 0;
+}
+
+static void add_recipients(slist& all, const slist& more)
+{
+  for (slist::const_iter i(more); i; i++) {
+    bool have = false;
+    for (slist::const_iter j(all); j && !have; j++)
+      have = *i == *j;
+    if (!have)
+      all.append(*i);
+  }
+}
+
+// Rewrite the first of the messages to hold the recipients of all of
+// them, and then remove the others.  The merged message is in place
+// before any of the others go, so a crash in between can only have
+// some recipients sent the message twice.
+static void merge_claimed(merge_candidate* group[], unsigned claimed)
+{
+  message& first = *group[0]->msg;
+  slist all = group[0]->recipients;
+  for (unsigned i = 1; i < claimed; i++)
+    add_recipients(all, group[i]->recipients);
+  const mystring tmp = "../tmp/" + queuedir_name(first.filename());
+  if (!copy_msg(first.filename(), tmp, all)
+      || rename(tmp.c_str(), first.name()) == -1) {
+    flog << "Can't merge into " << first.filename() << ": "
+	 << strerror(errno) << endl;
+    unlink(tmp.c_str());
+    return;
+  }
+  own_file(first.name());
+  unlink(envindex_path(first.filename()).c_str());
+  journal_record(journal_recipients(first.filename(), all));
+  first.keyed = false;
+  for (unsigned i = 1; i < claimed; i++) {
+    message& msg = *group[i]->msg;
+    if (unlink(msg.name()) == -1 && errno != ENOENT) {
+      flog << "Can't unlink merged file " << msg.filename() << ": "
+	   << strerror(errno) << endl;
+      continue;
+    }
+    unlink(envindex_path(msg.filename()).c_str());
+    journal_record(journal_delivered(msg.filename()));
+    msg.done = true;
+  }
+  flog << "Merged " << itoa(claimed - 1) << " message(s) into "
+       << first.filename() << ", " << itoa(all.count())
+       << " recipient(s)." << endl;
+}
+
+// Merge those of the messages that this instance can claim, holding
+// the claims only while they are rewritten.
+static void merge_msgs(merge_candidate* group[], unsigned n)
+{
+  message& first = *group[0]->msg;
+  if (!claim_msg(first) || first.busy)
+    return;
+  unsigned claimed = 1;
+  for (unsigned i = 1; i < n; i++)
+    if (claim_msg(*group[i]->msg) && !group[i]->msg->busy)
+      group[claimed++] = group[i];
+  if (claimed >= 2)
+    merge_claimed(group, claimed);
+  for (unsigned i = 0; i < claimed; i++)
+    release_claim(*group[i]->msg);
+}
+
+static void merge_due()
+{
+  if (mergerecipients <= 0 || direct || fastlane || due.count() < 2)
+    return;
+  merge_candidate* found = new merge_candidate[MERGE_SCAN];
+  merge_candidate** order = new merge_candidate*[MERGE_SCAN];
+  unsigned n = 0;
+  for (duelist::iter msg(due); msg && n < MERGE_SCAN; msg++) {
+    message& m = **msg;
+    if (m.done || m.busy || m.attempts > 0)
+      continue;
+    merge_candidate& c = found[n];
+    c.recipients.empty();
+    if (!read_envelope(m.filename(), c.sender, c.recipients)
+	|| c.recipients.count() >= (unsigned)mergerecipients)
+      continue;
+    c.msg = &m;
+    c.digested = c.merged = false;
+    order[n] = &c;
+    ++n;
+  }
+  qsort(order, n, sizeof *order, by_merge_key);
+  merge_candidate** group = new merge_candidate*[n > 0 ? n : 1];
+  for (unsigned start = 0; start < n; ) {
+    unsigned end = start + 1;
+    while (end < n && same_merge_key(*order[start], *order[end]))
+      ++end;
+    for (unsigned i = start; end - start > 1 && i < end; i++) {
+      merge_candidate& lead = *order[i];
+      if (lead.merged || !digest_of(lead))
+	continue;
+      unsigned count = lead.recipients.count();
+      unsigned members = 0;
+      group[members++] = &lead;
+      for (unsigned j = i + 1; j < end; j++) {
+	merge_candidate& other = *order[j];
+	if (other.merged
+	    || count + other.recipients.count() > (unsigned)mergerecipients
+	    || !digest_of(other) || other.digest != lead.digest)
+	  continue;
+	other.merged = true;
+	count += other.recipients.count();
+	group[members++] = &other;
+      }
+      if (members > 1)
+	merge_msgs(group, members);
+    }
+    start = end;
+  }
+  delete[] group;
+  delete[] order;
+  delete[] found;
+  sweep_due();
+}
+
+// Find the priority class of a message: the class of the first priority
+// rule to match its sender, or else the class its header gave it.
+static void prioritize_msg(message& msg)
+{
+  msg.prioritized = priority_generation;
+  msg.priority = PRIORITY_NORMAL;
+  mystring sender;
+  int priority = -1;
+  struct stat st;
+  envelope_index index;
+  if (stat(msg.name(), &st) == 0
+      && envindex_read(envindex_path(msg.filename()), st.st_size, index)) {
+    sender = index.sender;
+    priority = index.priority;
+  }
+  else {
+    mmapibuf in(msg.name());
+    mystring line;
+    queuefile_skip(in);
+    if (!in.getline(line))
+      return;
+    sender = line;
+    while (in.getline(line) && !!line)
+      ;
+    while (in.getline(line) && !!line && line != "\r") {
+      int p = priority_header(line);
+      if (p >= 0)
+	priority = p;
+    }
+  }
+  mystring name;
+  if (priority_rules.find(sender, name))
+    priority = priority_parse(name);
+  if (priority >= 0)
+    msg.priority = priority;
+}
+
+// The share of the deliveries each class gets while messages of more
+// than one class are due.
+static const int priority_weights[PRIORITY_CLASSES] = { 4, 2, 1 };
+
+// Interleave the messages due by priority class, by smooth weighted
+// round-robin among the classes with messages left, so that urgent
+// messages go first without holding up the others for long.  Within
+// each class the messages keep the order they had.
+static void prioritize_due()
+{
+  if (due.count() < 2)
+    return;
+  unsigned counts[PRIORITY_CLASSES] = { 0 };
+  for(duelist::iter msg(due); msg; msg++) {
+    if ((*msg)->prioritized != priority_generation)
+      prioritize_msg(**msg);
+    ++counts[(*msg)->priority];
+  }
+  int classes = 0;
+  for (int c = 0; c < PRIORITY_CLASSES; c++)
+    classes += counts[c] > 0;
+  if (classes < 2)
+    return;
+  const unsigned count = due.count();
+  message** lists[PRIORITY_CLASSES];
+  unsigned next[PRIORITY_CLASSES];
+  int current[PRIORITY_CLASSES];
+  for (int c = 0; c < PRIORITY_CLASSES; c++) {
+    lists[c] = new message*[counts[c]];
+    next[c] = 0;
+    current[c] = 0;
+  }
+  for(duelist::iter msg(due); msg; msg++)
+    lists[(*msg)->priority][next[(*msg)->priority]++] = *msg;
+  due.empty();
+  for (int c = 0; c < PRIORITY_CLASSES; c++)
+    next[c] = 0;
+  for (unsigned n = 0; n < count; n++) {
+    int total = 0;
+    int best = -1;
+    for (int c = 0; c < PRIORITY_CLASSES; c++) {
+      if (next[c] == counts[c])
+	continue;
+      current[c] += priority_weights[c];
+      total += priority_weights[c];
+      if (best < 0 || current[c] > current[best])
+	best = c;
+    }
+    current[best] -= total;
+    due.append(lists[best][next[best]++]);
+  }
+  for (int c = 0; c < PRIORITY_CLASSES; c++)
+    delete[] lists[c];
+}
+
+// Check if a message is to be sent to a remote.
+static bool routed_to(const message& msg, const remote& remote)
+{
+  if (msg.busy || msg.spilled == &remote || (remote.mxhost && !msg.picked))
+    return false;
+  if (msg.group != 0 || have_default_group)
+    return msg.group_name() == remote.group;
+  return true;
+}
+
+// When a message that was not tried may be, if every remote it could
+// go to is in a deferral window after throttling, or else 0.
+static time_t throttle_release(const message& msg, time_t now)
+{
+  time_t until = 0;
+  for(rlist::const_iter r(remotes); r; r++) {
+    if ((*r).mxhost || !routed_to(msg, *r))
+      continue;
+    if ((*r).mx || (*r).throttled_until <= now)
+      return 0;
+    if (until == 0 || (*r).throttled_until < until)
+      until = (*r).throttled_until;
+  }
+  return until;
+}
+
+// Leave the due messages beyond the spillover threshold of a remote
+// to the next remote in its group that is up, if there is one.  The
+// first messages, in the order they are sent, stay with the remote.
+static void spill_over(const remote& remote)
+{
+  unsigned limit = remote.spillover;
+  if (remote.spillwait > 0 && remote.delivery_ms > 0) {
+    const long long fits = remote.spillwait * 1000LL * concurrency(remote)
+      / remote.delivery_ms;
+    const unsigned wait = fits < 1 ? 1 : fits > UINT_MAX ? UINT_MAX : fits;
+    if (limit == 0 || wait < limit)
+      limit = wait;
+  }
+  if (limit == 0)
+    return;
+  const struct remote* next = 0;
+  bool later = false;
+  for (rlist::const_iter r(remotes); r && !next; r++) {
+    if (&*r == &remote)
+      later = true;
+    else if (later && !(*r).down && !(*r).mxhost
+	     && (*r).group == remote.group)
+      next = &*r;
+  }
+  if (!next)
+    return;
+  unsigned kept = 0;
+  unsigned spilled = 0;
+  for (duelist::iter msg(due); msg; msg++)
+    if (routed_to(**msg, remote) && ++kept > limit) {
+      (*msg)->spilled = &remote;
+      ++spilled;
+    }
+  if (spilled > 0)
+    flog << "Spilling " << itoa(spilled) << " message(s) over from "
+	 << remote.host << " to " << next->host << ", its backlog is over "
+	 << itoa(limit) << "." << endl;
+}
+
+static bool have_due(const remote& remote)
+{
+  for(duelist::const_iter msg(due); msg; msg++)
+    if (routed_to(**msg, remote))
+      return true;
+  return false;
+}
+
+// Open the next message to deliver and log it, skipping over (and
+// disposing of) any that cannot be opened and any that are routed
+// elsewhere, and waiting first if the remote is paced.
+static int open_msg(duelist::iter& msg, remote& remote)
+{
+  for (; msg && !routed_to(**msg, remote); msg++)
+    ;
+  while (msg) {
+    if (skip_oversized(**msg, remote) || bounce_rejected(**msg, remote)) {
+      for (msg++; msg && !routed_to(**msg, remote); msg++)
+	;
+      continue;
+    }
+    pace_wait(remote);
+    mystring text;
+    bool described;
+    int fd = open_queued(**msg, text, described);
+    if (fd >= 0 && !claim_fd(**msg, fd)) {
+      close(fd);
+      for (msg++; msg && !routed_to(**msg, remote); msg++)
+	;
+      continue;
+    }
+    if (fd >= 0) {
+      (*msg)->attempted = true;
+      trace_attempt(**msg);
+      log_msg((*msg)->filename(), remote, fd, described ? &text : 0);
+      pace_take(remote, fd);
+      read_ahead(msg, remote);
+      return fd;
+    }
+    flog << "Can't open file '" << (*msg)->filename() << "'" << endl;
+    if (!vanished(**msg))
+      finish_msg(**msg, remote, tempfail, "");
+    for (msg++; msg && !routed_to(**msg, remote); msg++)
+      ;
+  }
+  return -1;
+}
+
+static void send_multi(remote& remote)
+{
+  duelist::iter msg(due);
+  autoclose fd;
+  while (!remote.down && !reload_wanted
+	 && (fd = open_msg(msg, remote)) >= 0) {
+    multi_session* warm = remote.multi ? take_warm(remote) : 0;
+    multi_session& session = warm ? *warm : *new multi_session(remote);
+    mystring output;
+    long long started = clock_ms();
+    if (warm) {
+      if (!session.next((*msg)->filename(), fd)) {
+	session.finish(output);
+	delete &session;
+	continue;
+      }
+    }
+    else if (!session.start(remote, (*msg)->filename(), fd)) {
+      delete &session;
+      finish_msg(**msg, remote, tempfail, output);
+      msg++;
+      continue;
+    }
+    long long deadline = send_deadline(fd);
+    fd.close();
+    ++active_workers;
+    bool idle = false;
+    // The first message in a session always gets a result, either from
+    // the protocol output or its exit status.  Later messages that
+    // were not answered before the protocol exited are retried in a
+    // new session.
+    for (bool first = true; ; first = false) {
+      proto_result result;
+      int r = session.result(result, deadline);
+      if (r < 0) {
+	session.finish(output);
+	if (r == -2)
+	  deadline_hit(remote);
+	count_result(remote, tempfail, started);
+	finish_msg(**msg, remote, tempfail, output);
+	msg++;
+	break;
+      }
+      if (r == 0) {
+	if (first) {
+	  int status = session.finish(output);
+	  if (status >= 0 && WIFEXITED(status))
+	    update_health(remote, WEXITSTATUS(status));
+	  const tristate result = status_result(status);
+	  count_result(remote, result, started);
+	  finish_msg(**msg, remote, result, output);
+	  msg++;
+	}
+	break;
+      }
+      update_health(remote, result.code);
+      const tristate outcome = exit_result(result.code);
+      count_result(remote, outcome, started);
+      count_phases(remote, result);
+      learn_caps(remote, result);
+      finish_reported(**msg, remote, outcome, result);
+      msg++;
+      write_metrics(false);
+      write_usage(false);
+      if (remote.down)
+	break;
+      if (reload_wanted || (fd = open_msg(msg, remote)) < 0) {
+	idle = true;
+	break;
+      }
+      deadline = send_deadline(fd);
+      started = clock_ms();
+      const bool sent = session.next((*msg)->filename(), fd);
+      fd.close();
+      if (!sent)
+	break;
+    }
+    --active_workers;
+    if (idle && remote.warm > 0)
+      keep_warm(remote, &session);
+    else {
+      session.finish(output);
+      delete &session;
+    }
+  }
+}
+
+// Set up a warm session to each remote that is to have one, ahead of
+// the messages for it.
+static void warm_up()
+{
+  time_t now = time(0);
+  for (rlist::iter r(remotes); r; r++) {
+    if ((*r).warm <= 0 || !(*r).multi || (*r).mx || (*r).down_until > now)
+      continue;
+    bool have = false;
+    for (list<warm_session>::const_iter w(warm_sessions); w && !have; w++)
+      have = (*w).program == (*r).program && (*w).options == (*r).options;
+    if (have)
+      continue;
+    resolve_remote(*r);
+    multi_session* session = new multi_session(*r);
+    if (!session->start(*r, mystring(), REDIRECT_NULL)) {
+      delete session;
+      continue;
+    }
+    flog << "Warming up a session to " << (*r).host << endl;
+    keep_warm(*r, session);
+  }
+}
+
+// Wait for at least one running delivery to complete or time out,
+// or for at most limit milliseconds if that is positive, and dispose
+// of the messages of those that did.  Returns the number of
+// deliveries that were finished.
+static unsigned reap_workers(delivery workers[], int count, int limit = 0)
+{
+  int timeout = limit > 0 ? limit : -1;
+  for (int i = 0; i < count; i++)
+    if (workers[i].fp && workers[i].deadline) {
+      int left = time_left(workers[i].deadline);
+      if (timeout < 0 || left < timeout)
+	timeout = left;
+    }
+  int max = count + 4;
+  int* ready = new int[max];
+  int others;
+  if (wait_events(timeout, ready, max, others) < 0)
+    msg1sys("Error waiting for the protocols: ");
+  for (int r = 0; r < others; r++)
+    for (int i = 0; i < count; i++)
+      if (workers[i].fp && workers[i].fromfd == ready[r]) {
+	if (read_output(ready[r], workers[i].output) <= 0)
+	  workers[i].close_output();
+	break;
+      }
+  delete[] ready;
+
+  unsigned finished = 0;
+  long long now = clock_ms();
+  for (int i = 0; i < count; i++) {
+    delivery& d = workers[i];
+    if (!d.fp)
+      continue;
+    tristate result;
+    int status;
+    if (d.fp->poll_status(status)) {
+      if (count > 1)
+	flog << "Finished delivery: file: " << d.msg->filename() << endl;
+      if (status >= 0 && WIFEXITED(status))
+	update_health(*d.rem, WEXITSTATUS(status));
+      result = status_result(status);
+    }
+    else if (d.deadline && now >= d.deadline) {
+      flog << "Sending timed out, killing protocol";
+      if (count > 1)
+	flog << " for file: " << d.msg->filename();
+      flog << endl;
+      d.fp->kill(SIGTERM);
+      d.fp->wait_status();
+      result = tempfail;
+      deadline_hit(*d.rem);
+    }
+    else
+      continue;
+    finish_one(d, result);
+    ++finished;
+  }
+  if (finished > 0) {
+    write_metrics(false);
+    write_usage(false);
+  }
+  return finished;
+}
+
+// Take the urgent messages routed to the remote that have arrived
+// since the queue run started into the run, and onto the list of those
+// to send first, so that they need not wait for the run to end.  The
+// others are left on the schedule.
+static void take_urgent(const remote& remote, duelist& first)
+{
+  const time_t now = time(0);
+  duelist later;
+  while (sched.top() && sched.top()->next_attempt <= now) {
+    message* msg = sched.pop();
+    if (msg->routed != route_generation)
+      route_msg(*msg);
+    if (msg->prioritized != priority_generation)
+      prioritize_msg(*msg);
+    if (msg->priority == PRIORITY_URGENT && routed_to(*msg, remote)) {
+      msg->tried = 0;
+      due.append(msg);
+      first.append(msg);
+    }
+    else
+      later.append(msg);
+  }
+  for(duelist::iter msg(later); msg; msg++)
+    sched.push(*msg);
+}
+
+// Move the cursor to the next message for the remote that has not been
+// started yet, and if urgent is set, that is urgent.
+static bool next_single(duelist::iter& msg, const remote& remote,
+			bool urgent)
+{
+  for (; msg; msg++)
+    if (!(*msg)->tried && routed_to(**msg, remote)
+	&& (!urgent || (*msg)->priority == PRIORITY_URGENT))
+      return true;
+  return false;
+}
+
+// Deliver each message with its own protocol process, running up to
+// maxconcurrency (or the remote's lower cap, or its window) at once.
+// Up to urgentslots of those are kept for urgent messages, and urgent
+// messages that arrive meanwhile go ahead of the rest.
+static void send_single(remote& remote)
+{
+  const int count = max_concurrency(remote);
+  delivery* workers = new delivery[count];
+  int active = 0;
+  for(duelist::iter msg(due); msg; msg++)
+    (*msg)->tried = 0;
+  duelist::iter msg(due);
+  duelist::iter urgent(due);
+  duelist arrived;
+  duelist::iter fresh(arrived);
+  unsigned seen = arrivals;
+  for (;;) {
+    int pace = 0;
+    for (int i = 0;
+	 active < concurrency(remote) && !remote.down && !reload_wanted; ) {
+      const int limit = concurrency(remote);
+      const int reserved = urgentslots < limit ? urgentslots : limit - 1;
+      message* next;
+      if (next_single(fresh, remote, true))
+	next = *fresh;
+      else if (active < limit - reserved && next_single(msg, remote, false))
+	next = *msg;
+      else if (next_single(urgent, remote, true))
+	next = *urgent;
+      else
+	break;
+      if ((pace = pace_delay(remote)) > 0)
+	break;
+      while (workers[i].fp)
+	++i;
+      next->tried = 1;
+      if (start_one(workers[i], *next, remote)) {
+	++active;
+	read_ahead(msg, remote);
+      }
+      else
+	finish_msg(*next, remote, tempfail, "");
+    }
+    if (active == 0 && pace == 0)
+      break;
+    active -= reap_workers(workers, count, pace);
+    if (arrivals != seen) {
+      seen = arrivals;
+      take_urgent(remote, arrived);
+    }
+  }
+  delete[] workers;
+}
+
+// The most remotes that can be balanced together.
+#define MAX_BALANCED 32
+
+static bool balanced(const remote& r)
+{
+  return r.weight > 0 && !r.multi;
+}
+
+static bool same_set(const remote& a, const remote& b)
+{
+  return balanced(a) && balanced(b) && a.group == b.group;
+}
+
+// Pick the member of a balanced set to send a message to, by smooth
+// weighted round-robin among the members that are up, have room for
+// another delivery, are not being paced and have not tried the message
+// yet.  Returns -1 if there is none.
+static int pick_member(remote* members[], int active[], int count,
+		       const message& msg)
+{
+  int total = 0;
+  int best = -1;
+  for (int i = 0; i < count; i++) {
+    remote& r = *members[i];
+    if (r.down || (msg.tried & (1U << i)) != 0)
+      continue;
+    if (active[i] >= concurrency(r) || pace_delay(r) > 0)
+      continue;
+    r.current += r.weight;
+    total += r.weight;
+    if (best < 0 || r.current > members[best]->current)
+      best = i;
+  }
+  if (best >= 0)
+    members[best]->current -= total;
+  return best;
+}
+
+// Deliver the messages for a balanced set of remotes, starting with the
+// given one, spreading them across the members with up to
+// maxconcurrency deliveries running at once in all.  A message that
+// fails on one member is tried again on the others in later passes,
+// as it would be with failover.
+static void send_balanced(remote& first)
+{
+  remote* members[MAX_BALANCED];
+  int count = 0;
+  for(rlist::iter r(remotes); r && count < MAX_BALANCED; r++)
+    if (same_set(*r, first)) {
+      if ((*r).down) {
+	flog << "Skipping " << (*r).host << ", it is down." << endl;
+	continue;
+      }
+      resolve_remote(*r);
+      members[count++] = &*r;
+    }
+  for(duelist::iter msg(due); msg; msg++)
+    (*msg)->tried = 0;
+  int active[MAX_BALANCED];
+  for (int i = 0; i < count; i++)
+    active[i] = 0;
+  delivery* workers = new delivery[maxconcurrency];
+  int running = 0;
+  for (bool started = true; started; ) {
+    started = false;
+    for (duelist::iter msg(due); msg && !reload_wanted; msg++) {
+      if ((*msg)->done || !routed_to(**msg, first))
+	continue;
+      int m;
+      for (;;) {
+	if (running < maxconcurrency
+	    && (m = pick_member(members, active, count, **msg)) >= 0)
+	  break;
+	// Wait for room if a member that could take the message is busy
+	// or being paced.
+	bool busy = false;
+	int pace = 0;
+	for (int i = 0; i < count; i++)
+	  if (!members[i]->down && ((*msg)->tried & (1U << i)) == 0) {
+	    busy = true;
+	    int wait = pace_delay(*members[i]);
+	    if (wait > 0 && (pace == 0 || wait < pace))
+	      pace = wait;
+	  }
+	if (!busy || (running == 0 && pace == 0)) {
+	  m = -1;
+	  break;
+	}
+	running -= reap_workers(workers, maxconcurrency, pace);
+	for (int i = 0; i < count; i++)
+	  active[i] = 0;
+	for (int i = 0; i < maxconcurrency; i++)
+	  for (int j = 0; workers[i].fp && j < count; j++)
+	    if (workers[i].rem == members[j])
+	      ++active[j];
+      }
+      if (m < 0)
+	continue;
+      (*msg)->tried |= 1U << m;
+      int w = 0;
+      while (workers[w].fp)
+	++w;
+      if (start_one(workers[w], **msg, *members[m])) {
+	++active[m];
+	++running;
+	read_ahead(msg, first);
+      }
+      else
+	finish_msg(**msg, *members[m], tempfail, "");
+      started = true;
+    }
+    while (running > 0)
+      running -= reap_workers(workers, maxconcurrency);
+    for (int i = 0; i < count; i++)
+      active[i] = 0;
+  }
+  delete[] workers;
+}
+
+// The mail exchangers of the domains sent to through the mx remote,
+// kept for the time to live of their records, and the health of each
+// domain: one whose mail exchangers cannot be reached is skipped the
+// way a remote that is down is.
+struct mx_domain
+{
+  mystring name;
+  int status;
+  slist hosts;
+  time_t expires;
+  unsigned failures;
+  time_t down_until;
+};
+
+#define MX_BUCKETS 256
+#define MX_MAX_HOSTS 1024
+
+static list<mx_domain> mx_domains[MX_BUCKETS];
+// The remotes for the mail exchangers, which keep their health and
+// pacing from one queue run to the next.
+static rlist mx_hosts;
+
+static void lookup_mx(mx_domain& d, time_t now)
+{
+  unsigned long ttl;
+  d.hosts.empty();
+  d.status = mx_lookup(d.name, d.hosts, ttl);
+  if (d.status == MX_TEMPFAIL)
+    ttl = 0;
+  d.expires = now + ttl;
+}
+
+static mx_domain& find_mx(const mystring& name, time_t now)
+{
+  list<mx_domain>& bucket =
+    mx_domains[configdb_hash(name.c_str(), name.length()) % MX_BUCKETS];
+  for (list<mx_domain>::iter d(bucket); d; ) {
+    if ((*d).name == name) {
+      if ((*d).expires <= now)
+	lookup_mx(*d, now);
+      return *d;
+    }
+    // Drop the answers that have run out for domains in good health.
+    if ((*d).expires <= now && (*d).down_until <= now)
+      bucket.remove(d);
+    else
+      d++;
   }
-  if(messages.count() == 0)
-    return;
-  fout << "Starting delivery, "
-       << itoa(messages.count()) << " message(s) in queue." << endl;
-  mystring output;
-  for(rlist::iter remote(remotes); remote; remote++) {
-    msglist::iter msg(messages);
-    while(msg) {
-      switch (send_one((*msg).filename, *remote, output)) {
-      case tempfail:
-	if (time(0) - (*msg).timestamp > queuelifetime) {
-	  if (bounce_msg(*msg, *remote, output)) {
-	    messages.remove(msg);
-	    continue;
-	  }
+  mx_domain d;
+  d.name = name;
+  d.failures = 0;
+  d.down_until = 0;
+  lookup_mx(d, now);
+  bucket.append(d);
+  return bucket.last();
+}
+
+static void domain_failed(mx_domain& d)
+{
+  time_t delay = minpause;
+  for (unsigned i = 0; i < d.failures && delay < maxpause; i++)
+    delay *= 2;
+  if (delay > maxpause)
+    delay = maxpause;
+  ++d.failures;
+  d.down_until = time(0) + delay;
+  flog << "Could not reach a mail exchanger for " << d.name
+       << ", skipping it for " << itoa(delay) << " seconds." << endl;
+}
+
+// The remote for a mail exchanger: the arguments of the mx remote with
+// the host name of the exchanger.
+static remote& mx_host(const remote& mx, const mystring& host)
+{
+  slist args;
+  slist::const_iter a(mx.args);
+  args.append(host);
+  for (a++; a; a++)
+    args.append(*a);
+  remote r(args);
+  for (rlist::iter i(mx_hosts); i; i++)
+    if ((*i).program == r.program && (*i).options == r.options)
+      return *i;
+  r.mxhost = true;
+  mx_hosts.append(r);
+  return mx_hosts.last();
+}
+
+// A message due for the mx remote and the domain of its recipients.
+struct mx_entry
+{
+  message* msg;
+  mystring domain;
+};
+
+static int by_mx_domain(const void* a, const void* b)
+{
+  const mx_entry* ea = *(const mx_entry* const*)a;
+  const mx_entry* eb = *(const mx_entry* const*)b;
+  int c = strcmp(ea->domain.c_str(), eb->domain.c_str());
+  if (c != 0)
+    return c;
+  return ea < eb ? -1 : ea > eb;
+}
+
+// Deliver the messages for the mx remote straight to the mail
+// exchangers of the domains of their recipients.  Messages with
+// recipients in more than one domain are split up first.  The messages
+// for each domain are then sent to its exchangers in order of
+// preference, over one connection each for a multi remote, until none
+// are left to try.
+static void send_mx(remote& mx)
+{
+  time_t now = time(0);
+  if (mx_hosts.count() > MX_MAX_HOSTS) {
+    for (rlist::iter r(mx_hosts); r; ) {
+      if ((*r).down_until <= now)
+	mx_hosts.remove(r);
+      else
+	r++;
+    }
+  }
+  for (rlist::iter r(mx_hosts); r; r++)
+    (*r).down = (*r).down_until > now;
+  // The split copies are appended to the list, and so are visited too.
+  list<mx_entry> entries;
+  for (duelist::iter msg(due); msg; msg++) {
+    message& m = **msg;
+    if (m.done || !routed_to(m, mx))
+      continue;
+    mystring sender;
+    slist recipients;
+    if (!read_envelope(m.filename(), sender, recipients))
+      continue;
+    slist domains;
+    for (slist::const_iter r(recipients); r; r++) {
+      mystring domain = recipient_domain(*r);
+      bool seen = false;
+      for (slist::const_iter d(domains); d && !seen; d++)
+	seen = *d == domain;
+      if (!seen)
+	domains.append(domain);
+    }
+    if (domains.count() > 1
+	&& !split_msg(m, recipients, domains, recipient_domain, false))
+      continue;
+    if (domains.count() > 0) {
+      mx_entry e;
+      e.msg = &m;
+      e.domain = *slist::const_iter(domains);
+      entries.append(e);
+    }
+  }
+  const unsigned n = entries.count();
+  mx_entry** order = new mx_entry*[n];
+  unsigned k = 0;
+  for (list<mx_entry>::iter e(entries); e; e++)
+    order[k++] = &*e;
+  qsort(order, n, sizeof *order, by_mx_domain);
+  for (unsigned i = 0; i < n && !reload_wanted; ) {
+    unsigned end = i + 1;
+    while (end < n && order[end]->domain == order[i]->domain)
+      ++end;
+    mx_domain& d = find_mx(order[i]->domain, now);
+    if (d.down_until > now)
+      flog << "Skipping " << d.name << ", it is down." << endl;
+    else if (d.status == MX_NONE) {
+      for (unsigned j = i; j < end; j++)
+	finish_msg(*order[j]->msg, mx, permfail,
+		   "No mail exchanger for domain " + d.name, "5.1.2");
+    }
+    else if (d.status == MX_TEMPFAIL) {
+      flog << "Could not look up the mail exchangers for " << d.name
+	   << endl;
+      domain_failed(d);
+    }
+    else {
+      for (unsigned j = i; j < end; j++)
+	order[j]->msg->picked = true;
+      bool reached = false;
+      bool left = true;
+      for (slist::const_iter h(d.hosts); h && left; h++) {
+	remote& host = mx_host(mx, *h);
+	if (host.down) {
+	  flog << "Skipping " << host.host << ", it is down." << endl;
+	  continue;
 	}
-	msg++;
-	break;
-      case permfail:
-	if (bounce_msg(*msg, *remote, output))
-	  messages.remove(msg);
+	resolve_remote(host);
+	if (host.multi)
+	  send_multi(host);
 	else
-	  msg++;
+	  send_single(host);
+	reached = reached || !host.down;
+	left = false;
+	for (unsigned j = i; j < end; j++)
+	  left = left || !order[j]->msg->done;
+      }
+      for (unsigned j = i; j < end; j++)
+	order[j]->msg->picked = false;
+      if (!reached)
+	domain_failed(d);
+      else
+	d.failures = d.down_until = 0;
+    }
+    i = end;
+  }
+  delete[] order;
+}
+
+// The control socket takes one command on each connection, as a line
+// of words, and answers it with lines of text, the first of which
+// starts with "ok" or "error", before closing the connection.  The
+// commands only leave requests that change the schedule for the start
+// of the next queue run, since a command may arrive during one.
+#define CONTROL_CLIENTS 8
+#define CONTROL_LINE_MAX 1024
+
+struct control_client
+{
+  int fd;
+  mystring line;
+};
+
+static int control = -1;
+static control_client control_clients[CONTROL_CLIENTS];
+static slist flush_domains;
+static slist flush_hosts;
+static slist paused_hosts;
+static time_t drain_until = 0;
+
+static bool listed(const slist& list, const mystring& item)
+{
+  for (slist::const_iter i(list); i; i++)
+    if (*i == item)
+      return true;
+  return false;
+}
+
+static bool paused(const mystring& host)
+{
+  return listed(paused_hosts, host);
+}
+
+static void open_control()
+{
+  struct sockaddr_un sa;
+  memset(&sa, 0, sizeof sa);
+  sa.sun_family = AF_UNIX;
+  if (control_path.length() >= sizeof sa.sun_path) {
+    msg1("Control socket path is too long, not listening for commands");
+    return;
+  }
+  strcpy(sa.sun_path, control_path.c_str());
+  if ((control = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    msg1sys("Could not create control socket: ");
+    return;
+  }
+  // Only a socket that nobody answers on is stale.  One that accepts a
+  // connection belongs to another nullmailer-send on this queue, and
+  // is left to it.
+  int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (probe >= 0) {
+    bool live = connect(probe, (struct sockaddr*)&sa, sizeof sa) == 0;
+    close(probe);
+    if (live) {
+      msg1("Another nullmailer-send has the control socket, not listening for commands");
+      close(control);
+      control = -1;
+      return;
+    }
+  }
+  unlink(sa.sun_path);
+  if (bind(control, (struct sockaddr*)&sa, sizeof sa) < 0
+      || chmod(sa.sun_path, 0600) < 0
+      || listen(control, CONTROL_CLIENTS) < 0
+      || fcntl(control, F_SETFL, O_NONBLOCK) < 0
+      || fcntl(control, F_SETFD, FD_CLOEXEC) < 0) {
+    msg1sys("Could not set up control socket: ");
+    close(control);
+    control = -1;
+  }
+  else {
+    for (int i = 0; i < CONTROL_CLIENTS; i++)
+      control_clients[i].fd = -1;
+    events.add(control);
+  }
+}
+
+static bool remote_known(const mystring& host)
+{
+  for (rlist::const_iter r(remotes); r; r++)
+    if ((*r).host == host)
+      return true;
+  return false;
+}
+
+static void control_stats(mystring& reply, time_t now)
+{
+  unsigned due_now = 0;
+  for (msglist::const_iter msg(messages); msg; msg++)
+    if (!(*msg).done && (*msg).next_attempt <= now)
+      ++due_now;
+  reply = "ok\n";
+  reply += mystringjoin("messages ") + itoa(messages.count()) + "\n";
+  reply += mystringjoin("due ") + itoa(due_now) + "\n";
+  reply += mystringjoin("runs ") + itoa(queue_runs) + "\n";
+  for (rlist::const_iter r(remotes); r; r++) {
+    reply += "remote ";
+    reply += (*r).host;
+    if (paused((*r).host))
+      reply += " paused";
+    else if ((*r).down_until > now)
+      reply += mystringjoin(" down ") + itoa((*r).down_until - now);
+    else
+      reply += " up";
+    reply += '\n';
+  }
+  if (drain_until > 0)
+    reply += mystringjoin("draining ")
+      + itoa(drain_until > now ? drain_until - now : 0) + "\n";
+}
+
+// Carry out a command, setting the reply to send back.
+static void control_command(const mystring& line, mystring& reply)
+{
+  arglist words;
+  parse_args(words, line);
+  arglist::const_iter w(words);
+  const mystring cmd = w ? *w : mystring();
+  if (w)
+    w++;
+  const mystring arg = w ? *w : mystring();
+  if (w)
+    w++;
+  const mystring arg2 = w ? *w : mystring();
+  const time_t now = time(0);
+  flog << "Control command: " << line << endl;
+  if (cmd == "flush" && arg == "domain" && !!arg2) {
+    flush_domains.append(arg2.lower());
+    reply = "ok flushing domain " + arg2 + "\n";
+  }
+  else if (cmd == "flush" && arg == "remote" && !!arg2) {
+    if (!remote_known(arg2))
+      reply = "error no such remote: " + arg2 + "\n";
+    else {
+      flush_hosts.append(arg2);
+      reply = "ok flushing remote " + arg2 + "\n";
+    }
+  }
+  else if (cmd == "flush" && !arg) {
+    flush_messages = true;
+    reply = "ok flushing all\n";
+  }
+  else if (cmd == "pause" && !!arg) {
+    if (!remote_known(arg))
+      reply = "error no such remote: " + arg + "\n";
+    else {
+      if (!paused(arg))
+	paused_hosts.append(arg);
+      // A remote is only checked for being down between messages, so
+      // the pause takes effect with the next one sent to it.
+      for (rlist::iter r(remotes); r; r++)
+	if ((*r).host == arg)
+	  (*r).down = true;
+      reply = "ok paused " + arg + "\n";
+    }
+  }
+  else if (cmd == "resume" && !!arg) {
+    bool found = false;
+    for (slist::iter i(paused_hosts); i; i++)
+      if (*i == arg) {
+	paused_hosts.remove(i);
+	found = true;
 	break;
-      default:
-	if(unlink((*msg).filename.c_str()) == -1) {
-	  fout << "Can't unlink file: " << strerror(errno) << endl;
-	  msg++;
-	}
-	else
-	  messages.remove(msg);
       }
+    if (!found)
+      reply = "error not paused: " + arg + "\n";
+    else {
+      flush_hosts.append(arg);
+      reply = "ok resumed " + arg + "\n";
+    }
+  }
+  else if (cmd == "drain" && !!arg && strtoul(arg.c_str(), 0, 10) > 0) {
+    drain_until = now + strtoul(arg.c_str(), 0, 10);
+    flush_messages = true;
+    reply = mystringjoin("ok draining for ") + arg + " seconds\n";
+  }
+  else if (cmd == "stats" && !arg)
+    control_stats(reply, now);
+  else
+    reply = "error unknown command: " + line + "\n";
+}
+
+static void control_close(control_client& c)
+{
+  events.remove(c.fd);
+  close(c.fd);
+  c.fd = -1;
+  c.line = "";
+}
+
+// Take a new connection, or read from one that has been taken.  A
+// client that has not sent a line yet is dropped when the slots are all
+// taken, so that a stuck one cannot lock out the rest.
+static bool control_ready(int fd)
+{
+  if (control < 0)
+    return false;
+  if (fd == control) {
+    int c;
+    while ((c = accept(control, 0, 0)) >= 0) {
+      int slot = 0;
+      while (slot < CONTROL_CLIENTS && control_clients[slot].fd >= 0)
+	++slot;
+      if (slot == CONTROL_CLIENTS
+	  || fcntl(c, F_SETFL, O_NONBLOCK) < 0
+	  || fcntl(c, F_SETFD, FD_CLOEXEC) < 0) {
+	close(c);
+	continue;
+      }
+      control_clients[slot].fd = c;
+      events.add(c);
+    }
+    return true;
+  }
+  for (int i = 0; i < CONTROL_CLIENTS; i++) {
+    control_client& c = control_clients[i];
+    if (c.fd != fd)
+      continue;
+    char buf[256];
+    ssize_t rd = read(fd, buf, sizeof buf);
+    if (rd < 0 && errno == EAGAIN)
+      return true;
+    if (rd > 0)
+      c.line += mystring(buf, rd);
+    const int nl = c.line.find_first('\n');
+    if (nl < 0 && rd > 0 && c.line.length() < CONTROL_LINE_MAX)
+      return true;
+    if (nl >= 0 || rd == 0) {
+      mystring reply;
+      control_command((nl >= 0 ? c.line.left(nl) : c.line).strip(), reply);
+      ssize_t ignored = write(fd, reply.c_str(), reply.length());
+      (void)ignored;
+    }
+    control_close(c);
+    return true;
+  }
+  return false;
+}
+
+static bool flushed_domain(const mystring& recipient)
+{
+  const int at = recipient.find_last('@');
+  return at >= 0 && listed(flush_domains, recipient.right(at + 1).lower());
+}
+
+// Whether the message has a recipient in one of the domains to flush.
+static bool to_flushed_domain(const mystring& filename)
+{
+  mystring sender;
+  slist recipients;
+  if (!read_envelope(filename, sender, recipients))
+    return false;
+  for (slist::const_iter i(recipients); i; i++)
+    if (flushed_domain(*i))
+      return true;
+  return false;
+}
+
+// Make the messages asked for on the control socket due at once: those
+// with a recipient in one of the domains, and those routed to one of
+// the remotes, which are no longer held back after a failure either.
+static void flush_targeted()
+{
+  for (rlist::iter r(remotes); r; r++)
+    if (listed(flush_hosts, (*r).host)) {
+      (*r).failures = 0;
+      (*r).down_until = 0;
+    }
+  unsigned flushed = 0;
+  for (msglist::iter msg(messages); msg; msg++) {
+    if ((*msg).done)
+      continue;
+    bool match = false;
+    for (rlist::const_iter r(remotes); r && !match; r++)
+      match = listed(flush_hosts, (*r).host) && routed_to(*msg, *r);
+    if (!match && flush_domains.count() > 0)
+      match = to_flushed_domain((*msg).filename());
+    if (match) {
+      (*msg).next_attempt = 0;
+      ++flushed;
+    }
+  }
+  flush_domains.empty();
+  flush_hosts.empty();
+  flog << "Flushing " << itoa(flushed) << " message(s) on request." << endl;
+  if (flushed > 0)
+    schedule_all();
+}
+
+// Returns true if the run was cut short to reload the config.
+static bool run_queue()
+{
+  if(!load_config()) {
+    flog << "Could not load the config" << endl;
+    return false;
+  }
+  if(remotes.count() <= 0) {
+    flog << "No remote hosts listed for delivery";
+    return false;
+  }
+  time_t now = time(0);
+  if (expire_messages(now) > 0) {
+    sweep_messages();
+    flush_bounces();
+  }
+  if (flush_messages) {
+    flush_messages = false;
+    for(msglist::iter msg(messages); msg; msg++)
+      (*msg).next_attempt = 0;
+    schedule_all();
+  }
+  if (flush_domains.count() > 0 || flush_hosts.count() > 0)
+    flush_targeted();
+  while (sched.top() && sched.top()->next_attempt <= now)
+    due.append(sched.pop());
+  if(due.count() == 0)
+    return false;
+  ++queue_runs;
+  flog << "Starting delivery, "
+       << itoa(due.count()) << " of "
+       << itoa(messages.count()) << " message(s) in queue." << endl;
+  route_due();
+  sort_due();
+  prioritize_due();
+  merge_due();
+  // A tenant runs its one delivery, and as many more as it can borrow
+  // for this run.
+  const int own = maxconcurrency;
+  if (tenant_index >= 0) {
+    const int want = ((int)due.count() < own ? (int)due.count() : own) - 1;
+    maxconcurrency = 1 + slotpool_borrow(tenant_index, want > 0 ? want : 0);
+  }
+  for(rlist::iter remote(remotes); remote; remote++)
+    (*remote).down = (*remote).down_until > now || paused((*remote).host);
+  for(duelist::iter msg(due); msg; msg++)
+    (*msg)->spilled = 0;
+  for(rlist::iter remote(remotes);
+      remote && due.count() > 0 && !reload_wanted; remote++) {
+    if (!have_due(*remote))
+      continue;
+    if ((*remote).mx) {
+      send_mx(*remote);
+      drop_ahead();
+      sweep_due();
+      continue;
+    }
+    if (balanced(*remote)) {
+      // The whole set is sent to when its first member is reached.
+      bool first = true;
+      for(rlist::iter r(remotes); first && &*r != &*remote; r++)
+	first = !same_set(*r, *remote);
+      if (first)
+	send_balanced(*remote);
+      drop_ahead();
+      sweep_due();
+      continue;
+    }
+    if ((*remote).down) {
+      flog << "Skipping " << (*remote).host << ", it is down." << endl;
+      continue;
+    }
+    spill_over(*remote);
+    resolve_remote(*remote);
+    if ((*remote).multi)
+      send_multi(*remote);
+    else
+      send_single(*remote);
+    drop_ahead();
+    sweep_due();
+  }
+  if (tenant_index >= 0) {
+    slotpool_return(tenant_index);
+    maxconcurrency = own;
+  }
+  now = time(0);
+  const bool reload = reload_wanted;
+  unsigned untried = 0;
+  for(duelist::iter msg(due); msg; msg++) {
+    release_claim(**msg);
+    (*msg)->busy = false;
+    if (reload && !(*msg)->attempted) {
+      sched.push(*msg);
+      ++untried;
+      continue;
+    }
+    const time_t until = (*msg)->attempted ? 0 : throttle_release(**msg, now);
+    if (until > 0) {
+      (*msg)->next_attempt = until;
+      sched.push(*msg);
+      journal_record(journal_attempt((*msg)->filename(), (*msg)->attempts,
+				     until));
+      continue;
     }
+    (*msg)->attempted = false;
+    ++(*msg)->attempts;
+    reschedule(**msg, now);
+  }
+  due.empty();
+  sweep_messages();
+  flush_bounces();
+  // Compact the journal once most of it is records of messages that
+  // have left the queue or of earlier attempts.
+  if (!scanning && journal_appended > messages.count() + 1000)
+    compact_journal();
+  if (reload) {
+    flog << "Reloading the config, " << itoa(untried)
+	 << " message(s) left to try." << endl;
+    return true;
   }
-  fout << "Delivery complete, "
+  flog << "Delivery complete, "
        << itoa(messages.count()) << " message(s) remain." << endl;
+  return false;
 }
 
-static int trigger;
-#ifdef NAMEDPIPEBUG
-static int trigger2;
-#endif
+void send_all()
+{
+  while (run_queue())
+    ;
+  write_metrics(true);
+  write_usage(true);
+}
 
-bool open_trigger()
+// Deliver a message held by nullmailer-queue straight away, trying
+// each remote it is routed to in turn until one takes it or rejects it
+// permanently.  A message whose recipients are routed to more than one
+// group is left for the queue to split.
+static tristate send_direct(const char* name)
 {
-  trigger = open(trigger_path.c_str(), O_RDONLY|O_NONBLOCK);
-#ifdef NAMEDPIPEBUG
-  trigger2 = open(trigger_path.c_str(), O_WRONLY|O_NONBLOCK);
-#endif
-  if(trigger == -1)
-    fail1sys("Could not open trigger file: ");
-  return true;
+  if (!load_config() || remotes.count() <= 0) {
+    flog << "Could not load the config" << endl;
+    return tempfail;
+  }
+  message msg(time(0), (fastlane ? "../fastlane/" : "../holding/")
+	      + mystring(name), false);
+  if (sender_routes.count() > 0 || recipient_routes.count() > 0) {
+    mystring sender;
+    slist recipients;
+    if (!read_envelope(msg.filename(), sender, recipients))
+      return tempfail;
+    mystring group;
+    if (!sender_routes.find(sender, group)) {
+      slist::const_iter r(recipients);
+      if (r)
+	group = recipient_group(*r);
+      for (; r; r++)
+	if (recipient_group(*r) != group)
+	  return tempfail;
+    }
+    msg.group = message_groups.intern(group);
+  }
+  msg.routed = route_generation;
+  for (rlist::iter r(remotes); r && !msg.done; r++) {
+    if ((*r).mx || !routed_to(msg, *r))
+      continue;
+    delivery d;
+    if (!start_one(d, msg, *r))
+      continue;
+    while (d.fp)
+      reap_workers(&d, 1);
+  }
+  flush_bounces();
+  return msg.done ? direct_result : tempfail;
 }
 
-bool read_trigger()
+// Move the messages left in the holding area and the fast lane by
+// nullmailer-queue into the queue.  Each is locked for as long as
+// nullmailer-queue is still delivering it, so only those whose delivery
+// was cut short are moved.  The fast lane is on another file system, so
+// its messages are copied instead.
+static void release_held(const char* area, bool copy)
 {
-  if(trigger != -1) {
-    char buf[1024];
-    read(trigger, buf, sizeof buf);
-#ifdef NAMEDPIPEBUG
-    close(trigger2);
-#endif
-    close(trigger);
+  DIR* dir = opendir(area);
+  if (!dir)
+    return;
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != 0) {
+    const char* name = entry->d_name;
+    if (name[0] == '.')
+      continue;
+    const mystring held = mystring(area) + "/" + name;
+    autoclose fd = open(held.c_str(), O_RDONLY);
+    if (fd < 0 || flock(fd, LOCK_EX|LOCK_NB) < 0)
+      continue;
+    const mystring path = queuedir_path(name, queuedirs);
+    if (queuedirs > 0)
+      mkdir(queuedir_of(name, queuedirs).c_str(), 0700);
+    flog << "Moving held message " << name << " into the queue" << endl;
+    if (copy ? !queue_spill(name) : rename(held.c_str(), path.c_str()) == -1) {
+      flog << "Can't move file: " << strerror(errno) << endl;
+      continue;
+    }
+    time_t timestamp;
+    bool stated;
+    if (queue_time(path.c_str(), timestamp, stated))
+      journal_message(message(timestamp, path, stated));
+  }
+  closedir(dir);
+}
+
+// The failed queue is pruned to the retention limits once an hour, in
+// a child so that a large directory does not hold up deliveries.  The
+// bounces of the messages in it have already been generated by then.
+static const int prune_interval = 60*60;
+static time_t last_prune = 0;
+static fork_exec* pruner = 0;
+
+static bool retention_set()
+{
+  return failedlifetime > 0 || maxfailedfiles > 0 || maxfailedsize > 0;
+}
+
+static int prune_failed(void*)
+{
+  signal(SIGALRM, SIG_DFL);
+  signal(SIGCHLD, SIG_DFL);
+  flog.discard();
+  retention_limits limits;
+  limits.lifetime = failedlifetime;
+  limits.files = maxfailedfiles;
+  limits.bytes = maxfailedsize * 1024ULL;
+  limits.archive = failedarchive;
+  unsigned long removed;
+  unsigned long long bytes;
+  if (!retention_enforce("../failed", limits, time(0), removed, bytes)) {
+    flog << "Could not read the failed queue: " << strerror(errno) << endl;
+    return 1;
+  }
+  if (removed > 0)
+    flog << (failedarchive ? "Archived " : "Removed ") << itoa(removed)
+	 << " failed message(s), " << itoa(bytes / 1024) << "KB." << endl;
+  return 0;
+}
+
+// Reap the last pruning and start the next one when it is due.
+static void prune_check(time_t now)
+{
+  int status;
+  if (pruner != 0 && pruner->poll_status(status)) {
+    delete pruner;
+    pruner = 0;
+  }
+  if (pruner != 0 || !retention_set() || now - last_prune < prune_interval)
+    return;
+  last_prune = now;
+  flog.drain();
+  pruner = new fork_exec("retention");
+  int redirs[] = { REDIRECT_NULL };
+  if (!pruner->start(prune_failed, 0, 1, redirs)) {
+    delete pruner;
+    pruner = 0;
   }
-  return open_trigger();
 }
 
 bool do_select()
 {
-  fd_set readfds;
-  FD_ZERO(&readfds);
-  FD_SET(trigger, &readfds);
-  struct timeval timeout;
-
-  if (messages.count() == 0)
-    pausetime = maxpause;
-  timeout.tv_sec = pausetime;
-  timeout.tv_usec = 0;
-
-  pausetime *= 2;
-  if (pausetime > maxpause)
-    pausetime = maxpause;
-
-  int s = select(trigger+1, &readfds, 0, 0, &timeout);
-  if(s == 1) {
-    fout << "Trigger pulled." << endl;
-    read_trigger();
-    reload_messages = true;
-    pausetime = minpause;
-  }
-  else if(s == -1 && errno != EINTR)
-    fail1sys("Internal error in select: ");
+  // Sleep until the next message is due to be retried.
+  time_t now = time(0);
+  time_t pause = maxpause;
+  if (sched.top())
+    pause = sched.top()->next_attempt - now;
+  // Wake up to bounce the next message to expire.
+  if (expiry.top()
+      && expiry.top()->timestamp + queuelifetime + 1 - now < pause)
+    pause = expiry.top()->timestamp + queuelifetime + 1 - now;
+  if (watcher >= 0 && last_scan + rescan_interval - now < pause)
+    pause = last_scan + rescan_interval - now;
+  int warm = expire_warm(now);
+  if (warm >= 0 && warm < pause)
+    pause = warm;
+  if (drain_until > 0 && drain_until - now < pause)
+    pause = drain_until - now;
+  prune_check(now);
+  if (retention_set() && last_prune + prune_interval - now < pause)
+    pause = last_prune + prune_interval - now;
+  if (pause < 0)
+    pause = 0;
+  else if (pause > maxpause)
+    pause = maxpause;
+
+  int ready[8];
+  int others;
+  int s = wait_events(pause * 1000, ready, 8, others);
+  if(s == -1)
+    fail1sys("Internal error waiting for events: ");
   else if(s == 0)
-    reload_messages = true;
-  if(reload_messages)
+    if (watcher < 0 || time(0) - last_scan >= rescan_interval)
+      reload_messages = true;
+  if (warm_wanted) {
+    warm_wanted = false;
+    if (load_config())
+      warm_up();
+  }
+  if(reload_messages) {
+    release_held("../holding", false);
+    release_held("../fastlane", true);
     load_messages();
+    compact_journal();
+  }
+  return true;
+}
+
+// The tenants listed in the tenants control file are each served by a
+// process of their own, forked from this one, which restarts a process
+// that dies and passes signals on to them all.  They share one pool of
+// delivery slots, sized by the shared maxconcurrency.
+#define TENANT_RESTART 10
+
+struct tenant_proc
+{
+  mystring name;
+  pid_t pid;
+  time_t restart;
+};
+
+static volatile sig_atomic_t tenant_signal = 0;
+
+static void catch_tenant_signal(int sig)
+{
+  tenant_signal = sig;
+}
+
+// Returns true in the forked process, which goes on to serve its
+// tenant, or false once every tenant process is gone.
+static bool start_tenant(tenant_proc& t, unsigned index)
+{
+  t.restart = 0;
+  const pid_t pid = fork();
+  if (pid < 0) {
+    flog << "Could not fork for tenant " << t.name << ": "
+	 << strerror(errno) << endl;
+    t.restart = time(0) + TENANT_RESTART;
+    return false;
+  }
+  if (pid > 0) {
+    t.pid = pid;
+    flog << "Serving tenant " << t.name << " as process " << itoa(pid)
+	 << '.' << endl;
+    return false;
+  }
+  flog.discard();
+  signal(SIGHUP, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGALRM, SIG_DFL);
+  setenv("NULLMAILER_TENANT", t.name.c_str(), 1);
+  configdb_close();
+  tenant_index = index;
+  tenant_program = "nullmailer-send/" + t.name;
   return true;
 }
 
-int main(int, char*[])
+// Serve the listed tenants, if there are any.  Returns true in a
+// tenant's process, and sets code and returns false in this one once
+// it is done.
+static bool serve_tenants(int& code)
+{
+  code = -1;
+  slist names;
+  config_readlist("tenants", names);
+  tenant_proc procs[SLOTPOOL_MAX];
+  unsigned count = 0;
+  for (slist::const_iter n(names); n; n++)
+    if (!config_tenant_valid((*n).c_str()))
+      flog << "Ignoring tenant " << *n << ", it is not a valid name." << endl;
+    else if (count < SLOTPOOL_MAX) {
+      procs[count].name = *n;
+      procs[count].pid = 0;
+      ++count;
+    }
+  if (count == 0)
+    return false;
+  size_defaults();
+  int total;
+  if (!config_readint("maxconcurrency", total) || total < 1)
+    total = sized_workers;
+  const unsigned pooled = (unsigned)total > count ? total - count : 0;
+  if (!slotpool_open(count, pooled)) {
+    msg1sys("Could not set up the tenant slot pool: ");
+    code = 1;
+    return false;
+  }
+  flog << "Serving " << itoa(count) << " tenant(s) with "
+       << itoa(pooled) << " shared delivery slot(s)." << endl;
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = catch_tenant_signal;
+  sigaction(SIGHUP, &sa, 0);
+  sigaction(SIGTERM, &sa, 0);
+  sigaction(SIGINT, &sa, 0);
+  sigaction(SIGALRM, &sa, 0);
+  for (unsigned i = 0; i < count; i++)
+    if (start_tenant(procs[i], i))
+      return true;
+
+  bool stopping = false;
+  for (;;) {
+    bool pending = false;
+    bool running = false;
+    for (unsigned i = 0; i < count; i++) {
+      pending = pending || procs[i].restart > 0;
+      running = running || procs[i].pid > 0;
+    }
+    if (!running && !pending)
+      break;
+    int status;
+    const pid_t pid = running ? waitpid(-1, &status, WNOHANG) : 0;
+    for (unsigned i = 0; pid > 0 && i < count; i++) {
+      tenant_proc& t = procs[i];
+      if (t.pid != pid)
+	continue;
+      t.pid = 0;
+      slotpool_return(i);
+      if (stopping || (WIFEXITED(status) && WEXITSTATUS(status) == 0))
+	flog << "Tenant " << t.name << " is done." << endl;
+      else {
+	flog << "Tenant " << t.name << " failed, restarting it in "
+	     << itoa(TENANT_RESTART) << " seconds." << endl;
+	t.restart = time(0) + TENANT_RESTART;
+      }
+    }
+    const int sig = tenant_signal;
+    tenant_signal = 0;
+    if (sig == SIGTERM || sig == SIGINT) {
+      stopping = true;
+      for (unsigned i = 0; i < count; i++)
+	procs[i].restart = 0;
+    }
+    if (sig != 0)
+      for (unsigned i = 0; i < count; i++)
+	if (procs[i].pid > 0)
+	  kill(procs[i].pid, sig == SIGINT ? SIGTERM : sig);
+    const time_t now = time(0);
+    for (unsigned i = 0; i < count; i++)
+      if (procs[i].restart > 0 && procs[i].restart <= now
+	  && start_tenant(procs[i], i))
+	return true;
+    flog.drain();
+    // A signal cuts the wait short.
+    if (pid <= 0 && sig == 0)
+      sleep(1);
+  }
+  code = 0;
+  return false;
+}
+
+int main(int argc, char* argv[])
 {
+  stats_phase("setup");
+  if (argc == 1 && config_tenant() == 0) {
+    int code;
+    if (!serve_tenants(code) && code >= 0)
+      return code;
+  }
   trigger_path = CONFIG_PATH(QUEUE, NULL, "trigger");
   msg_dir = CONFIG_PATH(QUEUE, NULL, "queue");
+  notify_path = CONFIG_PATH(QUEUE, "queue", ".notify");
+  control_path = CONFIG_PATH(QUEUE, NULL, "control");
 
   read_hostnames();
+  srandom(time(0) ^ getpid());
 
   if(!selfpipe) {
-    fout << "Could not set up self-pipe." << endl;
+    flog << "Could not set up self-pipe." << endl;
     return 1;
   }
   selfpipe.catchsig(SIGCHLD);
+  if(!events) {
+    flog << "Could not set up the event loop." << endl;
+    return 1;
+  }
+  events.add(selfpipe.fd());
+
+  // nullmailer-queue runs "nullmailer-send --direct NAME" to deliver a
+  // held message, or "--fastlane NAME" for one in the fast lane, and is
+  // told the result in the exit code.
+  if(argc == 3 && (strcmp(argv[1], "--direct") == 0
+		   || strcmp(argv[1], "--fastlane") == 0)) {
+    if(strchr(argv[2], '/') != 0 || chdir(msg_dir.c_str()) == -1)
+      return 1;
+    direct = true;
+    fastlane = argv[1][2] == 'f';
+    signal(SIGPIPE, SIG_IGN);
+    switch(send_direct(argv[2])) {
+    case success: return 0;
+    // Nobody is waiting to be told of a message from the fast lane being
+    // rejected, so it is left to be bounced from the queue.
+    case permfail: return fastlane ? 1 : 2;
+    default: return 1;
+    }
+  }
   
   if(!open_trigger())
     return 1;
   if(chdir(msg_dir.c_str()) == -1) {
-    fout << "Could not chdir to queue message directory." << endl;
+    flog << "Could not chdir to queue message directory." << endl;
     return 1;
   }
+  open_watcher();
+  open_notify();
+  open_control();
   
   signal(SIGALRM, catch_alrm);
-  signal(SIGHUP, SIG_IGN);
+  selfpipe.catchsig(SIGHUP);
+  signal(SIGPIPE, SIG_IGN);
   load_config();
-  load_messages();
+  release_held("../holding", false);
+  release_held("../fastlane", true);
+  // Without a journal the queue is scanned as it is delivered, and the
+  // journal is written once the scan is complete.
+  if (access(journal_path().c_str(), F_OK) == -1) {
+    flog << "No queue journal, scanning the queue." << endl;
+    if (!start_scan())
+      return 1;
+  }
+  else if (!journal_compact(load_journal, 0))
+    msg1sys("Could not write the queue journal: ");
   for(;;) {
+    if (scanning) {
+      scan_batch();
+      if (!scanning)
+	compact_journal();
+    }
+    stats_phase("send");
     send_all();
+    if (scanning)
+      continue;
+    if (drain_until > 0
+	&& (messages.count() == 0 || time(0) >= drain_until)) {
+      flog << "Drained, exiting with " << itoa(messages.count())
+	   << " message(s) in queue." << endl;
+      break;
+    }
     if (minpause == 0) break;
+    stats_phase("idle");
     do_select();
   }
   return 0;
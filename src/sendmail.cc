@@ -29,6 +29,9 @@
 #include "forkexec.h"
 #include "setenv.h"
 #include "cli++/cli++.h"
+#ifdef MULTICALL
+#include "multicall.h"
+#endif
 
 const char* cli_program = "sendmail";
 const char* cli_help_prefix = "Nullmailer sendmail emulator\n";
@@ -45,6 +48,7 @@ static const char* o_dummys;
 static const char* o_sender = 0;
 static int o_mode = 0;
 static char* o_from;
+static const char* o_option = 0;
 static int use_header = false;
 
 cli_option cli_options[] = {
@@ -67,7 +71,8 @@ cli_option cli_options[] = {
   { 'm', 0,    cli_option::flag,   0, &o_dummyi, "Ignored", 0 },
   { 'N', 0,    cli_option::string, 0, &o_dummys, "Ignored", 0 },
   { 'n', 0,    cli_option::flag, 0, &o_dummyi, "Ignored", 0 },
-  { 'O', 0,    cli_option::string, 0, &o_dummys, "Ignored", 0 },
+  { 'O', 0,    cli_option::string, 0, &o_option,
+    "Set an option: only Priority=CLASS is used", 0 },
   { 'o', 0,    cli_option::string, 0, &o_dummys, "Set sendmail option, ignored", 0 },
   {  0, "em",  cli_option::flag, 0, &o_dummyi,
      "Ignored", 0 },
@@ -113,6 +118,13 @@ int do_exec(const char* program, const char* xarg1, int argc, char* argv[])
     newargv[j++] = argv[i];
   newargv[j] = 0;
 
+#ifdef MULTICALL
+  // Built into the same program, nullmailer-inject is run without an
+  // exec.  It still runs nullmailer-queue when it does not own the
+  // queue itself.
+  if (strcmp(program, "nullmailer-inject") == 0)
+    return multicall_inject(j, (char**)newargv);
+#endif
   execv(newargv[0], (char**)newargv);
   ferr << "sendmail: Could not exec " << program << '.' << endl;
   return 1;
@@ -125,6 +137,8 @@ int cli_main(int argc, char* argv[])
   if(o_from)
     if(!setenvelope(o_from))
       return -1;
+  if(o_option && !strncasecmp(o_option, "priority=", 9))
+    setenv("NULLMAILER_PRIORITY", o_option + 9, 1);
   switch (o_mode) {
   case mode_smtp:
     return do_exec("nullmailer-smtpd", 0, 0, 0);
@@ -20,14 +20,28 @@
 // <nullmailer-subscribe@lists.untroubled.org>.
 
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include "autoclose.h"
+#include "configio.h"
 #include "defines.h"
+#include "dotstuff.h"
 #include "fdbuf/fdbuf.h"
 #include "mystring/mystring.h"
+#include "mystring/builder.h"
 #include "forkexec.h"
+#include "itoa.h"
+#include "poller.h"
+#include "queuewriter.h"
+#include "stats.h"
 
 static const char resp_data_ok[] = "354 End your message with a period on a line by itself";
 static const char resp_goodbye[] = "221 2.0.0 Good bye";
@@ -40,33 +54,47 @@ static const char resp_no_param[] = "501 5.5.2 Syntax error, no parameters allow
 static const char resp_no_queue[] = "451 4.3.0 Starting nullmailer-queue failed";
 static const char resp_no_rcpt[] = "503 5.5.1 You must send a valid recipient first";
 static const char resp_ok[] = "250 2.3.0 OK";
+static const char resp_queue_err[] = "451 4.3.0 Could not queue the message";
+static const char resp_queue_full[] = "452 4.3.1 Insufficient system storage";
 static const char resp_queue_exiterr[] = "451 4.3.0 Error returned from nullmailer-queue";
 static const char resp_queue_ok[] = "250 2.6.0 Accepted message";
 static const char resp_queue_waiterr[] = "451 4.3.0 Error checking return status from nullmailer-queue";
 static const char resp_qwrite_err[] = "451 4.3.0 Write to nullmailer-queue failed";
+static const char resp_too_big[] = "552 5.3.4 Message size exceeds fixed maximum message size";
 static const char resp_rcpt_bad[] = "554 5.1.2 Recipient invalid";
 static const char resp_rcpt_ok[] = "250 2.1.5 Recipient accepted";
 static const char resp_unimp[] = "500 5.5.1 Not implemented";
 
-static mystring line;
+// The session is on standard input and output, or on a connection
+// accepted by the listener.
+static fdibuf* in = &fin;
+static fdobuf* out = &fout;
+
+static mystringview line;
 static mystring sender;
-static mystring recipients;
+// Kept from one message to the next, so that its storage is reused.
+static mystringbuilder recipients;
+// The largest message accepted, from the maxmsgsize control file, or 0
+// for no limit.
+static unsigned long maxsize = 0;
 
-extern const char cli_program[] = "nullmailer-smtpd";
+const char* cli_program = "nullmailer-smtpd";
 
+// The line stays in the input buffer until the next one is read.
 static int readline()
 {
-  if (!fin.getline(line))
+  const char* data;
+  unsigned len;
+  if (!in->getline(data, len))
     return 0;
-  if (line.length() > 0
-      && line[line.length()-1] == '\r')
-    line = line.left(line.length()-1);
+  if (len > 0 && data[len-1] == '\r')
+    --len;
+  line = mystringview(data, len);
   return 1;
 }
 
-static mystring parse_addr_arg(mystring& param)
+static mystring parse_addr_arg(const mystringview& param)
 {
-  mystring addr;
   unsigned i;
   char term;
   if ((i = param.find_first('<') + 1) > 0)
@@ -79,52 +107,111 @@ static mystring parse_addr_arg(mystring& param)
     while (i < param.length() && param[i] == ' ')
       ++i;
   }
+  mystringbuilder addr(param.length() + 1);
   for (bool quoted = false; i < param.length() && (quoted || param[i] != term); ++i) {
     switch (param[i]) {
     case '"':
       quoted = !quoted;
       break;
     case '\\':
-      ++i;
+      if (++i >= param.length())
+	break;
       // fall through
     default:
-      addr += param[i];
+      addr << param[i];
     }
   }
+  addr << '\n';
   // strip source routing
-  if (addr[0] == '@'
-      && (i = addr.find_first(':')) > 0)
-    addr = addr.right(i+1);
-  
-  return addr + "\n";
+  mystringview result = addr.view();
+  if (result[0] == '@'
+      && (i = result.find_first(':')) > 0)
+    result = result.right(i+1);
+  return result.str();
+}
+
+// Find the SIZE parameter following the address, as in
+// "FROM:<addr> SIZE=1234".
+static bool parse_size(const mystringview& param, unsigned long& size)
+{
+  int i = param.find_last('>');
+  if (i < 0)
+    return false;
+  mystringview rest = param.right(i + 1).lstrip();
+  while (!rest.empty()) {
+    int end = rest.find_first(' ');
+    mystringview word = end < 0 ? rest : rest.left(end);
+    if (word.left(5).equal_nocase("SIZE=")) {
+      const mystring value = word.right(5).str();
+      char* endptr;
+      size = strtoul(value.c_str(), &endptr, 10);
+      return endptr > value.c_str() && *endptr == 0;
+    }
+    if (end < 0)
+      break;
+    rest = rest.right(end + 1).lstrip();
+  }
+  return false;
 }
 
 static void do_reset(void)
 {
   sender = "";
-  recipients = "";
+  recipients.clear();
 }
 
+// Replies are only sent once there are no more commands waiting to be
+// read, so that a pipelining client gets them all in one packet.
 static bool respond(const char* msg)
 {
-  fout << msg << '\r' << endl;
-  return fout;
+  *out << msg << "\r\n";
+  if (in->buffered() == 0)
+    out->flush();
+  return *out;
+}
+
+// Data goes either to the queue writer, which writes it in this
+// process, or through a buffer into the pipe to nullmailer-queue.
+static bool qwrite(queue_writer* qw, fdobuf& out, const char* data, size_t len)
+{
+  if (qw != 0)
+    return qw->write(data, len);
+  return out.write(data, len);
 }
 
-static bool qwrite(int qfd, const char* data, size_t len)
+// The sender and recipients are kept with a newline after each one.
+static bool qenvelope(queue_writer& qw)
 {
-  ssize_t wr;
-  while (len > 0) {
-    wr = write(qfd, data, len);
-    if (wr <= 0)
+  mystring addr = sender.left(sender.length() - 1);
+  if (!qw.sender(addr))
+    return false;
+  const mystringview rcpts = recipients.view();
+  for (unsigned start = 0; start < rcpts.length(); ) {
+    const int nl = rcpts.find_first('\n', start);
+    addr = rcpts.sub(start, nl - start).str();
+    if (!qw.recipient(addr))
       return false;
-    len -= wr;
-    data += wr;
+    start = nl + 1;
   }
-  return true;
+  return qw.end_envelope();
 }
 
-static bool DATA(mystring& param)
+// Read the rest of a message that is not being queued, so that the
+// session can go on.
+static void discard_data(dotunstuffer& dec)
+{
+  const char* data;
+  unsigned len;
+  static char qbuf[FDBUF_SIZE + 1];
+  unsigned qlen;
+  while (!dec.done() && in->peek(data, len)) {
+    if (len >= sizeof qbuf)
+      len = sizeof qbuf - 1;
+    in->skip(dec.decode(data, len, qbuf, qlen));
+  }
+}
+
+static bool DATA(const mystringview& param)
 {
   if (!!param)
     return respond(resp_no_param);
@@ -133,87 +220,159 @@ static bool DATA(mystring& param)
   if (!recipients)
     return respond(resp_no_rcpt);
 
+  // If this process owns the queue, the message is written into it
+  // here instead of starting nullmailer-queue for it.
+  queue_writer writer(ferr);
+  queue_writer* qw = 0;
   queue_pipe nq;
-  autoclose wfd = nq.start();
-  if (wfd < 0)
-    return respond(resp_no_queue);
-  if (!qwrite(wfd, sender.c_str(), sender.length())
-      || !qwrite(wfd, recipients.c_str(), recipients.length())
-      || !qwrite(wfd, "\n", 1))
+  autoclose wfd;
+  if (queue_writer::usable()) {
+    qw = &writer;
+    if (!writer.open() || !qenvelope(writer))
+      return respond(resp_queue_err);
+  }
+  else {
+    wfd = nq.start();
+    if (wfd < 0)
+      return respond(resp_no_queue);
+  }
+  fdobuf qout(qw ? -1 : (int)wfd);
+  if (!qw && (!qout.write(sender.c_str(), sender.length())
+	      || !qout.write(recipients.c_str(), recipients.length())
+	      || !qout.write("\n", 1)))
     return respond(resp_qwrite_err);
+  const char* const write_err = qw ? resp_queue_err : resp_qwrite_err;
 
   if (!respond(resp_data_ok))
     return false;
+  stats_phase("data");
 
-  while (readline()) {
-    if (line.length() == 1 && line[0] == '.')
+  // A message that grows too big, or that cannot be written to the
+  // queue, is read to the end but not queued; nullmailer-queue is
+  // killed so that it does not queue what it got.
+  dotunstuffer dec;
+  const char* data;
+  unsigned len;
+  static char qbuf[FDBUF_SIZE + 1];
+  unsigned qlen;
+  unsigned long size = 0;
+  bool written = true;
+  while (!dec.done() && in->peek(data, len)) {
+    if (len >= sizeof qbuf)
+      len = sizeof qbuf - 1;
+    in->skip(dec.decode(data, len, qbuf, qlen));
+    size += qlen;
+    if (maxsize > 0 && size > maxsize)
+      break;
+    if (!qwrite(qw, qout, qbuf, qlen)) {
+      written = false;
       break;
-    if (line.length() > 1 && line[0] == '.')
-      line = line.sub(1, line.length() - 1);
-    line += '\n';
-    if (!qwrite(wfd, line.c_str(), line.length()))
+    }
+  }
+  if (!written || (maxsize > 0 && size > maxsize)) {
+    if (!qw) {
+      nq.kill(SIGTERM);
+      nq.wait_status();
+    }
+    discard_data(dec);
+    return respond(written ? resp_too_big : write_err);
+  }
+  qlen = dec.finish(qbuf);
+  if (!qwrite(qw, qout, qbuf, qlen))
+    return respond(write_err);
+
+  stats_phase("queue");
+  bool queued;
+  if (qw)
+    queued = writer.commit();
+  else {
+    if (!qout.flush())
       return respond(resp_qwrite_err);
+    wfd.close();
+    queued = nq.wait();
   }
-  wfd.close();
+  stats_phase("commands");
+  return respond(queued ? resp_queue_ok
+		 : qw ? resp_queue_err : resp_queue_exiterr);
+}
 
-  return respond(nq.wait() ? resp_queue_ok : resp_queue_exiterr);
+static bool EHLO(const mystringview& param)
+{
+  if (!param)
+    return respond(resp_need_param);
+  if (!respond("250-nullmailer-smtpd")
+      || !respond("250-PIPELINING"))
+    return false;
+  if (maxsize == 0)
+    return respond("250 SIZE");
+  const mystring size = "250 SIZE " + mystring(itoa(maxsize));
+  return respond(size.c_str());
 }
 
-static bool HELO(mystring& param)
+static bool HELO(const mystringview& param)
 {
   if (!param)
     return respond(resp_need_param);
   return respond(resp_ok);
 }
 
-static bool HELP(mystring&)
+static bool HELP(const mystringview&)
 {
   return respond(resp_help);
 }
 
-static bool MAIL(mystring& param)
+static bool MAIL(const mystringview& param)
 {
   if (!param)
     return respond(resp_need_param);
   do_reset();
+  unsigned long size;
+  if (!parse_size(param, size))
+    size = 0;
+  if (maxsize > 0 && size > maxsize)
+    return respond(resp_too_big);
+  // Turn the message away before it is sent if the queue is full.
+  mystring reason;
+  if (!queue_admit(size, reason))
+    return respond(resp_queue_full);
   sender = parse_addr_arg(param);
   return respond(!sender ? resp_mail_bad : resp_mail_ok);
 }
 
-static bool NOOP(mystring&)
+static bool NOOP(const mystringview&)
 {
   return respond(resp_ok);
 }
 
-static bool QUIT(mystring&)
+static bool QUIT(const mystringview&)
 {
   respond(resp_goodbye);
   return false;
 }
 
-static bool RCPT(mystring& param)
+static bool RCPT(const mystringview& param)
 {
   if (!param)
     return respond(resp_need_param);
   if (!sender)
     return respond(resp_no_mail);
   mystring tmp = parse_addr_arg(param);
-  recipients += tmp;
+  recipients << tmp;
   return respond(!tmp ? resp_rcpt_bad : resp_rcpt_ok);
 }
 
-static bool RSET(mystring&)
+static bool RSET(const mystringview&)
 {
   do_reset();
   return respond(resp_ok);
 }
 
-static bool VRFY(mystring&)
+static bool VRFY(const mystringview&)
 {
   return respond(resp_unimp);
 }
 
-typedef bool (*dispatch_fn)(mystring& param);
+typedef bool (*dispatch_fn)(const mystringview& param);
 struct dispatch 
 {
   const char* cmd;
@@ -221,7 +380,7 @@ struct dispatch
 };
 static struct dispatch dispatch_table[] = {
   { "DATA", DATA },
-  { "EHLO", HELO },
+  { "EHLO", EHLO },
   { "HELO", HELO },
   { "HELP", HELP },
   { "MAIL", MAIL },
@@ -235,33 +394,387 @@ static struct dispatch dispatch_table[] = {
 
 static bool dispatch()
 {
-  mystring cmd;
-  mystring param;
-  cmd = line;
-  for (size_t i = 0; i < line.length(); i++) {
-    if (line[i] == ' ') {
-      cmd = line.left(i);
-      param = line.right(i+1).lstrip();
-      break;
-    }
+  mystringview cmd = line;
+  mystringview param;
+  int i = line.find_first(' ');
+  if (i >= 0) {
+    cmd = line.left(i);
+    param = line.right(i+1).lstrip();
   }
-  cmd = cmd.upper();
   struct dispatch* d;
   for (d = dispatch_table; d->cmd != 0; d++) {
-    if (cmd == d->cmd)
+    if (cmd.equal_nocase(d->cmd))
       return d->fn(param);
   }
   return respond("500 5.5.1 Not implemented");
 }
 
-int main(void)
+static void session()
 {
-  mystring line;
+  do_reset();
+  stats_phase("commands");
   if (!respond("220 nullmailer-smtpd ready"))
-    return 0;
+    return;
   while (readline()) {
     if (!dispatch())
-      return 0;
+      return;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Listener
+///////////////////////////////////////////////////////////////////////////////
+// With --listen, connections are accepted here and each is handed to
+// one of a pool of worker processes, which runs the session and then
+// waits for the next one.  The pool size limits the sessions at once.
+#define LISTEN_MAX 16
+
+#define fail(MSG) do{ fout << "nullmailer-smtpd: " << MSG << endl; return 1; }while(0)
+#define failsys(MSG) do{ fout << "nullmailer-smtpd: " << MSG << strerror(errno) << endl; return 1; }while(0)
+
+struct worker
+{
+  pid_t pid;
+  int chan;			// Socket to pass connections over
+  bool busy;
+  mystring peer;		// Address of the client while busy
+};
+
+static int listeners[LISTEN_MAX];
+static unsigned nlisteners = 0;
+static worker* workers = 0;
+static unsigned nworkers = 16;
+static unsigned per_peer = 0;
+static int session_timeout = 300;
+static poller events;
+
+static bool listen_unix(const char* path, int& sock)
+{
+  struct sockaddr_un sa;
+  memset(&sa, 0, sizeof sa);
+  sa.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof sa.sun_path) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  strcpy(sa.sun_path, path);
+  if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    return false;
+  unlink(path);
+  return bind(sock, (struct sockaddr*)&sa, sizeof sa) == 0;
+}
+
+// The address is a path for a Unix socket, or [HOST:]PORT, with an
+// IPv6 host in brackets.
+static bool listen_tcp(const char* address, int& sock)
+{
+  mystring host;
+  mystring port = address;
+  if (address[0] == '[') {
+    const char* end = strchr(address, ']');
+    if (end == 0 || end[1] != ':')
+      return false;
+    host = mystring(address + 1, end - address - 1);
+    port = end + 2;
+  }
+  else if (const char* colon = strrchr(address, ':')) {
+    host = mystring(address, colon - address);
+    port = colon + 1;
+  }
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  struct addrinfo* ai;
+  if (getaddrinfo(!host ? 0 : host.c_str(), port.c_str(), &hints, &ai) != 0) {
+    errno = EINVAL;
+    return false;
+  }
+  // Prefer IPv6, which also accepts IPv4 connections when listening on
+  // all addresses.
+  struct addrinfo* use = ai;
+  for (struct addrinfo* a = ai; a != 0; a = a->ai_next)
+    if (a->ai_family == AF_INET6) {
+      use = a;
+      break;
+    }
+  bool ok = (sock = socket(use->ai_family, SOCK_STREAM, 0)) >= 0;
+  if (ok) {
+    int on = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+    ok = bind(sock, use->ai_addr, use->ai_addrlen) == 0;
   }
+  freeaddrinfo(ai);
+  return ok;
+}
+
+// Name the address a socket is bound to, giving the port chosen when
+// the address asked for port 0.
+static mystring bound_name(int sock, const char* address)
+{
+  struct sockaddr_storage sa;
+  socklen_t salen = sizeof sa;
+  char host[NI_MAXHOST];
+  char port[NI_MAXSERV];
+  if (address[0] == '/'
+      || getsockname(sock, (struct sockaddr*)&sa, &salen) < 0
+      || getnameinfo((struct sockaddr*)&sa, salen, host, sizeof host,
+		     port, sizeof port, NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+    return address;
+  if (sa.ss_family == AF_INET6)
+    return mystring("[") + host + "]:" + port;
+  return mystring(host) + ":" + port;
+}
+
+static bool listen_on(const char* address)
+{
+  int sock = -1;
+  if (nlisteners >= LISTEN_MAX) {
+    errno = EMFILE;
+    return false;
+  }
+  if (!(address[0] == '/' ? listen_unix(address, sock)
+	: listen_tcp(address, sock))
+      || listen(sock, SOMAXCONN) < 0
+      || fcntl(sock, F_SETFL, O_NONBLOCK) < 0
+      || fcntl(sock, F_SETFD, FD_CLOEXEC) < 0
+      || !events.add(sock)) {
+    if (sock >= 0)
+      close(sock);
+    return false;
+  }
+  listeners[nlisteners++] = sock;
+  return true;
+}
+
+static bool send_fd(int chan, int fd)
+{
+  char byte = 0;
+  struct iovec iov;
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof msg);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  char control[CMSG_SPACE(sizeof fd)];
+  memset(control, 0, sizeof control);
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof control;
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof fd);
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof fd);
+  return sendmsg(chan, &msg, 0) == 1;
+}
+
+static int recv_fd(int chan)
+{
+  char byte;
+  struct iovec iov;
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof msg);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  char control[CMSG_SPACE(sizeof(int))];
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof control;
+  if (recvmsg(chan, &msg, 0) != 1)
+    return -1;
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == 0 || cmsg->cmsg_level != SOL_SOCKET
+      || cmsg->cmsg_type != SCM_RIGHTS)
+    return -1;
+  int fd;
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof fd);
+  return fd;
+}
+
+// Run sessions until the listener goes away, telling it as each one
+// ends.
+static void worker_loop(int chan)
+{
+  int fd;
+  while ((fd = recv_fd(chan)) >= 0) {
+    {
+      fdibuf cin(fd);
+      fdobuf cout(fd);
+      cin.set_timeout(session_timeout * 1000);
+      cout.set_timeout(session_timeout * 1000);
+      in = &cin;
+      out = &cout;
+      session();
+      out->flush();
+      in = &fin;
+      out = &fout;
+    }
+    close(fd);
+    char done = 0;
+    if (write(chan, &done, 1) != 1)
+      break;
+  }
+}
+
+static bool start_worker(worker& w)
+{
+  int pair[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+    return false;
+  fout.flush();
+  if ((w.pid = fork()) < 0) {
+    close(pair[0]);
+    close(pair[1]);
+    return false;
+  }
+  if (w.pid == 0) {
+    close(pair[0]);
+    for (unsigned i = 0; i < nlisteners; i++)
+      close(listeners[i]);
+    for (unsigned i = 0; i < nworkers; i++)
+      if (workers[i].chan >= 0)
+	close(workers[i].chan);
+    worker_loop(pair[1]);
+    _exit(0);
+  }
+  close(pair[1]);
+  w.chan = pair[0];
+  w.busy = false;
+  w.peer = "";
+  fcntl(w.chan, F_SETFD, FD_CLOEXEC);
+  return events.add(w.chan);
+}
+
+static void refuse(int fd, const char* msg)
+{
+  ssize_t ignored = write(fd, msg, strlen(msg));
+  (void)ignored;
+  close(fd);
+}
+
+static void accept_client(int sock)
+{
+  struct sockaddr_storage sa;
+  socklen_t salen = sizeof sa;
+  int fd = accept(sock, (struct sockaddr*)&sa, &salen);
+  if (fd < 0)
+    return;
+  char host[NI_MAXHOST] = "";
+  if (sa.ss_family == AF_INET || sa.ss_family == AF_INET6)
+    getnameinfo((struct sockaddr*)&sa, salen, host, sizeof host, 0, 0,
+		NI_NUMERICHOST);
+  worker* idle = 0;
+  unsigned same = 0;
+  for (unsigned i = 0; i < nworkers; i++) {
+    if (!workers[i].busy) {
+      if (idle == 0 && workers[i].chan >= 0)
+	idle = &workers[i];
+    }
+    else if (host[0] != 0 && workers[i].peer == host)
+      ++same;
+  }
+  if (per_peer > 0 && same >= per_peer)
+    refuse(fd, "421 4.7.0 Too many connections from your address\r\n");
+  else if (idle == 0)
+    refuse(fd, "421 4.3.2 Too many connections, try again later\r\n");
+  else if (!send_fd(idle->chan, fd))
+    refuse(fd, "421 4.3.0 Could not start the session\r\n");
+  else {
+    idle->busy = true;
+    idle->peer = host;
+    close(fd);
+  }
+}
+
+// A worker said its session is done, or exited.
+static void worker_ready(worker& w)
+{
+  char done;
+  if (read(w.chan, &done, 1) == 1) {
+    w.busy = false;
+    w.peer = "";
+    return;
+  }
+  events.remove(w.chan);
+  close(w.chan);
+  w.chan = -1;
+  waitpid(w.pid, 0, 0);
+  if (!start_worker(w))
+    fout << "nullmailer-smtpd: Could not start a worker: "
+	 << strerror(errno) << endl;
+}
+
+static bool parse_count(const char* arg, const char* option, unsigned& value)
+{
+  const size_t len = strlen(option);
+  if (strncmp(arg, option, len) != 0)
+    return false;
+  value = strtoul(arg + len, 0, 10);
+  return true;
+}
+
+static int serve(int argc, char* argv[])
+{
+  if (!events)
+    fail("Could not set up the event loop.");
+  for (int i = 1; i < argc; i++) {
+    unsigned timeout;
+    if (parse_count(argv[i], "--sessions=", nworkers)
+	|| parse_count(argv[i], "--per-ip=", per_peer))
+      continue;
+    if (parse_count(argv[i], "--timeout=", timeout)) {
+      session_timeout = timeout;
+      continue;
+    }
+    if (strcmp(argv[i], "--listen") == 0 && ++i < argc) {
+      if (!listen_on(argv[i]))
+	failsys("Could not listen on " << argv[i] << ": ");
+      fout << "nullmailer-smtpd: Listening on "
+	   << bound_name(listeners[nlisteners - 1], argv[i]) << '.' << endl;
+      continue;
+    }
+    fail("usage: nullmailer-smtpd [--listen ADDRESS]... [--sessions=N] [--per-ip=N] [--timeout=SECONDS]");
+  }
+  if (nlisteners == 0 || nworkers == 0)
+    fail("usage: nullmailer-smtpd [--listen ADDRESS]... [--sessions=N] [--per-ip=N] [--timeout=SECONDS]");
+
+  workers = new worker[nworkers];
+  for (unsigned i = 0; i < nworkers; i++)
+    workers[i].chan = -1;
+  for (unsigned i = 0; i < nworkers; i++)
+    if (!start_worker(workers[i]))
+      failsys("Could not start a worker: ");
+
+  int* ready = new int[LISTEN_MAX + nworkers];
+  for (;;) {
+    int n = events.wait(-1, ready, LISTEN_MAX + nworkers);
+    if (n < 0)
+      failsys("Error waiting for connections: ");
+    for (int r = 0; r < n; r++) {
+      for (unsigned i = 0; i < nworkers; i++)
+	if (workers[i].chan == ready[r])
+	  worker_ready(workers[i]);
+      for (unsigned i = 0; i < nlisteners; i++)
+	if (listeners[i] == ready[r])
+	  accept_client(listeners[i]);
+    }
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  // A message that is too big leaves data buffered for the killed
+  // nullmailer-queue, which must not kill this program when it is
+  // written out.
+  signal(SIGPIPE, SIG_IGN);
+  int size;
+  if (config_readint("maxmsgsize", size) && size > 0)
+    maxsize = size;
+  if (argc > 1)
+    return serve(argc, argv);
+  session();
   return 0;
 }
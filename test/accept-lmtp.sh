@@ -0,0 +1,26 @@
+# Accepts every recipient, and at the end of the data defers or rejects
+# the recipients named for it and delivers to the rest
+echo '220 OK'
+rcpts=
+while read cmd
+do
+  case "$cmd" in
+    LHLO*) echo '250-OK'; echo '250 PIPELINING' ;;
+    RCPT*) rcpts="$rcpts ${cmd#RCPT TO:}"; echo '250 OK' ;;
+    DATA*)
+      echo '354 OK'
+      while read line && test "$line" != $'.\r'; do :; done
+      for rcpt in $rcpts
+      do
+	case "$rcpt" in
+	  *full*) echo '452 4.2.2 Mailbox full' ;;
+	  *bad*) echo '550 5.1.1 No such user' ;;
+	  *) echo '250 2.0.0 Delivered' ;;
+	esac
+      done
+      rcpts=
+      ;;
+    QUIT*) echo '221 OK'; exit ;;
+    *) echo '250 OK' ;;
+  esac
+done
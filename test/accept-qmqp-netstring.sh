@@ -0,0 +1,15 @@
+# Accepts the message only if it arrives as correctly sized netstrings
+export LC_ALL=C
+read -r -d : outer
+read -r -t 5 -N "$outer" packet
+read -r -t 5 -N 1 comma
+inner=${packet%%:*}
+rest=${packet#*:}
+if test "${#packet}" != "$outer" || test "$comma" != , \
+   || test "${rest:$inner:1}" != , \
+   || ! grep -qx 'Just testing, please ignore' <<< "${rest:0:$inner}"
+then
+  echo -n '15:DBad netstring,'
+  exit
+fi
+echo -n '3:KOK,'
@@ -0,0 +1,20 @@
+# Rejects every BDAT chunk, and says on standard error how many it got
+export LC_ALL=C
+echo '220 OK'
+read cmd
+echo '250-OK'
+echo '250-PIPELINING'
+echo '250 CHUNKING'
+chunks=0
+while read cmd len last
+do
+  case "$cmd" in
+    BDAT)
+      read -r -N ${len%$'\r'} body
+      chunks=$(( $chunks + 1 ))
+      echo '554 Rejected'
+      ;;
+    QUIT*) echo "$chunks chunk(s)" >&2; echo '221 OK'; exit ;;
+    *) echo '250 OK' ;;
+  esac
+done
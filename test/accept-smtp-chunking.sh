@@ -0,0 +1,26 @@
+# Accepts the message only if it arrives as one correctly formed BDAT
+export LC_ALL=C
+echo '220 OK'
+read cmd
+echo '250-OK'
+echo '250 CHUNKING'
+read mail
+echo '250 OK'
+read rcpt
+echo '250 OK'
+read bdat len last
+if test "$bdat" != BDAT || test "$last" != $'LAST\r'
+then
+  echo '554 No BDAT'
+  exit
+fi
+read -r -N $len body
+if test "${#body}" != "$len" || ! grep -qx $'\\.dot\r' <<< "$body" \
+   || grep -q $'[^\r]$' <<< "$body"
+then
+  echo '554 Bad chunk'
+  exit
+fi
+echo '250 OK'
+read quit
+echo '221 OK'
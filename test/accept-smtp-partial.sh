@@ -0,0 +1,18 @@
+# Defers or rejects recipients or their domains by name, and accepts
+# the rest
+echo '220 OK'
+while read cmd
+do
+  case "$cmd" in
+    RCPT*defer*) echo '451 4.2.0 Try again later' ;;
+    RCPT*bad*) echo '550 5.1.1 No such user' ;;
+    RCPT*gone*) echo '550 5.1.2 No such domain' ;;
+    DATA*)
+      echo '354 OK'
+      while read line && test "$line" != $'.\r'; do :; done
+      echo '250 OK'
+      ;;
+    QUIT*) echo '221 OK'; exit ;;
+    *) echo '250 OK' ;;
+  esac
+done
@@ -0,0 +1,20 @@
+# Fails the message unless the envelope commands arrive in one batch
+echo '220 OK'
+read cmd
+echo '250-OK'
+echo '250 PIPELINING'
+read mail
+if ! read -t 1 rcpt1 || ! read -t 1 rcpt2
+then
+  echo '451 Not pipelined'
+  exit
+fi
+echo '250 OK'
+echo '250 OK'
+echo '250 OK'
+read data
+echo '354 OK'
+while read line && test "$line" != $'.\r'; do :; done
+echo '250 OK'
+read quit
+echo '221 OK'
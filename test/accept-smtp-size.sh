@@ -0,0 +1,27 @@
+# Fails the message unless MAIL FROM declares the size of the message
+# that follows
+echo '220 OK'
+read cmd
+echo '250-OK'
+echo '250 SIZE'
+read mail
+size=${mail##* SIZE=}
+size=${size%$'\r'}
+echo '250 OK'
+read rcpt
+echo '250 OK'
+read data
+echo '354 OK'
+count=0
+while IFS= read -r line && test "$line" != $'.\r'; do
+  line=${line%$'\r'}
+  count=$(( count + ${#line} + 1 ))
+done
+if test "$size" = "$mail" || test "$size" != $count
+then
+  echo '552 Wrong size'
+else
+  echo '250 OK'
+fi
+read quit
+echo '221 OK'
@@ -0,0 +1,4 @@
+# Sends the greeting and then never replies to anything
+echo '220 OK'
+read cmd
+sleep 5
@@ -0,0 +1,10 @@
+# Refuses every message as being sent too fast
+echo '220 OK'
+while read cmd
+do
+  case "$cmd" in
+    MAIL*) echo '421 4.7.0 Rate limited, retry in 90s'; exit ;;
+    QUIT*) echo '221 OK'; exit ;;
+    *) echo '250 OK' ;;
+  esac
+done
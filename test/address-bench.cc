@@ -0,0 +1,113 @@
+// Time parse_addresses over a corpus of header lines, and count the
+// allocations it makes:  address-bench [--reference] [ROUNDS]
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include "ac/time.h"
+#include "canonicalize.h"
+#include "mystring/mystring.h"
+#include "address.h"
+#include "address-ref.h"
+#include "alloccount.h"
+
+#include "fdbuf/fdbuf.h"
+#include "itoa.h"
+
+mystring defaulthost = "a";
+mystring defaultdomain = "b.c";
+
+struct sample
+{
+  const char* name;
+  mystring line;
+};
+
+static mystring repeat(const char* sep, const char* prefix,
+		       const char* suffix, unsigned count)
+{
+  mystring line;
+  for (unsigned i = 0; i < count; i++) {
+    if (i)
+      line += sep;
+    line += prefix;
+    line += itoa(i);
+    line += suffix;
+  }
+  return line;
+}
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Print a value with one decimal place.
+static void format(double value)
+{
+  unsigned long tenths = (unsigned long)(value * 10 + 0.5);
+  fout << itoa(tenths / 10) << '.' << itoa(tenths % 10);
+}
+
+int main(int argc, char* argv[])
+{
+  bool reference = false;
+  if (argc > 1 && strcmp(argv[1], "--reference") == 0) {
+    reference = true;
+    --argc;
+    ++argv;
+  }
+  unsigned rounds = argc > 1 ? strtoul(argv[1], 0, 10) : 20;
+
+  const sample corpus[] = {
+    { "single", "joe@example.com" },
+    { "display name", "Joe Random <joe@example.com>" },
+    { "comments", "joe@example.com (Joe Random), (work) jr@example.net" },
+    { "quoted", "\"Random, Joe Q.\" <\"joe q\"@example.com>" },
+    { "route", "<@relay.example.net:joe@example.com>" },
+    { "domain literal", "joe@[192.0.2.1]" },
+    { "long list", repeat(", ", "\"User Name\" <user", "@example.com>", 1000) },
+    { "group", "undisclosed: " + repeat(", ", "u", "@example.com", 1000) + ";" },
+    { "comment list", repeat(", ", "u", "@example.com (a comment)", 1000) },
+  };
+  const unsigned nsamples = sizeof corpus / sizeof corpus[0];
+
+  double total_time = 0;
+  unsigned long total_addrs = 0;
+  unsigned long total_allocs = 0;
+  for (unsigned s = 0; s < nsamples; s++) {
+    unsigned long addrs = 0;
+    unsigned long allocs = 0;
+    bool parsed = true;
+    double start = now();
+    for (unsigned r = 0; r < rounds; r++) {
+      mystring line = corpus[s].line;
+      mystring list;
+      unsigned long before = allocations;
+      parsed = reference ? address_ref::parse_addresses(line, list)
+	: parse_addresses(line, list);
+      allocs += allocations - before;
+      for (const char* p = list.c_str(); (p = strchr(p, '\n')) != 0; ++p)
+	++addrs;
+    }
+    double elapsed = now() - start;
+    // A line that fails to parse still counts as one address tried.
+    if (addrs == 0)
+      addrs = rounds;
+    fout << corpus[s].name << ": ";
+    format(elapsed * 1e9 / addrs);
+    fout << " ns/address, ";
+    format((double)allocs / addrs);
+    fout << " allocations/address" << (parsed ? "" : " (not parsed)") << endl;
+    total_time += elapsed;
+    total_addrs += addrs;
+    total_allocs += allocs;
+  }
+  fout << "total: ";
+  format(total_time * 1e9 / total_addrs);
+  fout << " ns/address, ";
+  format((double)total_allocs / total_addrs);
+  fout << " allocations/address" << endl;
+  return 0;
+}
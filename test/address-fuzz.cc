@@ -0,0 +1,75 @@
+// Compare parse_addresses with the reference parser on generated
+// lines: address-fuzz [SEED [COUNT]]
+#include "config.h"
+#include <stdlib.h>
+#include "canonicalize.h"
+#include "mystring/mystring.h"
+#include "address.h"
+#include "address-ref.h"
+
+#include "fdbuf/fdbuf.h"
+#include "itoa.h"
+
+mystring defaulthost = "a";
+mystring defaultdomain = "b.c";
+
+// Pieces of addresses the lines are assembled from: the specials, the
+// token types, whitespace, controls and 8-bit bytes, and some whole
+// addresses and groups.
+static const char* pieces[] = {
+  "a", "bc", "x.y", "localhost", "joe@example.com", "Joe <j@x>",
+  "@", "<", ">", ",", ";", ":", ".", "\\", "\"", "(", ")", "[", "]",
+  " ", "  ", "\t", "\n", "\r\n ",
+  "(c)", "(nested (comment))", "\"q q\"", "\"a\\\"b\"", "[1.2.3.4]",
+  "@r1,@r2:", "grp: a@b, c@d;", "\x01", "\x7f", "\xc3\xa9",
+};
+static const unsigned npieces = sizeof pieces / sizeof pieces[0];
+
+static mystring generate()
+{
+  mystring line;
+  for (unsigned n = random() % 16; n > 0; --n) {
+    if (random() % 16 == 0)
+      line += (char)(1 + random() % 255);
+    else
+      line += pieces[random() % npieces];
+  }
+  return line;
+}
+
+static void show(const char* name, bool ok, const mystring& line,
+		 const mystring& list)
+{
+  fout << name << ": ";
+  if (!ok)
+    fout << "failed" << endl;
+  else
+    fout << "line '" << line << "' list '" << list << "'" << endl;
+}
+
+int main(int argc, char* argv[])
+{
+  unsigned seed = argc > 1 ? strtoul(argv[1], 0, 10) : 1;
+  unsigned count = argc > 2 ? strtoul(argv[2], 0, 10) : 100000;
+  srandom(seed);
+  unsigned failed = 0;
+  for (unsigned i = 0; i < count; i++) {
+    const mystring in = generate();
+    mystring line = in;
+    mystring list;
+    mystring refline = in;
+    mystring reflist;
+    bool ok = parse_addresses(line, list);
+    bool refok = address_ref::parse_addresses(refline, reflist);
+    if (ok == refok && (!ok || (line == refline && list == reflist)))
+      continue;
+    if (++failed <= 10) {
+      fout << "Parsing of '" << in << "' differs:" << endl;
+      show("parser", ok, line, list);
+      show("reference", refok, refline, reflist);
+    }
+  }
+  fout << itoa(count) << " tests run, ";
+  fout << itoa(failed) << " failed." << endl;
+  return failed != 0;
+}
@@ -0,0 +1,10 @@
+#ifndef NULLMAILER__ADDRESS_REF__H__
+#define NULLMAILER__ADDRESS_REF__H__
+
+#include "mystring/mystring.h"
+
+namespace address_ref {
+  bool parse_addresses(mystring& line, mystring& list);
+}
+
+#endif // NULLMAILER__ADDRESS_REF__H__
@@ -0,0 +1,42 @@
+// Replacements of the global allocation operators that count the
+// allocations a benchmark makes.
+#include "config.h"
+#include <stdlib.h>
+#include "alloccount.h"
+
+unsigned long allocations = 0;
+
+void* operator new(size_t size)
+{
+  ++allocations;
+  void* ptr = malloc(size ? size : 1);
+  // The tree is built without exceptions.
+  if (!ptr)
+    abort();
+  return ptr;
+}
+
+void* operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete(void* ptr) throw()
+{
+  free(ptr);
+}
+
+void operator delete[](void* ptr) throw()
+{
+  free(ptr);
+}
+
+void operator delete(void* ptr, size_t) throw()
+{
+  free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) throw()
+{
+  free(ptr);
+}
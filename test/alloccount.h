@@ -0,0 +1,8 @@
+#ifndef NULLMAILER__ALLOCCOUNT__H__
+#define NULLMAILER__ALLOCCOUNT__H__
+
+// The number of times operator new has been called, counted by the
+// replacement operators in alloccount.cc that a benchmark links in.
+extern unsigned long allocations;
+
+#endif // NULLMAILER__ALLOCCOUNT__H__
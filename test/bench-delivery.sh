@@ -0,0 +1,98 @@
+#!/bin/bash
+# Measure the throughput and latency of nullmailer-send against a fake
+# remote:  bench-delivery.sh [MODE...]
+# The modes are serial, parallel, serial-reuse and parallel-reuse, all
+# four by default.  The parallel modes deliver up to $BENCH_CONCURRENCY
+# messages at once, and the reuse modes send through one session per
+# remote with the multi option.  Run it from the test directory of the
+# build tree, after make.
+#
+# The other settings come from the environment:
+#   BENCH_MESSAGES	messages to queue (500)
+#   BENCH_RATE		messages queued a second, or 0 for flat out (0)
+#   BENCH_SIZES		body sizes in bytes, used in turn (1000,10000)
+#   BENCH_VIA		queue, inject or sendmail (queue)
+#   BENCH_PROTOCOL	smtp or qmqp (smtp)
+#   BENCH_LATENCY	milliseconds added to each reply of the remote (0)
+#   BENCH_TEMPFAIL	percentage of messages deferred by the remote (0)
+#   BENCH_PERMFAIL	percentage of messages rejected by the remote (0)
+#   BENCH_CONCURRENCY	deliveries at once in the parallel modes (4)
+#   BENCH_TIMEOUT	seconds to wait for each run to finish (300)
+
+: ${BENCH_MESSAGES:=500}
+: ${BENCH_RATE:=0}
+: ${BENCH_SIZES:=1000,10000}
+: ${BENCH_VIA:=queue}
+: ${BENCH_PROTOCOL:=smtp}
+: ${BENCH_LATENCY:=0}
+: ${BENCH_TEMPFAIL:=0}
+: ${BENCH_PERMFAIL:=0}
+: ${BENCH_CONCURRENCY:=4}
+: ${BENCH_TIMEOUT:=300}
+
+run_mode() {
+    local mode=$1
+    local concurrency=1
+    local options=
+    case $mode in
+	serial) ;;
+	parallel) concurrency=$BENCH_CONCURRENCY ;;
+	serial-reuse) options=multi ;;
+	parallel-reuse) concurrency=$BENCH_CONCURRENCY; options=multi ;;
+	*) echo "Unknown mode: $mode"; return 1 ;;
+    esac
+
+    . ./functions
+    local log=$tmpdir/sink.log
+    local sinkopts="--latency=$BENCH_LATENCY --tempfail=$BENCH_TEMPFAIL --permfail=$BENCH_PERMFAIL"
+    [ $BENCH_PROTOCOL = qmqp ] && sinkopts="$sinkopts --qmqp"
+    start sink $builddir/test/bench-sink $sinkopts $log
+    local port=
+    for i in $( seq 50 ); do
+	port=$( head -n 1 $tmpdir/service/sink-log 2>/dev/null )
+	[ -n "$port" ] && break
+	sleep 0.1
+    done
+    [ -n "$port" ] || fail "The sink did not start"
+
+    echo "127.0.0.1 $BENCH_PROTOCOL port=$port $options" >$SYSCONFDIR/remotes
+    echo $concurrency >$SYSCONFDIR/maxconcurrency
+    # Deferred messages are retried straight away.
+    echo 1 >$SYSCONFDIR/pausetime
+    echo 1 >$SYSCONFDIR/maxpause
+    start send $builddir/src/nullmailer-send
+
+    local injected=$( $builddir/test/bench-inject --via=$BENCH_VIA \
+	--rate=$BENCH_RATE --sizes=$BENCH_SIZES --bindir=$builddir/src \
+	$BENCH_MESSAGES )
+    local deadline=$(( $( date +%s ) + $BENCH_TIMEOUT ))
+    local done=0
+    while [ $done -lt $BENCH_MESSAGES ]; do
+	[ $( date +%s ) -lt $deadline ] || fail "$mode: Timed out after $done messages"
+	sleep 0.1
+	done=$( grep -c ' ok$\| permfail$' $log || : )
+    done
+    stop send sink
+
+    echo "$mode: $injected"
+    awk '
+	NR == 1 || $1 < first { first = $1 }
+	$2 > last { last = $2 }
+	{ n[$4]++ }
+	END {
+	    secs = (last - first) / 1e6
+	    printf "  %d ok, %d tempfail, %d permfail in %.3fs, %.1f messages/s\n",
+		n["ok"], n["tempfail"], n["permfail"], secs,
+		(n["ok"] + n["permfail"]) / (secs > 0 ? secs : 1)
+	}' $log
+    echo "  attempt ms: $( sed -n 's/^Delivery took \([0-9]*\)ms.*/\1/p' \
+	$tmpdir/service/send-log | percentiles )"
+    echo "  queue to delivery ms: $( awk '$4 != "tempfail" { print ($2 - $1) / 1000 }' \
+	$log | percentiles )"
+}
+
+modes="$*"
+[ -n "$modes" ] || modes="serial parallel serial-reuse parallel-reuse"
+for mode in $modes; do
+    ( run_mode $mode ) || exit 1
+done
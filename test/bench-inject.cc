@@ -0,0 +1,132 @@
+// Queue messages for a benchmark of nullmailer-send:
+//   bench-inject [--via=queue|inject|sendmail] [--rate=N] [--sizes=N,...]
+//                [--bindir=DIR] COUNT
+// Each message is piped into nullmailer-queue, nullmailer-inject or
+// sendmail, with an X-Bench-Sent header holding the time it was handed
+// over in microseconds.  With a rate, the messages are spaced out to
+// that many a second; otherwise each is queued as soon as the one
+// before it.  The body sizes in bytes are used in turn, so that a list
+// of them makes a size distribution.  It prints the number of messages
+// queued and how long that took.
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ac/time.h"
+#include "fdbuf/fdbuf.h"
+#include "forkexec.h"
+#include "itoa.h"
+#include "mystring/mystring.h"
+
+const char* cli_program = "bench-inject";
+
+static const char* via = "queue";
+static const char* bindir = "../src";
+static double rate = 0;
+
+static long long now_usec()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+#define MAX_SIZES 64
+static unsigned long sizes[MAX_SIZES] = { 1000 };
+static unsigned size_count = 1;
+
+static void parse_sizes(const char* arg)
+{
+  size_count = 0;
+  for (const char* p = arg; *p && size_count < MAX_SIZES; ) {
+    char* end;
+    sizes[size_count++] = strtoul(p, &end, 10);
+    p = *end == ',' ? end + 1 : end + strlen(end);
+  }
+}
+
+static bool queue_message(unsigned n, unsigned long size)
+{
+  const mystring program = mystring(bindir) + "/"
+    + (strcmp(via, "queue") == 0 ? "nullmailer-queue"
+       : strcmp(via, "inject") == 0 ? "nullmailer-inject" : "sendmail");
+  const char* queue_args[] = { program.c_str(), 0 };
+  const char* inject_args[] = { program.c_str(), "-f", "bench@example.com",
+				"sink@example.net", 0 };
+  const bool envelope = strcmp(via, "queue") == 0;
+  fork_exec fp(via);
+  int redirs[] = { REDIRECT_PIPE_TO, REDIRECT_NONE, REDIRECT_NONE };
+  if (!fp.start(envelope ? queue_args : inject_args, 3, redirs))
+    return false;
+  fdobuf out(redirs[0], true);
+  if (envelope)
+    out << "bench@example.com\n"
+      "sink@example.net\n"
+      "\n";
+  out << "From: bench@example.com\n"
+    "To: sink@example.net\n"
+    "Subject: benchmark message " << n << "\n"
+    "X-Bench-Sent: " << itoa(now_usec()) << "\n"
+    "\n";
+  // The body is lines of 72 characters and a line break.
+  static const char text[] =
+    "The quick brown fox jumps over the lazy dog, again and again and again.\n";
+  for (unsigned long left = size; left > 0; ) {
+    const unsigned long len = left < sizeof text - 1 ? left : sizeof text - 1;
+    out.write(text + sizeof text - 1 - len, len);
+    left -= len;
+  }
+  if (!out.close())
+    return false;
+  return fp.wait();
+}
+
+int main(int argc, char* argv[])
+{
+  int i;
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    const char* arg = argv[i];
+    if (strncmp(arg, "--via=", 6) == 0)
+      via = arg + 6;
+    else if (strncmp(arg, "--rate=", 7) == 0)
+      rate = atof(arg + 7);
+    else if (strncmp(arg, "--sizes=", 8) == 0)
+      parse_sizes(arg + 8);
+    else if (strncmp(arg, "--bindir=", 9) == 0)
+      bindir = arg + 9;
+    else {
+      ferr << "bench-inject: Unknown option: " << arg << endl;
+      return 1;
+    }
+  }
+  if (i != argc - 1 || size_count == 0
+      || (strcmp(via, "queue") != 0 && strcmp(via, "inject") != 0
+	  && strcmp(via, "sendmail") != 0)) {
+    ferr << "usage: bench-inject [--via=queue|inject|sendmail] [--rate=N] "
+      "[--sizes=N,...] [--bindir=DIR] COUNT" << endl;
+    return 1;
+  }
+  const unsigned count = strtoul(argv[i], 0, 10);
+
+  const long long start = now_usec();
+  unsigned queued = 0;
+  for (unsigned n = 0; n < count; n++) {
+    if (rate > 0) {
+      const long long due = start + (long long)(n * 1e6 / rate);
+      const long long wait = due - now_usec();
+      if (wait > 0)
+	usleep(wait);
+    }
+    if (queue_message(n, sizes[n % size_count]))
+      ++queued;
+    else
+      ferr << "bench-inject: Could not queue message " << n << endl;
+  }
+  char line[100];
+  snprintf(line, sizeof line, "Queued %u messages in %.3fs\n",
+	   queued, (now_usec() - start) / 1e6);
+  fout << line;
+  fout.flush();
+  return queued == count ? 0 : 1;
+}
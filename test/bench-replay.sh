@@ -0,0 +1,104 @@
+#!/bin/bash
+# Replay a queue snapshot, written by queue-snapshot, through
+# nullmailer-send and report how long the queue took to drain:
+#   bench-replay.sh SNAPSHOT [CONFIG...]
+# Each remote in the snapshot is played by a bench-sink with the
+# latency and error rates recorded for it, and they are listed in the
+# remotes file in the same order.  Each CONFIG is a file of control
+# files to set for one run, one to a line as the name and its value,
+# with "options" giving options to add to every remote, such as:
+#   maxconcurrency 8
+#   options multi
+# The snapshot is replayed into an empty queue for each of them, or
+# once with the defaults if there are none.  Run it from the test
+# directory of the build tree, after make.
+#
+# The other settings come from the environment:
+#   BENCH_PROTOCOL	smtp or qmqp (smtp)
+#   BENCH_TIMEOUT	seconds to wait for each run to finish (600)
+
+: ${BENCH_PROTOCOL:=smtp}
+: ${BENCH_TIMEOUT:=600}
+
+queued() { find $QUEUEDIR/queue -type f -not -name '.*' | wc -l; }
+
+run_config() {
+    local snapshot=$1
+    local config=$2
+    local label=$( basename ${config:-default} )
+
+    . ./functions
+    local remotes=$( awk '$1 == "remote" { print $2 }' $snapshot )
+    local options=
+    : >$SYSCONFDIR/remotes
+    for r in $remotes; do
+	local sinkopts=$( awk -v r=$r '$1 == "remote" && $2 == r {
+	    for (i = 3; i <= NF; i++) printf " --%s", $i }' $snapshot )
+	[ $BENCH_PROTOCOL = qmqp ] && sinkopts="$sinkopts --qmqp"
+	start sink-$r $builddir/test/bench-sink $sinkopts $tmpdir/sink-$r.log
+    done
+    if [ -n "$config" ]; then
+	while read file value; do
+	    case $file in
+		''|'#'*) ;;
+		options) options="$options $value" ;;
+		*) echo "$value" >$SYSCONFDIR/$file ;;
+	    esac
+	done <$config
+    fi
+    for r in $remotes; do
+	local port=
+	for i in $( seq 50 ); do
+	    port=$( head -n 1 $tmpdir/service/sink-$r-log 2>/dev/null )
+	    [ -n "$port" ] && break
+	    sleep 0.1
+	done
+	[ -n "$port" ] || fail "The sink for $r did not start"
+	echo "127.0.0.1 $BENCH_PROTOCOL port=$port$options" >>$SYSCONFDIR/remotes
+    done
+    # Deferred messages are retried straight away.
+    [ -f $SYSCONFDIR/pausetime ] || echo 1 >$SYSCONFDIR/pausetime
+    [ -f $SYSCONFDIR/maxpause ] || echo 1 >$SYSCONFDIR/maxpause
+
+    local replayed=$( $builddir/test/queue-synth --snapshot=$snapshot )
+    local messages=$( queued )
+    local start=$( date +%s%N )
+    start send $builddir/src/nullmailer-send
+    local deadline=$(( $( date +%s ) + $BENCH_TIMEOUT ))
+    while [ $( queued ) -gt 0 ]; do
+	[ $( date +%s ) -lt $deadline ] || fail "$label: Timed out with $( queued ) messages left"
+	sleep 0.1
+    done
+    local secs=$( echo $start $( date +%s%N ) | awk '{ printf "%.3f", ($2 - $1) / 1e9 }' )
+    stop send
+    for r in $remotes; do
+	stop sink-$r
+    done
+
+    echo "$label: $replayed"
+    echo "  drained $messages messages in ${secs}s," \
+	"$( echo $messages $secs | awk '{ printf "%.1f", $1 / ($2 > 0 ? $2 : 1) }' ) messages/s"
+    for r in $remotes; do
+	awk -v r=$r '{ n[$4]++ } END {
+	    printf "  %s: %d ok, %d tempfail, %d permfail\n",
+		r, n["ok"], n["tempfail"], n["permfail"] }' $tmpdir/sink-$r.log
+    done
+    echo "  attempt ms: $( sed -n 's/^Delivery took \([0-9]*\)ms.*/\1/p' \
+	$tmpdir/service/send-log | percentiles )"
+    echo "  queue to delivery ms: $( cat $tmpdir/sink-*.log | \
+	awk '$1 > 0 && $4 != "tempfail" { print ($2 - $1) / 1000 }' | percentiles )"
+}
+
+[ $# -ge 1 ] || { echo "usage: $0 SNAPSHOT [CONFIG...]"; exit 1; }
+snapshot=$( cd $( dirname $1 ) && pwd )/$( basename $1 )
+shift
+configs=
+for config in "$@"; do
+    configs="$configs $( cd $( dirname $config ) && pwd )/$( basename $config )"
+done
+if [ -z "$configs" ]; then
+    ( run_config $snapshot ) || exit 1
+fi
+for config in $configs; do
+    ( run_config $snapshot $config ) || exit 1
+done
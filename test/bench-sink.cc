@@ -0,0 +1,258 @@
+// A fast fake SMTP or QMQP server for benchmarking nullmailer-send:
+//   bench-sink [--qmqp] [--latency=MS] [--tempfail=PCT] [--permfail=PCT] LOG
+// It listens on an unused port on 127.0.0.1, writes the port number to
+// standard output, and serves each connection in a child process.  The
+// latency is added to each round trip, so that pipelined commands only
+// wait once.  For each message it appends a line to LOG holding the
+// time it was handed to nullmailer (from its X-Bench-Sent header) and
+// the time it was received, both in microseconds, its size, and the
+// result it was given: ok, tempfail or permfail.
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "ac/time.h"
+#include "fdbuf/fdbuf.h"
+#include "mystring/mystring.h"
+#include "netstring.h"
+
+static bool qmqp = false;
+static int latency_ms = 0;
+static int tempfail_pct = 0;
+static int permfail_pct = 0;
+static int logfd = -1;
+
+enum outcome { ok, tempfail, permfail };
+static const char* const outcome_names[] = { "ok", "tempfail", "permfail" };
+
+static long long now_usec()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static outcome draw_outcome()
+{
+  int r = random() % 100;
+  if (r < permfail_pct)
+    return permfail;
+  if (r < permfail_pct + tempfail_pct)
+    return tempfail;
+  return ok;
+}
+
+// The stamp from the X-Bench-Sent header, if the line is one.
+static bool sent_stamp(const char* line, unsigned len, long long& sent)
+{
+  static const char name[] = "X-Bench-Sent:";
+  const unsigned namelen = sizeof name - 1;
+  if (len <= namelen || strncasecmp(line, name, namelen) != 0)
+    return false;
+  sent = strtoll(mystring(line + namelen, len - namelen).c_str(), 0, 10);
+  return true;
+}
+
+static void log_message(long long sent, unsigned long size, outcome result)
+{
+  char line[128];
+  int len = snprintf(line, sizeof line, "%lld %lld %lu %s\n",
+		     sent, now_usec(), size, outcome_names[result]);
+  // Each line goes out in one write, so that the lines from the
+  // concurrent sessions do not get mixed up.
+  if (write(logfd, line, len) != len)
+    _exit(1);
+}
+
+// Queue a reply, and send the replies once the client is waiting for
+// them, that is when no more pipelined commands are buffered.
+static bool reply(fdibuf& in, fdobuf& out, const char* text)
+{
+  out << text << "\r\n";
+  if (in.buffered() > 0)
+    return true;
+  if (latency_ms > 0)
+    usleep(latency_ms * 1000);
+  return out.flush();
+}
+
+static bool command_is(const char* line, unsigned len, const char* cmd)
+{
+  const unsigned cmdlen = strlen(cmd);
+  return len >= cmdlen && strncasecmp(line, cmd, cmdlen) == 0
+    && (len == cmdlen || line[cmdlen] == ' ' || line[cmdlen] == ':');
+}
+
+// Read the message data up to the terminating dot.
+static bool read_data(fdibuf& in, long long& sent, unsigned long& size)
+{
+  bool header = true;
+  const char* line;
+  unsigned len;
+  sent = 0;
+  size = 0;
+  while (in.getline(line, len)) {
+    if (len > 0 && line[len-1] == '\r')
+      --len;
+    if (len == 1 && line[0] == '.')
+      return true;
+    if (len == 0)
+      header = false;
+    else if (header)
+      sent_stamp(line, len, sent);
+    size += len + 1;
+  }
+  return false;
+}
+
+static void smtp_session(int fd)
+{
+  fdibuf in(fd);
+  fdobuf out(fd);
+  if (!reply(in, out, "220 bench-sink ESMTP"))
+    return;
+  const char* line;
+  unsigned len;
+  while (in.getline(line, len)) {
+    if (len > 0 && line[len-1] == '\r')
+      --len;
+    bool sent_ok;
+    if (command_is(line, len, "EHLO"))
+      sent_ok = reply(in, out,
+		      "250-bench-sink\r\n"
+		      "250-PIPELINING\r\n"
+		      "250-8BITMIME\r\n"
+		      "250 SIZE");
+    else if (command_is(line, len, "HELO")
+	     || command_is(line, len, "MAIL")
+	     || command_is(line, len, "RCPT")
+	     || command_is(line, len, "RSET")
+	     || command_is(line, len, "NOOP"))
+      sent_ok = reply(in, out, "250 OK");
+    else if (command_is(line, len, "DATA")) {
+      long long sent;
+      unsigned long size;
+      if (!reply(in, out, "354 Go ahead") || !read_data(in, sent, size))
+	return;
+      const outcome result = draw_outcome();
+      log_message(sent, size, result);
+      sent_ok = reply(in, out,
+		      result == ok ? "250 2.0.0 Accepted"
+		      : result == tempfail ? "451 4.3.0 Try again later"
+		      : "554 5.7.1 Rejected");
+    }
+    else if (command_is(line, len, "QUIT")) {
+      reply(in, out, "221 Bye");
+      return;
+    }
+    else
+      sent_ok = reply(in, out, "502 Command not implemented");
+    if (!sent_ok)
+      return;
+  }
+}
+
+static void qmqp_session(int fd)
+{
+  fdibuf in(fd);
+  fdobuf out(fd);
+  mystring packet;
+  mystring message;
+  if (!in.getnetstring(packet) || net2str(packet, message) <= 0)
+    return;
+  long long sent = 0;
+  for (unsigned start = 0; start < message.length(); ) {
+    int end = message.find_first('\n', start);
+    if (end < 0)
+      end = message.length();
+    if (end == (int)start)
+      break;
+    sent_stamp(message.c_str() + start, end - start, sent);
+    start = end + 1;
+  }
+  const outcome result = draw_outcome();
+  log_message(sent, message.length(), result);
+  if (latency_ms > 0)
+    usleep(latency_ms * 1000);
+  out << str2net(result == ok ? "Kbench-sink accepted"
+		 : result == tempfail ? "Ztry again later"
+		 : "Drejected");
+  out.flush();
+}
+
+static bool int_option(const char* arg, const char* name, int& value)
+{
+  const unsigned len = strlen(name);
+  if (strncmp(arg, name, len) != 0 || arg[len] != '=')
+    return false;
+  value = atoi(arg + len + 1);
+  return true;
+}
+
+int main(int argc, char* argv[])
+{
+  int i;
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "--qmqp") == 0)
+      qmqp = true;
+    else if (!int_option(argv[i], "--latency", latency_ms)
+	     && !int_option(argv[i], "--tempfail", tempfail_pct)
+	     && !int_option(argv[i], "--permfail", permfail_pct)) {
+      ferr << "bench-sink: Unknown option: " << argv[i] << endl;
+      return 1;
+    }
+  }
+  if (i != argc - 1) {
+    ferr << "usage: bench-sink [--qmqp] [--latency=MS] [--tempfail=PCT] "
+      "[--permfail=PCT] LOG" << endl;
+    return 1;
+  }
+  logfd = open(argv[i], O_WRONLY | O_CREAT | O_APPEND, 0666);
+  if (logfd < 0) {
+    ferr << "bench-sink: Could not open the log: " << strerror(errno) << endl;
+    return 1;
+  }
+
+  int s = socket(PF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sa;
+  memset(&sa, 0, sizeof sa);
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t salen = sizeof sa;
+  if (s < 0
+      || bind(s, (struct sockaddr*)&sa, sizeof sa) != 0
+      || listen(s, 128) != 0
+      || getsockname(s, (struct sockaddr*)&sa, &salen) != 0) {
+    ferr << "bench-sink: Could not listen: " << strerror(errno) << endl;
+    return 1;
+  }
+  fout << ntohs(sa.sin_port) << endl;
+
+  signal(SIGCHLD, SIG_IGN);
+  for (;;) {
+    int fd = accept(s, 0, 0);
+    if (fd < 0) {
+      if (errno == EINTR)
+	continue;
+      ferr << "bench-sink: Could not accept: " << strerror(errno) << endl;
+      return 1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(s);
+      srandom(now_usec() ^ getpid());
+      if (qmqp)
+	qmqp_session(fd);
+      else
+	smtp_session(fd);
+      _exit(0);
+    }
+    close(fd);
+  }
+}
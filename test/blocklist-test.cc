@@ -0,0 +1,116 @@
+#include "blocklist.h"
+
+#include "fdbuf/fdbuf.h"
+#include "itoa.h"
+#include "mystring/mystring.h"
+#include "check.h"
+
+typedef blocklist<mystring, 4> slist;
+
+// Check that the list holds the numbers from..to-1 for which keep is
+// true, in order.
+static void check(const char* name, const slist& l,
+		  unsigned from, unsigned to, bool (*keep)(unsigned))
+{
+  ++count;
+  slist::const_iter i(l);
+  unsigned expected = 0;
+  for (unsigned n = from; n < to; n++) {
+    if (!keep(n))
+      continue;
+    ++expected;
+    if (!i || *i != itoa(n)) {
+      fout << name << " failed, was: " << (i ? (*i).c_str() : "end")
+	   << " should be: " << itoa(n) << endl;
+      ++failed;
+      return;
+    }
+    i++;
+  }
+  if (i || l.count() != expected) {
+    fout << name << " failed, wrong count, was: " << itoa(l.count())
+	 << " should be: " << itoa(expected) << endl;
+    ++failed;
+  }
+}
+
+static bool all(unsigned) { return true; }
+static bool odd(unsigned n) { return n % 2 == 1; }
+static bool none(unsigned) { return false; }
+static bool low(unsigned n) { return n < 5; }
+
+static void fill(slist& l, unsigned from, unsigned to)
+{
+  for (unsigned n = from; n < to; n++)
+    l.append(itoa(n));
+}
+
+static void remove_if(slist& l, bool (*drop)(unsigned))
+{
+  unsigned n = 0;
+  for (slist::iter i(l); i; n++) {
+    if (drop(n))
+      l.remove(i);
+    else
+      i++;
+  }
+}
+
+static bool even(unsigned n) { return n % 2 == 0; }
+static bool high(unsigned n) { return n >= 5; }
+
+int main()
+{
+  slist l;
+  check("Empty list", l, 0, 0, all);
+  fill(l, 0, 10);
+  check("Appending across blocks", l, 0, 10, all);
+
+  const mystring* first = &*slist::const_iter(l);
+  fill(l, 10, 20);
+  ++count;
+  if (&*slist::const_iter(l) != first) {
+    fout << "Appending moved the first element" << endl;
+    ++failed;
+  }
+  l.empty();
+  fill(l, 0, 20);
+
+  remove_if(l, even);
+  check("Removing every other element", l, 0, 20, odd);
+  ++count;
+  if (l.holes() != 10) {
+    fout << "Removing left " << itoa(l.holes()) << " holes, should be 10" << endl;
+    ++failed;
+  }
+  l.compact();
+  check("Compacting", l, 0, 20, odd);
+  ++count;
+  if (l.holes() != 0) {
+    fout << "Compacting left " << itoa(l.holes()) << " holes" << endl;
+    ++failed;
+  }
+  fill(l, 20, 22);
+  ++count;
+  if (l.last() != "21") {
+    fout << "Appending after compacting failed, last was: " << l.last() << endl;
+    ++failed;
+  }
+
+  l.empty();
+  fill(l, 0, 10);
+  remove_if(l, high);
+  check("Removing the tail", l, 0, 10, low);
+  ++count;
+  if (l.holes() != 0) {
+    fout << "Removing the tail left " << itoa(l.holes()) << " holes" << endl;
+    ++failed;
+  }
+
+  remove_if(l, all);
+  check("Removing everything", l, 0, 10, none);
+
+  fout << itoa(count) << " tests run, ";
+  fout << itoa(failed) << " failed." << endl;
+  return failed;
+}
@@ -0,0 +1,92 @@
+#include "config.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cgroup.h"
+
+#include "fdbuf/fdbuf.h"
+#include "itoa.h"
+#include "mystring/mystring.h"
+#include "check.h"
+
+static mystring root;
+
+// Write a file under the root, making the directories above it.
+static void put(const char* path, const char* contents)
+{
+  mystring full = root;
+  for (const char* p = path; *p; p++) {
+    if (*p == '/')
+      mkdir(full.c_str(), 0700);
+    full += *p;
+  }
+  fdobuf out(full.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  out << contents << '\n';
+  out.flush();
+}
+
+static void clean()
+{
+  const mystring cmd = "rm -rf " + root + "/proc " + root + "/sys";
+  if (system(cmd.c_str()) != 0)
+    fout << "Could not clean up " << root << endl;
+}
+
+static void test_v2()
+{
+  cgroup_limits l;
+  put("/proc/self/cgroup", "0::/pod/app");
+  put("/sys/fs/cgroup/pod/app/cpu.max", "150000 100000");
+  put("/sys/fs/cgroup/pod/app/memory.max", "max");
+  put("/sys/fs/cgroup/pod/memory.max", "536870912");
+  check("v2", cgroup_read_limits(l, root)
+	&& l.millicpus == 1500 && l.memory == 536870912ULL);
+
+  put("/sys/fs/cgroup/pod/app/cpu.max", "max 100000");
+  put("/sys/fs/cgroup/pod/memory.max", "max");
+  check("v2 unlimited", !cgroup_read_limits(l, root)
+	&& l.millicpus == 0 && l.memory == 0);
+  clean();
+}
+
+static void test_v1()
+{
+  cgroup_limits l;
+  put("/proc/self/cgroup", "4:memory:/a/b\n2:cpu,cpuacct:/a/b\n1:pids:/a/b");
+  put("/sys/fs/cgroup/memory/a/b/memory.limit_in_bytes",
+      "9223372036854771712");
+  put("/sys/fs/cgroup/memory/a/memory.limit_in_bytes", "1073741824");
+  put("/sys/fs/cgroup/cpu,cpuacct/a/b/cpu.cfs_quota_us", "50000");
+  put("/sys/fs/cgroup/cpu,cpuacct/a/b/cpu.cfs_period_us", "100000");
+  put("/sys/fs/cgroup/cpu,cpuacct/cpu.cfs_quota_us", "-1");
+  put("/sys/fs/cgroup/cpu,cpuacct/cpu.cfs_period_us", "100000");
+  check("v1", cgroup_read_limits(l, root)
+	&& l.millicpus == 500 && l.memory == 1073741824ULL);
+  clean();
+
+  // Inside a container, the group's own directory is the mount.
+  put("/proc/self/cgroup", "4:memory:/a/b");
+  put("/sys/fs/cgroup/memory/memory.limit_in_bytes", "268435456");
+  check("v1 namespaced", cgroup_read_limits(l, root)
+	&& l.millicpus == 0 && l.memory == 268435456ULL);
+  clean();
+}
+
+int main(void)
+{
+  char dir[] = "/tmp/cgroup-test.XXXXXX";
+  if (mkdtemp(dir) == 0) {
+    fout << "Could not make a directory to test in" << endl;
+    return 1;
+  }
+  root = dir;
+  test_v2();
+  test_v1();
+  cgroup_limits l;
+  check("no control groups", !cgroup_read_limits(l, root));
+  check("online cpus", cgroup_online_cpus() >= 1);
+  rmdir(dir);
+  fout << itoa(count) << " tests run, " << itoa(failed) << " failed." << endl;
+  return failed > 0;
+}
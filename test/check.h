@@ -0,0 +1,21 @@
+#ifndef NULLMAILER__CHECK__H__
+#define NULLMAILER__CHECK__H__
+
+#include "fdbuf/fdbuf.h"
+
+// The number of checks made and of those that failed, which a test
+// reports at the end and exits with.
+static int count = 0;
+static int failed = 0;
+
+// Count a check, and report it by name if it failed.
+static inline void check(const char* name, bool ok)
+{
+  ++count;
+  if (!ok) {
+    fout << name << " failed" << endl;
+    ++failed;
+  }
+}
+
+#endif // NULLMAILER__CHECK__H__
@@ -0,0 +1,101 @@
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fdbuf/fdbuf.h"
+#include "fdbuf/mmapibuf.h"
+#include "itoa.h"
+#include "mystring/mystring.h"
+#include "stats.h"
+#include "check.h"
+
+int main(void)
+{
+  unsigned size = 16384;
+  char* a = fdbuf_pool_get(size);
+  check("get", a != 0 && size == 16384);
+  fdbuf_pool_put(a, size);
+  unsigned long before = run_stats.buffers;
+  char* b = fdbuf_pool_get(size);
+  check("reuse", b == a && run_stats.buffers == before);
+  unsigned odd = 5000;
+  char* c = fdbuf_pool_get(odd);
+  check("odd size", c != 0 && odd == 5000 && run_stats.buffers == before + 1);
+  fdbuf_pool_put(c, odd);
+  fdbuf_pool_put(b, size);
+
+  // Only buffers above FDBUF_SIZE count against the budget.
+  fdbuf_pool_budget(65536);
+  unsigned s1 = 32768, s2 = 65536, s3 = FDBUF_SIZE;
+  char* d1 = fdbuf_pool_get(s1);
+  char* d2 = fdbuf_pool_get(s2);
+  char* d3 = fdbuf_pool_get(s3);
+  check("within budget", s1 == 32768);
+  check("over budget", s2 == FDBUF_SIZE);
+  check("default size", s3 == FDBUF_SIZE);
+  fdbuf_pool_put(d1, s1);
+  fdbuf_pool_put(d2, s2);
+  s2 = 32768;
+  d2 = fdbuf_pool_get(s2);
+  check("budget given back", s2 == 32768 && d2 == d1);
+  fdbuf_pool_put(d2, s2);
+  fdbuf_pool_put(d3, s3);
+  fdbuf_pool_put(0, 4096);
+
+  char path[] = "/tmp/fdbufpool-test.XXXXXX";
+  int file = mkstemp(path);
+  if (file < 0) {
+    fout << "Could not make a file" << endl;
+    return 1;
+  }
+  check("empty file", fdbuf_size_for(file) == FDBUF_SIZE);
+  ftruncate(file, 10000);
+  check("small file", fdbuf_size_for(file) == 16384);
+  ftruncate(file, 10000000);
+  check("large file", fdbuf_size_for(file) == FDBUF_POOL_MAX);
+  int p[2];
+  if (pipe(p) == 0) {
+    check("pipe", fdbuf_size_for(p[0]) == FDBUF_SIZE);
+    close(p[0]);
+    close(p[1]);
+  }
+
+  ftruncate(file, 0);
+  for (int i = 0; i < 3000; i++)
+    write(file, "xxx", 3);
+  write(file, "\n", 1);
+  close(file);
+  fdbuf_pool_budget(1024*1024);
+  {
+    fdibuf in(path);
+    mystring line;
+    check("read sized", in.getline(line) && line.length() == 9000);
+  }
+  // A line longer than the buffer is still read whole when the budget
+  // stops the buffer from growing.
+  fdbuf_pool_budget(0);
+  {
+    fdibuf in(path, FDBUF_SIZE);
+    mystring line;
+    check("read within budget", in.getline(line) && line.length() == 9000);
+  }
+  // A mapped file takes no buffer from the pool; an odd size is never
+  // kept there, so any buffer taken would be a new one.
+  before = run_stats.buffers;
+  {
+    mmapibuf in(path, 5000);
+    mystring line;
+    check("mapped", in.mapped() && run_stats.buffers == before);
+    check("read mapped", in.getline(line) && line.length() == 9000);
+  }
+  if (pipe(p) == 0) {
+    mmapibuf in(p[0], true, 5000);
+    close(p[1]);
+    check("not mapped", !in.mapped() && run_stats.buffers == before + 1);
+  }
+  unlink(path);
+
+  fout << itoa(count) << " tests run, " << itoa(failed) << " failed." << endl;
+  return failed > 0;
+}
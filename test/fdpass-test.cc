@@ -0,0 +1,67 @@
+#include "config.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "fdpass.h"
+
+#include "fdbuf/fdbuf.h"
+#include "itoa.h"
+#include "mystring/mystring.h"
+#include "check.h"
+
+// Whether fd is open on a file holding exactly text.
+static bool holds(int fd, const char* text)
+{
+  char buf[64];
+  ssize_t rd = pread(fd, buf, sizeof buf, 0);
+  return rd == (ssize_t)strlen(text) && memcmp(buf, text, rd) == 0;
+}
+
+int main(void)
+{
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    fout << "Could not create a socket pair" << endl;
+    return 1;
+  }
+  char path[] = "/tmp/fdpass-test.XXXXXX";
+  int file = mkstemp(path);
+  if (file < 0 || write(file, "message", 7) != 7) {
+    fout << "Could not make a file to pass" << endl;
+    return 1;
+  }
+  // The file is only reachable through the descriptor from here on.
+  unlink(path);
+
+  mystring line;
+  int fd;
+  check("send with fd", fdpass_send(sv[1], "1001.1", file));
+  close(file);
+  check("receive with fd",
+	fdpass_recv(sv[0], line, fd) == 1 && line == "1001.1" && fd >= 0);
+  check("fd is the file", holds(fd, "message"));
+  check("fd is close-on-exec", fcntl(fd, F_GETFD) & FD_CLOEXEC);
+  close(fd);
+
+  check("send without fd", fdpass_send(sv[1], "1002.2", -1));
+  check("receive without fd",
+	fdpass_recv(sv[0], line, fd) == 1 && line == "1002.2" && fd == -1);
+
+  check("send empty", fdpass_send(sv[1], "", -1));
+  check("receive empty",
+	fdpass_recv(sv[0], line, fd) == 1 && !line && fd == -1);
+
+  // A job sent before the last was read is refused.
+  fdpass_send(sv[1], "a", -1);
+  fdpass_send(sv[1], "b", -1);
+  check("two jobs at once", fdpass_recv(sv[0], line, fd) == -1);
+
+  close(sv[1]);
+  check("end of file", fdpass_recv(sv[0], line, fd) == 0 && fd == -1);
+  close(sv[0]);
+
+  fout << itoa(count) << " tests run, " << itoa(failed) << " failed." << endl;
+  return failed > 0;
+}
@@ -0,0 +1,104 @@
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "iobatch.h"
+
+#include "fdbuf/fdbuf.h"
+#include "itoa.h"
+#include "mystring/mystring.h"
+#include "check.h"
+
+// Run the same calls with and without the ring, in a fresh directory.
+static void test(bool ring)
+{
+  const char* mode = ring ? " (ring)" : " (no ring)";
+  io_batch b(ring);
+
+  int fd = ::open("a", O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  if (write(fd, "hello", 5) != 5)
+    fd = -1;
+  int f = b.fsync(fd);
+  int bad = b.fsync(-1);
+  b.submit();
+  check(mystring(mystring("fsync") + mode).c_str(), b.result(f) == 0);
+  check(mystring(mystring("fsync bad fd") + mode).c_str(),
+	b.result(bad) == -EBADF);
+  close(fd);
+  b.clear();
+
+  int l = b.link("a", "b");
+  int l2 = b.link("a", "b");
+  b.submit();
+  // Whichever of the two links is made first succeeds.
+  check(mystring(mystring("link") + mode).c_str(),
+	(b.result(l) == 0 && b.result(l2) == -EEXIST)
+	|| (b.result(l2) == 0 && b.result(l) == -EEXIST));
+  b.clear();
+
+  struct stat st[3];
+  int s = b.stat("a", &st[0]);
+  int s2 = b.stat("b", &st[1]);
+  int missing = b.stat("c", &st[2]);
+  int o = b.open("b", O_RDONLY);
+  b.submit();
+  check(mystring(mystring("stat") + mode).c_str(),
+	b.result(s) == 0 && st[0].st_size == 5 && S_ISREG(st[0].st_mode));
+  check(mystring(mystring("stat link") + mode).c_str(),
+	b.result(s2) == 0 && st[1].st_ino == st[0].st_ino
+	&& st[1].st_dev == st[0].st_dev && st[1].st_nlink == 2);
+  check(mystring(mystring("stat missing") + mode).c_str(),
+	b.result(missing) == -ENOENT);
+  char buf[8];
+  check(mystring(mystring("open") + mode).c_str(),
+	b.result(o) >= 0 && read(b.result(o), buf, sizeof buf) == 5
+	&& memcmp(buf, "hello", 5) == 0);
+  if (b.result(o) >= 0)
+    close(b.result(o));
+  b.clear();
+
+  int u = b.unlink("a");
+  int u2 = b.unlink("b");
+  int u3 = b.unlink("c");
+  b.submit();
+  check(mystring(mystring("unlink") + mode).c_str(),
+	b.result(u) == 0 && b.result(u2) == 0 && b.result(u3) == -ENOENT
+	&& access("a", F_OK) < 0 && access("b", F_OK) < 0);
+  b.clear();
+
+  // A full batch takes no more calls.
+  struct stat many[IOBATCH_MAX];
+  fd = ::open("d", O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  close(fd);
+  for (unsigned i = 0; i < IOBATCH_MAX; i++)
+    b.stat("d", &many[i]);
+  check(mystring(mystring("full") + mode).c_str(),
+	b.full() && b.stat("d", &many[0]) == -1);
+  b.submit();
+  bool all = true;
+  for (unsigned i = 0; i < b.count(); i++)
+    all = all && b.result(i) == 0 && many[i].st_nlink == 1;
+  check(mystring(mystring("full batch") + mode).c_str(), all);
+  unlink("d");
+}
+
+int main(void)
+{
+  char dir[] = "/tmp/iobatch-test.XXXXXX";
+  if (mkdtemp(dir) == 0 || chdir(dir) < 0) {
+    fout << "Could not make a directory to test in" << endl;
+    return 1;
+  }
+  test(true);
+  test(false);
+  if (chdir("/") == 0)
+    rmdir(dir);
+  fout << itoa(count) << " tests run, " << itoa(failed) << " failed";
+  if (io_batch::have_ring())
+    fout << ", through io_uring";
+  fout << '.' << endl;
+  return failed > 0;
+}
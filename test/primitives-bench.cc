@@ -0,0 +1,261 @@
+// Time the buffered I/O, string and encoding primitives on typical
+// inputs, and count the allocations they make:  primitives-bench [ROUNDS]
+#include "config.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ac/time.h"
+#include "alloccount.h"
+#include "base64.h"
+#include "fdbuf/fdbuf.h"
+#include "itoa.h"
+#include "mystring/mystring.h"
+#include "netstring.h"
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Keeps the results of the work from being optimized away.
+static volatile unsigned long sink;
+
+// The operations done and the bytes they went through.
+struct work
+{
+  unsigned long ops;
+  unsigned long bytes;
+};
+
+// A message body of 72 character lines, the shape of most mail.
+#define LINE "The quick brown fox jumps over the lazy dog, again and again and again.\n"
+#define LINE_LENGTH (sizeof LINE - 1)
+#define MESSAGE_LINES 16384
+static char message_path[] = "/tmp/primitives-bench.XXXXXX";
+static mystring message;
+static mystring copy_path;
+
+static void make_message(void)
+{
+  for (unsigned i = 0; i < MESSAGE_LINES; i++)
+    message += LINE;
+  int fd = mkstemp(message_path);
+  if (fd < 0
+      || write(fd, message.c_str(), message.length()) != (ssize_t)message.length()
+      || close(fd) != 0) {
+    ferr << "primitives-bench: Could not write the test message" << endl;
+    exit(1);
+  }
+  copy_path = mystring(message_path) + ".copy";
+}
+
+static void getline_copied(unsigned rounds, work& w)
+{
+  for (unsigned r = 0; r < rounds; r++) {
+    fdibuf in(message_path);
+    mystring line;
+    while (in.getline(line)) {
+      sink += line.length();
+      ++w.ops;
+    }
+    w.bytes += message.length();
+  }
+}
+
+static void getline_in_place(unsigned rounds, work& w)
+{
+  for (unsigned r = 0; r < rounds; r++) {
+    fdibuf in(message_path);
+    const char* line;
+    unsigned len;
+    while (in.getline(line, len)) {
+      sink += len;
+      ++w.ops;
+    }
+    w.bytes += message.length();
+  }
+}
+
+static void copy_file(unsigned rounds, work& w)
+{
+  for (unsigned r = 0; r < rounds; r++) {
+    // A file, as the queue writes, since copies to /dev/null are free.
+    fdibuf in(message_path);
+    fdobuf out(copy_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC);
+    sink += fdbuf_copy(in, out);
+    ++w.ops;
+    w.bytes += message.length();
+  }
+}
+
+static void write_small(unsigned rounds, work& w)
+{
+  fdobuf out("/dev/null", O_WRONLY);
+  for (unsigned r = 0; r < rounds; r++)
+    for (unsigned i = 0; i < message.length(); i += 16) {
+      out.write(message.c_str() + i, 16);
+      ++w.ops;
+      w.bytes += 16;
+    }
+  out.flush();
+}
+
+static void write_lines(unsigned rounds, work& w)
+{
+  fdobuf out("/dev/null", O_WRONLY);
+  for (unsigned r = 0; r < rounds; r++)
+    for (unsigned i = 0; i < MESSAGE_LINES; i++) {
+      out << LINE;
+      ++w.ops;
+      w.bytes += LINE_LENGTH;
+    }
+  out.flush();
+}
+
+static void string_append(unsigned rounds, work& w)
+{
+  for (unsigned r = 0; r < rounds; r++) {
+    mystring s;
+    for (unsigned i = 0; i < 4096; i++) {
+      s += "0123456789abcdef";
+      ++w.ops;
+    }
+    sink += s.length();
+    w.bytes += s.length();
+  }
+}
+
+static void string_sub(unsigned rounds, work& w)
+{
+  for (unsigned r = 0; r < rounds; r++)
+    for (unsigned i = 0; i < MESSAGE_LINES; i++) {
+      mystring line = message.sub(i * LINE_LENGTH, LINE_LENGTH - 1);
+      sink += line.length();
+      ++w.ops;
+      w.bytes += line.length();
+    }
+}
+
+static void string_subst(unsigned rounds, work& w)
+{
+  // A long multi-line SMTP reply, as logged.
+  const mystring reply = message.left(64 * LINE_LENGTH);
+  for (unsigned r = 0; r < rounds * 64; r++) {
+    mystring flat = reply.subst('\n', '/');
+    sink += flat.length();
+    ++w.ops;
+    w.bytes += reply.length();
+  }
+}
+
+static void encode_netstring(unsigned rounds, work& w)
+{
+  const mystring line = message.left(LINE_LENGTH);
+  for (unsigned r = 0; r < rounds; r++)
+    for (unsigned i = 0; i < MESSAGE_LINES; i++) {
+      mystring ns = str2net(line);
+      sink += ns.length();
+      ++w.ops;
+      w.bytes += line.length();
+    }
+}
+
+static void decode_netstring(unsigned rounds, work& w)
+{
+  const mystring line = message.left(LINE_LENGTH);
+  mystring records;
+  for (unsigned i = 0; i < 1024; i++)
+    records += str2net(line);
+  for (unsigned r = 0; r < rounds * 16; r++) {
+    mystring buffer = records;
+    mystring field;
+    while (net2str(buffer, field) > 0) {
+      sink += field.length();
+      ++w.ops;
+      w.bytes += field.length();
+    }
+  }
+}
+
+static void encode_base64_short(unsigned rounds, work& w)
+{
+  // The size of an AUTH PLAIN response.
+  const mystring in = message.left(48);
+  for (unsigned r = 0; r < rounds * 1024; r++) {
+    mystring out;
+    base64_encode(in, out);
+    sink += out.length();
+    ++w.ops;
+    w.bytes += in.length();
+  }
+}
+
+static void encode_base64_long(unsigned rounds, work& w)
+{
+  for (unsigned r = 0; r < rounds; r++) {
+    mystring out;
+    base64_encode(message, out);
+    sink += out.length();
+    ++w.ops;
+    w.bytes += message.length();
+  }
+}
+
+struct benchmark
+{
+  const char* name;
+  void (*run)(unsigned rounds, work& w);
+};
+
+static const benchmark benchmarks[] = {
+  { "fdibuf getline", getline_copied },
+  { "fdibuf getline in place", getline_in_place },
+  { "fdbuf_copy", copy_file },
+  { "fdobuf write 16 bytes", write_small },
+  { "fdobuf << line", write_lines },
+  { "mystring append", string_append },
+  { "mystring sub", string_sub },
+  { "mystring subst", string_subst },
+  { "str2net", encode_netstring },
+  { "net2str", decode_netstring },
+  { "base64_encode 48 bytes", encode_base64_short },
+  { "base64_encode 1 MB", encode_base64_long },
+};
+
+// Print a value with one decimal place.
+static void format(double value)
+{
+  unsigned long tenths = (unsigned long)(value * 10 + 0.5);
+  fout << itoa(tenths / 10) << '.' << itoa(tenths % 10);
+}
+
+int main(int argc, char* argv[])
+{
+  unsigned rounds = argc > 1 ? strtoul(argv[1], 0, 10) : 20;
+  make_message();
+  for (unsigned b = 0; b < sizeof benchmarks / sizeof benchmarks[0]; b++) {
+    work w = { 0, 0 };
+    unsigned long before = allocations;
+    double start = now();
+    benchmarks[b].run(rounds, w);
+    double elapsed = now() - start;
+    unsigned long allocs = allocations - before;
+    if (w.ops == 0)
+      w.ops = 1;
+    if (elapsed <= 0)
+      elapsed = 1e-9;
+    fout << benchmarks[b].name << ": ";
+    format(w.bytes / elapsed / 1e6);
+    fout << " MB/s, ";
+    format(elapsed * 1e9 / w.ops);
+    fout << " ns/op, ";
+    format((double)allocs / w.ops);
+    fout << " allocations/op" << endl;
+  }
+  unlink(message_path);
+  unlink(copy_path.c_str());
+  return 0;
+}
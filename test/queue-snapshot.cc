@@ -0,0 +1,242 @@
+// Write an anonymized snapshot of the queue, for replaying it into a
+// test queue with queue-synth --snapshot:
+//   queue-snapshot [--metrics=FILE] >SNAPSHOT
+// Each message becomes a line giving its age in seconds, the size of
+// its header and body in bytes, and the domains of its sender and each
+// of its recipients:
+//   message 3600 5120 d1.example d2.example d2.example
+// The local parts are left out and every domain is renamed dN.example
+// in the order it is first seen, so that the mix of domains is kept
+// without naming any of them.  A null sender is written as "-".  The
+// remotes come first, renamed rN in the order nullmailer-send lists
+// them in its metrics file, with the mean time their deliveries took
+// in milliseconds and the percentages of them that were deferred and
+// rejected:
+//   remote r1 latency=35 tempfail=2 permfail=0
+#include "config.h"
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "ac/time.h"
+#include "cli++/cli++.h"
+#include "configio.h"
+#include "defines.h"
+#include "fdbuf/fdbuf.h"
+#include "itoa.h"
+#include "list.h"
+#include "mystring/mystring.h"
+#include "queuedirs.h"
+#include "queuefile.h"
+#include "routetable.h"
+
+static const char* opt_metrics = 0;
+
+const char* cli_program = "queue-snapshot";
+const char* cli_help_prefix =
+"Write an anonymized snapshot of the queue\n";
+const char* cli_help_suffix = "";
+const char* cli_args_usage = "";
+const int cli_args_min = 0;
+const int cli_args_max = 0;
+cli_option cli_options[] = {
+  { 0, "metrics", cli_option::string, 0, &opt_metrics,
+    "Take the remotes from this metrics file",
+    "the metrics file in the queue" },
+  CLI_OPTION_END
+};
+
+struct remote_stats
+{
+  mystring host;
+  double seconds;
+  unsigned long deliveries;
+  unsigned long results[3];	// tempfail, permfail, success
+  remote_stats(const mystring& h) : host(h), seconds(0), deliveries(0)
+  {
+    results[0] = results[1] = results[2] = 0;
+  }
+};
+
+static list<remote_stats> remotes;
+
+static remote_stats& find_remote(const mystring& host)
+{
+  for (list<remote_stats>::iter i(remotes); i; i++)
+    if ((*i).host == host)
+      return *i;
+  remotes.append(remote_stats(host));
+  return remotes.last();
+}
+
+// The value of the label in a sample line, such as host in
+//   nullmailer_delivery_seconds_sum{host="relay",protocol="smtp"} 1.5
+static mystring label(const char* line, const char* name)
+{
+  const mystring key = mystringjoin(name) + "=\"";
+  const char* start = strstr(line, key.c_str());
+  if (!start)
+    return "";
+  start += key.length();
+  const char* end = strchr(start, '"');
+  return end ? mystring(start, end - start) : mystring("");
+}
+
+static double sample(const char* line)
+{
+  const char* value = strrchr(line, ' ');
+  return value ? strtod(value + 1, 0) : 0;
+}
+
+static bool starts(const char* line, const char* prefix)
+{
+  return strncmp(line, prefix, strlen(prefix)) == 0;
+}
+
+static void read_metrics(const mystring& path)
+{
+  fdibuf in(path.c_str());
+  mystring line;
+  while (in.getline(line)) {
+    const char* l = line.c_str();
+    if (starts(l, "nullmailer_remote_up{"))
+      find_remote(label(l, "host"));
+    else if (starts(l, "nullmailer_delivery_seconds_sum{"))
+      find_remote(label(l, "host")).seconds = sample(l);
+    else if (starts(l, "nullmailer_delivery_seconds_count{"))
+      find_remote(label(l, "host")).deliveries = sample(l);
+    else if (starts(l, "nullmailer_delivery_attempts_total{")) {
+      static const char* const results[3] =
+	{ "tempfail", "permfail", "success" };
+      const mystring result = label(l, "result");
+      for (int i = 0; i < 3; i++)
+	if (result == results[i])
+	  find_remote(label(l, "host")).results[i] = sample(l);
+    }
+  }
+}
+
+static unsigned percent(unsigned long part, unsigned long whole)
+{
+  return whole ? (part * 100 + whole / 2) / whole : 0;
+}
+
+static void write_remotes()
+{
+  if (remotes.count() == 0)
+    remotes.append(remote_stats(""));
+  unsigned n = 0;
+  for (list<remote_stats>::const_iter i(remotes); i; i++) {
+    const remote_stats& r = *i;
+    const unsigned long attempts = r.results[0] + r.results[1] + r.results[2];
+    const unsigned long latency = r.deliveries
+      ? (unsigned long)(r.seconds * 1000 / r.deliveries + 0.5) : 0;
+    fout << "remote r" << itoa(++n)
+	 << " latency=" << itoa(latency)
+	 << " tempfail=" << itoa(percent(r.results[0], attempts))
+	 << " permfail=" << itoa(percent(r.results[1], attempts)) << '\n';
+  }
+}
+
+// The aliases are kept in a route table, each domain routing to its
+// own.
+static route_table domains;
+
+static mystring domain_of(const mystring& address)
+{
+  if (!address)
+    return "-";
+  const int at = address.find_first('@');
+  const mystring domain = at < 0 ? mystring("") : address.right(at + 1);
+  mystring alias;
+  if (!domains.find("x@" + domain, alias)) {
+    alias = "d" + mystring(itoa(domains.count() + 1)) + ".example";
+    domains.add("*@" + domain, alias);
+  }
+  return alias;
+}
+
+static bool write_message(const mystring& path, time_t now,
+			  unsigned long& bytes)
+{
+  struct stat st;
+  fdibuf in(path.c_str());
+  queuefile_header h;
+  if (!in || stat(path.c_str(), &st) != 0)
+    return false;
+  const bool versioned = queuefile_read(in, h);
+  mystring sender;
+  mystring line;
+  if (!in.getline(sender))
+    return false;
+  unsigned long envelope = sender.length() + 1;
+  mystring out = "message ";
+  const long age = now - atol(queuedir_name(path).c_str());
+  out += itoa(age > 0 ? age : 0);
+  mystring rcpts = " " + domain_of(sender);
+  unsigned count = 0;
+  while (in.getline(line) && !!line) {
+    envelope += line.length() + 1;
+    rcpts += " " + domain_of(line);
+    ++count;
+  }
+  if (count == 0)
+    return true;
+  const unsigned long size = versioned
+    ? h.header_length + h.body_size
+    : (unsigned long)st.st_size - envelope - 1;
+  bytes += size;
+  fout << out << ' ' << itoa(size) << rcpts << '\n';
+  return true;
+}
+
+// Find the messages in a queue directory, and in the subdirectories
+// of the queue itself.
+static void scan_dir(const mystring& prefix, list<mystring>& paths)
+{
+  DIR* dir = opendir(!prefix ? "." : prefix.c_str());
+  if (!dir)
+    return;
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != 0) {
+    const char* name = entry->d_name;
+    if (name[0] == '.')
+      continue;
+    if (!prefix && queuedir_is_subdir(name)) {
+      scan_dir(name, paths);
+      continue;
+    }
+    paths.append(!prefix ? mystring(name) : mystring(prefix + "/" + name));
+  }
+  closedir(dir);
+}
+
+int cli_main(int, char*[])
+{
+  read_metrics(opt_metrics ? mystring(opt_metrics)
+	       : CONFIG_PATH(QUEUE, NULL, "metrics"));
+  const mystring queue_dir = CONFIG_PATH(QUEUE, NULL, "queue");
+  if (chdir(queue_dir.c_str()) != 0) {
+    ferr << "queue-snapshot: Could not change to " << queue_dir << ": "
+	 << strerror(errno) << endl;
+    return 1;
+  }
+  list<mystring> paths;
+  scan_dir("", paths);
+  const time_t now = time(0);
+  fout << "# nullmailer queue snapshot of " << itoa(paths.count())
+       << " message(s)\n";
+  write_remotes();
+  unsigned long bytes = 0;
+  for (list<mystring>::const_iter i(paths); i; i++)
+    if (!write_message(*i, now, bytes))
+      ferr << "queue-snapshot: Could not read " << *i << endl;
+  fout.flush();
+  ferr << "queue-snapshot: " << itoa(paths.count()) << " message(s), "
+       << itoa(bytes) << " bytes, " << itoa(domains.count())
+       << " domain(s)" << endl;
+  return 0;
+}
@@ -0,0 +1,267 @@
+// Fill the queue with synthetic messages for stress tests of a large
+// queue:
+//   queue-synth [--dirs=N] [--max-size=BYTES] [--no-index] [--age=SECS]
+//               [--seed=N] COUNT
+//   queue-synth [--dirs=N] [--no-index] --snapshot=FILE
+// The messages and their indexes are written straight into the queue
+// layout, the way nullmailer-queue leaves them, spread over the
+// subdirectories set by the queuedirs control file unless --dirs says
+// otherwise.  Their envelopes and sizes are mixed like real mail: most
+// have one recipient and a few kilobytes, some have a handful of
+// recipients or an attachment, and a few go to long lists or carry
+// megabytes, up to the maximum size.  Their names date them over the
+// last --age seconds.
+// With --snapshot, the messages are those of a snapshot written by
+// queue-snapshot instead, each with its age, size and domains, and
+// carrying an X-Bench-Sent header for bench-sink to time it from.
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "ac/time.h"
+#include "cli++/cli++.h"
+#include "configio.h"
+#include "defines.h"
+#include "envindex.h"
+#include "fdbuf/fdbuf.h"
+#include "itoa.h"
+#include "mystring/mystring.h"
+#include "queuedirs.h"
+
+static int opt_dirs = -1;
+static unsigned opt_max_size = 1024 * 1024;
+static int opt_no_index = 0;
+static unsigned opt_age = 86400;
+static unsigned opt_seed = 1;
+static const char* opt_snapshot = 0;
+
+const char* cli_program = "queue-synth";
+const char* cli_help_prefix =
+"Fill the queue with synthetic messages\n";
+const char* cli_help_suffix = "";
+const char* cli_args_usage = "[count]";
+const int cli_args_min = 0;
+const int cli_args_max = 1;
+cli_option cli_options[] = {
+  { 0, "age", cli_option::uinteger, 0, &opt_age,
+    "Spread the message times over this many seconds", "86400" },
+  { 0, "dirs", cli_option::integer, 0, &opt_dirs,
+    "Number of queue subdirectories", "the queuedirs control file" },
+  { 0, "max-size", cli_option::uinteger, 0, &opt_max_size,
+    "Largest message size in bytes", "1048576" },
+  { 0, "no-index", cli_option::flag, 1, &opt_no_index,
+    "Do not write the message indexes", 0 },
+  { 0, "seed", cli_option::uinteger, 0, &opt_seed,
+    "Seed for the random mix", "1" },
+  { 0, "snapshot", cli_option::string, 0, &opt_snapshot,
+    "Replay the messages of a queue snapshot", 0 },
+  CLI_OPTION_END
+};
+
+static int dirs;
+
+static unsigned long pick(unsigned long low, unsigned long high)
+{
+  return low + random() % (high - low + 1);
+}
+
+static unsigned long pick_size()
+{
+  const unsigned r = random() % 1000;
+  unsigned long size;
+  if (r < 700)
+    size = pick(1000, 8000);
+  else if (r < 900)
+    size = pick(8000, 100000);
+  else if (r < 990)
+    size = pick(100000, 1000000);
+  else
+    size = pick(1000000, 5000000);
+  return size < opt_max_size ? size : opt_max_size;
+}
+
+static unsigned pick_recipients()
+{
+  const unsigned r = random() % 100;
+  if (r < 80)
+    return 1;
+  if (r < 95)
+    return pick(2, 5);
+  if (r < 99)
+    return pick(6, 20);
+  return pick(20, 100);
+}
+
+static const char* const domains[] = {
+  "example.com", "example.net", "example.org",
+};
+
+static mystring address(const char* user, unsigned long n)
+{
+  return mystringjoin(user) + itoa(n) + "@" + domains[n % 3];
+}
+
+static bool write_message(const mystring& msg_dir, const mystring& name,
+			  envelope_index& index, unsigned long size,
+			  const mystring& extra, unsigned long& bytes)
+{
+  mystring envelope = index.sender + "\n";
+  for (list<mystring>::const_iter i(index.recipients); i; i++)
+    envelope += *i + "\n";
+  envelope += "\n";
+  const mystring message_id = "<" + name + "@synth.example.com>";
+  index.message_id = "Message-Id: " + message_id;
+  const mystring header = "From: <" + index.sender + ">\n"
+    "To: <" + index.recipients.last() + ">\n"
+    "Subject: synthetic message " + name + "\n"
+    "Message-Id: " + message_id + "\n"
+    + extra + "\n";
+
+  const mystring path = msg_dir + queuedir_path(name, dirs);
+  fdobuf out(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0600);
+  if (!out)
+    return false;
+  out << envelope << header;
+  static const char text[] =
+    "The quick brown fox jumps over the lazy dog, again and again and again.\n";
+  unsigned long left = size > header.length() ? size - header.length() : 0;
+  while (left > 0) {
+    const unsigned long len = left < sizeof text - 1 ? left : sizeof text - 1;
+    out.write(text + sizeof text - 1 - len, len);
+    left -= len;
+  }
+  if (!out.flush() || !out.close())
+    return false;
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0)
+    return false;
+  bytes += st.st_size;
+  index.size = st.st_size;
+  index.offset = envelope.length();
+  return opt_no_index || envindex_write(envindex_path(name), index);
+}
+
+static bool make_subdir(const mystring& msg_dir, const mystring& name)
+{
+  if (dirs > 0) {
+    const mystring sub = msg_dir + queuedir_of(name, dirs);
+    if (mkdir(sub.c_str(), 0700) != 0 && errno != EEXIST) {
+      ferr << "queue-synth: Could not create " << sub << ": "
+	   << strerror(errno) << endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool write_random(const mystring& msg_dir, const mystring& name,
+			 unsigned long& bytes)
+{
+  envelope_index index;
+  index.sender = address("sender", random() % 1000);
+  const unsigned rcpts = pick_recipients();
+  for (unsigned i = 0; i < rcpts; i++)
+    index.recipients.append(address("user", random() % 100000));
+  return write_message(msg_dir, name, index, pick_size(), "", bytes);
+}
+
+// Replay the message lines of a snapshot:
+//   message AGE SIZE SENDER-DOMAIN RECIPIENT-DOMAIN...
+static bool replay_snapshot(const mystring& msg_dir, time_t now,
+			    unsigned long& count, unsigned long& bytes)
+{
+  fdibuf in(opt_snapshot);
+  if (!in) {
+    ferr << "queue-synth: Could not open " << opt_snapshot << ": "
+	 << strerror(errno) << endl;
+    return false;
+  }
+  mystring line;
+  while (in.getline(line)) {
+    if (strncmp(line.c_str(), "message ", 8) != 0)
+      continue;
+    char* end;
+    const unsigned long age = strtoul(line.c_str() + 8, &end, 10);
+    const unsigned long size = strtoul(end, &end, 10);
+    envelope_index index;
+    unsigned n = 0;
+    while (*end == ' ') {
+      const char* domain = ++end;
+      while (*end && *end != ' ')
+	++end;
+      const mystring d(domain, end - domain);
+      if (n++ == 0)
+	index.sender = d == "-" ? mystring("") : mystring("sender@" + d);
+      else
+	index.recipients.append("user" + mystring(itoa(n - 1)) + "@" + d);
+    }
+    if (index.recipients.count() == 0)
+      continue;
+    mystring name = itoa(now - age);
+    name += ".replay.";
+    name += itoa(count);
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    char sent[64];
+    snprintf(sent, sizeof sent, "X-Bench-Sent: %lld\n",
+	     tv.tv_sec * 1000000LL + tv.tv_usec);
+    if (!make_subdir(msg_dir, name))
+      return false;
+    if (!write_message(msg_dir, name, index, size, sent, bytes)) {
+      ferr << "queue-synth: Could not write message " << name << ": "
+	   << strerror(errno) << endl;
+      return false;
+    }
+    ++count;
+  }
+  return true;
+}
+
+int cli_main(int argc, char* argv[])
+{
+  if (!opt_snapshot && argc != 1)
+    usage(1, "A count or a snapshot is needed.");
+  unsigned long count = opt_snapshot ? 0 : strtoul(argv[0], 0, 10);
+  if (opt_age == 0)
+    opt_age = 1;
+  dirs = opt_dirs < 0 ? queuedirs_read() : opt_dirs;
+  if (dirs > QUEUEDIRS_MAX)
+    dirs = QUEUEDIRS_MAX;
+  srandom(opt_seed);
+
+  const mystring msg_dir = CONFIG_PATH(QUEUE, NULL, "queue") + "/";
+  struct timeval start;
+  gettimeofday(&start, 0);
+  const time_t now = start.tv_sec;
+  unsigned long bytes = 0;
+  if (opt_snapshot) {
+    if (!replay_snapshot(msg_dir, now, count, bytes))
+      return 1;
+  }
+  else
+    for (unsigned long n = 0; n < count; n++) {
+      mystring name = itoa(now - random() % opt_age);
+      name += ".synth.";
+      name += itoa(n);
+      if (!make_subdir(msg_dir, name))
+	return 1;
+      if (!write_random(msg_dir, name, bytes)) {
+	ferr << "queue-synth: Could not write message " << name << ": "
+	     << strerror(errno) << endl;
+	return 1;
+      }
+    }
+  struct timeval end;
+  gettimeofday(&end, 0);
+  char line[100];
+  snprintf(line, sizeof line, "Wrote %lu messages, %lu bytes, in %.3fs\n",
+	   count, bytes, (end.tv_sec - start.tv_sec)
+	   + (end.tv_usec - start.tv_usec) / 1e6);
+  fout << line;
+  fout.flush();
+  return 0;
+}
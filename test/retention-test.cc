@@ -0,0 +1,138 @@
+#include "config.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#include "retention.h"
+
+#include "fdbuf/fdbuf.h"
+#include "itoa.h"
+#include "mystring/mystring.h"
+#include "check.h"
+
+static const time_t now = 1000000000;
+
+// A failed message of the given size that failed age seconds ago.
+static void make(const char* name, unsigned size, time_t age)
+{
+  int fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  char buf[1024];
+  memset(buf, 'x', sizeof buf);
+  while (size > 0) {
+    unsigned n = size < sizeof buf ? size : sizeof buf;
+    if (write(fd, buf, n) != (ssize_t)n)
+      break;
+    size -= n;
+  }
+  close(fd);
+  struct timespec times[2];
+  times[0].tv_sec = times[1].tv_sec = now - age;
+  times[0].tv_nsec = times[1].tv_nsec = 0;
+  utimensat(AT_FDCWD, name, times, 0);
+}
+
+static bool exists(const char* name)
+{
+  return access(name, F_OK) == 0;
+}
+
+static void clean(void)
+{
+  DIR* d = opendir(".");
+  struct dirent* e;
+  while ((e = readdir(d)) != 0)
+    if (e->d_name[0] != '.')
+      unlink(e->d_name);
+  closedir(d);
+}
+
+static retention_limits limits(time_t lifetime, unsigned long files,
+			       unsigned long long bytes, bool archive = false)
+{
+  retention_limits l;
+  l.lifetime = lifetime;
+  l.files = files;
+  l.bytes = bytes;
+  l.archive = archive;
+  return l;
+}
+
+int main(void)
+{
+  char dir[] = "/tmp/retention-test.XXXXXX";
+  if (mkdtemp(dir) == 0 || chdir(dir) < 0) {
+    fout << "Could not make a directory to test in" << endl;
+    return 1;
+  }
+  unsigned long removed;
+  unsigned long long bytes;
+
+  make("1.1", 100, 3000);
+  make("2.2", 100, 2000);
+  make("3.3", 100, 1000);
+  check("no limits",
+	retention_enforce(".", limits(0, 0, 0), now, removed, bytes)
+	&& removed == 0 && exists("1.1") && exists("3.3"));
+  check("lifetime",
+	retention_enforce(".", limits(1500, 0, 0), now, removed, bytes)
+	&& removed == 2 && bytes == 200
+	&& !exists("1.1") && !exists("2.2") && exists("3.3"));
+  clean();
+
+  make("1.1", 100, 3000);
+  make("2.2", 100, 2000);
+  make("3.3", 100, 1000);
+  check("count",
+	retention_enforce(".", limits(0, 2, 0), now, removed, bytes)
+	&& removed == 1 && !exists("1.1") && exists("2.2") && exists("3.3"));
+  clean();
+
+  make("1.1", 300, 3000);
+  make("2.2", 100, 2000);
+  make("3.3", 100, 1000);
+  check("bytes",
+	retention_enforce(".", limits(0, 0, 250), now, removed, bytes)
+	&& removed == 1 && bytes == 300 && !exists("1.1") && exists("2.2"));
+  clean();
+
+  make("1.1", 100, 86400 * 2);
+  make("2.2", 100, 86400 * 2 - 1);
+  make("3.3", 100, 10);
+  check("archive",
+	retention_enforce(".", limits(86400, 0, 0, true), now, removed, bytes)
+	&& removed == 2 && !exists("1.1") && !exists("2.2") && exists("3.3"));
+#ifdef HAVE_LIBZ
+  const char* archive = RETENTION_ARCHIVE_PREFIX "2001-09-07.gz";
+  char buf[512];
+  int len = -1;
+  gzFile gz = gzopen(archive, "rb");
+  if (gz != 0) {
+    len = gzread(gz, buf, sizeof buf);
+    gzclose(gz);
+  }
+#else
+  const char* archive = RETENTION_ARCHIVE_PREFIX "2001-09-07";
+  char buf[512];
+  int fd = open(archive, O_RDONLY);
+  int len = fd < 0 ? -1 : read(fd, buf, sizeof buf);
+  close(fd);
+#endif
+  check("archive contents",
+	len == 2 * 111
+	&& memcmp(buf, "3:1.1,100:xxx", 13) == 0
+	&& memcmp(buf + 111, "3:2.2,100:xxx", 13) == 0);
+  check("archive kept",
+	retention_enforce(".", limits(1, 0, 0, true), now, removed, bytes)
+	&& removed == 1 && exists(archive));
+  clean();
+
+  if (chdir("/") == 0)
+    rmdir(dir);
+  fout << itoa(count) << " tests run, " << itoa(failed) << " failed." << endl;
+  return failed > 0;
+}
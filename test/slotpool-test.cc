@@ -0,0 +1,50 @@
+#include "config.h"
+#include <sys/wait.h>
+#include <unistd.h>
+#include "slotpool.h"
+
+#include "fdbuf/fdbuf.h"
+#include "itoa.h"
+#include "check.h"
+
+int main(void)
+{
+  check("borrow before open", slotpool_borrow(0, 4) == 0);
+  check("too many tenants", !slotpool_open(SLOTPOOL_MAX + 1, 6));
+  if (!slotpool_open(3, 6)) {
+    fout << "Could not open the pool" << endl;
+    return 1;
+  }
+
+  // A tenant alone may take the whole pool.
+  check("borrow alone", slotpool_borrow(0, 10) == 6);
+  check("held alone", slotpool_held(0) == 6 && slotpool_free() == 0);
+  check("borrow from empty", slotpool_borrow(1, 2) == 0);
+  slotpool_return(0);
+  slotpool_return(1);
+  check("returned", slotpool_held(0) == 0 && slotpool_free() == 6);
+
+  // While another wants slots, each is held to an even share.
+  check("borrow first", slotpool_borrow(0, 2) == 2);
+  check("borrow share", slotpool_borrow(1, 10) == 3);
+  check("borrow third", slotpool_borrow(2, 10) == 1);
+  check("unknown tenant", slotpool_borrow(3, 1) == 0);
+  slotpool_return(0);
+  slotpool_return(1);
+  slotpool_return(2);
+  check("all returned", slotpool_free() == 6);
+
+  // The pool is shared with forked processes.
+  const pid_t pid = fork();
+  if (pid == 0)
+    _exit(slotpool_borrow(2, 4) == 4 ? 0 : 1);
+  int status;
+  waitpid(pid, &status, 0);
+  check("borrow in child", WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  check("seen by parent", slotpool_held(2) == 4 && slotpool_free() == 2);
+  slotpool_return(2);
+  check("reclaimed", slotpool_held(2) == 0 && slotpool_free() == 6);
+
+  fout << itoa(count) << " tests run, " << itoa(failed) << " failed." << endl;
+  return failed > 0;
+}
@@ -0,0 +1,130 @@
+// Run the core library from several threads at once.  Only built when
+// configured with --enable-threads, which defines _REENTRANT.
+#include "config.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fdbuf/fdbuf.h"
+#include "itoa.h"
+#include "mystring/mystring.h"
+#include "stats.h"
+#include "check.h"
+
+#define THREADS 4
+#define ROUNDS 100000
+#define LINES 1000
+
+static mystringrep* rep;
+static fdobuf* shared_out;
+
+struct worker
+{
+  pthread_t thread;
+  long id;
+  bool itoa_ok;
+  bool stats_ok;
+  bool buffers_ok;
+};
+
+static void* work(void* arg)
+{
+  worker& w = *(worker*)arg;
+
+  // Each thread has a buffer of its own for itoa.
+  w.itoa_ok = true;
+  for (long i = 0; i < ROUNDS; i++) {
+    long v = w.id * ROUNDS + i;
+    if (strtol(itoa(v), 0, 10) != v)
+      w.itoa_ok = false;
+  }
+
+  for (unsigned i = 0; i < ROUNDS; i++)
+    rep->attach();
+  for (unsigned i = 0; i < ROUNDS; i++)
+    rep->detach();
+
+  // The counters start at zero in each thread and are its own.
+  w.stats_ok = run_stats.reads == 0;
+  for (unsigned i = 0; i < LINES; i++)
+    ++run_stats.reads;
+  w.stats_ok = w.stats_ok && run_stats.reads == LINES;
+
+  // Buffers of other sizes than FDBUF_SIZE come from the shared pool.
+  w.buffers_ok = true;
+  for (unsigned i = 0; i < LINES; i++) {
+    fdobuf out("/dev/null", 0, 0666, 16384);
+    if (!out.write("x", 1) || !out.flush())
+      w.buffers_ok = false;
+  }
+
+  // A stream created as shared takes whole writes from any thread.
+  char line[INTLENGTH + 2];
+  const char* n = itoa(w.id, line, 0);
+  unsigned len = strlen(n);
+  memmove(line, n, len);
+  line[len++] = '\n';
+  for (unsigned i = 0; i < LINES; i++)
+    shared_out->write(line, len);
+  return 0;
+}
+
+int main(void)
+{
+  char path[] = "/tmp/threads-test.XXXXXX";
+  int file = mkstemp(path);
+  if (file < 0) {
+    fout << "Could not make a file" << endl;
+    return 1;
+  }
+  shared_out = new fdobuf(file, true, FDBUF_SIZE, true);
+  rep = mystringrep::dup("a string longer than a local one", 32);
+  rep->attach();
+  unsigned long reads = run_stats.reads;
+
+  worker workers[THREADS];
+  for (int i = 0; i < THREADS; i++) {
+    workers[i].id = i + 1;
+    pthread_create(&workers[i].thread, 0, work, &workers[i]);
+  }
+  for (int i = 0; i < THREADS; i++)
+    pthread_join(workers[i].thread, 0);
+
+  bool itoa_ok = true, stats_ok = true, buffers_ok = true;
+  for (int i = 0; i < THREADS; i++) {
+    itoa_ok = itoa_ok && workers[i].itoa_ok;
+    stats_ok = stats_ok && workers[i].stats_ok;
+    buffers_ok = buffers_ok && workers[i].buffers_ok;
+  }
+  check("itoa", itoa_ok);
+  check("references", rep->references == 1);
+  rep->detach();
+  check("counters", stats_ok && run_stats.reads == reads);
+  check("pooled buffers", buffers_ok);
+
+  check("shared stream", shared_out->flush());
+  delete shared_out;
+  unsigned lines[THREADS + 1];
+  memset(lines, 0, sizeof lines);
+  bool whole = true;
+  {
+    fdibuf in(path);
+    mystring line;
+    while (in.getline(line)) {
+      long id = strtol(line.c_str(), 0, 10);
+      if (id < 1 || id > THREADS || line.length() != 1)
+	whole = false;
+      else
+	++lines[id];
+    }
+  }
+  for (int i = 1; i <= THREADS; i++)
+    whole = whole && lines[i] == LINES;
+  check("shared stream lines", whole);
+  unlink(path);
+
+  fout << itoa(count) << " tests run, " << itoa(failed) << " failed." << endl;
+  return failed > 0;
+}